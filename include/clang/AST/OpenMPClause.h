@@ -1196,6 +1196,8 @@ public:
         NestedNameSpecifierLoc Spec;
         /// \brief Name of custom operator.
         DeclarationNameInfo OperatorName;
+        /// \brief True for an exclusive scan, false for an inclusive one.
+        bool Exclusive;
 
         /// \brief Set operator for the clause.
         ///
@@ -1213,6 +1215,17 @@ public:
             OperatorName = OpName;
         }
 
+        /// \brief Set the scan mode of the clause.
+        void setExclusive(bool E) { Exclusive = E; }
+
+        /// \brief Set the segment flags of the clause.
+        ///
+        /// \param E Array whose non-zero elements start a new segment.
+        ///
+        void setSegment(Expr *E) {
+            *(reinterpret_cast<Stmt **>(getDefaultInits().end())) = cast_or_null<Stmt>(E);
+        }
+
         /// \brief Build clause with number of variables \a N and an operator \a Op.
         ///
         /// \param StartLoc Starting location of the clause.
@@ -1220,13 +1233,15 @@ public:
         /// \param N Number of the variables in the clause.
         /// \param Op Scan operator.
         /// \param OpLoc Location of the operator.
+        /// \param Excl True for an exclusive scan.
         ///
         OMPScanClause(SourceLocation StartLoc, SourceLocation EndLoc, unsigned N,
                       OpenMPScanClauseOperator Op,
-                      NestedNameSpecifierLoc Spec, DeclarationNameInfo OpName)
+                      NestedNameSpecifierLoc Spec, DeclarationNameInfo OpName,
+                      bool Excl)
                 : OMPVarListClause<OMPScanClause>(OMPC_scan, StartLoc, EndLoc,
                                                   N),
-                  Operator(Op), Spec(Spec), OperatorName(OpName) {}
+                  Operator(Op), Spec(Spec), OperatorName(OpName), Exclusive(Excl) {}
 
         /// \brief Build an empty clause.
         ///
@@ -1235,7 +1250,7 @@ public:
         explicit OMPScanClause(unsigned N)
                 : OMPVarListClause<OMPScanClause>(OMPC_scan, SourceLocation(),
                                                   SourceLocation(), N),
-                  Operator(OMPC_SCAN_unknown), Spec(), OperatorName() {}
+                  Operator(OMPC_SCAN_unknown), Spec(), OperatorName(), Exclusive(false) {}
 
         /// \brief Sets the list of generated expresssions.
         void setOpExprs(ArrayRef<Expr *> OpExprs);
@@ -1283,13 +1298,16 @@ public:
         /// \param Op Scan operator.
         /// \param S nested name specifier.
         /// \param OpName Scan identifier.
+        /// \param Excl True for an exclusive scan.
+        /// \param Segment Segment flags, or null for an unsegmented scan.
         ///
         static OMPScanClause *
         Create(const ASTContext &C, SourceLocation StartLoc, SourceLocation EndLoc,
                ArrayRef<Expr *> VL, ArrayRef<Expr *> OpExprs,
                ArrayRef<Expr *> HelperParams1, ArrayRef<Expr *> HelperParams2,
                ArrayRef<Expr *> DefaultInits, OpenMPScanClauseOperator Op,
-               NestedNameSpecifierLoc S, DeclarationNameInfo OpName);
+               NestedNameSpecifierLoc S, DeclarationNameInfo OpName,
+               bool Excl, Expr *Segment);
 
         /// \brief Creates an empty clause with the place for \a N variables.
         ///
@@ -1307,6 +1325,19 @@ public:
         /// \brief Fetches operator name for the clause.
         DeclarationNameInfo getOpName() const { return OperatorName; }
 
+        /// \brief True for an exclusive scan, false for an inclusive one.
+        bool isExclusive() const { return Exclusive; }
+
+        /// \brief Fetches the segment flags, or null for an unsegmented scan.
+        Expr *getSegment() {
+            return cast_or_null<Expr>(*(reinterpret_cast<Stmt **>(getDefaultInits().end())));
+        }
+
+        /// \brief Fetches the segment flags, or null for an unsegmented scan.
+        const Expr *getSegment() const {
+            return cast_or_null<Expr>(*(reinterpret_cast<const Stmt *const *>(getDefaultInits().end())));
+        }
+
         static bool classof(const OMPClause *T) {
             return T->getClauseKind() == OMPC_scan;
         }
@@ -1335,7 +1366,7 @@ public:
 
         StmtRange children() {
             return StmtRange(reinterpret_cast<Stmt **>(varlist_begin()),
-                             reinterpret_cast<Stmt **>(getDefaultInits().end()));
+                             reinterpret_cast<Stmt **>(getDefaultInits().end()) + 1);
         }
     };
 
@@ -7897,7 +7897,8 @@ public:
     OMPClause *ActOnOpenMPVarListClause(OpenMPClauseKind Kind, ArrayRef<Expr *> Vars,
                                         SourceLocation StartLoc, SourceLocation EndLoc,
                                         unsigned Op, Expr *TailExpr, CXXScopeSpec &SS,
-                                        const UnqualifiedId &OpName, SourceLocation OpLoc);
+                                        const UnqualifiedId &OpName, SourceLocation OpLoc,
+                                        bool ScanExclusive = false);
 
     /// \brief Helper to build DeclRefExpr for declarative clause.
   Expr *ActOnOpenMPParameterInDeclarativeVarListClause(SourceLocation Loc,
@@ -7958,7 +7959,8 @@ public:
                                      SourceLocation EndLoc,
                                      OpenMPScanClauseOperator Op,
                                      CXXScopeSpec &SS,
-                                     DeclarationNameInfo OpName);
+                                     DeclarationNameInfo OpName,
+                                     bool Exclusive, Expr *Segment);
 
     /// \brief Called on well-formed 'map' clause.
   OMPClause *ActOnOpenMPMapClause(ArrayRef<Expr *> VarList,
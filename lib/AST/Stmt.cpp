@@ -1307,19 +1307,21 @@ OMPScanClause *OMPScanClause::Create(
         ArrayRef<Expr *> VL, ArrayRef<Expr *> OpExprs,
         ArrayRef<Expr *> HelperParams1, ArrayRef<Expr *> HelperParams2,
         ArrayRef<Expr *> DefaultInits, OpenMPScanClauseOperator Op,
-        NestedNameSpecifierLoc S, DeclarationNameInfo OpName) {
+        NestedNameSpecifierLoc S, DeclarationNameInfo OpName,
+        bool Excl, Expr *Segment) {
     assert(VL.size() == OpExprs.size() &&
            "Number of expressions is not the same as number of variables!");
     void *Mem = C.Allocate(llvm::RoundUpToAlignment(sizeof(OMPScanClause),
                                                     llvm::alignOf<Expr *>()) +
-                           5 * sizeof(Expr *) * VL.size());
+                           5 * sizeof(Expr *) * VL.size() + sizeof(Expr *));
     OMPScanClause *Clause =
-            new(Mem) OMPScanClause(StartLoc, EndLoc, VL.size(), Op, S, OpName);
+            new(Mem) OMPScanClause(StartLoc, EndLoc, VL.size(), Op, S, OpName, Excl);
     Clause->setVars(VL);
     Clause->setOpExprs(OpExprs);
     Clause->setHelperParameters1st(HelperParams1);
     Clause->setHelperParameters2nd(HelperParams2);
     Clause->setDefaultInits(DefaultInits);
+    Clause->setSegment(Segment);
     return Clause;
 }
 
@@ -1327,7 +1329,7 @@ OMPScanClause *OMPScanClause::CreateEmpty(const ASTContext &C,
                                           unsigned N) {
     void *Mem = C.Allocate(llvm::RoundUpToAlignment(sizeof(OMPScanClause),
                                                     llvm::alignOf<Expr *>()) +
-                           5 * sizeof(Expr *) * N);
+                           5 * sizeof(Expr *) * N + sizeof(Expr *));
     return new(Mem) OMPScanClause(N);
 }
 
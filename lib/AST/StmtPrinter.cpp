@@ -731,6 +731,8 @@ void OMPClausePrinter::VisitOMPReductionClause(OMPReductionClause *Node) {
     void OMPClausePrinter::VisitOMPScanClause(OMPScanClause *Node) {
         if (!Node->varlist_empty()) {
             OS << "scan(";
+            if (Node->isExclusive())
+                OS << "exclusive, ";
             if (Node->getOperator() == OMPC_SCAN_custom) {
                 if (NestedNameSpecifier *Qual = Node->getSpec().getNestedNameSpecifier())
                     Qual->print(OS, Policy);
@@ -746,6 +748,10 @@ void OMPClausePrinter::VisitOMPReductionClause(OMPReductionClause *Node) {
                 OS << (I == Node->varlist_begin() ? ' ' : ',')
                    << *cast<NamedDecl>(cast<DeclRefExpr>(*I)->getDecl());
             }
+            if (Node->getSegment()) {
+                OS << " : ";
+                Node->getSegment()->printPretty(OS, 0, Policy, 0);
+            }
             OS << ")";
         }
     }
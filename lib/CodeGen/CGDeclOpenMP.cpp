@@ -121,49 +121,104 @@ void CodeGenModule::EmitOMPThreadPrivate(const OMPThreadPrivateDecl *D) {
   }
 }
 
+/// Appends to Inc the OpenCL macros <Name>_combiner(omp_out, omp_in) and
+/// <Name>_initializer taken from the functions Sema built for one type of a
+/// declare reduction or scan; Name already carries the type (see
+/// OpenMPSupportStackTy::getCLOperatorName) (see OMPDeclareReductionFunctionScope::setBody and
+/// OMPDeclareReductionInitFunctionScope::setInit). Returns false, appending
+/// nothing, if the bodies are not laid out as expected or the private copies
+/// are initialized by a call or a constructor, which kernels can not run.
+static bool emitCLReductionMacros(llvm::raw_ostream &Inc, StringRef Name,
+                                  const FunctionDecl *CF,
+                                  const FunctionDecl *IF,
+                                  const PrintingPolicy &Policy) {
+  // { omp_in; omp_out; <combiner>; *lhs = omp_out; }
+  const CompoundStmt *CB = dyn_cast_or_null<CompoundStmt>(CF->getBody());
+  if (CF->isInvalidDecl() || !CB || CB->size() != 4 ||
+      !isa<DeclStmt>(CB->body_begin()[0]) ||
+      !isa<DeclStmt>(CB->body_begin()[1]) || !isa<Expr>(CB->body_begin()[2]))
+    return false;
+  const Expr *Comb = cast<Expr>(CB->body_begin()[2]);
+
+  // { omp_orig; omp_priv = <init>; *lhs = omp_priv; } with an initializer
+  // clause, { omp_priv; memset(&omp_priv, 0, ...); *lhs = omp_priv; } for
+  // scalars without one
+  const CompoundStmt *IB = dyn_cast_or_null<CompoundStmt>(IF->getBody());
+  if (IF->isInvalidDecl() || !IB || IB->size() != 3 ||
+      !isa<DeclStmt>(IB->body_begin()[0]) || !isa<Expr>(IB->body_begin()[2]))
+    return false;
+  const Expr *Init = 0;
+  if (const DeclStmt *DS = dyn_cast<DeclStmt>(IB->body_begin()[1])) {
+    const VarDecl *VD = dyn_cast_or_null<VarDecl>(DS->getSingleDecl());
+    if (!VD || !VD->hasInit() || VD->getInit()->getLocStart().isInvalid())
+      return false;
+    Init = VD->getInit();
+  } else if (!isa<CallExpr>(IB->body_begin()[1])) {
+    return false;
+  }
+
+  Inc << "\n#ifndef " << Name << "_combiner\n#define " << Name
+      << "_combiner(omp_out, omp_in) ";
+  Comb->printPretty(Inc, 0, Policy, 0);
+  Inc << "\n#endif\n";
+  // Without an initializer clause the private copies are zeroed
+  Inc << "#ifndef " << Name << "_initializer\n#define " << Name
+      << "_initializer ";
+  if (Init)
+    Init->printPretty(Inc, 0, Policy, 0);
+  else
+    Inc << "0";
+  Inc << "\n#endif\n";
+  return true;
+}
+
 void CodeGenModule::EmitOMPDeclareReduction(const OMPDeclareReductionDecl *D) {
+  std::string incStr;
+  llvm::raw_string_ostream Inc(incStr);
+  const std::string Name = D->getDeclName().getAsString();
   for (OMPDeclareReductionDecl::datalist_const_iterator I = D->datalist_begin(),
                                                         E = D->datalist_end();
        I != E; ++I) {
     if (!I->CombinerFunction || !I->InitFunction)
       continue;
-    Decl *D = cast<DeclRefExpr>(I->CombinerFunction)->getDecl();
-    EmitGlobal(cast<FunctionDecl>(D));
-    D = cast<DeclRefExpr>(I->InitFunction)->getDecl();
-    EmitGlobal(cast<FunctionDecl>(D));
+    FunctionDecl *CF = cast<FunctionDecl>(cast<DeclRefExpr>(I->CombinerFunction)->getDecl());
+    FunctionDecl *IF = cast<FunctionDecl>(cast<DeclRefExpr>(I->InitFunction)->getDecl());
+    // Reduction kernels use <name>_<type>_combiner(omp_out, omp_in) and
+    // <name>_<type>_initializer (see EmitOMPDirectiveWithReduction); loops
+    // whose declare reduction has no macros for the type of the variable
+    // run on the host, which still needs the functions for them
+    if (getLangOpts().MPtoGPU &&
+        emitCLReductionMacros(Inc, OpenMPSupport.getCLOperatorName(Name, I->QTy),
+                              CF, IF, PrintingPolicy(getContext().getLangOpts())))
+      OpenMPSupport.addCLOperator(Name, I->QTy);
+    EmitGlobal(CF);
+    EmitGlobal(IF);
+  }
+  if (getLangOpts().MPtoGPU) {
+    OpenMPSupport.appendIncludeStr(Inc.str());
   }
 }
 
 void CodeGenModule::EmitOMPDeclareScan(const OMPDeclareScanDecl *D) {
     std::string incStr;
     llvm::raw_string_ostream Inc(incStr);
+    const std::string Name = D->getDeclName().getAsString();
     for (OMPDeclareScanDecl::datalist_const_iterator I = D->datalist_begin(),
                  E = D->datalist_end();
          I != E; ++I) {
         if (!I->CombinerFunction || !I->InitFunction)
             continue;
+        FunctionDecl *CF = cast<FunctionDecl>(cast<DeclRefExpr>(I->CombinerFunction)->getDecl());
+        FunctionDecl *IF = cast<FunctionDecl>(cast<DeclRefExpr>(I->InitFunction)->getDecl());
         if (getLangOpts().MPtoGPU) {
-            FunctionDecl *IF = cast<FunctionDecl>(cast<DeclRefExpr>(I->InitFunction)->getDecl());
-            if (IF->getBody()) {
-                CompoundStmt::body_iterator BI = cast<CompoundStmt>(IF->getBody())->body_begin();
-                ++BI;
-                if (DeclStmt *DS = dyn_cast<DeclStmt>(*BI)) {
-                    if (VarDecl *VD = dyn_cast_or_null<VarDecl>(DS->getSingleDecl())) {
-                        if (VD->hasInit() && VD->getInit()->getLocStart().isValid()) {
-                            Inc << "\n#define ";
-                            D->printName(Inc);
-                            Inc << "_initializer ";
-                            VD->getInit()->printPretty(Inc, 0, PrintingPolicy(getContext().getLangOpts()), 0);
-                            Inc << "\n";
-                        }
-                    }
-                }
-            }
+            // Scan kernels use <name>_<type>_combiner(omp_out, omp_in) and
+            // <name>_<type>_initializer, as the reduction ones do
+            if (emitCLReductionMacros(Inc, OpenMPSupport.getCLOperatorName(Name, I->QTy),
+                                      CF, IF, PrintingPolicy(getContext().getLangOpts())))
+                OpenMPSupport.addCLOperator(Name, I->QTy);
         } else {
-            Decl *D = cast<DeclRefExpr>(I->CombinerFunction)->getDecl();
-            EmitGlobal(cast<FunctionDecl>(D));
-            D = cast<DeclRefExpr>(I->InitFunction)->getDecl();
-            EmitGlobal(cast<FunctionDecl>(D));
+            EmitGlobal(CF);
+            EmitGlobal(IF);
         }
     }
     if (getLangOpts().MPtoGPU) {
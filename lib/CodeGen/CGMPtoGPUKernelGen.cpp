@@ -0,0 +1,609 @@
+//===--- CGMPtoGPUKernelGen.cpp - Kernel generation steps for MPtoGPU -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This implements the steps that lower the kernels extracted from target
+// regions. See CGMPtoGPUKernelGen.h.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CGMPtoGPUKernelGen.h"
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Basic/Version.h"
+#include "clang/CodeGen/CodeGenAction.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+using namespace clang;
+using namespace CodeGen;
+
+/// \brief Locate one of the kernel generation tools. Tools are looked up in
+/// the PATH first, then under $LLVM_INCLUDE_PATH/<Subdir>, where the
+/// SpirTools distribution installs them.
+static std::string findKernelTool(llvm::StringRef Name,
+                                  llvm::StringRef Subdir = llvm::StringRef()) {
+  std::string P = llvm::sys::FindProgramByName(Name.str());
+  if (!P.empty())
+    return P;
+  const char *Base = std::getenv("LLVM_INCLUDE_PATH");
+  if (!Base || Subdir.empty())
+    return std::string();
+  llvm::SmallString<256> Path(Base);
+  llvm::sys::path::append(Path, Subdir, Name);
+  if (!llvm::sys::fs::can_execute(Path.str()))
+    return std::string();
+  return Path.str().str();
+}
+
+/// \brief Locate the declarations of the OpenCL builtins for the spir
+/// targets, which the SpirTools distribution installs under
+/// $LLVM_INCLUDE_PATH. Returns an empty string if they are missing; the
+/// kernels are then compiled with SPIRPrelude.
+static std::string findSPIRPrelude() {
+  const char *Base = std::getenv("LLVM_INCLUDE_PATH");
+  if (!Base)
+    return std::string();
+  llvm::SmallString<256> Prelude(Base);
+  llvm::sys::path::append(Prelude, "llvm", "SpirTools", "opencl_spir.h");
+  if (!llvm::sys::fs::exists(Prelude.str()))
+    return std::string();
+  return Prelude.str().str();
+}
+
+/// \brief Declarations of the OpenCL builtins that generated kernels call
+/// themselves, used when the SpirTools prelude is not installed: this clang
+/// has no OpenCL builtin header of its own. The functions are overloadable
+/// so that they get the mangled names SPIR consumers expect. Loop bodies
+/// that call other builtins still need the SpirTools prelude; without it
+/// they fail to compile (see MPtoGPUCompileOpenCL).
+static const char SPIRPreludeName[] = "mptogpu_spir_prelude.h";
+static const char SPIRPrelude[] =
+    "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+    "#define __OVERLOAD __attribute__((overloadable))\n"
+    "typedef unsigned char uchar;\n"
+    "typedef unsigned short ushort;\n"
+    "typedef unsigned int uint;\n"
+    "typedef unsigned long ulong;\n"
+    "typedef __SIZE_TYPE__ size_t;\n"
+    "typedef __PTRDIFF_TYPE__ ptrdiff_t;\n"
+    "#define __EACH_TYPE(M) M(char) M(uchar) M(short) M(ushort) M(int) \\\n"
+    "  M(uint) M(long) M(ulong) M(float) M(double)\n"
+    "#define __VECTOR(T, N) \\\n"
+    "  typedef T T##N __attribute__((ext_vector_type(N)));\n"
+    "#define __VECTORS(T) __VECTOR(T, 2) __VECTOR(T, 3) __VECTOR(T, 4) \\\n"
+    "  __VECTOR(T, 8) __VECTOR(T, 16)\n"
+    "__EACH_TYPE(__VECTORS)\n"
+    "size_t __OVERLOAD get_global_id(uint);\n"
+    "size_t __OVERLOAD get_global_size(uint);\n"
+    "size_t __OVERLOAD get_local_id(uint);\n"
+    "size_t __OVERLOAD get_local_size(uint);\n"
+    "size_t __OVERLOAD get_group_id(uint);\n"
+    "size_t __OVERLOAD get_num_groups(uint);\n"
+    "uint __OVERLOAD get_work_dim(void);\n"
+    "typedef uint cl_mem_fence_flags;\n"
+    "#define CLK_LOCAL_MEM_FENCE 1\n"
+    "#define CLK_GLOBAL_MEM_FENCE 2\n"
+    "void __OVERLOAD barrier(cl_mem_fence_flags);\n"
+    "#define __VLOAD(T, N) \\\n"
+    "  T##N __OVERLOAD vload##N(size_t, const __global T *); \\\n"
+    "  void __OVERLOAD vstore##N(T##N, size_t, __global T *);\n"
+    "#define __VLOADS(T) __VLOAD(T, 2) __VLOAD(T, 4) __VLOAD(T, 8) \\\n"
+    "  __VLOAD(T, 16)\n"
+    "__EACH_TYPE(__VLOADS)\n"
+    "#define CHAR_BIT 8\n"
+    "#define CHAR_MAX 127\n"
+    "#define CHAR_MIN (-128)\n"
+    "#define UCHAR_MAX 255\n"
+    "#define SHRT_MAX 32767\n"
+    "#define SHRT_MIN (-32768)\n"
+    "#define USHRT_MAX 65535\n"
+    "#define INT_MAX 2147483647\n"
+    "#define INT_MIN (-2147483647 - 1)\n"
+    "#define UINT_MAX 0xffffffffU\n"
+    "#define LONG_MAX 0x7fffffffffffffffL\n"
+    "#define LONG_MIN (-0x7fffffffffffffffL - 1)\n"
+    "#define ULONG_MAX 0xffffffffffffffffUL\n"
+    "#define FLT_MAX __FLT_MAX__\n"
+    "#define DBL_MAX __DBL_MAX__\n";
+
+static bool isSPIRTarget(const llvm::Triple &Tgt) {
+  return Tgt.getArch() == llvm::Triple::spir ||
+         Tgt.getArch() == llvm::Triple::spir64 ||
+         Tgt.getArch() == llvm::Triple::spirv;
+}
+
+/// \brief Run \a Name with \a Args, without going through a shell.
+/// Returns false if it can not be run or fails, with the reason in \a Err.
+static bool runKernelTool(llvm::StringRef Name,
+                          const std::vector<std::string> &Args,
+                          MPtoGPUKernelError &Err,
+                          llvm::StringRef Subdir = llvm::StringRef()) {
+  Err.Tool = Name.str();
+  std::string Program = findKernelTool(Name, Subdir);
+  if (Program.empty()) {
+    Err.Message = "it was not found";
+    return false;
+  }
+
+  std::vector<const char *> Argv;
+  Argv.push_back(Program.c_str());
+  for (unsigned i = 0; i < Args.size(); ++i)
+    Argv.push_back(Args[i].c_str());
+  Argv.push_back(nullptr);
+
+  int Result = llvm::sys::ExecuteAndWait(Program, &Argv[0], nullptr, nullptr,
+                                         0, 0, &Err.Message);
+  if (Result == 0)
+    return true;
+  if (Err.Message.empty())
+    Err.Message = "exit status " + std::to_string(Result);
+  return false;
+}
+
+std::string clang::CodeGen::MPtoGPUHash(llvm::StringRef Data) {
+  llvm::MD5 Hash;
+  Hash.update(Data);
+  llvm::MD5::MD5Result Result;
+  Hash.final(Result);
+  llvm::SmallString<32> Str;
+  llvm::MD5::stringifyResult(Result, Str);
+  return Str.str().substr(0, 16).str();
+}
+
+/// \brief Directory of the kernel cache, from $MPTOGPU_KERNEL_CACHE. Returns
+/// an empty string when the cache is disabled.
+static std::string kernelCacheDir() {
+  const char *Dir = std::getenv("MPTOGPU_KERNEL_CACHE");
+  if (!Dir || !*Dir)
+    return std::string();
+  if (llvm::sys::fs::create_directories(Dir))
+    return std::string();
+  return Dir;
+}
+
+/// \brief Identity of the toolchain the kernels are generated with: this
+/// compiler, the external tools it runs and the SPIR prelude. Entries made
+/// by another toolchain are never reused.
+static std::string kernelToolchainId() {
+  std::string Id = getClangFullVersion();
+  Id += '\0';
+  Id += findKernelTool("clang-pcg");
+  Id += '\0';
+  Id += findKernelTool("vectorize", "vectorize");
+  Id += '\0';
+  Id += findKernelTool("spir-encoder");
+  Id += '\0';
+  Id += findKernelTool("llvm-spirv");
+  Id += '\0';
+  const std::string Prelude = findSPIRPrelude();
+  if (Prelude.empty()) {
+    Id += SPIRPrelude;
+  } else {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buf =
+        llvm::MemoryBuffer::getFile(Prelude);
+    if (Buf)
+      Id += Buf.get()->getBuffer();
+  }
+  return Id;
+}
+
+/// \brief Key of the cache entry for the contents of \a File produced
+/// under \a Options, or an empty string when the cache is disabled.
+static std::string kernelCacheKey(llvm::StringRef Options,
+                                  llvm::StringRef File) {
+  if (kernelCacheDir().empty())
+    return std::string();
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buf =
+      llvm::MemoryBuffer::getFile(File);
+  if (!Buf)
+    return std::string();
+  return MPtoGPUHash(kernelToolchainId() + '\0' + Options.str() + '\0' +
+                     Buf.get()->getBuffer().str());
+}
+
+static std::string kernelCachePath(const std::string &Key,
+                                   llvm::StringRef Suffix) {
+  llvm::SmallString<256> Path(kernelCacheDir());
+  llvm::sys::path::append(Path, Key + Suffix.str());
+  return Path.str().str();
+}
+
+/// \brief Placeholder of the entries for the name of the file they were
+/// generated from (see kernelCacheFetch and kernelCacheStoreFile).
+static const char KernelCacheName[] = "__mptogpu_cached_name";
+
+/// \brief Replace every occurrence of \a From in \a Data by \a To.
+static std::string replaceName(llvm::StringRef Data, llvm::StringRef From,
+                               llvm::StringRef To) {
+  std::string Result = Data.str();
+  if (From.empty())
+    return Result;
+  for (size_t Pos = Result.find(From); Pos != std::string::npos;
+       Pos = Result.find(From, Pos + To.size()))
+    Result.replace(Pos, From.size(), To);
+  return Result;
+}
+
+/// \brief Copy the entry Key+Suffix of the cache to \a Dest. If \a Name is
+/// given, it replaces the placeholder the entry was stored with.
+static bool kernelCacheFetch(const std::string &Key, llvm::StringRef Suffix,
+                             llvm::StringRef Dest,
+                             llvm::StringRef Name = llvm::StringRef()) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buf =
+      llvm::MemoryBuffer::getFile(kernelCachePath(Key, Suffix));
+  if (!Buf)
+    return false;
+  std::string Error;
+  llvm::raw_fd_ostream OS(Dest.str().c_str(), Error, llvm::sys::fs::F_None);
+  if (!Error.empty())
+    return false;
+  if (Name.empty())
+    OS << Buf.get()->getBuffer();
+  else
+    OS << replaceName(Buf.get()->getBuffer(), KernelCacheName, Name);
+  OS.close();
+  const bool Written = !OS.has_error();
+  OS.clear_error();
+  return Written;
+}
+
+/// \brief Store \a Data as the entry Key+Suffix of the cache. The entry is
+/// written aside and renamed, so that concurrent compilations never see a
+/// partial one. Returns false if the entry could not be stored.
+static bool kernelCacheStore(const std::string &Key, llvm::StringRef Suffix,
+                             llvm::StringRef Data) {
+  const std::string Path = kernelCachePath(Key, Suffix);
+  int FD;
+  llvm::SmallString<256> TmpPath;
+  if (llvm::sys::fs::createUniqueFile(Path + ".%%%%%%", FD, TmpPath))
+    return false;
+  bool Written;
+  {
+    llvm::raw_fd_ostream OS(FD, true);
+    OS << Data;
+    OS.close();
+    Written = !OS.has_error();
+    OS.clear_error();
+  }
+  if (!Written || llvm::sys::fs::rename(TmpPath.str(), Path)) {
+    llvm::sys::fs::remove(TmpPath.str());
+    return false;
+  }
+  return true;
+}
+
+/// \brief Store the file \a Src, if it exists, as the entry Key+Suffix. If
+/// \a Name is given, its occurrences are stored as a placeholder. Returns
+/// false if the file is missing or could not be stored.
+static bool kernelCacheStoreFile(const std::string &Key,
+                                 llvm::StringRef Suffix, llvm::StringRef Src,
+                                 llvm::StringRef Name = llvm::StringRef()) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buf =
+      llvm::MemoryBuffer::getFile(Src);
+  if (!Buf)
+    return false;
+  if (Name.empty())
+    return kernelCacheStore(Key, Suffix, Buf.get()->getBuffer());
+  return kernelCacheStore(
+      Key, Suffix, replaceName(Buf.get()->getBuffer(), Name, KernelCacheName));
+}
+
+bool clang::CodeGen::MPtoGPUPolyhedralCodegen(
+    llvm::StringRef CFile, const MPtoGPUPolyhedralOptions &Opts,
+    MPtoGPUKernelError &Err) {
+  std::vector<std::string> Args;
+  if (Opts.Verbose)
+    Args.push_back("--verbose");
+  if (Opts.NoReschedule)
+    Args.push_back("--no-reschedule");
+  Args.push_back("--tile-size=" + std::to_string(Opts.TileSize));
+  if (Opts.NoSharedMemory)
+    Args.push_back("--no-shared-memory");
+  if (Opts.NoPrivateMemory)
+    Args.push_back("--no-private-memory");
+  Args.push_back(CFile.str());
+
+  // clang-pcg writes the argument map to <base> and the kernels to
+  // <base>.cl. Both are cached under the loop nest and the options; the
+  // kernels are named after <base>, which is stored as a placeholder.
+  const std::string Base = CFile.substr(0, CFile.rfind('.')).str();
+  const llvm::StringRef Name = llvm::sys::path::filename(Base);
+  std::string Options = "pcg";
+  for (unsigned i = Opts.Verbose ? 1 : 0; i < Args.size(); ++i)
+    Options += " " + Args[i];
+  const std::string Key = kernelCacheKey(Options, CFile);
+  // An entry that can not be read back whole is a miss
+  if (!Key.empty() && kernelCacheFetch(Key, ".args", Base, Name) &&
+      kernelCacheFetch(Key, ".cl", Base + ".cl", Name))
+    return true;
+
+  if (!runKernelTool("clang-pcg", Args, Err))
+    return false;
+
+  // The argument map is stored last, once the kernels are: it marks the
+  // entry as complete
+  if (!Key.empty() && kernelCacheStoreFile(Key, ".cl", Base + ".cl", Name))
+    kernelCacheStoreFile(Key, ".args", Base, Name);
+  return true;
+}
+
+bool clang::CodeGen::MPtoGPUVectorize(llvm::StringRef CLFile,
+                                      MPtoGPUKernelError &Err) {
+  std::vector<std::string> Args;
+  Args.push_back("-silent");
+  Args.push_back(CLFile.str());
+  return runKernelTool("vectorize", Args, Err, "vectorize");
+}
+
+namespace {
+/// \brief Keeps the first error of a nested compilation, with the line it
+/// was found at, so that the caller can report it.
+class FirstErrorConsumer : public DiagnosticConsumer {
+public:
+  std::string Message;
+
+  void HandleDiagnostic(DiagnosticsEngine::Level Level,
+                        const Diagnostic &Info) override {
+    DiagnosticConsumer::HandleDiagnostic(Level, Info);
+    if (Level < DiagnosticsEngine::Error || !Message.empty())
+      return;
+    llvm::raw_string_ostream OS(Message);
+    if (Info.getLocation().isValid() && Info.hasSourceManager()) {
+      PresumedLoc PLoc =
+          Info.getSourceManager().getPresumedLoc(Info.getLocation());
+      if (PLoc.isValid())
+        OS << llvm::sys::path::filename(PLoc.getFilename()) << ":"
+           << PLoc.getLine() << ": ";
+    }
+    llvm::SmallString<128> Text;
+    Info.FormatDiagnostic(Text);
+    OS << Text;
+  }
+};
+} // end anonymous namespace
+
+bool clang::CodeGen::MPtoGPUCompileOpenCL(llvm::StringRef CLFile,
+                                          llvm::StringRef Output,
+                                          llvm::StringRef Triple,
+                                          MPtoGPUKernelError &Err) {
+  std::vector<std::string> Args;
+  Args.push_back("-x");
+  Args.push_back("cl");
+  Args.push_back("-cl-std=CL1.2");
+  Args.push_back("-fno-builtin");
+  Args.push_back("-emit-llvm-bc");
+  Args.push_back("-triple");
+  Args.push_back(Triple.str());
+  // The SPIR prelude declares the OpenCL builtins for the spir targets. A
+  // builtin it does not declare must fail here, not when the program runs
+  const std::string Prelude = findSPIRPrelude();
+  Args.push_back("-include");
+  Args.push_back(Prelude.empty() ? SPIRPreludeName : Prelude);
+  Args.push_back("-Werror=implicit-function-declaration");
+  Args.push_back("-ffp-contract=off");
+  Args.push_back("-o");
+  Args.push_back(Output.str());
+  Args.push_back(CLFile.str());
+
+  std::vector<const char *> Argv;
+  for (unsigned i = 0; i < Args.size(); ++i)
+    Argv.push_back(Args[i].c_str());
+
+  // The diagnostics of the nested compilation are not printed: the first
+  // error is reported at the target region
+  Err.Tool.clear();
+  FirstErrorConsumer Errors;
+  std::unique_ptr<CompilerInstance> Clang(new CompilerInstance());
+  Clang->createDiagnostics(&Errors, false);
+  if (!Clang->hasDiagnostics())
+    return false;
+  if (!CompilerInvocation::CreateFromArgs(Clang->getInvocation(),
+                                          Argv.data(),
+                                          Argv.data() + Argv.size(),
+                                          Clang->getDiagnostics())) {
+    Err.Message = Errors.Message;
+    return false;
+  }
+  if (Prelude.empty())
+    Clang->getPreprocessorOpts().addRemappedFile(
+        SPIRPreludeName,
+        llvm::MemoryBuffer::getMemBuffer(SPIRPrelude, SPIRPreludeName));
+
+  std::unique_ptr<CodeGenAction> Act(new EmitBCAction());
+  if (!Clang->ExecuteAction(*Act)) {
+    Err.Message = Errors.Message;
+    return false;
+  }
+  return true;
+}
+
+bool clang::CodeGen::MPtoGPUEncodeSPIR(llvm::StringRef Input,
+                                       llvm::StringRef Output,
+                                       MPtoGPUKernelError &Err) {
+  std::vector<std::string> Args;
+  Args.push_back(Input.str());
+  Args.push_back(Output.str());
+  return runKernelTool("spir-encoder", Args, Err);
+}
+
+bool clang::CodeGen::MPtoGPUTranslateSPIRV(llvm::StringRef Input,
+                                           MPtoGPUKernelError &Err) {
+  std::vector<std::string> Args;
+  Args.push_back(Input.str());
+  return runKernelTool("llvm-spirv", Args, Err);
+}
+
+bool clang::CodeGen::MPtoGPUFindKernelTools(bool Polyhedral, bool Vectorize,
+                                            const llvm::Triple &Tgt,
+                                            std::string &Tool,
+                                            std::string &Subdir) {
+  const struct {
+    bool Needed;
+    const char *Name;
+    const char *Subdir;
+  } Tools[] = {{Polyhedral, "clang-pcg", ""},
+               {Vectorize, "vectorize", "vectorize"},
+               {isSPIRTarget(Tgt), "spir-encoder", ""},
+               {Tgt.getArch() == llvm::Triple::spirv, "llvm-spirv", ""}};
+  for (unsigned i = 0; i < llvm::array_lengthof(Tools); ++i) {
+    if (!Tools[i].Needed ||
+        !findKernelTool(Tools[i].Name, Tools[i].Subdir).empty())
+      continue;
+    Tool = Tools[i].Name;
+    Subdir = Tools[i].Subdir;
+    return false;
+  }
+  return true;
+}
+
+bool clang::CodeGen::MPtoGPULowerKernelFile(const std::string &FileName,
+                                            bool Vectorize, bool Verbose,
+                                            const llvm::Triple &Tgt,
+                                            MPtoGPUKernelError &Err) {
+  const std::string clName = FileName + ".cl";
+  const std::string AuxName = FileName + ".tmp";
+  const bool SPIR = isSPIRTarget(Tgt);
+  if (!Vectorize && !SPIR)
+    return true;
+
+  // The outputs are cached under the kernel source, the vectorization and
+  // the target; the .done entry marks a complete one
+  std::string Options = "lower ";
+  Options += Tgt.getTriple();
+  if (Vectorize)
+    Options += " vectorize";
+  const std::string Key = kernelCacheKey(Options, clName);
+  // An entry that can not be read back whole is a miss. The vectorized
+  // kernels are fetched aside: on a miss, the source must be left intact
+  if (!Key.empty() && llvm::sys::fs::exists(kernelCachePath(Key, ".done")) &&
+      (!Vectorize || kernelCacheFetch(Key, ".cl", AuxName)) &&
+      (!SPIR || kernelCacheFetch(Key, ".bc", FileName + ".bc")) &&
+      (Tgt.getArch() != llvm::Triple::spirv ||
+       kernelCacheFetch(Key, ".spv", FileName + ".spv"))) {
+    if (Vectorize)
+      llvm::sys::fs::rename(AuxName, clName);
+    if (Tgt.getArch() == llvm::Triple::spirv && !Verbose)
+      llvm::sys::fs::remove(FileName + ".bc");
+    return true;
+  }
+  llvm::sys::fs::remove(AuxName);
+
+  // Generate kernel with vectorization ?
+  if (Vectorize) {
+    const bool Vectorized = MPtoGPUVectorize(clName, Err);
+    if (!Verbose && llvm::sys::fs::exists(AuxName))
+      llvm::sys::fs::remove(AuxName);
+    if (!Vectorized)
+      return false;
+  }
+
+  // Generate the spir-code ?
+  if (SPIR) {
+    // SPIR-V is translated from spir64
+    std::string tgtStr = Tgt.getArch() == llvm::Triple::spirv
+                             ? std::string("spir64-unknown-unknown")
+                             : Tgt.getTriple();
+
+    // Lower the OpenCL C file in-process, then encode it as SPIR
+    const bool Encoded = MPtoGPUCompileOpenCL(clName, AuxName, tgtStr, Err) &&
+                         MPtoGPUEncodeSPIR(AuxName, FileName + ".bc", Err);
+    llvm::sys::fs::remove(AuxName);
+    if (!Encoded)
+      return false;
+
+    // Now convert to spir-v format
+    if (Tgt.getArch() == llvm::Triple::spirv &&
+        !MPtoGPUTranslateSPIRV(FileName + ".bc", Err))
+      return false;
+  }
+
+  const std::string Last = Tgt.getArch() == llvm::Triple::spirv
+                               ? FileName + ".spv"
+                               : SPIR ? FileName + ".bc" : clName;
+  // The .done entry is stored last, once every output is
+  if (!Key.empty() && llvm::sys::fs::exists(Last) &&
+      (!Vectorize || kernelCacheStoreFile(Key, ".cl", clName)) &&
+      (!SPIR || kernelCacheStoreFile(Key, ".bc", FileName + ".bc")) &&
+      (Tgt.getArch() != llvm::Triple::spirv ||
+       kernelCacheStoreFile(Key, ".spv", FileName + ".spv")))
+    kernelCacheStore(Key, ".done", llvm::StringRef());
+
+  if (Tgt.getArch() == llvm::Triple::spirv && !Verbose)
+    llvm::sys::fs::remove(FileName + ".bc");
+  return true;
+}
+
+MPtoGPUKernelJobs::MPtoGPUKernelJobs(unsigned Threads)
+    : MaxThreads(Threads), Pending(0), Stop(false) {
+  if (MaxThreads == 0)
+    MaxThreads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+MPtoGPUKernelJobs::~MPtoGPUKernelJobs() {
+  wait();
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Stop = true;
+  }
+  Ready.notify_all();
+  for (unsigned i = 0; i < Workers.size(); ++i)
+    Workers[i].join();
+}
+
+void MPtoGPUKernelJobs::enqueue(std::function<void()> Job) {
+  if (!llvm::llvm_is_multithreaded()) {
+    Job();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Queue.push_back(std::move(Job));
+    ++Pending;
+    // Threads are started on demand, so modules without target loops
+    // never create any
+    if (Workers.size() < MaxThreads && Workers.size() < Pending)
+      Workers.push_back(std::thread(&MPtoGPUKernelJobs::worker, this));
+  }
+  Ready.notify_one();
+}
+
+void MPtoGPUKernelJobs::wait() {
+  std::unique_lock<std::mutex> Guard(Lock);
+  Done.wait(Guard, [this] { return Pending == 0; });
+}
+
+void MPtoGPUKernelJobs::worker() {
+  std::unique_lock<std::mutex> Guard(Lock);
+  while (true) {
+    Ready.wait(Guard, [this] { return Stop || !Queue.empty(); });
+    if (Queue.empty())
+      return;
+    std::function<void()> Job = std::move(Queue.front());
+    Queue.pop_front();
+    Guard.unlock();
+    Job();
+    Guard.lock();
+    if (--Pending == 0)
+      Done.notify_all();
+  }
+}
@@ -0,0 +1,137 @@
+//===--- CGMPtoGPUKernelGen.h - Kernel generation steps for MPtoGPU -*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This provides the steps that turn the C loop nests extracted from target
+// regions into the OpenCL kernel images loaded by the MPtoGPU runtime:
+// polyhedral code generation, vectorization and the OpenCL C to SPIR/SPIR-V
+// lowering. The OpenCL C compilation runs in-process on a nested
+// CompilerInstance; the remaining steps are reached through this interface
+// so that codegen does not depend on a shell.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CLANG_CODEGEN_MPTOGPUKERNELGEN_H
+#define CLANG_CODEGEN_MPTOGPUKERNELGEN_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Triple.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace clang {
+
+namespace CodeGen {
+
+/// \brief Returns a short hex digest of \a Data. Kernels and the entries of
+/// the kernel cache are named after the digest of their contents.
+std::string MPtoGPUHash(llvm::StringRef Data);
+
+/// \brief Failure of a kernel generation step. The steps may run on the
+/// kernel generation pool, where the DiagnosticsEngine must not be used:
+/// codegen reports the failure at the target region instead.
+struct MPtoGPUKernelError {
+  /// \brief The external tool that failed, or empty for the in-process
+  /// OpenCL C compilation.
+  std::string Tool;
+  /// \brief What went wrong, if known.
+  std::string Message;
+};
+
+/// \brief Options of the polyhedral code generator.
+struct MPtoGPUPolyhedralOptions {
+  unsigned TileSize;
+  bool NoReschedule;
+  bool NoSharedMemory;
+  bool NoPrivateMemory;
+  bool Verbose;
+
+  MPtoGPUPolyhedralOptions()
+      : TileSize(16), NoReschedule(false), NoSharedMemory(false),
+        NoPrivateMemory(false), Verbose(false) {}
+};
+
+/// \brief Generate the OpenCL kernels and the argument file for the loop nest
+/// in \a CFile. Returns true on success. When $MPTOGPU_KERNEL_CACHE names a
+/// directory, the results are reused from (and saved to) the kernel cache.
+/// Each step returns false on failure, with the reason in \a Err.
+bool MPtoGPUPolyhedralCodegen(llvm::StringRef CFile,
+                              const MPtoGPUPolyhedralOptions &Opts,
+                              MPtoGPUKernelError &Err);
+
+/// \brief Rewrite the kernels in \a CLFile using vector types.
+bool MPtoGPUVectorize(llvm::StringRef CLFile, MPtoGPUKernelError &Err);
+
+/// \brief Compile the OpenCL C file \a CLFile to LLVM bitcode for \a Triple,
+/// in-process. The OpenCL builtins are declared by the SPIR prelude under
+/// $LLVM_INCLUDE_PATH when it is installed, and otherwise by a built-in one
+/// that only covers the builtins generated kernels call themselves.
+bool MPtoGPUCompileOpenCL(llvm::StringRef CLFile, llvm::StringRef Output,
+                          llvm::StringRef Triple, MPtoGPUKernelError &Err);
+
+/// \brief Encode the bitcode \a Input as a SPIR 1.2 module in \a Output.
+bool MPtoGPUEncodeSPIR(llvm::StringRef Input, llvm::StringRef Output,
+                       MPtoGPUKernelError &Err);
+
+/// \brief Translate the SPIR bitcode \a Input to SPIR-V.
+bool MPtoGPUTranslateSPIRV(llvm::StringRef Input, MPtoGPUKernelError &Err);
+
+/// \brief Check that the tools the polyhedral code generation (if
+/// \a Polyhedral) and the lowering of a kernel file for \a Tgt (see
+/// MPtoGPULowerKernelFile) run can be found. Otherwise returns false with
+/// the first missing tool in \a Tool, and the directory under
+/// $LLVM_INCLUDE_PATH it is looked up in too in \a Subdir.
+bool MPtoGPUFindKernelTools(bool Polyhedral, bool Vectorize,
+                            const llvm::Triple &Tgt, std::string &Tool,
+                            std::string &Subdir);
+
+/// \brief Vectorize (if requested) and lower the kernel file FileName.cl
+/// for the target \a Tgt: spir and spir64 produce FileName.bc, spirv
+/// produces FileName.spv. Other targets keep the OpenCL C source. The
+/// outputs go through the kernel cache too. Returns false if a step failed,
+/// with the reason in \a Err.
+bool MPtoGPULowerKernelFile(const std::string &FileName, bool Vectorize,
+                            bool Verbose, const llvm::Triple &Tgt,
+                            MPtoGPUKernelError &Err);
+
+/// \brief A pool of threads that runs the kernel generation jobs of a
+/// module while host codegen continues. Each job only touches the files of
+/// its own kernel, so jobs run in any order; wait() joins them.
+class MPtoGPUKernelJobs {
+public:
+  /// \param Threads Maximum number of threads, or 0 for one per core.
+  explicit MPtoGPUKernelJobs(unsigned Threads = 0);
+  ~MPtoGPUKernelJobs();
+
+  /// \brief Queue \a Job. It runs on the caller when threads are disabled.
+  void enqueue(std::function<void()> Job);
+
+  /// \brief Block until every queued job has finished.
+  void wait();
+
+private:
+  void worker();
+
+  unsigned MaxThreads;
+  unsigned Pending;
+  bool Stop;
+  std::vector<std::thread> Workers;
+  std::deque<std::function<void()>> Queue;
+  std::mutex Lock;
+  std::condition_variable Ready;
+  std::condition_variable Done;
+};
+
+} // end namespace CodeGen
+} // end namespace clang
+#endif
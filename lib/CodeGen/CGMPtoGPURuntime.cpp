@@ -16,11 +16,14 @@
 #include "CGMPtoGPURuntime.h"
 #include "CodeGenFunction.h"
 #include "clang/AST/Decl.h"
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Frontend/FrontendDiagnostic.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Constants.h"
@@ -30,7 +33,9 @@
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <cassert>
 
 namespace llvm {
@@ -75,7 +80,8 @@ namespace llvm {
 using namespace clang;
 using namespace CodeGen;
 
-CGMPtoGPURuntime::CGMPtoGPURuntime(CodeGenModule &CGM) : CGM(CGM) {
+CGMPtoGPURuntime::CGMPtoGPURuntime(CodeGenModule &CGM)
+    : CGM(CGM), NumKernelJobs(0) {
 }
 
 llvm::Value *
@@ -262,6 +268,95 @@ CGMPtoGPURuntime::CreateRuntimeFunction(MPtoGPURTLFunction Function) {
           RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_get_threads_blocks");
           break;
       }
+  case MPtoGPURTL_cl_kernel_handle: {
+    // Build int _cl_kernel_handle(char* prog, char* kernel);
+    llvm::Type *TParams[] = {CGM.Int8PtrTy, CGM.Int8PtrTy};
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.Int32Ty, TParams, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_kernel_handle");
+    break;
+  }
+  case MPtoGPURTL_cl_use_kernel: {
+    // Build int _cl_use_kernel(int handle);
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.Int32Ty, CGM.Int32Ty, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_use_kernel");
+    break;
+  }
+  case MPtoGPURTL_cl_read_mapped: {
+    // Build int _cl_read_mapped(long size, int id, void* loc);
+    llvm::Type *TParams[] = {CGM.Int64Ty, CGM.Int32Ty, CGM.VoidPtrTy};
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.Int32Ty, TParams, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_read_mapped");
+    break;
+  }
+  case MPtoGPURTL_cl_register_program: {
+    // Build void _cl_register_program(char* name);
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.VoidTy, CGM.Int8PtrTy, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_register_program");
+    break;
+  }
+  case MPtoGPURTL_cl_register_image: {
+    // Build void _cl_register_image(char* name, int kind, char* image, long size);
+    llvm::Type *TParams[] = {CGM.Int8PtrTy, CGM.Int32Ty, CGM.Int8PtrTy, CGM.Int64Ty};
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.VoidTy, TParams, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_register_image");
+    break;
+  }
+  case MPtoGPURTL_cl_get_reduction_groups: {
+    // Build int _cl_get_reduction_groups(int* threads, int* blocks, long size);
+    llvm::Type *TParams[] = {CGM.Int32Ty->getPointerTo(), CGM.Int32Ty->getPointerTo(), CGM.Int64Ty};
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.Int32Ty, TParams, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_get_reduction_groups");
+    break;
+  }
+  case MPtoGPURTL_cl_scan: {
+    // Build int _cl_scan(int block, int add, int in, int out, int flags, long n, int bytes, int fbytes, int exclusive);
+    llvm::Type *TParams[] = {CGM.Int32Ty, CGM.Int32Ty, CGM.Int32Ty, CGM.Int32Ty, CGM.Int32Ty, CGM.Int64Ty, CGM.Int32Ty, CGM.Int32Ty, CGM.Int32Ty};
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.Int32Ty, TParams, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_scan");
+    break;
+  }
+  case MPtoGPURTL_cl_launch: {
+    // Build int _cl_launch(int handle, int nargs, _cl_arg_desc* desc, void** vals, long* ndrange);
+    llvm::Type *TParams[] = {CGM.Int32Ty, CGM.Int32Ty, CGM.Int32Ty->getPointerTo(), CGM.VoidPtrTy->getPointerTo(), CGM.Int64Ty->getPointerTo()};
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.Int32Ty, TParams, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_launch");
+    break;
+  }
+  case MPtoGPURTL_cl_launch_stream: {
+    // Build int _cl_launch_stream(int handle, int nargs, _cl_arg_desc* desc, void** vals, long* ndrange,
+    //                             int loop, int nstreams, _cl_stream_desc* streams);
+    llvm::Type *TParams[] = {CGM.Int32Ty, CGM.Int32Ty, CGM.Int32Ty->getPointerTo(), CGM.VoidPtrTy->getPointerTo(),
+                             CGM.Int64Ty->getPointerTo(), CGM.Int32Ty, CGM.Int32Ty, CGM.Int32Ty->getPointerTo()};
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.Int32Ty, TParams, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_launch_stream");
+    break;
+  }
+  case MPtoGPURTL_cl_offload_profitable: {
+    // Build int _cl_offload_profitable(long ops, int launches, int nmaps, void** locs,
+    //                                  long* sizes, int* types);
+    llvm::Type *TParams[] = {CGM.Int64Ty, CGM.Int32Ty, CGM.Int32Ty, CGM.VoidPtrTy->getPointerTo(),
+                             CGM.Int64Ty->getPointerTo(), CGM.Int32Ty->getPointerTo()};
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.Int32Ty, TParams, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_offload_profitable");
+    break;
+  }
+  case MPtoGPURTL_cl_vector_width: {
+    // Build int _cl_vector_width(int kind);
+    llvm::FunctionType *FnTy =
+      llvm::FunctionType::get(CGM.Int32Ty, CGM.Int32Ty, false);
+    RTLFn = CGM.CreateRuntimeFunction(FnTy, "_cl_vector_width");
+    break;
+  }
     
   }
   return RTLFn;
@@ -435,6 +530,178 @@ CGMPtoGPURuntime::cl_get_threads_blocks() {
 	 , "_cl_get_threads_blocks");
 }
 
+llvm::Value*
+CGMPtoGPURuntime::cl_kernel_handle() {
+  return CGM.CreateRuntimeFunction(
+	 llvm::TypeBuilder<_cl_kernel_handle, false>::get(CGM.getLLVMContext())
+	 , "_cl_kernel_handle");
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_use_kernel() {
+  return CGM.CreateRuntimeFunction(
+	 llvm::TypeBuilder<_cl_use_kernel, false>::get(CGM.getLLVMContext())
+	 , "_cl_use_kernel");
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_read_mapped() {
+  return CGM.CreateRuntimeFunction(
+	 llvm::TypeBuilder<_cl_read_mapped, false>::get(CGM.getLLVMContext())
+	 , "_cl_read_mapped");
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_register_program() {
+  return CGM.CreateRuntimeFunction(
+	 llvm::TypeBuilder<_cl_register_program, false>::get(CGM.getLLVMContext())
+	 , "_cl_register_program");
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_register_image() {
+  return CGM.CreateRuntimeFunction(
+	 llvm::TypeBuilder<_cl_register_image, false>::get(CGM.getLLVMContext())
+	 , "_cl_register_image");
+}
+
+void CGMPtoGPURuntime::registerProgram(const std::string &Program) {
+  if (std::find(Programs.begin(), Programs.end(), Program) == Programs.end())
+    Programs.push_back(Program);
+}
+
+bool CGMPtoGPURuntime::checkKernelTools(SourceLocation Loc, bool Polyhedral,
+                                        bool Vectorize) {
+  std::string Tool, Subdir;
+  if (MPtoGPUFindKernelTools(Polyhedral, Vectorize,
+                             CGM.getLangOpts().OMPtoGPUTriple, Tool, Subdir))
+    return true;
+  if (MissingTools.insert(Tool))
+    CGM.getDiags().Report(Loc, diag::err_mptogpu_kernel_tool)
+        << Tool << !Subdir.empty() << Subdir;
+  return false;
+}
+
+void CGMPtoGPURuntime::reportKernelError(SourceLocation Loc,
+                                         const MPtoGPUKernelError &Err) {
+  CGM.getDiags().Report(Loc, diag::err_mptogpu_kernel_step)
+      << Err.Tool.empty() << Err.Tool << !Err.Message.empty() << Err.Message;
+}
+
+void CGMPtoGPURuntime::enqueueKernelJob(SourceLocation Loc,
+                                        const std::string &Program,
+                                        bool Vectorize, bool Verbose,
+                                        const llvm::Triple &Tgt) {
+  const unsigned Job = NumKernelJobs++;
+  KernelJobs.enqueue([=] {
+    KernelJobError E;
+    if (MPtoGPULowerKernelFile(Program, Vectorize, Verbose, Tgt, E.Err))
+      return;
+    E.Job = Job;
+    E.Loc = Loc;
+    std::lock_guard<std::mutex> Guard(KernelErrorsLock);
+    KernelErrors.push_back(E);
+  });
+}
+
+void CGMPtoGPURuntime::finishKernelJobs() {
+  KernelJobs.wait();
+  // In the order of the target regions, whatever order the jobs ran in
+  std::sort(KernelErrors.begin(), KernelErrors.end(),
+            [](const KernelJobError &A, const KernelJobError &B) {
+              return A.Job < B.Job;
+            });
+  for (std::vector<KernelJobError>::iterator I = KernelErrors.begin(),
+                                             E = KernelErrors.end();
+       I != E; ++I)
+    reportKernelError(I->Loc, I->Err);
+  KernelErrors.clear();
+}
+
+llvm::Function *CGMPtoGPURuntime::emitRegistrationFunction() {
+  if (Programs.empty())
+    return nullptr;
+
+  llvm::FunctionType *FnTy = llvm::FunctionType::get(CGM.VoidTy, false);
+  llvm::Function *Fn =
+    llvm::Function::Create(FnTy, llvm::GlobalValue::InternalLinkage,
+                           ".cl_register_programs", &CGM.getModule());
+  llvm::BasicBlock *Entry =
+    llvm::BasicBlock::Create(CGM.getLLVMContext(), "entry", Fn);
+  llvm::IRBuilder<> Builder(Entry);
+
+  // The kernel files have been generated by now. Embed each image in the
+  // host object so that the runtime does not need to find them at run time;
+  // the kinds match the _CL_IMAGE_* constants of cldevice.h.
+  static const char *const Suffixes[] = {".cl", ".bc", ".aocx", ".spv"};
+  for (std::vector<std::string>::iterator I = Programs.begin(),
+                                          E = Programs.end();
+       I != E; ++I) {
+    llvm::Value *Name = Builder.CreateGlobalStringPtr(*I);
+    Builder.CreateCall(cl_register_program(), Name);
+    for (unsigned Kind = 0; Kind < llvm::array_lengthof(Suffixes); ++Kind) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Image =
+          llvm::MemoryBuffer::getFile(*I + Suffixes[Kind]);
+      if (!Image)
+        continue;
+      llvm::Constant *Data = llvm::ConstantDataArray::getString(
+          CGM.getLLVMContext(), Image.get()->getBuffer(), false);
+      llvm::GlobalVariable *GV = new llvm::GlobalVariable(
+          CGM.getModule(), Data->getType(), true,
+          llvm::GlobalValue::PrivateLinkage, Data,
+          ".cl_image." + *I + Suffixes[Kind]);
+      GV->setUnnamedAddr(true);
+      llvm::Value *Args[] = {
+        Name, Builder.getInt32(Kind),
+        Builder.CreateConstInBoundsGEP2_32(GV, 0, 0),
+        Builder.getInt64(Image.get()->getBufferSize())
+      };
+      Builder.CreateCall(cl_register_image(), Args);
+    }
+  }
+  Builder.CreateRetVoid();
+  return Fn;
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_get_reduction_groups() {
+  return CGM.CreateRuntimeFunction(
+	 llvm::TypeBuilder<_cl_get_reduction_groups, false>::get(CGM.getLLVMContext())
+	 , "_cl_get_reduction_groups");
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_scan() {
+  // TypeBuilder does not go up to nine parameters
+  return CreateRuntimeFunction(MPtoGPURTL_cl_scan);
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_launch() {
+  return CGM.CreateRuntimeFunction(
+	 llvm::TypeBuilder<_cl_launch, false>::get(CGM.getLLVMContext())
+	 , "_cl_launch");
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_launch_stream() {
+  // TypeBuilder does not go up to eight parameters
+  return CreateRuntimeFunction(MPtoGPURTL_cl_launch_stream);
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_offload_profitable() {
+  // TypeBuilder does not go up to six parameters
+  return CreateRuntimeFunction(MPtoGPURTL_cl_offload_profitable);
+}
+
+llvm::Value*
+CGMPtoGPURuntime::cl_vector_width() {
+  return CGM.CreateRuntimeFunction(
+	 llvm::TypeBuilder<_cl_vector_width, false>::get(CGM.getLLVMContext())
+	 , "_cl_vector_width");
+}
+
 //
 // Create runtime for the target used in the Module
 //
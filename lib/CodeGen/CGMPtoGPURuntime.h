@@ -18,10 +18,14 @@
 
 #include "clang/AST/Type.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Value.h"
 #include "CodeGenModule.h"
 #include "CodeGenFunction.h"
+#include "CGMPtoGPUKernelGen.h"
+#include <string>
+#include <vector>
 
 namespace llvm {
 class AllocaInst;
@@ -64,6 +68,14 @@ namespace {
 
     typedef int32_t(_cl_get_threads_blocks)(int32_t *threads, int32_t *blocks, int32_t *sthreads, int32_t *sblocks,
                                             int64_t size, int32_t bytes);
+  typedef int32_t(_cl_kernel_handle)(char* prog, char* kernel);
+  typedef int32_t(_cl_use_kernel)(int32_t handle);
+  typedef int32_t(_cl_read_mapped)(int64_t size, int32_t id, void* loc);
+  typedef void(_cl_register_program)(char* name);
+  typedef void(_cl_register_image)(char* name, int32_t kind, char* image, int64_t size);
+  typedef int32_t(_cl_get_reduction_groups)(int32_t *threads, int32_t *blocks, int64_t size);
+  typedef int32_t(_cl_launch)(int32_t handle, int32_t nargs, int32_t* desc, void** vals, int64_t* ndrange);
+  typedef int32_t(_cl_vector_width)(int32_t kind);
 }
 
 namespace clang {
@@ -77,6 +89,30 @@ class CGMPtoGPURuntime {
 
 protected:
   CodeGenModule &CGM;
+
+  /// \brief Kernel files (programs) referenced by this module, in the order
+  /// they were first used.
+  std::vector<std::string> Programs;
+
+  /// \brief Kernel generation jobs still running for this module.
+  MPtoGPUKernelJobs KernelJobs;
+
+  /// \brief Kernel generation tools found missing, which are reported once.
+  llvm::StringSet<> MissingTools;
+
+  /// \brief Kernel generation jobs queued so far.
+  unsigned NumKernelJobs;
+
+  /// \brief Failures of the kernel generation jobs, with their target
+  /// regions and the order the jobs were queued in. They are reported once
+  /// the jobs are joined (see finishKernelJobs).
+  struct KernelJobError {
+    unsigned Job;
+    SourceLocation Loc;
+    MPtoGPUKernelError Err;
+  };
+  std::vector<KernelJobError> KernelErrors;
+  std::mutex KernelErrorsLock;
   
 public:
   enum MPtoGPURTLFunction {
@@ -103,7 +139,18 @@ public:
     MPtoGPURTL_cl_execute_tiled_kernel,
     MPtoGPURTL_cl_release_buffers,
     MPtoGPURTL_cl_release_buffer,
-    MPtoGPURTL_cl_get_threads_blocks
+    MPtoGPURTL_cl_get_threads_blocks,
+    MPtoGPURTL_cl_kernel_handle,
+    MPtoGPURTL_cl_use_kernel,
+    MPtoGPURTL_cl_read_mapped,
+    MPtoGPURTL_cl_register_program,
+    MPtoGPURTL_cl_register_image,
+    MPtoGPURTL_cl_get_reduction_groups,
+    MPtoGPURTL_cl_scan,
+    MPtoGPURTL_cl_launch,
+    MPtoGPURTL_cl_launch_stream,
+    MPtoGPURTL_cl_offload_profitable,
+    MPtoGPURTL_cl_vector_width
   };
   
   explicit CGMPtoGPURuntime(CodeGenModule &CGM);
@@ -138,6 +185,45 @@ public:
   virtual llvm::Value* cl_release_buffers();  
   virtual llvm::Value* cl_release_buffer();
   virtual llvm::Value* cl_get_threads_blocks();
+  virtual llvm::Value* cl_kernel_handle();
+  virtual llvm::Value* cl_use_kernel();
+  virtual llvm::Value* cl_read_mapped();
+  virtual llvm::Value* cl_register_program();
+  virtual llvm::Value* cl_register_image();
+
+  /// \brief Records that this module uses the kernel file Program.
+  void registerProgram(const std::string &Program);
+
+  /// \brief Emits a function that registers the programs of this module
+  /// with the runtime (so that it can build them ahead of their first use)
+  /// along with the kernel images embedded for them, or returns null if
+  /// there are none. It is meant to run as a global ctor.
+  llvm::Function *emitRegistrationFunction();
+
+  /// \brief Reports at \a Loc a kernel generation tool the target region
+  /// needs that can not be found, unless it was reported before (see
+  /// MPtoGPUFindKernelTools). Returns false if one is missing.
+  bool checkKernelTools(SourceLocation Loc, bool Polyhedral, bool Vectorize);
+
+  /// \brief Reports at \a Loc the failure of a kernel generation step of the
+  /// target region.
+  void reportKernelError(SourceLocation Loc, const MPtoGPUKernelError &Err);
+
+  /// \brief Queues the vectorization and SPIR lowering of the kernel file
+  /// Program of the target region at \a Loc on the kernel generation pool
+  /// (see MPtoGPULowerKernelFile).
+  void enqueueKernelJob(SourceLocation Loc, const std::string &Program,
+                        bool Vectorize, bool Verbose, const llvm::Triple &Tgt);
+
+  /// \brief Waits for the queued kernel generation jobs and reports their
+  /// failures. Must be called before the kernel images are embedded.
+  void finishKernelJobs();
+  virtual llvm::Value* cl_get_reduction_groups();
+  virtual llvm::Value* cl_scan();
+  virtual llvm::Value* cl_launch();
+  virtual llvm::Value* cl_launch_stream();
+  virtual llvm::Value* cl_offload_profitable();
+  virtual llvm::Value* cl_vector_width();
 };
   
 /// \brief Returns an implementation of the OpenMP to GPU RTL for a given target
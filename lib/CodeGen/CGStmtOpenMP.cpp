@@ -16,6 +16,7 @@
 #include "CGOpenCLRuntime.h"
 #include "CGOpenMPRuntimeTypes.h"
 #include "CGOpenMPRuntime.h"
+#include "CGMPtoGPUKernelGen.h"
 #include "CGMPtoGPURuntime.h"
 #include "CodeGenModule.h"
 #include "TargetInfo.h"
@@ -28,6 +29,7 @@
 #include "clang/Basic/TargetInfo.h"
 #include "clang/Basic/Diagnostic.h"
 #include "clang/Frontend/CodeGenOptions.h"
+#include "clang/Frontend/FrontendDiagnostic.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/GlobalVariable.h"
@@ -57,6 +59,98 @@ bool isTargetDataIf = false;
 int TargetDataIfRegion = 0;
 bool insideTarget = false;
 
+//
+// Nesting depth of target data regions, and whether the host version of
+// the current target region was chosen by -offload-dispatch (its loops then
+// run as host OpenMP parallel loops, see EmitOffloadDispatch)
+//
+int targetDataDepth = 0;
+bool hostDispatch = false;
+
+//
+// A reduction variable of the loop being offloaded, with the OpenCL C code
+// that initializes its private copies and combines two of them: Combine
+// folds omp_in into omp_out (see EmitOMPDirectiveWithReduction)
+//
+struct ReductionVar {
+    llvm::Value *Addr;
+    std::string Name;
+    std::string Type;
+    std::string Init;
+    std::string Combine;
+    unsigned Bytes;
+};
+std::vector<ReductionVar> reductionVars;
+
+//
+// A scan variable of the loop being offloaded: the mapped buffers it is
+// scanned from and into, the buffer of segment heads (or -1) and the OpenCL
+// C code of its identity and combiner, as for ReductionVar. Var is the
+// variable as the scan clause names it
+//
+struct ScanVar {
+    const Expr *Var;
+    int In;
+    int Out;
+    int Flags;
+    bool Exclusive;
+    QualType Elem;
+    std::string Type;
+    std::string FlagType;
+    std::string Init;
+    std::string Combine;
+    unsigned Bytes;
+    unsigned FlagBytes;
+};
+
+//
+// An argument of the next kernel launch (see EmitCLLaunch): a mapped buffer
+// (Index), a host value of Bytes bytes at Loc, or a local array of Bytes
+// times the int at Loc bytes. Kinds are the _CL_ARG_* of cldevice.h
+//
+enum { CL_ARG_BUFFER, CL_ARG_HOST, CL_ARG_LOCAL };
+struct LaunchArg {
+    int Kind;
+    int Index;
+    unsigned Bytes;
+    llvm::Value *Loc;
+};
+std::vector<LaunchArg> launchArgs;
+
+//
+// A mapped array the next launch may stream (see EmitCLLaunch): the kernel
+// arguments of its buffer and of the offset of its slice, the range of the
+// constants added to the counter in its subscripts, and in the ones of its
+// stores (empty when WLo > WHi), and its element size. The fields are those
+// of _cl_stream_desc in cldevice.h
+//
+struct StreamArg {
+    int Pos;
+    int Offset;
+    int Lo;
+    int Hi;
+    int WLo;
+    int WHi;
+    int Elem;
+};
+std::vector<StreamArg> streamArgs;
+
+//
+// Loops of the target region that EmitOMPtoOpenCLParallelFor runs in the
+// kernel of the loop it emits, after its body (see EmitTargetBodytoGPU)
+//
+std::vector<const OMPExecutableDirective *> fusedLoops;
+
+static void addLaunchArg(unsigned Pos, int Kind, int Index, unsigned Bytes,
+                         llvm::Value *Loc) {
+    if (Pos >= launchArgs.size()) {
+        LaunchArg Unset = {-1, 0, 0, nullptr};
+        launchArgs.resize(Pos + 1, Unset);
+    }
+    LaunchArg Arg = {Kind, Index, Bytes, Loc};
+    launchArgs[Pos] = Arg;
+}
+
     llvm::SmallVector<QualType, 16> deftypes;
 
 static bool dumpedDefType(const QualType* T) {
@@ -86,24 +180,607 @@ private:
     std::string val_;
 };
 
-    int GetTypeSizeInBits(llvm::Type *ty) {
-        int typeSize = 0;
-        if (ty->isSized()) {
-            if (ty->isStructTy()) {
-                int nElements = ty->getStructNumElements();
-                for (int i = 0; i < nElements; i++) {
-                    llvm::Type *elTy = ty->getStructElementType(i);
-                    typeSize += GetTypeSizeInBits(elTy);
-                }
+//
+// OpenCL C name of the scalar type Q, or "" if kernels can not reduce it
+//
+static std::string getReductionCLType(ASTContext &Ctx, QualType Q) {
+    Q = Q.getCanonicalType().getUnqualifiedType();
+    uint64_t Bits = Ctx.getTypeSize(Q);
+    if (Q->isRealFloatingType()) {
+        if (Bits == 32) return "float";
+        if (Bits == 64) return "double";
+        return "";
+    }
+    if (!Q->isIntegerType() || Q->isBooleanType() || Q->isEnumeralType())
+        return "";
+    std::string Name;
+    switch (Bits) {
+        case 8: Name = "char"; break;
+        case 16: Name = "short"; break;
+        case 32: Name = "int"; break;
+        case 64: Name = "long"; break;
+        default: return "";
+    }
+    return Q->isUnsignedIntegerType() ? "u" + Name : Name;
+}
+
+//
+// Element type of the array or pointer type Q, keeping its typedef name
+//
+static QualType getScanElementType(ASTContext &Ctx, QualType Q) {
+    Q = Q.getNonReferenceType();
+    if (const PointerType *PT = Q->getAs<PointerType>())
+        Q = PT->getPointeeType();
+    while (const ArrayType *AT = Ctx.getAsArrayType(Q))
+        Q = AT->getElementType();
+    return Q.getUnqualifiedType();
+}
+
+//
+// Identity of min (Max = false) or max (Max = true) reductions of type Ty
+//
+static std::string getReductionCLLimit(const std::string &Ty, bool Max) {
+    if (Ty == "float") return Max ? "-FLT_MAX" : "FLT_MAX";
+    if (Ty == "double") return Max ? "-DBL_MAX" : "DBL_MAX";
+    if (Ty[0] == 'u') {
+        if (Max) return "0";
+        if (Ty == "uchar") return "UCHAR_MAX";
+        if (Ty == "ushort") return "USHRT_MAX";
+        return Ty == "uint" ? "UINT_MAX" : "ULONG_MAX";
+    }
+    std::string Prefix = Ty == "char" ? "CHAR" : Ty == "short" ? "SHRT" : Ty == "int" ? "INT" : "LONG";
+    return Prefix + (Max ? "_MIN" : "_MAX");
+}
+
+//
+// OpenCL C code of the identity of the reduction or scan operator Op on Type
+// and of its combiner, which folds omp_in into omp_out. Op is spelled as
+// getOpenMPSimpleClauseTypeName does; declare reductions and scans use the
+// macros that come with the include file for their name OpName and the type
+// QTy Type spells (see EmitOMPDeclareReduction). Returns false if kernels can
+// not apply Op
+//
+static bool getCLCombineOp(CodeGenModule &CGM, StringRef Op, const std::string &OpName,
+                           QualType QTy, const std::string &Type,
+                           std::string &Init, std::string &Combine) {
+    if (Op == "+" || Op == "-") {
+        Init = "0";
+        Combine = "omp_out += omp_in";
+    } else if (Op == "*") {
+        Init = "1";
+        Combine = "omp_out *= omp_in";
+    } else if (Op == "&") {
+        Init = "~(" + Type + ")0";
+        Combine = "omp_out &= omp_in";
+    } else if (Op == "|") {
+        Init = "0";
+        Combine = "omp_out |= omp_in";
+    } else if (Op == "^") {
+        Init = "0";
+        Combine = "omp_out ^= omp_in";
+    } else if (Op == "&&") {
+        Init = "1";
+        Combine = "omp_out = omp_out && omp_in";
+    } else if (Op == "||") {
+        Init = "0";
+        Combine = "omp_out = omp_out || omp_in";
+    } else if (Op == "min") {
+        Init = getReductionCLLimit(Type, false);
+        Combine = "omp_out = (omp_in < omp_out) ? omp_in : omp_out";
+    } else if (Op == "max") {
+        Init = getReductionCLLimit(Type, true);
+        Combine = "omp_out = (omp_in > omp_out) ? omp_in : omp_out";
+    } else if (Op == "/*custom*/" && CGM.OpenMPSupport.hasCLOperator(OpName, QTy)) {
+        const std::string Macro = CGM.OpenMPSupport.getCLOperatorName(OpName, QTy);
+        Init = Macro + "_initializer";
+        Combine = Macro + "_combiner(omp_out, omp_in)";
+    } else {
+        return false;
+    }
+    return true;
+}
+
+//
+// Emit the local-memory tree that reduces the private copies of a
+// work-group into _loc_<var>[0], then store the result: the partial result
+// of the group in the first stage, the combination with the original value
+// of the variable in the final one.
+//
+static void EmitCLReductionTree(llvm::raw_ostream &OS, bool Final) {
+    OS << "   _LID = get_local_id(0);\n";
+    for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                 E = reductionVars.end(); I != E; ++I)
+        OS << "   _loc_" << I->Name << "[_LID] = " << I->Name << ";\n";
+    OS << "   barrier(CLK_LOCAL_MEM_FENCE);\n";
+    OS << "   for (_S = get_local_size(0) / 2; _S > 0; _S >>= 1) {\n";
+    OS << "     if (_LID < _S) {\n";
+    for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                 E = reductionVars.end(); I != E; ++I) {
+        OS << "       { " << I->Type << " omp_out = _loc_" << I->Name << "[_LID], omp_in = _loc_"
+           << I->Name << "[_LID + _S];\n";
+        OS << "         " << I->Combine << ";\n";
+        OS << "         _loc_" << I->Name << "[_LID] = omp_out; }\n";
+    }
+    OS << "     }\n";
+    OS << "     barrier(CLK_LOCAL_MEM_FENCE);\n";
+    OS << "   }\n";
+    OS << "   if (_LID == 0) {\n";
+    for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                 E = reductionVars.end(); I != E; ++I) {
+        if (Final) {
+            OS << "     { " << I->Type << " omp_out = _orig_" << I->Name << ", omp_in = _loc_"
+               << I->Name << "[0];\n";
+            OS << "       " << I->Combine << ";\n";
+            OS << "       _red_" << I->Name << "[0] = omp_out; }\n";
+        } else {
+            OS << "     _red_" << I->Name << "[get_group_id(0)] = _loc_" << I->Name << "[0];\n";
+        }
+    }
+    OS << "   }\n";
+}
+
+//
+// Emit the statement that folds In into the variable Acc with the combiner
+// of the scan variable V
+//
+static void EmitCLScanCombine(llvm::raw_ostream &OS, const ScanVar &V, const char *Indent,
+                              const std::string &Acc, const std::string &In) {
+    OS << Indent << "{ " << V.Type << " omp_out = " << Acc << ", omp_in = " << In << ";\n";
+    OS << Indent << "  " << V.Combine << ";\n";
+    OS << Indent << "  " << Acc << " = omp_out; }\n";
+}
+
+//
+// Emit the two kernels of the scan variable number K that _cl_scan runs on
+// each level of the block-sum hierarchy. _scan_block_<K> scans a tile of _K
+// elements per work-item: a serial pass sums the elements of each item, the
+// sums are scanned in local memory and a second pass writes the inclusive or
+// exclusive results. With more than one group, it also stores the total of
+// the group in _sums and, for segmented scans, whether the group holds a
+// segment head and the offset of the first one. _scan_add_<K> folds the
+// scanned total of the previous group into each element that precedes the
+// first head of its group. Segmented scans reset the running value at every
+// head, i.e. they combine (flag, value) pairs.
+//
+static void EmitCLScanKernels(llvm::raw_ostream &OS, const ScanVar &V, unsigned K) {
+    const std::string T = V.Type;
+    const bool Seg = V.Flags >= 0;
+
+    OS << "\n__kernel void _scan_block_" << K << " (\n";
+    OS << "__global " << T << " *_in, __global " << T << " *_out, __global " << T << " *_sums,\n";
+    OS << "long _N, int _K, int _EX, __local " << T << " *_loc";
+    if (Seg) {
+        OS << ",\n__global const " << V.FlagType << " *_flg, __global " << V.FlagType
+           << " *_gflg, __global int *_gfirst, __local int *_lflg";
+    }
+    OS << ") {\n";
+    OS << "   int _LID = get_local_id(0), _LS = get_local_size(0), _S, _k;\n";
+    OS << "   long _base = ((long) get_group_id(0) * _LS + _LID) * _K, _j;\n";
+    OS << "   " << T << " _id = " << V.Init << ";\n";
+    OS << "   " << T << " _acc = _id, _x, _p;\n";
+    if (Seg) OS << "   int _f = 0, _first = 0, _pf = 0;\n";
+    OS << "   for (_k = 0; _k < _K && _base + _k < _N; _k++) {\n";
+    OS << "     _j = _base + _k;\n";
+    if (Seg) OS << "     if (_flg[_j]) { _acc = _id; if (!_f) _first = _k; _f = 1; }\n";
+    EmitCLScanCombine(OS, V, "     ", "_acc", "_in[_j]");
+    OS << "   }\n";
+    OS << "   _loc[_LID] = _acc;\n";
+    if (Seg) OS << "   _lflg[_LID] = _f;\n";
+    OS << "   barrier(CLK_LOCAL_MEM_FENCE);\n";
+    OS << "   for (_S = 1; _S < _LS; _S <<= 1) {\n";
+    OS << "     if (_LID >= _S) {\n";
+    OS << "       _p = _loc[_LID - _S];\n";
+    if (Seg) OS << "       _pf = _lflg[_LID - _S];\n";
+    OS << "     }\n";
+    OS << "     barrier(CLK_LOCAL_MEM_FENCE);\n";
+    OS << "     if (_LID >= _S) {\n";
+    if (Seg) {
+        OS << "       if (!_lflg[_LID]) {\n";
+        EmitCLScanCombine(OS, V, "         ", "_p", "_loc[_LID]");
+        OS << "         _loc[_LID] = _p;\n";
+        OS << "       }\n";
+        OS << "       _lflg[_LID] |= _pf;\n";
+    } else {
+        EmitCLScanCombine(OS, V, "       ", "_p", "_loc[_LID]");
+        OS << "       _loc[_LID] = _p;\n";
+    }
+    OS << "     }\n";
+    OS << "     barrier(CLK_LOCAL_MEM_FENCE);\n";
+    OS << "   }\n";
+    OS << "   if (_LID > 0) _acc = _loc[_LID - 1]; else _acc = _id;\n";
+    OS << "   for (_k = 0; _k < _K && _base + _k < _N; _k++) {\n";
+    OS << "     _j = _base + _k;\n";
+    OS << "     _x = _in[_j];\n";
+    if (Seg) OS << "     if (_flg[_j]) _acc = _id;\n";
+    OS << "     if (_EX) _out[_j] = _acc;\n";
+    EmitCLScanCombine(OS, V, "     ", "_acc", "_x");
+    OS << "     if (!_EX) _out[_j] = _acc;\n";
+    OS << "   }\n";
+    OS << "   if (get_num_groups(0) > 1) {\n";
+    OS << "     if (_LID == _LS - 1) {\n";
+    OS << "       _sums[get_group_id(0)] = _loc[_LID];\n";
+    if (Seg) {
+        OS << "       _gflg[get_group_id(0)] = _lflg[_LID];\n";
+        OS << "       if (!_lflg[_LID]) _gfirst[get_group_id(0)] = _LS * _K;\n";
+    }
+    OS << "     }\n";
+    if (Seg) {
+        OS << "     if (_f && (_LID == 0 || !_lflg[_LID - 1]))\n";
+        OS << "       _gfirst[get_group_id(0)] = _LID * _K + _first;\n";
+    }
+    OS << "   }\n";
+    OS << "}\n";
+
+    OS << "\n__kernel void _scan_add_" << K << " (\n";
+    OS << "__global " << T << " *_out, __global " << T << " *_sums, long _N, int _K";
+    if (Seg) OS << ",\n__global int *_gfirst";
+    OS << ") {\n";
+    OS << "   int _LID = get_local_id(0), _k;\n";
+    OS << "   long _g = get_group_id(0), _base = (_g * get_local_size(0) + _LID) * _K, _j;\n";
+    OS << "   " << T << " _c;\n";
+    OS << "   if (_g == 0) return;\n";
+    OS << "   for (_k = 0; _k < _K && _base + _k < _N; _k++) {\n";
+    if (Seg) OS << "     if (_LID * _K + _k >= _gfirst[_g]) break;\n";
+    OS << "     _j = _base + _k;\n";
+    OS << "     _c = _sums[_g - 1];\n";
+    EmitCLScanCombine(OS, V, "     ", "_c", "_out[_j]");
+    OS << "     _out[_j] = _c;\n";
+    OS << "   }\n";
+    OS << "}\n";
+}
+
+//
+// How a target [data] region uses a mapped variable (see MapUseScanner):
+// whether some element is read, stored, and whether the stores alone give
+// every element of the mapped extent its value, so that the contents the
+// host had before the region are never observed
+//
+struct MapUse {
+    bool Read;
+    bool Written;
+    bool Covered;
+};
+
+//
+// One dimension of a mapped variable, [0, Size) or [0, Length): Length is
+// the length of an array section when it is not a constant
+//
+struct MapExtent {
+    const Expr *Length;
+    uint64_t Size;
+    bool Known;
+};
+
+//
+// A for statement in the canonical form for (IV = Lower; IV < Upper; IV++),
+// or IV <= Upper when Inclusive
+//
+struct MapLoop {
+    const ForStmt *For;
+    const VarDecl *IV;
+    const Expr *Lower;
+    const Expr *Upper;
+    bool Inclusive;
+};
+
+static bool getMapLoop(const ForStmt *FS, MapLoop &L) {
+    L.For = FS;
+    L.IV = nullptr;
+    const Stmt *Init = FS->getInit();
+    if (const BinaryOperator *BO = dyn_cast_or_null<BinaryOperator>(Init)) {
+        const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(BO->getLHS()->IgnoreParenImpCasts());
+        if (BO->getOpcode() != BO_Assign || !DRE) return false;
+        L.IV = dyn_cast<VarDecl>(DRE->getDecl());
+        L.Lower = BO->getRHS();
+    } else if (const DeclStmt *DS = dyn_cast_or_null<DeclStmt>(Init)) {
+        if (!DS->isSingleDecl()) return false;
+        L.IV = dyn_cast<VarDecl>(DS->getSingleDecl());
+        L.Lower = L.IV ? L.IV->getInit() : nullptr;
+    }
+    if (!L.IV || !L.Lower) return false;
+
+    const BinaryOperator *Cond = dyn_cast_or_null<BinaryOperator>(FS->getCond());
+    if (!Cond || (Cond->getOpcode() != BO_LT && Cond->getOpcode() != BO_LE)) return false;
+    const DeclRefExpr *CV = dyn_cast<DeclRefExpr>(Cond->getLHS()->IgnoreParenImpCasts());
+    if (!CV || CV->getDecl() != L.IV) return false;
+    L.Upper = Cond->getRHS();
+    L.Inclusive = Cond->getOpcode() == BO_LE;
+
+    const Expr *Inc = FS->getInc();
+    const Expr *IncVar = nullptr;
+    if (const UnaryOperator *UO = dyn_cast_or_null<UnaryOperator>(Inc)) {
+        if (UO->isIncrementOp()) IncVar = UO->getSubExpr();
+    } else if (const CompoundAssignOperator *CA = dyn_cast_or_null<CompoundAssignOperator>(Inc)) {
+        const IntegerLiteral *One = dyn_cast<IntegerLiteral>(CA->getRHS()->IgnoreParenImpCasts());
+        if (CA->getOpcode() == BO_AddAssign && One && One->getValue() == 1)
+            IncVar = CA->getLHS();
+    }
+    const DeclRefExpr *IV = IncVar ? dyn_cast<DeclRefExpr>(IncVar->IgnoreParenImpCasts()) : nullptr;
+    return IV && IV->getDecl() == L.IV;
+}
+
+//
+// Classifies the uses of the mapped variable VD in the region Root. Only
+// element loads and stores through subscripts of VD itself are understood;
+// any other reference (address taken, passed to a call, copied to another
+// pointer) counts as both a read and a write, so the map is left alone. So
+// does any call that may reach VD without naming it, through a global or a
+// copy of its address made before the region (see mayAccessMemory)
+//
+class MapUseScanner {
+public:
+    MapUseScanner(ASTContext &Ctx, const Stmt *Root, const ValueDecl *VD)
+        : Ctx(Ctx), Root(Root), VD(VD), Cond(0), Jumps(false) {
+        U.Read = U.Written = U.Covered = false;
+    }
+
+    MapUse scan(const std::vector<MapExtent> &Dims) {
+        Extents = Dims;
+        visit(Root);
+        if (Jumps) U.Covered = false;
+        return U;
+    }
+
+private:
+    void visit(const Stmt *S);
+    void visitConditional(const Stmt *S) {
+        Cond++;
+        visit(S);
+        Cond--;
+    }
+    bool getAccess(const Expr *E, SmallVectorImpl<const Expr *> &Idx);
+    void store(ArrayRef<const Expr *> Idx);
+    bool runsOnce(const MapLoop &L);
+    bool covers(const MapLoop &L, const MapExtent &X);
+    bool isConstant(const Expr *E, llvm::APSInt &V) {
+        return !E->isValueDependent() && E->EvaluateAsInt(V, Ctx);
+    }
+
+    ASTContext &Ctx;
+    const Stmt *Root;
+    const ValueDecl *VD;
+    std::vector<MapExtent> Extents;
+    SmallVector<const ForStmt *, 4> Loops;
+    unsigned Cond;
+    bool Jumps;
+    MapUse U;
+};
+
+//
+// The variable E is, or the one E is an element of, with the subscripts in
+// Idx from the outermost one. Subscripts that leave a (sub)array and arrays
+// or pointers themselves are not element accesses
+//
+static const ValueDecl *getElementAccess(const Expr *E, SmallVectorImpl<const Expr *> &Idx) {
+    Idx.clear();
+    E = E->IgnoreParens();
+    if (E->getType()->isArrayType()) return nullptr;
+    while (const ArraySubscriptExpr *ASE = dyn_cast<ArraySubscriptExpr>(E)) {
+        Idx.push_back(ASE->getIdx());
+        E = ASE->getBase()->IgnoreParenImpCasts();
+    }
+    const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E);
+    if (!DRE) return nullptr;
+    const ValueDecl *VD = DRE->getDecl();
+    if (Idx.empty() && (VD->getType()->isPointerType() || VD->getType()->isArrayType()))
+        return nullptr;
+    std::reverse(Idx.begin(), Idx.end());
+    return VD;
+}
+
+//
+// A call that may read or write memory the caller can see, without naming
+// it: any call but one to a library built-in with no pointer argument
+//
+static bool mayAccessMemory(const CallExpr *CE) {
+    const FunctionDecl *FD = CE->getDirectCallee();
+    if (!FD || !FD->getBuiltinID()) return true;
+    for (unsigned i = 0; i < CE->getNumArgs(); ++i)
+        if (CE->getArg(i)->getType()->isPointerType() || CE->getArg(i)->getType()->isArrayType())
+            return true;
+    return false;
+}
+
+bool MapUseScanner::getAccess(const Expr *E, SmallVectorImpl<const Expr *> &Idx) {
+    return getElementAccess(E, Idx) == VD;
+}
+
+void MapUseScanner::visit(const Stmt *S) {
+    if (!S) return;
+    SmallVector<const Expr *, 4> Idx;
+
+    if (const BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+        if (BO->isAssignmentOp() && getAccess(BO->getLHS(), Idx)) {
+            if (BO->isCompoundAssignmentOp())
+                U.Read = true;
+            store(Idx);
+            for (unsigned i = 0; i < Idx.size(); ++i) visit(Idx[i]);
+            visit(BO->getRHS());
+            return;
+        }
+        if (BO->isLogicalOp()) {
+            visit(BO->getLHS());
+            visitConditional(BO->getRHS());
+            return;
+        }
+    } else if (const UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+        if (UO->isIncrementDecrementOp() && getAccess(UO->getSubExpr(), Idx)) {
+            U.Read = true;
+            store(Idx);
+            for (unsigned i = 0; i < Idx.size(); ++i) visit(Idx[i]);
+            return;
+        }
+    } else if (const ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S)) {
+        if (ICE->getCastKind() == CK_LValueToRValue && getAccess(ICE->getSubExpr(), Idx)) {
+            U.Read = true;
+            for (unsigned i = 0; i < Idx.size(); ++i) visit(Idx[i]);
+            return;
+        }
+    } else if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S)) {
+        if (DRE->getDecl() == VD)
+            U.Read = U.Written = true;
+        return;
+    } else if (const CallExpr *CE = dyn_cast<CallExpr>(S)) {
+        if (mayAccessMemory(CE))
+            U.Read = U.Written = true;
+    } else if (const CapturedStmt *CS = dyn_cast<CapturedStmt>(S)) {
+        // The captures are references to the variables, not uses
+        visit(CS->getCapturedStmt());
+        return;
+    } else if (const IfStmt *IS = dyn_cast<IfStmt>(S)) {
+        visit(IS->getConditionVariableDeclStmt());
+        visit(IS->getCond());
+        visitConditional(IS->getThen());
+        visitConditional(IS->getElse());
+        return;
+    } else if (const AbstractConditionalOperator *CO = dyn_cast<AbstractConditionalOperator>(S)) {
+        visit(CO->getCond());
+        visitConditional(CO->getTrueExpr());
+        visitConditional(CO->getFalseExpr());
+        return;
+    } else if (const ForStmt *FS = dyn_cast<ForStmt>(S)) {
+        visitConditional(FS->getInit());
+        visitConditional(FS->getCond());
+        visitConditional(FS->getInc());
+        Loops.push_back(FS);
+        visit(FS->getBody());
+        Loops.pop_back();
+        return;
+    } else if (isa<WhileStmt>(S) || isa<DoStmt>(S) || isa<SwitchStmt>(S)) {
+        for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+            visitConditional(*I);
+        return;
+    } else if (isa<BreakStmt>(S) || isa<ContinueStmt>(S) || isa<ReturnStmt>(S) ||
+               isa<GotoStmt>(S) || isa<IndirectGotoStmt>(S)) {
+        Jumps = true;
+        return;
+    }
+
+    for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+        visit(*I);
+}
+
+//
+// A loop that is not indexing the store must run at least once
+//
+bool MapUseScanner::runsOnce(const MapLoop &L) {
+    llvm::APSInt Lo, Up;
+    if (!isConstant(L.Lower, Lo) || !isConstant(L.Upper, Up)) return false;
+    return L.Inclusive ? Lo.getSExtValue() <= Up.getSExtValue()
+                       : Lo.getSExtValue() < Up.getSExtValue();
+}
+
+//
+// A loop indexing dimension X must walk all of it: from 0 up to its size,
+// or up to the unchanged length of its array section
+//
+bool MapUseScanner::covers(const MapLoop &L, const MapExtent &X) {
+    llvm::APSInt Lo, Up;
+    if (!isConstant(L.Lower, Lo) || Lo.getSExtValue() != 0) return false;
+    if (isConstant(L.Upper, Up))
+        return X.Known && Up.getSExtValue() + (L.Inclusive ? 1 : 0) >= (int64_t) X.Size;
+    if (!X.Length || L.Inclusive) return false;
+
+    llvm::FoldingSetNodeID A, B;
+    L.Upper->IgnoreParenImpCasts()->Profile(A, Ctx, true);
+    X.Length->IgnoreParenImpCasts()->Profile(B, Ctx, true);
+    if (!(A == B)) return false;
+
+    // and nothing in the region may change the length
+    SmallVector<const Stmt *, 4> Work(1, X.Length);
+    while (!Work.empty()) {
+        const Stmt *S = Work.pop_back_val();
+        if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S)) {
+            MapUseScanner Len(Ctx, Root, DRE->getDecl());
+            if (Len.scan(std::vector<MapExtent>()).Written) return false;
+        }
+        for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+            if (*I) Work.push_back(*I);
+    }
+    return true;
+}
+
+//
+// A store with subscripts Idx: it covers the variable when it is not
+// conditional and each subscript is the counter of a distinct enclosing
+// loop that walks its whole dimension
+//
+void MapUseScanner::store(ArrayRef<const Expr *> Idx) {
+    U.Written = true;
+    if (U.Covered || Cond || Idx.size() != Extents.size()) return;
+
+    SmallVector<MapLoop, 4> Info(Loops.size());
+    SmallVector<bool, 4> Used(Loops.size(), false);
+    for (unsigned l = 0; l < Loops.size(); ++l) {
+        if (!getMapLoop(Loops[l], Info[l])) return;
+        // the body must leave the counter alone
+        MapUseScanner Counter(Ctx, Loops[l]->getBody(), Info[l].IV);
+        if (Counter.scan(std::vector<MapExtent>()).Written) return;
+    }
+
+    for (unsigned k = 0; k < Idx.size(); ++k) {
+        const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Idx[k]->IgnoreParenImpCasts());
+        if (!DRE) return;
+        unsigned l = 0;
+        while (l < Loops.size() && (Used[l] || Info[l].IV != DRE->getDecl())) ++l;
+        if (l == Loops.size() || !covers(Info[l], Extents[k])) return;
+        Used[l] = true;
+    }
+    for (unsigned l = 0; l < Loops.size(); ++l)
+        if (!Used[l] && !runsOnce(Info[l])) return;
+    U.Covered = true;
+}
+
+//
+// The mapped variable of the map clause item E and the extent of each of
+// its dimensions: the array sections of E, or the bounds of its type
+//
+static const VarDecl *getMapExtents(ASTContext &Ctx, const Expr *E,
+                                    std::vector<MapExtent> &Dims) {
+    SmallVector<const CEANIndexExpr *, 4> Sections;
+    E = E->IgnoreParenImpCasts();
+    while (const ArraySubscriptExpr *ASE = dyn_cast<ArraySubscriptExpr>(E)) {
+        Sections.push_back(dyn_cast<CEANIndexExpr>(ASE->getIdx()->IgnoreParenImpCasts()));
+        E = ASE->getBase()->IgnoreParenImpCasts();
+    }
+    std::reverse(Sections.begin(), Sections.end());
+    const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E);
+    const VarDecl *VD = DRE ? dyn_cast<VarDecl>(DRE->getDecl()) : nullptr;
+    if (!VD) return nullptr;
+
+    QualType T = VD->getType().getNonReferenceType();
+    for (unsigned k = 0; ; ++k) {
+        MapExtent X = {nullptr, 0, false};
+        if (const ConstantArrayType *CAT = Ctx.getAsConstantArrayType(T)) {
+            X.Size = CAT->getSize().getZExtValue();
+            X.Known = true;
+            T = CAT->getElementType();
+        } else if (const ArrayType *AT = Ctx.getAsArrayType(T)) {
+            T = AT->getElementType();
+        } else if (const PointerType *PT = T->getAs<PointerType>()) {
+            T = PT->getPointeeType();
+        } else {
+            break;
+        }
+        // An element, or a section that does not start at 0, is never covered
+        if (k < Sections.size()) {
+            const CEANIndexExpr *CE = Sections[k];
+            llvm::APSInt V;
+            if (!CE || !CE->getLowerBound()->EvaluateAsInt(V, Ctx) ||
+                V.getSExtValue() != 0) {
+                X.Known = false;
+            } else if (CE->getLength()->EvaluateAsInt(V, Ctx)) {
+                X.Size = V.getZExtValue();
+                X.Known = true;
             } else {
-                typeSize = ty->getScalarSizeInBits();
+                X.Length = CE->getLength();
+                X.Known = false;
             }
-        } else {
-            llvm_unreachable("Unsupported data type for scan clause");
-            typeSize = 32; /* assume i32 data type */
         }
-        return typeSize;
+        Dims.push_back(X);
     }
+    return VD;
+}
 
 // Getters for fields of the loop-like directives. We may want to add a
 // common parent to all the loop-like directives to get rid of these.
@@ -673,6 +1350,748 @@ static void EmitCancellationPoint(
   }
 }
 
+//
+// A use a loop body makes of a variable declared outside of it, in the
+// order of evaluation: Own when the leading subscripts are the counters of
+// the parallel loops, so that only the work-item of the iteration touches
+// the element, and Defines for an unconditional store to a scalar
+//
+struct LoopUse {
+    const ValueDecl *VD;
+    bool Read;
+    bool Write;
+    bool Own;
+    bool Defines;
+};
+
+//
+// Collects the uses of the body of a parallel loop nest with the given
+// counters. Locals of the body and the counters are private to the
+// work-item and not collected; any use scan() does not understand, or a
+// jump out of the body, makes the loop unfit for fusion
+//
+class LoopUseScanner {
+public:
+    explicit LoopUseScanner(ArrayRef<const ValueDecl *> Counters)
+        : Counters(Counters.begin(), Counters.end()), Cond(0), Nest(0), Opaque(false) {}
+
+    bool scan(const Stmt *Body, std::vector<LoopUse> &Out) {
+        visit(Body);
+        Out.swap(Uses);
+        return !Opaque;
+    }
+
+private:
+    void visit(const Stmt *S);
+    void use(const ValueDecl *VD, ArrayRef<const Expr *> Idx, bool Read, bool Write);
+    void visitNested(const Stmt *S) {
+        Cond++;
+        Nest++;
+        visit(S);
+        Nest--;
+        Cond--;
+    }
+
+    SmallVector<const ValueDecl *, 3> Counters;
+    llvm::SmallPtrSet<const ValueDecl *, 8> Locals;
+    std::vector<LoopUse> Uses;
+    unsigned Cond;
+    unsigned Nest;
+    bool Opaque;
+};
+
+void LoopUseScanner::use(const ValueDecl *VD, ArrayRef<const Expr *> Idx, bool Read, bool Write) {
+    if (Locals.count(VD) ||
+        std::find(Counters.begin(), Counters.end(), VD) != Counters.end())
+        return;
+    bool Own = Idx.size() >= Counters.size();
+    for (unsigned k = 0; Own && k < Counters.size(); ++k) {
+        const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Idx[k]->IgnoreParenImpCasts());
+        Own = DRE && DRE->getDecl() == Counters[k];
+    }
+    LoopUse U = {VD, Read, Write, Own, Write && !Read && Idx.empty() && !Cond};
+    Uses.push_back(U);
+}
+
+void LoopUseScanner::visit(const Stmt *S) {
+    if (!S) return;
+    SmallVector<const Expr *, 4> Idx;
+    const ValueDecl *VD;
+
+    if (const DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+        for (DeclStmt::const_decl_iterator I = DS->decl_begin(), E = DS->decl_end(); I != E; ++I) {
+            if (const VarDecl *Var = dyn_cast<VarDecl>(*I)) {
+                Locals.insert(Var);
+                visit(Var->getInit());
+            }
+        }
+        return;
+    } else if (const BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+        if (BO->isAssignmentOp() && (VD = getElementAccess(BO->getLHS(), Idx))) {
+            for (unsigned i = 0; i < Idx.size(); ++i) visit(Idx[i]);
+            visit(BO->getRHS());
+            use(VD, Idx, BO->isCompoundAssignmentOp(), true);
+            return;
+        }
+        if (BO->isLogicalOp()) {
+            visit(BO->getLHS());
+            Cond++;
+            visit(BO->getRHS());
+            Cond--;
+            return;
+        }
+    } else if (const UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+        if (UO->isIncrementDecrementOp() && (VD = getElementAccess(UO->getSubExpr(), Idx))) {
+            for (unsigned i = 0; i < Idx.size(); ++i) visit(Idx[i]);
+            use(VD, Idx, true, true);
+            return;
+        }
+    } else if (const ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S)) {
+        if (ICE->getCastKind() == CK_LValueToRValue &&
+            (VD = getElementAccess(ICE->getSubExpr(), Idx))) {
+            for (unsigned i = 0; i < Idx.size(); ++i) visit(Idx[i]);
+            use(VD, Idx, true, false);
+            return;
+        }
+    } else if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S)) {
+        const ValueDecl *D = DRE->getDecl();
+        if (isa<VarDecl>(D) && !Locals.count(D) &&
+            std::find(Counters.begin(), Counters.end(), D) == Counters.end())
+            Opaque = true;
+        return;
+    } else if (const CapturedStmt *CS = dyn_cast<CapturedStmt>(S)) {
+        visit(CS->getCapturedStmt());
+        return;
+    } else if (const IfStmt *IS = dyn_cast<IfStmt>(S)) {
+        visit(IS->getConditionVariableDeclStmt());
+        visit(IS->getCond());
+        Cond++;
+        visit(IS->getThen());
+        visit(IS->getElse());
+        Cond--;
+        return;
+    } else if (const AbstractConditionalOperator *CO = dyn_cast<AbstractConditionalOperator>(S)) {
+        visit(CO->getCond());
+        Cond++;
+        visit(CO->getTrueExpr());
+        visit(CO->getFalseExpr());
+        Cond--;
+        return;
+    } else if (const ForStmt *FS = dyn_cast<ForStmt>(S)) {
+        visit(FS->getInit());
+        visitNested(FS->getCond());
+        visitNested(FS->getBody());
+        visitNested(FS->getInc());
+        return;
+    } else if (isa<WhileStmt>(S) || isa<DoStmt>(S) || isa<SwitchStmt>(S)) {
+        for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+            visitNested(*I);
+        return;
+    } else if (isa<BreakStmt>(S) || isa<ContinueStmt>(S)) {
+        if (!Nest) Opaque = true;
+        return;
+    } else if (isa<ReturnStmt>(S) || isa<GotoStmt>(S) || isa<IndirectGotoStmt>(S)) {
+        Opaque = true;
+        return;
+    }
+
+    for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+        visit(*I);
+}
+
+//
+// The N perfectly nested loops of the loop directive S, from the outermost
+// one, as GetNumNestedLoops counts them. Returns the innermost body
+//
+static Stmt *getLoopNest(const OMPExecutableDirective &S, unsigned N,
+                         SmallVectorImpl<ForStmt *> &Fors) {
+    Stmt *Body = S.getAssociatedStmt();
+    if (CapturedStmt *CS = dyn_cast_or_null<CapturedStmt>(Body))
+        Body = CS->getCapturedStmt();
+    while (Body && Fors.size() < N) {
+        if (ForStmt *For = dyn_cast<ForStmt>(Body)) {
+            Fors.push_back(For);
+            Body = For->getBody();
+        } else if (AttributedStmt *AS = dyn_cast<AttributedStmt>(Body)) {
+            Body = AS->getSubStmt();
+        } else if (CompoundStmt *CS = dyn_cast<CompoundStmt>(Body)) {
+            Body = CS->size() == 1 ? CS->body_back() : nullptr;
+        } else {
+            Body = nullptr;
+        }
+    }
+    return Body;
+}
+
+//
+// A 'parallel for [simd]' whose clauses do not change the data environment
+//
+static const OMPExecutableDirective *getFusibleLoop(const Stmt *S) {
+    if (!isa<OMPParallelForDirective>(S) && !isa<OMPParallelForSimdDirective>(S))
+        return nullptr;
+    const OMPExecutableDirective *D = cast<OMPExecutableDirective>(S);
+    for (ArrayRef<OMPClause *>::iterator I = D->clauses().begin(),
+                 E = D->clauses().end();
+         I != E; ++I) {
+        OpenMPClauseKind ckind = ((*I)->getClauseKind());
+        if (ckind != OMPC_schedule && ckind != OMPC_collapse)
+            return nullptr;
+    }
+    return D;
+}
+
+//
+// The iteration space of the fusible loop D as text, and the uses of its
+// body. Loops with the same text run the same iterations on the same
+// counters; only fully collapsed canonical nests are described
+//
+static bool describeFusibleLoop(CodeGenFunction &CGF, const OMPExecutableDirective &D,
+                                std::string &Space, std::vector<LoopUse> &Uses) {
+    unsigned Nest = CGF.GetNumNestedLoops(D);
+    for (ArrayRef<OMPClause *>::iterator I = D.clauses().begin(),
+                 E = D.clauses().end();
+         I != E; ++I)
+        if ((*I)->getClauseKind() == OMPC_collapse &&
+            getCollapsedNumberFromLoopDirective(&D) != Nest)
+            return false;
+
+    SmallVector<ForStmt *, 3> Fors;
+    Stmt *Body = getLoopNest(D, Nest, Fors);
+    if (!Body || Nest == 0 || Nest > 3) return false;
+
+    PrintingPolicy Policy(CGF.getContext().getLangOpts());
+    llvm::raw_string_ostream OS(Space);
+    OS << (isa<OMPParallelForSimdDirective>(D) ? "simd" : "for");
+    SmallVector<const ValueDecl *, 3> Counters;
+    for (unsigned i = 0; i < Fors.size(); ++i) {
+        MapLoop L;
+        if (!getMapLoop(Fors[i], L)) return false;
+        Counters.push_back(L.IV);
+        OS << '\0';
+        Fors[i]->getInit()->printPretty(OS, nullptr, Policy);
+        OS << ';';
+        Fors[i]->getCond()->printPretty(OS, nullptr, Policy);
+        OS << ';';
+        Fors[i]->getInc()->printPretty(OS, nullptr, Policy);
+    }
+    OS.flush();
+    return LoopUseScanner(Counters).scan(Body, Uses);
+}
+
+//
+// Whether the arrays the variables A and B refer to may overlap: two arrays
+// never do, and neither do two restrict pointers
+//
+static bool mayAlias(const ValueDecl *A, const ValueDecl *B) {
+    if (A == B) return true;
+    QualType TA = A->getType(), TB = B->getType();
+    if (!TA->isPointerType() && !TB->isPointerType()) return false;
+    return !(TA->isPointerType() && TA.isRestrictQualified() &&
+             TB->isPointerType() && TB.isRestrictQualified());
+}
+
+//
+// Running the loops with the uses Uses one after the other in the same
+// work-item keeps their results when an element some loop may write and
+// that is shared by several work-items is used by that loop only, and when
+// no loop reads the value a scalar has left from an earlier loop. Elements
+// written through a pointer may be those another loop uses through another
+// pointer or an array, so that keeps the loops apart too (see mayAlias)
+//
+static bool canFuseLoops(const std::vector<std::vector<LoopUse> > &Uses) {
+    for (unsigned m = 0; m < Uses.size(); ++m) {
+        llvm::SmallPtrSet<const ValueDecl *, 8> Seen;
+        for (unsigned u = 0; u < Uses[m].size(); ++u) {
+            const LoopUse &U = Uses[m][u];
+            QualType T = U.VD->getType();
+            bool First = Seen.insert(U.VD);
+            for (unsigned l = 0; l < Uses.size(); ++l) {
+                if (l == m) continue;
+                for (unsigned w = 0; w < Uses[l].size(); ++w) {
+                    const LoopUse &W = Uses[l][w];
+                    if (W.VD != U.VD) {
+                        QualType WT = W.VD->getType();
+                        if (U.Write && (T->isPointerType() || T->isArrayType()) &&
+                            (WT->isPointerType() || WT->isArrayType()) && mayAlias(U.VD, W.VD))
+                            return false;
+                        continue;
+                    }
+                    if (T->isPointerType() || T->isArrayType()) {
+                        if (!U.Own && (U.Write || W.Write)) return false;
+                    } else if (l < m && W.Write && First && !U.Defines) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//
+// The subscripts of a mapped array in the body of a 1-D loop (see
+// StreamScanner): Affine when all of them are the counter plus a constant,
+// with the constants in [Lo, Hi], and those of the stores in [WLo, WHi]
+// (when there are Loads and Stores)
+//
+struct StreamUse {
+    bool Affine;
+    bool Loads;
+    bool Stores;
+    int64_t Lo, Hi;
+    int64_t WLo, WHi;
+};
+
+//
+// Finds the arrays whose slices a streamed launch can move: every reference
+// to them in the loop body is an element A[IV + c] or A[IV - c] through a
+// single subscript. Any other reference makes the array unfit, and a store
+// to the counter the whole loop
+//
+class StreamScanner {
+public:
+    StreamScanner(ASTContext &Ctx, const ValueDecl *IV)
+        : Ctx(Ctx), IV(IV), Counter(false) {}
+
+    bool scan(const Stmt *Body, std::map<std::string, StreamUse> &Out) {
+        visit(Body);
+        Out.swap(Uses);
+        return !Counter;
+    }
+
+private:
+    void visit(const Stmt *S);
+    void use(const ValueDecl *VD, ArrayRef<const Expr *> Idx, bool Load, bool Store);
+    bool getOffset(const Expr *E, int64_t &C);
+    bool isCounter(const Expr *E) {
+        const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+        return DRE && DRE->getDecl() == IV;
+    }
+
+    ASTContext &Ctx;
+    const ValueDecl *IV;
+    std::map<std::string, StreamUse> Uses;
+    bool Counter;
+};
+
+bool StreamScanner::getOffset(const Expr *E, int64_t &C) {
+    llvm::APSInt V;
+    E = E->IgnoreParenImpCasts();
+    C = 0;
+    if (isCounter(E)) return true;
+    const BinaryOperator *BO = dyn_cast<BinaryOperator>(E);
+    if (!BO || (BO->getOpcode() != BO_Add && BO->getOpcode() != BO_Sub)) return false;
+    const Expr *K = nullptr;
+    if (isCounter(BO->getLHS()))
+        K = BO->getRHS();
+    else if (BO->getOpcode() == BO_Add && isCounter(BO->getRHS()))
+        K = BO->getLHS();
+    if (!K || K->isValueDependent() || !K->EvaluateAsInt(V, Ctx)) return false;
+    C = V.getSExtValue();
+    if (BO->getOpcode() == BO_Sub) C = -C;
+    return C > -(1 << 30) && C < (1 << 30);
+}
+
+void StreamScanner::use(const ValueDecl *VD, ArrayRef<const Expr *> Idx, bool Load, bool Store) {
+    std::string Name = VD->getNameAsString();
+    if (!Uses.count(Name)) {
+        StreamUse U = {true, false, false, 0, 0, 0, 0};
+        Uses[Name] = U;
+    }
+    StreamUse &U = Uses[Name];
+    int64_t C;
+    if (Idx.size() != 1 || !getOffset(Idx[0], C)) {
+        U.Affine = false;
+        return;
+    }
+    bool First = !U.Loads && !U.Stores;
+    U.Lo = First ? C : std::min(U.Lo, C);
+    U.Hi = First ? C : std::max(U.Hi, C);
+    if (Store) {
+        U.WLo = U.Stores ? std::min(U.WLo, C) : C;
+        U.WHi = U.Stores ? std::max(U.WHi, C) : C;
+        U.Stores = true;
+    }
+    if (Load) U.Loads = true;
+}
+
+void StreamScanner::visit(const Stmt *S) {
+    if (!S) return;
+    SmallVector<const Expr *, 4> Idx;
+    const ValueDecl *VD;
+
+    if (const BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+        if (BO->isAssignmentOp() && isCounter(BO->getLHS())) {
+            Counter = true;
+        } else if (BO->isAssignmentOp() && (VD = getElementAccess(BO->getLHS(), Idx))) {
+            for (unsigned i = 0; i < Idx.size(); ++i) visit(Idx[i]);
+            visit(BO->getRHS());
+            use(VD, Idx, BO->isCompoundAssignmentOp(), true);
+            return;
+        }
+    } else if (const UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+        if ((UO->isIncrementDecrementOp() || UO->getOpcode() == UO_AddrOf) &&
+            isCounter(UO->getSubExpr())) {
+            Counter = true;
+        } else if (UO->isIncrementDecrementOp() && (VD = getElementAccess(UO->getSubExpr(), Idx))) {
+            for (unsigned i = 0; i < Idx.size(); ++i) visit(Idx[i]);
+            use(VD, Idx, true, true);
+            return;
+        }
+    } else if (const ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S)) {
+        if (ICE->getCastKind() == CK_LValueToRValue &&
+            (VD = getElementAccess(ICE->getSubExpr(), Idx))) {
+            for (unsigned i = 0; i < Idx.size(); ++i) visit(Idx[i]);
+            use(VD, Idx, true, false);
+            return;
+        }
+    } else if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S)) {
+        QualType T = DRE->getDecl()->getType();
+        if (T->isPointerType() || T->isArrayType())
+            use(DRE->getDecl(), ArrayRef<const Expr *>(), true, true);
+        return;
+    }
+
+    for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+        visit(*I);
+}
+
+//
+// The body of a 1-D loop written with OpenCL vectors of Width elements (see
+// EmitCLVectorKernels): assignments to elements A[IV] of arrays of one
+// arithmetic type, or to locals of that type declared in the body, from
+// element loads A[IV + c], those locals, arithmetic operators, math
+// functions and loop invariant scalars. Expressions must compute in the
+// element type. Any other statement or use of the counter keeps the loop
+// scalar. Kinds are the _CL_VEC_* of cldevice.h
+//
+enum { CL_VEC_INT, CL_VEC_LONG, CL_VEC_FLOAT, CL_VEC_DOUBLE };
+class VectorBody {
+public:
+    VectorBody(ASTContext &Ctx) : Ctx(Ctx), IV(nullptr), Kind(-1), Stores(false) {}
+
+    bool analyze(const ValueDecl *Counter, const Stmt *Body) {
+        IV = Counter;
+        Kind = -1;
+        Stores = false;
+        Locals.clear();
+        return checkStmt(Body) && Stores;
+    }
+
+    // Body as a block of vector statements
+    void print(raw_ostream &OS, unsigned Width, const PrintingPolicy &Policy,
+               const Stmt *Body) const {
+        OS << "{\n";
+        if (const CompoundStmt *CS = dyn_cast<CompoundStmt>(Body)) {
+            for (CompoundStmt::const_body_iterator I = CS->body_begin(), E = CS->body_end(); I != E; ++I)
+                printStmt(OS, Width, Policy, *I);
+        } else {
+            printStmt(OS, Width, Policy, Body);
+        }
+        OS << "   }\n";
+    }
+
+    int getKind() const { return Kind; }
+
+private:
+    bool setElement(QualType T);
+    bool isElement(const Expr *E) const {
+        return Kind >= 0 && Ctx.hasSameUnqualifiedType(E->getType(), Elem);
+    }
+    bool isCounter(const Expr *E) const {
+        const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+        return DRE && DRE->getDecl() == IV;
+    }
+    bool isElementAccess(const Expr *E, bool Store);
+    bool isLocal(const Expr *E) const {
+        const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParens());
+        return DRE && Locals.count(DRE->getDecl());
+    }
+    bool checkStmt(const Stmt *S);
+    bool checkVector(const Expr *E);
+    bool checkScalar(const Expr *E) const;
+    const char *getMathName(const CallExpr *CE) const;
+    void printStmt(raw_ostream &OS, unsigned Width, const PrintingPolicy &Policy,
+                   const Stmt *S) const;
+    void printExpr(raw_ostream &OS, unsigned Width, const PrintingPolicy &Policy,
+                   const Expr *E) const;
+
+    ASTContext &Ctx;
+    const ValueDecl *IV;
+    QualType Elem;
+    std::string Type;
+    int Kind;
+    bool Stores;
+    llvm::SmallPtrSet<const ValueDecl *, 8> Locals;
+};
+
+bool VectorBody::setElement(QualType T) {
+    T = T.getCanonicalType().getUnqualifiedType();
+    if (Kind >= 0) return Ctx.hasSameType(T, Elem);
+    const BuiltinType *BT = T->getAs<BuiltinType>();
+    if (!BT) return false;
+    uint64_t Bits = Ctx.getTypeSize(T);
+    if (BT->getKind() == BuiltinType::Float) {
+        Type = "float";
+        Kind = CL_VEC_FLOAT;
+    } else if (BT->getKind() == BuiltinType::Double) {
+        Type = "double";
+        Kind = CL_VEC_DOUBLE;
+    } else if (BT->isInteger() && !T->isCharType() && !T->isBooleanType() &&
+               (Bits == 32 || Bits == 64)) {
+        Type = std::string(BT->isUnsignedInteger() ? "u" : "") + (Bits == 32 ? "int" : "long");
+        Kind = Bits == 32 ? CL_VEC_INT : CL_VEC_LONG;
+    } else {
+        return false;
+    }
+    Elem = T;
+    return true;
+}
+
+// An element A[IV + c] (A[IV] for a store) of a pointer or 1-D array A
+bool VectorBody::isElementAccess(const Expr *E, bool Store) {
+    SmallVector<const Expr *, 4> Idx;
+    const ValueDecl *VD = getElementAccess(E, Idx);
+    if (!VD || Idx.size() != 1 || VD == IV || Locals.count(VD) || !setElement(E->getType()))
+        return false;
+    const Expr *I = Idx[0]->IgnoreParenImpCasts();
+    if (isCounter(I)) return true;
+    const BinaryOperator *BO = dyn_cast<BinaryOperator>(I);
+    if (Store || !BO || (BO->getOpcode() != BO_Add && BO->getOpcode() != BO_Sub))
+        return false;
+    const Expr *K = isCounter(BO->getLHS()) ? BO->getRHS()
+                    : BO->getOpcode() == BO_Add && isCounter(BO->getRHS()) ? BO->getLHS()
+                    : nullptr;
+    llvm::APSInt V;
+    return K && !K->isValueDependent() && K->EvaluateAsInt(V, Ctx);
+}
+
+bool VectorBody::checkStmt(const Stmt *S) {
+    if (!S || isa<NullStmt>(S)) return true;
+    if (const CompoundStmt *CS = dyn_cast<CompoundStmt>(S)) {
+        for (CompoundStmt::const_body_iterator I = CS->body_begin(), E = CS->body_end(); I != E; ++I)
+            if (!checkStmt(*I)) return false;
+        return true;
+    }
+    if (const DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+        for (DeclStmt::const_decl_iterator I = DS->decl_begin(), E = DS->decl_end(); I != E; ++I) {
+            const VarDecl *VD = dyn_cast<VarDecl>(*I);
+            if (!VD || !VD->hasLocalStorage() || !VD->getInit() || !setElement(VD->getType()) ||
+                !checkVector(VD->getInit()))
+                return false;
+            Locals.insert(VD);
+        }
+        return true;
+    }
+    const BinaryOperator *BO = dyn_cast<BinaryOperator>(S);
+    if (!BO || !BO->isAssignmentOp()) return false;
+    if (const CompoundAssignOperator *CA = dyn_cast<CompoundAssignOperator>(BO)) {
+        if (!Ctx.hasSameUnqualifiedType(CA->getComputationLHSType(), CA->getType()) ||
+            !Ctx.hasSameUnqualifiedType(CA->getComputationResultType(), CA->getType()))
+            return false;
+    }
+    if (isElementAccess(BO->getLHS(), true)) {
+        Stores = true;
+    } else if (!isLocal(BO->getLHS())) {
+        return false;
+    }
+    return isElement(BO->getLHS()) && checkVector(BO->getRHS());
+}
+
+// A vector value: its lanes are the values of consecutive iterations
+bool VectorBody::checkVector(const Expr *E) {
+    E = E->IgnoreParens();
+    if (checkScalar(E)) return setElement(E->getType());
+    if (!setElement(E->getType())) return false;
+
+    if (const ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(E)) {
+        const Expr *Sub = ICE->getSubExpr();
+        if (ICE->getCastKind() == CK_LValueToRValue)
+            return isElementAccess(Sub, false) || isLocal(Sub);
+        return ICE->getCastKind() == CK_NoOp && checkVector(Sub);
+    }
+    if (const BinaryOperator *BO = dyn_cast<BinaryOperator>(E)) {
+        switch (BO->getOpcode()) {
+        case BO_Add: case BO_Sub: case BO_Mul: case BO_Div:
+            break;
+        case BO_Rem: case BO_And: case BO_Or: case BO_Xor: case BO_Shl: case BO_Shr:
+            if (!Elem->isIntegerType()) return false;
+            break;
+        default:
+            return false;
+        }
+        return checkVector(BO->getLHS()) && checkVector(BO->getRHS());
+    }
+    if (const UnaryOperator *UO = dyn_cast<UnaryOperator>(E)) {
+        if (UO->getOpcode() == UO_Not && !Elem->isIntegerType()) return false;
+        if (UO->getOpcode() != UO_Minus && UO->getOpcode() != UO_Plus && UO->getOpcode() != UO_Not)
+            return false;
+        return checkVector(UO->getSubExpr());
+    }
+    if (const CallExpr *CE = dyn_cast<CallExpr>(E)) {
+        if (!getMathName(CE)) return false;
+        for (unsigned i = 0; i < CE->getNumArgs(); ++i)
+            if (!checkVector(CE->getArg(i))) return false;
+        return true;
+    }
+    return false;
+}
+
+// A loop invariant value, broadcast to all lanes
+bool VectorBody::checkScalar(const Expr *E) const {
+    if (!E->getType()->isArithmeticType()) return false;
+    if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E)) {
+        const ValueDecl *VD = DRE->getDecl();
+        if (isa<EnumConstantDecl>(VD)) return true;
+        return isa<VarDecl>(VD) && VD != IV && !Locals.count(VD) &&
+               VD->getType()->isArithmeticType();
+    }
+    if (isa<ArraySubscriptExpr>(E) || isa<CallExpr>(E) || isa<StmtExpr>(E) ||
+        isa<MemberExpr>(E))
+        return false;
+    if (const BinaryOperator *BO = dyn_cast<BinaryOperator>(E))
+        if (BO->isAssignmentOp() || BO->getOpcode() == BO_Comma) return false;
+    if (const UnaryOperator *UO = dyn_cast<UnaryOperator>(E))
+        if (UO->isIncrementDecrementOp() || UO->getOpcode() == UO_Deref ||
+            UO->getOpcode() == UO_AddrOf)
+            return false;
+    for (Stmt::const_child_iterator I = E->child_begin(), End = E->child_end(); I != End; ++I) {
+        const Expr *Sub = dyn_cast_or_null<Expr>(*I);
+        if (!Sub || (!isa<UnaryExprOrTypeTraitExpr>(E) && !checkScalar(Sub))) return false;
+    }
+    return true;
+}
+
+// The OpenCL built-in a call to a C math function maps to, for floating
+// elements only; the float forms of <math.h> map to the generic names
+const char *VectorBody::getMathName(const CallExpr *CE) const {
+    static const char *Names[] = {
+        "sqrt", "fabs", "exp", "exp2", "log", "log2", "log10", "sin", "cos",
+        "tan", "floor", "ceil", "fmin", "fmax", "pow", "round", "trunc"
+    };
+    const FunctionDecl *FD = CE->getDirectCallee();
+    if (!FD || !FD->getIdentifier() || !FD->getBuiltinID() || !Elem->isRealFloatingType())
+        return nullptr;
+    StringRef Name = FD->getName();
+    for (unsigned i = 0; i < llvm::array_lengthof(Names); ++i)
+        if (Name == Names[i] || (Name.endswith("f") && Name.substr(0, Name.size() - 1) == Names[i]))
+            return Names[i];
+    return nullptr;
+}
+
+void VectorBody::printStmt(raw_ostream &OS, unsigned Width, const PrintingPolicy &Policy,
+                           const Stmt *S) const {
+    if (!S || isa<NullStmt>(S)) return;
+    if (const CompoundStmt *CS = dyn_cast<CompoundStmt>(S)) {
+        OS << "      {\n";
+        for (CompoundStmt::const_body_iterator I = CS->body_begin(), E = CS->body_end(); I != E; ++I)
+            printStmt(OS, Width, Policy, *I);
+        OS << "      }\n";
+        return;
+    }
+    if (const DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+        for (DeclStmt::const_decl_iterator I = DS->decl_begin(), E = DS->decl_end(); I != E; ++I) {
+            const VarDecl *VD = cast<VarDecl>(*I);
+            OS << "      " << Type << Width << " " << VD->getName() << " = ";
+            printExpr(OS, Width, Policy, VD->getInit());
+            OS << ";\n";
+        }
+        return;
+    }
+    const BinaryOperator *BO = cast<BinaryOperator>(S);
+    const Expr *LHS = BO->getLHS()->IgnoreParens();
+    std::string Op = BinaryOperator::getOpcodeStr(BO->getOpcode()).str();
+    OS << "      ";
+    if (isa<ArraySubscriptExpr>(LHS)) {
+        std::string Addr;
+        llvm::raw_string_ostream AOS(Addr);
+        AOS << "&";
+        LHS->printPretty(AOS, nullptr, Policy);
+        AOS.flush();
+        OS << "vstore" << Width << "(";
+        if (BO->isCompoundAssignmentOp())
+            OS << "vload" << Width << "(0, " << Addr << ") " << Op.substr(0, Op.size() - 1) << " (";
+        printExpr(OS, Width, Policy, BO->getRHS());
+        if (BO->isCompoundAssignmentOp()) OS << ")";
+        OS << ", 0, " << Addr << ");\n";
+    } else {
+        LHS->printPretty(OS, nullptr, Policy);
+        OS << " " << Op << " ";
+        printExpr(OS, Width, Policy, BO->getRHS());
+        OS << ";\n";
+    }
+}
+
+void VectorBody::printExpr(raw_ostream &OS, unsigned Width, const PrintingPolicy &Policy,
+                           const Expr *E) const {
+    E = E->IgnoreParens();
+    if (checkScalar(E)) {
+        OS << "((" << Type << Width << ")((" << Type << ")(";
+        E->printPretty(OS, nullptr, Policy);
+        OS << ")))";
+    } else if (const ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(E)) {
+        const Expr *Sub = ICE->getSubExpr()->IgnoreParens();
+        if (ICE->getCastKind() == CK_LValueToRValue && isa<ArraySubscriptExpr>(Sub)) {
+            OS << "vload" << Width << "(0, &";
+            Sub->printPretty(OS, nullptr, Policy);
+            OS << ")";
+        } else {
+            printExpr(OS, Width, Policy, Sub);
+        }
+    } else if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E)) {
+        OS << DRE->getDecl()->getName();
+    } else if (const BinaryOperator *BO = dyn_cast<BinaryOperator>(E)) {
+        OS << "(";
+        printExpr(OS, Width, Policy, BO->getLHS());
+        OS << " " << BinaryOperator::getOpcodeStr(BO->getOpcode()) << " ";
+        printExpr(OS, Width, Policy, BO->getRHS());
+        OS << ")";
+    } else if (const UnaryOperator *UO = dyn_cast<UnaryOperator>(E)) {
+        OS << "(" << UnaryOperator::getOpcodeStr(UO->getOpcode());
+        printExpr(OS, Width, Policy, UO->getSubExpr());
+        OS << ")";
+    } else {
+        const CallExpr *CE = cast<CallExpr>(E);
+        OS << getMathName(CE) << "(";
+        for (unsigned i = 0; i < CE->getNumArgs(); ++i) {
+            if (i) OS << ", ";
+            printExpr(OS, Width, Policy, CE->getArg(i));
+        }
+        OS << ")";
+    }
+}
+
+//
+// Append to the kernel KernelName its versions KernelName_v<W> for the
+// widths _cl_vector_width may choose. They take the arguments of the naive
+// kernel; a work-item runs W consecutive iterations (IName is the counter)
+// with vloadn/vstoren, or runs them one at a time with the scalar Body when
+// fewer than W are left
+//
+static void EmitCLVectorKernels(std::string &Kernels, const std::string &KernelName,
+                                const std::string &IName, const VectorBody &VB,
+                                const Stmt *Body, const PrintingPolicy &Policy) {
+    const std::string Head = "__kernel void " + KernelName + " (";
+    size_t Begin = Kernels.find(Head);
+    size_t End = Begin == std::string::npos ? Begin : Kernels.find(") {\n", Begin);
+    assert(End != std::string::npos && "Naive kernel not found");
+    std::string Params = Kernels.substr(Begin + Head.size(), End - Begin - Head.size());
+
+    llvm::raw_string_ostream OS(Kernels);
+    for (unsigned W = 2; W <= 16; W *= 2) {
+        OS << "\n__kernel void " << KernelName << "_v" << W << " (" << Params << ") {\n";
+        OS << "   int _ID_0 = get_global_id(0) * " << W << ";\n";
+        OS << "   int " << IName << " = _INC_0 * _ID_0 + _MIN_0;\n";
+        OS << "   if ( _ID_0 + " << W << " <= _UB_0 ) ";
+        VB.print(OS, W, Policy, Body);
+        OS << "   else for (; _ID_0 < _UB_0; _ID_0++, " << IName << "++) {\n";
+        Body->printPretty(OS, nullptr, Policy, 8);
+        if (!isa<CompoundStmt>(Body)) OS << ";";
+        OS << "\n   }\n}\n";
+    }
+    OS.flush();
+}
+
 namespace {
 /// \brief RAII object that save current insert position and then restores it.
 class BuilderInsertPositionRAII {
@@ -741,6 +2160,135 @@ static llvm::GlobalVariable *CreateRuntimeVariable(CodeGenModule &CGM,
       MangledName, 0, llvm::GlobalVariable::NotThreadLocal, AddrSpace);
 }
 
+/// Emit the code that yields the registry handle of Kernel (from Program).
+/// The handle is resolved on the first execution and kept in a private
+/// global, so later launches skip the lookup.
+static llvm::Value *EmitKernelHandleValue(CodeGenFunction &CGF,
+                                          const std::string &Program,
+                                          const std::string &Kernel) {
+  CodeGenModule &CGM = CGF.CGM;
+  CGBuilderTy &Builder = CGF.Builder;
+  CGM.getMPtoGPURuntime().registerProgram(Program);
+  llvm::GlobalVariable *Handle = new llvm::GlobalVariable(
+      CGM.getModule(), CGM.Int32Ty, false, llvm::GlobalValue::PrivateLinkage,
+      llvm::ConstantInt::get(CGM.Int32Ty, -1, true), ".cl_handle");
+
+  llvm::BasicBlock *ResolveBB = CGF.createBasicBlock("cl.handle.resolve");
+  llvm::BasicBlock *ContBB = CGF.createBasicBlock("cl.handle.cont");
+  llvm::Value *Cached = Builder.CreateLoad(Handle);
+  llvm::BasicBlock *CachedBB = Builder.GetInsertBlock();
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Cached, Builder.getInt32(0)),
+                       ResolveBB, ContBB);
+
+  CGF.EmitBlock(ResolveBB);
+  llvm::Value *Args[] = {Builder.CreateGlobalStringPtr(Program),
+                         Builder.CreateGlobalStringPtr(Kernel)};
+  llvm::Value *Resolved =
+      CGF.EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_kernel_handle(), Args);
+  Builder.CreateStore(Resolved, Handle);
+  llvm::BasicBlock *ResolvedBB = Builder.GetInsertBlock();
+
+  CGF.EmitBlock(ContBB);
+  llvm::PHINode *Value = Builder.CreatePHI(CGM.Int32Ty, 2, "cl.handle");
+  Value->addIncoming(Cached, CachedBB);
+  Value->addIncoming(Resolved, ResolvedBB);
+  return Value;
+}
+
+/// Emit the code that makes Kernel (from Program) the current kernel of the
+/// MPtoGPU runtime (see EmitKernelHandleValue).
+static llvm::Value *EmitKernelHandle(CodeGenFunction &CGF,
+                                     const std::string &Program,
+                                     const std::string &Kernel) {
+  llvm::Value *Handle = EmitKernelHandleValue(CGF, Program, Kernel);
+  return CGF.EmitRuntimeCall(CGF.CGM.getMPtoGPURuntime().cl_use_kernel(), Handle);
+}
+
+/// Emit the launch of the kernel given by Handle with the arguments collected
+/// in launchArgs, through one call to the runtime: the arguments are
+/// described by a constant table and the runtime only sets the ones that
+/// changed since the previous launch. NDRange holds the number of dimensions,
+/// the sizes and the blocks (0 for the runtime to choose), as _cl_launch.
+/// When streamArgs is not empty the kernel runs a 1-D loop whose trip count,
+/// first value and step are the arguments StreamLoop to StreamLoop + 2, and
+/// the launch goes through _cl_launch_stream, which moves the arrays that do
+/// not fit on the device in slices.
+static llvm::Value *EmitCLLaunch(CodeGenFunction &CGF, llvm::Value *Handle,
+                                 ArrayRef<llvm::Value *> NDRange,
+                                 int StreamLoop = -1) {
+  CodeGenModule &CGM = CGF.CGM;
+  CGBuilderTy &Builder = CGF.Builder;
+  unsigned NArgs = launchArgs.size();
+  assert(NDRange.size() == 7 && "Invalid launch range");
+
+  SmallVector<uint32_t, 48> Desc;
+  for (std::vector<LaunchArg>::iterator I = launchArgs.begin(),
+                                        E = launchArgs.end();
+       I != E; ++I) {
+    assert(I->Kind >= 0 && "Kernel argument was not set");
+    Desc.push_back(I->Kind);
+    Desc.push_back(I->Index);
+    Desc.push_back(I->Bytes);
+  }
+  llvm::Constant *Init =
+      llvm::ConstantDataArray::get(CGM.getLLVMContext(), Desc);
+  llvm::GlobalVariable *Table = new llvm::GlobalVariable(
+      CGM.getModule(), Init->getType(), true,
+      llvm::GlobalValue::PrivateLinkage, Init, ".cl_args");
+  Table->setUnnamedAddr(true);
+
+  llvm::Value *Vals = CGF.CreateTempAlloca(
+      llvm::ArrayType::get(CGM.VoidPtrTy, NArgs), "cl.vals");
+  for (unsigned i = 0; i < NArgs; ++i) {
+    llvm::Value *Loc = launchArgs[i].Loc;
+    Builder.CreateStore(Loc ? Builder.CreateBitCast(Loc, CGM.VoidPtrTy)
+                            : llvm::ConstantPointerNull::get(CGM.VoidPtrTy),
+                        Builder.CreateConstInBoundsGEP2_32(Vals, 0, i));
+  }
+  llvm::Value *Range = CGF.CreateTempAlloca(
+      llvm::ArrayType::get(CGM.Int64Ty, 7), "cl.ndrange");
+  for (unsigned i = 0; i < 7; ++i)
+    Builder.CreateStore(Builder.CreateIntCast(NDRange[i], CGM.Int64Ty, false),
+                        Builder.CreateConstInBoundsGEP2_32(Range, 0, i));
+  launchArgs.clear();
+
+  llvm::Value *Args[] = {Handle, Builder.getInt32(NArgs),
+                         Builder.CreateConstInBoundsGEP2_32(Table, 0, 0),
+                         Builder.CreateConstInBoundsGEP2_32(Vals, 0, 0),
+                         Builder.CreateConstInBoundsGEP2_32(Range, 0, 0)};
+  if (streamArgs.empty() || StreamLoop < 0) {
+    streamArgs.clear();
+    return CGF.EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_launch(), Args);
+  }
+
+  SmallVector<uint32_t, 28> Streams;
+  for (std::vector<StreamArg>::iterator I = streamArgs.begin(),
+                                        E = streamArgs.end();
+       I != E; ++I) {
+    Streams.push_back(I->Pos);
+    Streams.push_back(I->Offset);
+    Streams.push_back(I->Lo);
+    Streams.push_back(I->Hi);
+    Streams.push_back(I->WLo);
+    Streams.push_back(I->WHi);
+    Streams.push_back(I->Elem);
+  }
+  llvm::Constant *SInit =
+      llvm::ConstantDataArray::get(CGM.getLLVMContext(), Streams);
+  llvm::GlobalVariable *STable = new llvm::GlobalVariable(
+      CGM.getModule(), SInit->getType(), true,
+      llvm::GlobalValue::PrivateLinkage, SInit, ".cl_streams");
+  STable->setUnnamedAddr(true);
+  unsigned NStreams = streamArgs.size();
+  streamArgs.clear();
+
+  llvm::Value *SArgs[] = {Args[0], Args[1], Args[2], Args[3], Args[4],
+                          Builder.getInt32(StreamLoop),
+                          Builder.getInt32(NStreams),
+                          Builder.CreateConstInBoundsGEP2_32(STable, 0, 0)};
+  return CGF.EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_launch_stream(), SArgs);
+}
+
 void CodeGenFunction::EmitOMPBarrier(SourceLocation L, unsigned Flags) {
   EmitOMPCallWithLocAndTidHelper(OPENMPRTL_FUNC(barrier), L, Flags);
 }
@@ -996,7 +2544,6 @@ llvm::Type* getVarType (llvm::Value *FV) {
 /// Recursively transverse the body of the for loop looking for uses or assigns.
 ///
 void CodeGenFunction::HandleStmts(Stmt *ST, llvm::raw_fd_ostream &FOS, int &num_args, bool CLgen) {
-  llvm::Value *Status = nullptr;  
 
   if(isa<DeclRefExpr>(ST)) {
     DeclRefExpr *D = dyn_cast<DeclRefExpr>(ST);
@@ -1008,10 +2555,8 @@ void CodeGenFunction::HandleStmts(Stmt *ST, llvm::raw_fd_ostream &FOS, int &num_
 	if (CLgen) {
 	  if (!CGM.OpenMPSupport.isKernelVar(BodyVar)) {
 	    CGM.OpenMPSupport.addKernelVar(BodyVar);
-	    llvm::Value *BVRef  = Builder.CreateBitCast(BodyVar, CGM.VoidPtrTy);
-	    llvm::Value *CArg[] = { Builder.getInt32(num_args++),
-				    Builder.getInt32((dyn_cast<llvm::AllocaInst>(BodyVar)->getAllocatedType())->getPrimitiveSizeInBits()/8), BVRef };
-	    Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_hostArg(), CArg);	    
+	    addLaunchArg(num_args++, CL_ARG_HOST, 0,
+			 (dyn_cast<llvm::AllocaInst>(BodyVar)->getAllocatedType())->getPrimitiveSizeInBits()/8, BodyVar);
 	    FOS << ",\n";
 	    FOS << D->getType().getAsString() << " " << ND->getDeclName();
 	  }
@@ -1050,7 +2595,6 @@ llvm::Value *CodeGenFunction::EmitHostParameters(ForStmt *FS,
     llvm::Value *A = nullptr;
     llvm::Value *B = nullptr;
     llvm::Value *C = nullptr;
-    llvm::Value *Status = nullptr;
     llvm::Value *IVal = nullptr;
     Expr *init = nullptr;
     std::string initType;
@@ -1154,10 +2698,8 @@ llvm::Value *CodeGenFunction::EmitHostParameters(ForStmt *FS,
     Builder.CreateStore(nCores, AL);
 
     // Create hostArg to represent _UB_n (i.e., nCores)
-    llvm::Value *CVRef = Builder.CreateBitCast(AL, CGM.VoidPtrTy);
-    llvm::Value *CArg[] = {Builder.getInt32(num_args++),
-                           Builder.getInt32((AL->getAllocatedType())->getPrimitiveSizeInBits() / 8), CVRef};
-    Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_hostArg(), CArg);
+    addLaunchArg(num_args++, CL_ARG_HOST, 0,
+                 (AL->getAllocatedType())->getPrimitiveSizeInBits() / 8, AL);
 
     if (Collapse) {
         FOS << initType;
@@ -1168,12 +2710,10 @@ llvm::Value *CodeGenFunction::EmitHostParameters(ForStmt *FS,
         llvm::AllocaInst *AL2 = Builder.CreateAlloca(B->getType(), NULL);
         AL2->setUsedWithInAlloca(true);
         Builder.CreateStore(MIN, AL2);
-        llvm::Value *CVRef2 = Builder.CreateBitCast(AL2, CGM.VoidPtrTy);
 
         // Create hostArg to represent _MIN_n
-        llvm::Value *CArg2[] = {Builder.getInt32(num_args++),
-                                Builder.getInt32((AL2->getAllocatedType())->getPrimitiveSizeInBits() / 8), CVRef2};
-        Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_hostArg(), CArg2);
+        addLaunchArg(num_args++, CL_ARG_HOST, 0,
+                     (AL2->getAllocatedType())->getPrimitiveSizeInBits() / 8, AL2);
 
         FOS << initType;
         FOS << " _INC_" << loopNest;
@@ -1182,12 +2722,10 @@ llvm::Value *CodeGenFunction::EmitHostParameters(ForStmt *FS,
         llvm::AllocaInst *AL3 = Builder.CreateAlloca(C->getType(), NULL);
         AL2->setUsedWithInAlloca(true);
         Builder.CreateStore(C, AL3);
-        llvm::Value *CVRef3 = Builder.CreateBitCast(AL3, CGM.VoidPtrTy);
 
         // Create hostArg to represent _INC_n
-        llvm::Value *CArg3[] = {Builder.getInt32(num_args++),
-                                Builder.getInt32((AL3->getAllocatedType())->getPrimitiveSizeInBits() / 8), CVRef3};
-        Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_hostArg(), CArg3);
+        addLaunchArg(num_args++, CL_ARG_HOST, 0,
+                     (AL3->getAllocatedType())->getPrimitiveSizeInBits() / 8, AL3);
     } else {
         if (isa<BinaryOperator>(FS->getInit())) {
             BinaryOperator *lInit = dyn_cast<BinaryOperator>(FS->getInit());
@@ -1283,6 +2821,13 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
     if (isTargetDataIf && TargetDataIfRegion == 2) {
         // When an if clause is present and the if clause expression
         // evaluates to false, the loop will be executed on host.
+        // If the cost model chose the host, it runs on all host threads.
+        if (hostDispatch && DKind == S.getDirectiveKind()) {
+            insideTarget = false;
+            EmitOMPDirectiveWithParallel(DKind, SKinds, S);
+            insideTarget = true;
+            return;
+        }
         CapturedStmt *CS = cast<CapturedStmt>(S.getAssociatedStmt());
         EmitStmt(CS->getCapturedStmt());
         return;
@@ -1294,7 +2839,7 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
                  E = S.clauses().end();
          I != E; ++I) {
         OpenMPClauseKind ckind = ((*I)->getClauseKind());
-        if (ckind == OMPC_reduction) {
+        if (ckind == OMPC_reduction && reductionVars.empty()) {
             EmitOMPDirectiveWithReduction(DKind, SKinds, S);
             return;
         } else if (ckind == OMPC_scan) {
@@ -1315,10 +2860,28 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
     bool HasSimd = DKind == OMPD_parallel_for_simd;
     if (tile && HasSimd) vectorize = true;
 
+    // The polyhedral and vector generators know nothing about reductions:
+    // reduction loops always get the naive kernel (see EmitOMPDirectiveWithReduction)
+    bool reduce = !reductionVars.empty();
+    if (reduce) naive = tile = vectorize = stripmine = false;
+
+    // Simple 1-D loops are vectorized here rather than by clang-pcg: their
+    // kernel file also gets explicit vector versions, one per width, and
+    // the launch picks the one the device prefers (see EmitCLVectorKernels)
+    SmallVector<ForStmt *, 1> VecFor;
+    MapLoop VecLoop;
+    VectorBody VecBody(getContext());
+    bool vecKernels = vectorize && fusedLoops.empty() && GetNumNestedLoops(S) == 1 &&
+                      getLoopNest(S, 1, VecFor) && getMapLoop(VecFor[0], VecLoop) &&
+                      VecBody.analyze(VecLoop.IV, VecFor[0]->getBody());
+
     // Start creating a unique filename that refers to scop function
+    // The kernels are renamed after their contents once the scop is written
     llvm::raw_fd_ostream CLOS(CGM.OpenMPSupport.createTempFile(), true);
-    const std::string FileName = CGM.OpenMPSupport.getTempName();
+    const std::string TempName = CGM.OpenMPSupport.getTempName();
+    const std::string FileName = TempName;
     const std::string clName = FileName + ".cl";
+    std::string KernelName = TempName;
     const std::string AuxName = FileName + ".tmp";
 
     std::string Error;
@@ -1401,7 +2964,7 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
     scalarMap.clear();
 
     CLOS << "void foo (\n";
-    AXOS << "\n__kernel void " << FileName << " (\n";
+    AXOS << "\n__kernel void " << KernelName << " (\n";
 
     int j = 0;
     bool needComma = false;
@@ -1455,6 +3018,8 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
         // loop is not suitable to execute on GPUs
         insideTarget = false;
         EmitOMPDirectiveWithParallel(DKind, SKinds, S);
+        for (unsigned f = 0; f < fusedLoops.size(); ++f)
+            EmitOMPDirectiveWithParallel(DKind, SKinds, *fusedLoops[f]);
         return;
     }
 
@@ -1475,18 +3040,54 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
         HandleStmts(Body, CLOS, num_args, false);
     }
 
+    // Loops fused with this one follow it in the scop; their captured
+    // statements are the loop nests
+    SmallVector<Stmt *, 4> FusedNests;
+    for (unsigned f = 0; f < fusedLoops.size(); ++f) {
+        FusedNests.push_back(cast<CapturedStmt>(fusedLoops[f]->getAssociatedStmt())->getCapturedStmt());
+        HandleStmts(FusedNests.back(), CLOS, num_args, false);
+    }
+
     CLOS << "\n#pragma scop\n";
     Body->printPretty(CLOS, nullptr, PrintingPolicy(getContext().getLangOpts()), 4);
+    for (unsigned f = 0; f < FusedNests.size(); ++f) {
+        CLOS << "\n";
+        FusedNests[f]->printPretty(CLOS, nullptr, PrintingPolicy(getContext().getLangOpts()), 4);
+    }
     CLOS << "\n#pragma endscop\n}\n";
     CLOS.close();
 
+    // Name the kernels after the scop, the directive and the options that
+    // shape them, so that rebuilds produce the same kernel source and reuse
+    // the kernel cache (see MPtoGPULowerKernelFile). The files keep their
+    // unique temporary names: concurrent compilations share the directory
+    {
+        std::string Key;
+        llvm::raw_string_ostream KOS(Key);
+        std::ifstream scopFile(TempName);
+        KOS << scopFile.rdbuf() << '\0' << includeContents << '\0';
+        S.printPretty(KOS, nullptr, PrintingPolicy(getContext().getLangOpts()));
+        for (unsigned f = 0; f < fusedLoops.size(); ++f)
+            fusedLoops[f]->printPretty(KOS, nullptr, PrintingPolicy(getContext().getLangOpts()));
+        KOS << '\0' << naive << tile << vectorize << stripmine << ' '
+            << CGM.getLangOpts().TileSize;
+        KOS.flush();
+        KernelName = "kernel_" + MPtoGPUHash(Key);
+    }
+
+    // The external tools the kernels go through must be there: without them
+    // the kernel file would be left incomplete until the program runs
+    const bool polyhedral = (naive || tile || vectorize || stripmine) && !vecKernels;
+    const bool toolsFound = CGM.getMPtoGPURuntime().checkKernelTools(
+            S.getLocStart(), polyhedral, vectorize && !vecKernels);
+
     int workSizes[8][3];
     int blockSizes[8][3];
     int kernelId, upperKernel = 0;
     int k = 0;
     std::vector<std::pair<int, std::string>> pName;
 
-    if (!(naive || tile || vectorize || stripmine)) {
+    if (!polyhedral) {
         std::remove(FileName.c_str());
     } else {
         // Change the temporary name to c name
@@ -1519,9 +3120,9 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
             vectorNames[kernelId].clear();
             scalarNames[kernelId].clear();
         }
-        std::string tileSize = std::to_string(CGM.getLangOpts().TileSize);
-        std::string ChunkSize = "--tile-size=" + tileSize + " ";
-        bool hasScheduleStatic = false;
+        MPtoGPUPolyhedralOptions PolyOpts;
+        PolyOpts.TileSize = CGM.getLangOpts().TileSize;
+        PolyOpts.Verbose = verbose;
         for (ArrayRef<OMPClause *>::iterator I = S.clauses().begin(),
                      E = S.clauses().end();
              I != E; ++I) {
@@ -1531,12 +3132,12 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
                 OpenMPScheduleClauseKind ScheduleKind = C->getScheduleKind();
                 if (ScheduleKind == OMPC_SCHEDULE_static ||
                         ScheduleKind == OMPC_SCHEDULE_dynamic) {
-                    hasScheduleStatic = ScheduleKind == OMPC_SCHEDULE_static;
+                    PolyOpts.NoReschedule = ScheduleKind == OMPC_SCHEDULE_static;
                     Expr *CSExpr = C->getChunkSize();
                     if (CSExpr) {
                         llvm::APSInt Ch;
                         if (CSExpr->EvaluateAsInt(Ch, CGM.getContext())) {
-                            ChunkSize = "--tile-size=" + Ch.toString(10) + " ";
+                            PolyOpts.TileSize = Ch.getZExtValue();
                         }
                     }
                 }
@@ -1544,30 +3145,25 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
         }
 
         if (naive) {
-            ChunkSize = "--no-reschedule --tile-size=1 --no-shared-memory --no-private-memory ";
+            PolyOpts.NoReschedule = true;
+            PolyOpts.TileSize = 1;
+            PolyOpts.NoSharedMemory = true;
+            PolyOpts.NoPrivateMemory = true;
         } else if (vectorize) {
             // Vector optimization use tile-size=4, the preferred vector size for float.
             // Also, turn off the use of shared & private memories.
-            ChunkSize = "--tile-size=4 --no-shared-memory --no-private-memory ";
-        }
-
-        std::string pcg;
-        if (verbose) {
-            pcg = "clang-pcg --verbose " + ChunkSize;
-            if (hasScheduleStatic) pcg = pcg + "--no-reschedule ";
-        } else {
-            pcg = "clang-pcg " + ChunkSize;
-            if (hasScheduleStatic) pcg = pcg + "--no-reschedule ";
+            PolyOpts.TileSize = 4;
+            PolyOpts.NoSharedMemory = true;
+            PolyOpts.NoPrivateMemory = true;
         }
 
-        const std::string polycg = pcg + cName;
-        std::system(polycg.c_str());
+        MPtoGPUKernelError PolyErr;
+        if (toolsFound && !MPtoGPUPolyhedralCodegen(cName, PolyOpts, PolyErr))
+            CGM.getMPtoGPURuntime().reportKernelError(S.getLocStart(), PolyErr);
         // verbose preserve temp files (for debug purposes)
         if (!verbose) {
-            const std::string rmCfile = "rm " + FileName + ".c";
-            std::system(rmCfile.c_str());
-            const std::string rmHfile = "rm " + FileName + "_host.c";
-            std::system(rmHfile.c_str());
+            std::remove(cName.c_str());
+            std::remove((FileName + "_host.c").c_str());
         }
 
         std::ifstream argFile(FileName);
@@ -1602,16 +3198,15 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
 
     }
 
-    // Emit code to load the file that contain the kernels
+    // The file that contain the kernels is loaded by the runtime the first
+    // time one of its kernel handles is resolved (see EmitKernelHandle)
     llvm::Value *Status = nullptr;
-    llvm::Value *FileStr = Builder.CreateGlobalStringPtr(FileName);
-    Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_create_program(), FileStr);
 
     // CLgen control whether we need to generate the default kernel code.
     // The polyhedral optimization returns workSizes = 0, meaning that
     // the optimization does not worked. In this case generate naive kernel.
     bool CLgen = true;
-    if (naive || tile || vectorize || stripmine)
+    if ((naive || tile || vectorize || stripmine) && !vecKernels)
         if (workSizes[0][0] != 0)
             CLgen = false;
 
@@ -1629,12 +3224,19 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
         }
     }
 
+    // The arguments are collected in launchArgs and passed at the launch
+    llvm::Value *Handle = nullptr;
+    launchArgs.clear();
+    streamArgs.clear();
     if (CLgen) {
-        Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_create_kernel(), FileStr);
-        // Get the number of cl_mem args that will be passed first to kernel_function
+        Handle = EmitKernelHandleValue(*this, FileName, KernelName);
+        // The reduction groups are sized for the current kernel
+        if (reduce)
+            Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_use_kernel(), Handle);
+        // The cl_mem args are passed first to kernel_function
         int num_args = CGM.OpenMPSupport.getKernelVarSize();
-        llvm::Value *Args[] = {Builder.getInt32(num_args)};
-        Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_args(), Args);
+        for (int i = 0; i < num_args; i++)
+            addLaunchArg(i, CL_ARG_BUFFER, i, 0, nullptr);
     }
 
     // Look for CollapseNum
@@ -1657,8 +3259,19 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
     assert(loopNest <= 3 && "Invalid number of Loop nest.");
     assert(CollapseNum <= 3 && "Invalid number of Collapsed Loops.");
 
+    // Reductions run over the outermost loop only; inner loops are kept
+    // in the kernel body
+    if (reduce) CollapseNum = 1;
+
     // nCores is used only with CLgen, but must be declared outside it
     SmallVector<llvm::Value *, 3> nCores;
+    SmallVector<Stmt *, 4> FusedBodies;
+
+    // Launch of the reduction: work-items per group, groups, and the index
+    // of the first buffer of partial results (right after the mapped ones)
+    llvm::Value *RedThreads = nullptr;
+    llvm::Value *RedBlocks = nullptr;
+    int redBuffer = MapClausePointerValues.size();
 
     // Initialize Body to traverse it again, now for AXOS.
     Body = S.getAssociatedStmt();
@@ -1666,6 +3279,11 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
         Body = CS->getCapturedStmt();
     }
 
+    // The trip count, first value and step of the outermost loop follow
+    // the mapped arrays in the kernel arguments
+    int loopArg = num_args;
+    SmallVector<std::string, 4> StreamNames;
+
     if (CLgen) {
         ForStmt *For;
         unsigned nLoops = CollapseNum;
@@ -1713,6 +3331,11 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
             }
         }
 
+        // Reduction variables are private to the work-items, not arguments
+        for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                     E = reductionVars.end(); I != E; ++I)
+            CGM.OpenMPSupport.addKernelVar(I->Addr);
+
         // Traverse again the Body looking for scalar variables declared out of
         // "for" scope and generate value reference to pass to kernel function
         if (Body->getStmtClass() == Stmt::CompoundStmtClass) {
@@ -1726,107 +3349,210 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
             HandleStmts(Body, AXOS, num_args, true);
         }
 
+        // The bodies of the fused loops run on the same counters
+        for (unsigned f = 0; f < fusedLoops.size(); ++f) {
+            SmallVector<ForStmt *, 3> Fors;
+            FusedBodies.push_back(getLoopNest(*fusedLoops[f], CollapseNum, Fors));
+            HandleStmts(FusedBodies.back(), AXOS, num_args, true);
+        }
+
+        // The arrays a 1-D loop only subscripts with the counter plus a
+        // constant can be streamed when they do not fit on the device (see
+        // _cl_launch_stream). The kernel then works on a slice of them and
+        // gets the index of its first element
+        SmallVector<ForStmt *, 1> Outer;
+        MapLoop ML;
+        std::map<std::string, StreamUse> SUses;
+        if (!reduce && !vecKernels && CollapseNum == 1 && fusedLoops.empty())
+            getLoopNest(S, 1, Outer);
+        if (Outer.size() == 1 && getMapLoop(Outer[0], ML) &&
+            StreamScanner(getContext(), ML.IV).scan(Body, SUses)) {
+            for (unsigned j = 0; j < MapClausePointerValues.size(); ++j) {
+                std::string KName = vectorMap[cast<llvm::User>(MapClausePointerValues[j])->getOperand(0)];
+                std::map<std::string, StreamUse>::iterator U = SUses.find(KName);
+                if (U == SUses.end() || !U->second.Affine) continue;
+
+                // One-dimensional arrays of complete types only
+                QualType QT = MapClauseQualTypes[j].getNonReferenceType();
+                if (const PointerType *PT = QT->getAs<PointerType>())
+                    QT = PT->getPointeeType();
+                else if (const ArrayType *AT = getContext().getAsArrayType(QT))
+                    QT = AT->getElementType();
+                else
+                    continue;
+                if (QT->isArrayType() || QT->isIncompleteType()) continue;
+
+                StreamArg SA = {(int) j, num_args, (int) U->second.Lo, (int) U->second.Hi,
+                                U->second.Stores ? (int) U->second.WLo : 1,
+                                U->second.Stores ? (int) U->second.WHi : 0,
+                                (int) getContext().getTypeSizeInChars(QT).getQuantity()};
+                streamArgs.push_back(SA);
+                StreamNames.push_back(KName);
+
+                // Whole buffers start at element 0
+                llvm::Value *Offset = CreateTempAlloca(CGM.Int64Ty, "cl.offset");
+                Builder.CreateStore(Builder.getInt64(0), Offset);
+                addLaunchArg(num_args++, CL_ARG_HOST, 0, 8, Offset);
+                AXOS << ",\nlong _OFF_" << j;
+            }
+        }
+
+        if (reduce) {
+            // Each group stores its partial result in a buffer of its own
+            // and reduces in local memory (one slot per work-item)
+            RedThreads = CreateTempAlloca(CGM.Int32Ty, "rthreads");
+            RedBlocks = CreateTempAlloca(CGM.Int32Ty, "rblocks");
+            llvm::Value *RArg[] = {RedThreads, RedBlocks,
+                                   Builder.CreateIntCast(nCores[0], CGM.Int64Ty, false)};
+            Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_get_reduction_groups(), RArg);
+            llvm::Value *LB = Builder.CreateLoad(RedBlocks);
+            int k = redBuffer;
+            for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                         E = reductionVars.end(); I != E; ++I, ++k) {
+                llvm::Value *Size[] = {Builder.CreateMul(Builder.CreateIntCast(LB, CGM.Int64Ty, false),
+                                                         Builder.getInt64(I->Bytes))};
+                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_create_read_write(), Size);
+                addLaunchArg(num_args++, CL_ARG_BUFFER, k, 0, nullptr);
+                addLaunchArg(num_args++, CL_ARG_LOCAL, 0, I->Bytes, RedThreads);
+                AXOS << ",\n__global " << I->Type << " *_red_" << I->Name
+                     << ", __local " << I->Type << " *_loc_" << I->Name;
+            }
+        }
+
         AXOS << ") {\n   ";
 
-        for (unsigned i = 0; i < CollapseNum; ++i)
+        if (reduce) {
+            // Private copies start from the identity of the operator
+            for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                         E = reductionVars.end(); I != E; ++I)
+                AXOS << I->Type << " " << I->Name << " = " << I->Init << ";\n   ";
+            AXOS << "int _LID, _S, _ID_0;\n   ";
+        }
+
+        for (unsigned i = 0; i < CollapseNum && !reduce; ++i)
             AXOS << "int _ID_" << i << " = get_global_id(" << i << ");\n   ";
 
         SmallVector<llvm::Value *, 16> LocalVars;
         CGM.OpenMPSupport.getLocalVars(LocalVars);
-        for (unsigned i = 0; i < CollapseNum; ++i) {
+        for (unsigned i = 0; i < CollapseNum && !reduce; ++i) {
             std::string IName = getVarNameAsString(LocalVars[i]);
             AXOS << "int " << IName << " = _INC_" << i;
             AXOS << " * _ID_" << i << " + _MIN_" << i << ";\n   ";
         }
-
-        if (CollapseNum == 1) {
-            AXOS << "  if ( _ID_0 < _UB_0 )\n";
-        } else if (CollapseNum == 2) {
-            AXOS << "  if ( _ID_0 < _UB_0 && _ID_1 < _UB_1 )\n";
+        for (unsigned s = 0; s < streamArgs.size(); ++s)
+            AXOS << StreamNames[s] << " -= _OFF_" << streamArgs[s].Pos << ";\n   ";
+
+        if (reduce) {
+            // Work-items stride over the iterations, so that the number of
+            // groups does not depend on the trip count
+            std::string IName = getVarNameAsString(LocalVars[0]);
+            AXOS << "for (_ID_0 = get_global_id(0); _ID_0 < _UB_0; _ID_0 += get_global_size(0)) {\n   ";
+            AXOS << "  int " << IName << " = _INC_0 * _ID_0 + _MIN_0;\n";
+            Body->printPretty(AXOS, nullptr, PrintingPolicy(getContext().getLangOpts()), 4);
+            if (!isa<CompoundStmt>(Body)) AXOS << ";";
+            AXOS << "\n   }\n";
+            EmitCLReductionTree(AXOS, false);
+            AXOS << "}\n";
+
+            // Final stage: a single group combines the partial results
+            // with the original values of the variables
+            AXOS << "\n__kernel void " << KernelName << "_final (\n";
+            for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                         E = reductionVars.end(); I != E; ++I)
+                AXOS << "__global " << I->Type << " *_red_" << I->Name << ", __local " << I->Type
+                     << " *_loc_" << I->Name << ", " << I->Type << " _orig_" << I->Name << ",\n";
+            AXOS << "int _NG) {\n";
+            AXOS << "   int _LID, _S;\n";
+            for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                         E = reductionVars.end(); I != E; ++I) {
+                AXOS << "   " << I->Type << " " << I->Name << " = " << I->Init << ";\n";
+                AXOS << "   for (_S = get_local_id(0); _S < _NG; _S += get_local_size(0)) {\n";
+                AXOS << "     " << I->Type << " omp_out = " << I->Name << ", omp_in = _red_" << I->Name << "[_S];\n";
+                AXOS << "     " << I->Combine << ";\n";
+                AXOS << "     " << I->Name << " = omp_out;\n";
+                AXOS << "   }\n";
+            }
+            EmitCLReductionTree(AXOS, true);
+            AXOS << "}\n";
         } else {
-            AXOS << "  if ( _ID_0 < _UB_0 && _ID_1 < _UB_1 && _ID_2 < _UB_2 )\n";
-        }
+            if (CollapseNum == 1) {
+                AXOS << "  if ( _ID_0 < _UB_0 )\n";
+            } else if (CollapseNum == 2) {
+                AXOS << "  if ( _ID_0 < _UB_0 && _ID_1 < _UB_1 )\n";
+            } else {
+                AXOS << "  if ( _ID_0 < _UB_0 && _ID_1 < _UB_1 && _ID_2 < _UB_2 )\n";
+            }
 
-        if (isa<CompoundStmt>(Body)) {
-            Body->printPretty(AXOS, nullptr, PrintingPolicy(getContext().getLangOpts()));
-            AXOS << "\n}\n";
-        } else {
-            AXOS << " {\n";
-            Body->printPretty(AXOS, nullptr, PrintingPolicy(getContext().getLangOpts()), 8);
-            AXOS << ";\n }\n}\n";
+            if (!FusedBodies.empty()) {
+                FusedBodies.insert(FusedBodies.begin(), Body);
+                AXOS << " {\n";
+                for (unsigned f = 0; f < FusedBodies.size(); ++f) {
+                    FusedBodies[f]->printPretty(AXOS, nullptr, PrintingPolicy(getContext().getLangOpts()), 8);
+                    if (!isa<CompoundStmt>(FusedBodies[f])) AXOS << ";";
+                    AXOS << "\n";
+                }
+                AXOS << " }\n}\n";
+            } else if (isa<CompoundStmt>(Body)) {
+                Body->printPretty(AXOS, nullptr, PrintingPolicy(getContext().getLangOpts()));
+                AXOS << "\n}\n";
+            } else {
+                AXOS << " {\n";
+                Body->printPretty(AXOS, nullptr, PrintingPolicy(getContext().getLangOpts()), 8);
+                AXOS << ";\n }\n}\n";
+            }
         }
 
         // Close the kernel file
         AXOS.close();
 
-        // Change the auxiliary name to OpenCL kernel name
-        std::rename(AuxName.c_str(), clName.c_str());
+        // Change the temporary name to the kernel name. The first kernel
+        // was declared before the kernels got their final name.
+        std::ifstream auxFile(AuxName);
+        std::string kernels((std::istreambuf_iterator<char>(auxFile)),
+                            std::istreambuf_iterator<char>());
+        auxFile.close();
+        for (size_t pos = kernels.find(TempName); pos != std::string::npos;
+             pos = kernels.find(TempName, pos + KernelName.size()))
+            kernels.replace(pos, TempName.size(), KernelName);
+        if (vecKernels)
+            EmitCLVectorKernels(kernels, KernelName, getVarNameAsString(LocalVars[0]), VecBody,
+                                Body, PrintingPolicy(getContext().getLangOpts()));
+        std::ofstream kernelFile(clName);
+        kernelFile << kernels;
+        kernelFile.close();
+        std::remove(AuxName.c_str());
 
     } else {
         // AXOS was not used. Then remove the AuxName associated with it.
         AXOS.close();
         std::remove(AuxName.c_str());
-        // Also insert the include contents into the clName, if any.
+        // Also insert the include contents into the clName, if any, and
+        // change the temporary name of the pcg kernels to the kernel name.
         std::ofstream outputFile(AuxName);
         std::ifstream inputFile(clName);
-        outputFile << includeContents << inputFile.rdbuf();
+        std::string kernels((std::istreambuf_iterator<char>(inputFile)),
+                            std::istreambuf_iterator<char>());
         inputFile.close();
+        for (size_t pos = kernels.find(TempName); pos != std::string::npos;
+             pos = kernels.find(TempName, pos + KernelName.size()))
+            kernels.replace(pos, TempName.size(), KernelName);
+        outputFile << includeContents << kernels;
         outputFile.close();
         std::remove(clName.c_str());
         std::rename(AuxName.c_str(), clName.c_str());
     }
 
-    // Generate kernel with vectorization ?
-    if (vectorize) {
-        const std::string vectorizer = "$LLVM_INCLUDE_PATH/vectorize/vectorize -silent " + clName;
-        std::system(vectorizer.c_str());
-        if (!verbose) {
-            struct stat buffer;
-            if (stat(AuxName.c_str(), &buffer) == 0) {
-                std::remove(AuxName.c_str());
-            }
-        }
-    }
-
-    // Generate the spir-code ?
-    llvm::Triple Tgt = CGM.getLangOpts().OMPtoGPUTriple;
-    if (Tgt.getArch() == llvm::Triple::spir ||
-            Tgt.getArch() == llvm::Triple::spir64 ||
-            Tgt.getArch() == llvm::Triple::spirv) {
-
-        std::string tgtStr;
-        if (Tgt.getArch() == llvm::Triple::spirv) {
-            // First Generate code for spir64
-            tgtStr = "spir64-unknown-unknown";
-        } else {
-            tgtStr = Tgt.getTriple();
-        }
-
-        const std::string bcArg = "clang-3.5 -cc1 -x cl -cl-std=CL1.2 -fno-builtin -emit-llvm-bc -triple " +
-                tgtStr +
-                " -include $LLVM_INCLUDE_PATH/llvm/SpirTools/opencl_spir.h -ffp-contract=off -o " +
-                AuxName + " " + clName;
-        std::system(bcArg.c_str());
-
-        const std::string encodeStr = "spir-encoder " + AuxName + " " + FileName + ".bc";
-        std::system(encodeStr.c_str());
-        std::remove(AuxName.c_str());
-
-        if (Tgt.getArch() == llvm::Triple::spirv) {
-            // Now convert to spir-v format
-            const std::string spirvStr = "llvm-spirv " + FileName + ".bc";
-            std::system(spirvStr.c_str());
-            if (!verbose) {
-                const std::string rmbc = "rm " + FileName + ".bc";
-                std::system(rmbc.c_str());
-            }
-        }
-    }
+    // Vectorize and lower the kernel file on the kernel generation pool.
+    // Host codegen does not read these outputs; they are joined before the
+    // module embeds the kernel images.
+    if (toolsFound)
+        CGM.getMPtoGPURuntime().enqueueKernelJob(
+                S.getLocStart(), FileName, vectorize && !vecKernels, verbose,
+                CGM.getLangOpts().OMPtoGPUTriple);
 
     if (!CLgen) {
         for (kernelId = 0; kernelId <= upperKernel; kernelId++) {
-            llvm::Value *KernelStr = Builder.CreateGlobalStringPtr(FileName + std::to_string(kernelId));
-            Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_create_kernel(), KernelStr);
+            Handle = EmitKernelHandleValue(*this, FileName, KernelName + std::to_string(kernelId));
 
             // Set kernel args according pos & index of buffer, only if required
             k = 0;
@@ -1839,8 +3565,7 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
                 if (it == vectorNames[kernelId].end()) {
                     // the array is not required
                 } else {
-                    llvm::Value *Args[] = {Builder.getInt32(k), Builder.getInt32((I)->first)};
-                    Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_arg(), Args);
+                    addLaunchArg(k, CL_ARG_BUFFER, (I)->first, 0, nullptr);
                     k++;
                 }
             }
@@ -1849,11 +3574,8 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
                          E = scalarNames[kernelId].end();
                  I != E; ++I) {
                 llvm::Value *BV = scalarMap[(I)->second];
-                llvm::Value *BVRef = Builder.CreateBitCast(BV, CGM.VoidPtrTy);
-                llvm::Value *CArg[] = {Builder.getInt32((I)->first),
-                                       Builder.getInt32((dyn_cast<llvm::AllocaInst>(
-                                               BV)->getAllocatedType())->getPrimitiveSizeInBits() / 8), BVRef};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_hostArg(), CArg);
+                addLaunchArg((I)->first, CL_ARG_HOST, 0,
+                             (dyn_cast<llvm::AllocaInst>(BV)->getAllocatedType())->getPrimitiveSizeInBits() / 8, BV);
             }
 
             int workDim;
@@ -1861,15 +3583,52 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
             else if (workSizes[kernelId][1] != 0) workDim = 2;
             else workDim = 1;
 
-            llvm::Value *GroupSize[] = {Builder.getInt32(workSizes[kernelId][0]),
+            llvm::Value *GroupSize[] = {Builder.getInt32(workDim),
+                                        Builder.getInt32(workSizes[kernelId][0]),
                                         Builder.getInt32(workSizes[kernelId][1]),
                                         Builder.getInt32(workSizes[kernelId][2]),
                                         Builder.getInt32(blockSizes[kernelId][0]),
                                         Builder.getInt32(blockSizes[kernelId][1]),
-                                        Builder.getInt32(blockSizes[kernelId][2]),
-                                        Builder.getInt32(workDim)};
+                                        Builder.getInt32(blockSizes[kernelId][2])};
 
-            Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_execute_tiled_kernel(), GroupSize);
+            Status = EmitCLLaunch(*this, Handle, GroupSize);
+        }
+    } else if (reduce) {
+        llvm::Value *LT = Builder.CreateIntCast(Builder.CreateLoad(RedThreads), CGM.Int32Ty, false);
+        llvm::Value *LB = Builder.CreateIntCast(Builder.CreateLoad(RedBlocks), CGM.Int32Ty, false);
+        llvm::Value *GroupSize[] = {Builder.getInt32(1),
+                                    LB, Builder.getInt32(0), Builder.getInt32(0),
+                                    LT, Builder.getInt32(0), Builder.getInt32(0)};
+        Status = EmitCLLaunch(*this, Handle, GroupSize);
+
+        // Second stage, in one work-group
+        Handle = EmitKernelHandleValue(*this, FileName, KernelName + "_final");
+        int pos = 0;
+        int k = redBuffer;
+        for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                     E = reductionVars.end(); I != E; ++I, ++k) {
+            addLaunchArg(pos++, CL_ARG_BUFFER, k, 0, nullptr);
+            addLaunchArg(pos++, CL_ARG_LOCAL, 0, I->Bytes, RedThreads);
+            addLaunchArg(pos++, CL_ARG_HOST, 0, I->Bytes, I->Addr);
+        }
+        addLaunchArg(pos, CL_ARG_HOST, 0, 4, RedBlocks);
+        llvm::Value *FinalSize[] = {Builder.getInt32(1),
+                                    Builder.getInt32(1), Builder.getInt32(0), Builder.getInt32(0),
+                                    LT, Builder.getInt32(0), Builder.getInt32(0)};
+        Status = EmitCLLaunch(*this, Handle, FinalSize);
+
+        // Read the results into the host variables, then release the
+        // partial buffers (last created first)
+        k = redBuffer;
+        for (std::vector<ReductionVar>::iterator I = reductionVars.begin(),
+                     E = reductionVars.end(); I != E; ++I, ++k) {
+            llvm::Value *RArg[] = {Builder.getInt64(I->Bytes), Builder.getInt32(k),
+                                   Builder.CreateBitCast(I->Addr, CGM.VoidPtrTy)};
+            Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_read_buffer(), RArg);
+        }
+        while (k-- > redBuffer) {
+            llvm::Value *Aux[] = {Builder.getInt32(k)};
+            Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_release_buffer(), Aux);
         }
     } else {
         if (CollapseNum == 1) {
@@ -1878,248 +3637,286 @@ void CodeGenFunction::EmitOMPtoOpenCLParallelFor(
         } else if (CollapseNum == 2) {
             nCores.push_back(Builder.getInt32(0));
         }
-        llvm::Value *WGSize[] = {Builder.CreateIntCast(nCores[0], CGM.Int64Ty, false),
-                                 Builder.CreateIntCast(nCores[1], CGM.Int64Ty, false),
-                                 Builder.CreateIntCast(nCores[2], CGM.Int64Ty, false),
-                                 Builder.getInt32(CollapseNum)};
-        Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_execute_kernel(), WGSize);
+        // A vectorized loop runs the kernel of the width the device
+        // prefers, one work-item per Width iterations (1 is the scalar one)
+        if (vecKernels) {
+            llvm::Value *Width = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_vector_width(),
+                                                 Builder.getInt32(VecBody.getKind()));
+            for (unsigned W = 2; W <= 16; W *= 2) {
+                llvm::Value *VH = EmitKernelHandleValue(*this, FileName, KernelName + "_v" + std::to_string(W));
+                Handle = Builder.CreateSelect(Builder.CreateICmpEQ(Width, Builder.getInt32(W)), VH, Handle);
+            }
+            nCores[0] = Builder.CreateUDiv(Builder.CreateAdd(nCores[0], Builder.CreateSub(Width, Builder.getInt32(1))),
+                                           Width);
+        }
+        llvm::Value *WGSize[] = {Builder.getInt32(CollapseNum),
+                                 nCores[0], nCores[1], nCores[2],
+                                 Builder.getInt32(0), Builder.getInt32(0), Builder.getInt32(0)};
+        Status = EmitCLLaunch(*this, Handle, WGSize, loopArg);
     }
 }
 
 /// Generate an instructions for '#pragma omp parallel for [simd] reduction' directive
+///
+/// The loop is offloaded as a two-stage reduction: every work-group reduces
+/// the private copies of its work-items in local memory and stores one
+/// partial result, then a single work-group combines the partial results
+/// with the original values, which are read back into the host variables.
+/// Reductions of non-scalar variables, or by a declare reduction that has no
+/// OpenCL macros (see EmitOMPDeclareReduction), run on the host with a
+/// warning.
 void CodeGenFunction::EmitOMPDirectiveWithReduction(OpenMPDirectiveKind DKind,
                                                     ArrayRef<OpenMPDirectiveKind> SKinds,
                                                     const OMPExecutableDirective &S) {
 
-    llvm::errs() << "Reduction Clause code for Accelerators are under construction!\n";
+    bool supported = true;
+    // Variable that keeps the loop on the host, and why (see
+    // warn_mptogpu_host_fallback)
+    const Expr *unsupportedVar = nullptr;
+    unsigned unsupportedWhy = 0;
+    reductionVars.clear();
+    for (ArrayRef<OMPClause *>::iterator I = S.clauses().begin(), E = S.clauses().end();
+         I != E && supported; ++I) {
+        if ((*I)->getClauseKind() != OMPC_reduction) continue;
+        const OMPReductionClause *C = cast<OMPReductionClause>(*I);
+        for (OMPReductionClause::varlist_const_iterator l = C->varlist_begin(), le = C->varlist_end();
+             l != le && supported; ++l) {
+            const DeclRefExpr *D = dyn_cast<DeclRefExpr>(*l);
+            ReductionVar RV;
+            RV.Addr = D ? EmitSpirDeclRefLValue(D) : nullptr;
+            RV.Type = D ? getReductionCLType(getContext(), D->getType()) : "";
+            unsupportedVar = *l;
+            if (!RV.Addr || RV.Type == "") {
+                supported = false;
+                break;
+            }
+            RV.Name = D->getDecl()->getNameAsString();
+            RV.Bytes = getContext().getTypeSizeInChars(D->getType()).getQuantity();
+            if (!getCLCombineOp(CGM, getOpenMPSimpleClauseTypeName(OMPC_reduction, C->getOperator()),
+                                C->getOpName().getAsString(), D->getType(), RV.Type,
+                                RV.Init, RV.Combine)) {
+                unsupportedWhy = C->getOperator() == OMPC_REDUCTION_custom ? 1 : 0;
+                supported = false;
+                break;
+            }
+            reductionVars.push_back(RV);
+        }
+    }
+
+    if (!supported) {
+        std::string varName;
+        llvm::raw_string_ostream VN(varName);
+        unsupportedVar->printPretty(VN, 0, PrintingPolicy(getContext().getLangOpts()));
+        CGM.getDiags().Report(unsupportedVar->getExprLoc(), diag::warn_mptogpu_host_fallback)
+            << 0 << VN.str() << unsupportedWhy << unsupportedVar->getSourceRange();
+        reductionVars.clear();
+        insideTarget = false;
+        EmitOMPDirectiveWithParallel(DKind, SKinds, S);
+        insideTarget = true;
+        return;
+    }
 
+    EmitOMPtoOpenCLParallelFor(DKind, SKinds, S);
+    reductionVars.clear();
 }
 
 /// Generate an instructions for '#pragma omp parallel for [simd] scan' directive
+///
+/// Every variable of the scan clauses names a mapped array. An array mapped
+/// tofrom is scanned in place; one mapped 'to' is scanned into the next
+/// array mapped 'from' that no clause names, and the other way round, with a
+/// warning if more than one such array could be meant. Scans that kernels
+/// can not run stay on the host with a warning, as reductions do. The
+/// kernels are written to the kernel file here and _cl_scan runs them over
+/// as many levels of group totals as the size of the data requires.
 void CodeGenFunction::EmitOMPDirectiveWithScan(OpenMPDirectiveKind DKind,
                                                ArrayRef<OpenMPDirectiveKind> SKinds,
                                                const OMPExecutableDirective &S) {
 
-    for (ArrayRef<OMPClause *>::iterator I = S.clauses().begin(), E = S.clauses().end(); I != E; ++I) {
-        OpenMPClauseKind ckind = ((*I)->getClauseKind());
-        if (ckind == OMPC_scan) {
-            OMPVarListClause<OMPScanClause> *list = cast<OMPVarListClause<OMPScanClause> >(
-                    cast<OMPScanClause>(*I));
-            for (auto l = list->varlist_begin(); l != list->varlist_end(); l++) {
-                DeclRefExpr *scanVar = cast<DeclRefExpr>(*l);
-                QualType qt = getContext().IntTy;
-                llvm::Type *TT1 = ConvertType(qt);
-                llvm::Value *T1 = CreateTempAlloca(TT1, "nthreads");
-
-                llvm::Type *BB1 = ConvertType(qt);
-                llvm::Value *B1 = CreateTempAlloca(BB1, "nblocks");
-
-                llvm::Type *ST1 = ConvertType(qt);
-                llvm::Value *ST = CreateTempAlloca(ST1, "sthreads");
-
-                llvm::Type *SB1 = ConvertType(qt);
-                llvm::Value *SB = CreateTempAlloca(SB1, "sblocks");
-
-                ArrayRef<llvm::Value *> MapClausePointerValues;
-                ArrayRef<llvm::Value *> MapClauseSizeValues;
-                ArrayRef<QualType> MapClauseQualTypes;
-                ArrayRef<unsigned> MapClauseTypeValues;
-                ArrayRef<unsigned> MapClausePositionValues;
-                ArrayRef<unsigned> MapClauseScopeValues;
-
-                CGM.OpenMPSupport.getMapPos(MapClausePointerValues,
-                                            MapClauseSizeValues,
-                                            MapClauseQualTypes,
-                                            MapClauseTypeValues,
-                                            MapClausePositionValues,
-                                            MapClauseScopeValues);
-
-                int templateId = 1; /* indicates one data i/o & basic operation */
-                int idxInput, idxOutput, idxAux;
-                /* get the number of mapped clauses */
-                int num_mapped_data = (int) MapClausePointerValues.size();
-                if (num_mapped_data == 1) {
-                    /* data input & output are the same */
-                    idxInput = 0;
-                    idxOutput = 0;
-                    idxAux = 1;
-                } else {
-                    /* We only support two mapped values, one input and one output */
-                    if (num_mapped_data > 2) {
-                        llvm_unreachable("Unsupported scan clause with more than two mapped data");
-                    }
-                    if (MapClauseTypeValues[0] == OMP_TGT_MAPTYPE_TO ||
-                        MapClauseTypeValues[0] == OMP_TGT_MAPTYPE_TOFROM) {
-                        idxInput = 0;
-                        idxOutput = 1;
-                    } else {
-                        idxInput = 1;
-                        idxOutput = 0;
-                    }
-                    idxAux = 2;
-                    templateId = 2; /* indicates two data i/o & basic operation */
-                }
+    ArrayRef<llvm::Value *> MapClausePointerValues;
+    ArrayRef<llvm::Value *> MapClauseSizeValues;
+    ArrayRef<QualType> MapClauseQualTypes;
+    ArrayRef<unsigned> MapClauseTypeValues;
+    ArrayRef<unsigned> MapClausePositionValues;
+    ArrayRef<unsigned> MapClauseScopeValues;
 
-                QualType Q = MapClauseQualTypes[idxInput];
-                const Type *ty = Q.getTypePtr();
-                if (ty->isPointerType() || ty->isReferenceType()) {
-                    Q = ty->getPointeeType();
-                }
-                while (Q.getTypePtr()->isArrayType()) {
-                    Q = dyn_cast<ArrayType>(Q.getTypePtr())->getElementType();
-                }
-                if (!dumpedDefType(&Q)) {
-                    std::string defty = Q.getAsString();
-                    Q = ty->getCanonicalTypeInternal().getTypePtr()->getPointeeType();
-                    while (Q.getTypePtr()->isArrayType()) {
-                        Q = dyn_cast<ArrayType>(Q.getTypePtr())->getElementType();
-                    }
-                }
+    CGM.OpenMPSupport.getMapPos(MapClausePointerValues,
+                                MapClauseSizeValues,
+                                MapClauseQualTypes,
+                                MapClauseTypeValues,
+                                MapClausePositionValues,
+                                MapClauseScopeValues);
 
-                /* get the number of blocks and threads */
-                llvm::Value *Status = nullptr;
-                llvm::Type *tR = ConvertType(Q);
-                int typeSize = GetTypeSizeInBits(tR);
-                llvm::Value *Bytes = Builder.getInt32(typeSize / 8);
-                llvm::Value *KArg[] = {T1, B1, ST, SB, MapClauseSizeValues[idxInput], Bytes};
-                llvm::Value *ThreadBytes = nullptr;
-                ThreadBytes = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_get_threads_blocks(), KArg);
-
-                /* Offload the Auxiliary array */
-                llvm::Value *Size[] = {Builder.CreateIntCast(ThreadBytes, CGM.Int64Ty, false)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_create_read_write(), Size);
+    // Buffer of the mapped array referred by E, or -1
+    auto findMapped = [&](const Expr *E) -> int {
+        const DeclRefExpr *D = E ? dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()) : nullptr;
+        if (!D) return -1;
+        const std::string Name = D->getDecl()->getNameAsString();
+        for (unsigned j = 0; j < MapClausePointerValues.size(); j++) {
+            if (vectorMap[cast<llvm::User>(MapClausePointerValues[j])->getOperand(0)] == Name)
+                return (int) j;
+        }
+        return -1;
+    };
+
+    std::vector<ScanVar> scanVars;
+    std::vector<bool> named(MapClausePointerValues.size(), false);
+    bool supported = true;
+    // Variable that keeps the loop on the host, and why (see
+    // warn_mptogpu_host_fallback)
+    const Expr *unsupportedVar = nullptr;
+    unsigned unsupportedWhy = 0;
+    for (ArrayRef<OMPClause *>::iterator I = S.clauses().begin(), E = S.clauses().end();
+         I != E && supported; ++I) {
+        if ((*I)->getClauseKind() != OMPC_scan) continue;
+        const OMPScanClause *C = cast<OMPScanClause>(*I);
+
+        ScanVar SV;
+        SV.Exclusive = C->isExclusive();
+        SV.Flags = -1;
+        SV.FlagBytes = 0;
+        if (C->getSegment()) {
+            SV.Flags = findMapped(C->getSegment());
+            QualType FQ = getScanElementType(getContext(), C->getSegment()->IgnoreParenImpCasts()->getType());
+            SV.FlagType = getReductionCLType(getContext(), FQ);
+            if (SV.Flags < 0 || SV.FlagType == "" || FQ->isRealFloatingType()) {
+                unsupportedVar = *C->varlist_begin();
+                unsupportedWhy = 3;
+                supported = false;
+                break;
+            }
+            named[SV.Flags] = true;
+            SV.FlagBytes = getContext().getTypeSizeInChars(FQ).getQuantity();
+        }
 
-                /*Fetch the scan variable type and its operator */
-                const std::string scanVarType = scanVar->getType().getAsString();
-                OpenMPScanClauseOperator op = cast<OMPScanClause>(*I)->getOperator();
-                const std::string operatorName = cast<OMPScanClause>(*I)->getOpName().getAsString();
+        for (OMPScanClause::varlist_const_iterator l = C->varlist_begin(), le = C->varlist_end();
+             l != le && supported; ++l) {
+            SV.Var = *l;
+            SV.In = SV.Out = findMapped(*l);
+            unsupportedVar = *l;
+            unsupportedWhy = 2;
+            if (SV.In < 0) {
+                supported = false;
+                break;
+            }
+            named[SV.In] = true;
+            SV.Elem = getScanElementType(getContext(), (*l)->getType());
+            SV.Type = getReductionCLType(getContext(), SV.Elem);
+            SV.Bytes = getContext().getTypeSizeInChars(SV.Elem).getQuantity();
+            if (SV.Type == "") {
+                // user types can only be scanned by their declare scan
+                if (C->getOperator() != OMPC_SCAN_custom || !SV.Elem->isRecordType()) {
+                    supported = false;
+                    break;
+                }
+                SV.Type = SV.Elem.getAsString();
+            }
+            if (!getCLCombineOp(CGM, getOpenMPSimpleClauseTypeName(OMPC_scan, C->getOperator()),
+                                C->getOpName().getAsString(), SV.Elem, SV.Type,
+                                SV.Init, SV.Combine)) {
+                unsupportedWhy = C->getOperator() == OMPC_SCAN_custom ? 1 : 2;
+                supported = false;
+                break;
+            }
+            scanVars.push_back(SV);
+        }
+    }
 
-                /* Create the unique filename that refers to kernel file */
-                llvm::raw_fd_ostream CLOS(CGM.OpenMPSupport.createTempFile(), true);
-                const std::string FileNameScan = CGM.OpenMPSupport.getTempName();
-                const std::string clNameScan = FileNameScan;
+    if (!supported) {
+        std::string varName;
+        llvm::raw_string_ostream VN(varName);
+        unsupportedVar->printPretty(VN, 0, PrintingPolicy(getContext().getLangOpts()));
+        CGM.getDiags().Report(unsupportedVar->getExprLoc(), diag::warn_mptogpu_host_fallback)
+            << 1 << VN.str() << unsupportedWhy << unsupportedVar->getSourceRange();
+        insideTarget = false;
+        EmitOMPDirectiveWithParallel(DKind, SKinds, S);
+        insideTarget = true;
+        return;
+    }
 
-                /* use of type 'double' requires cl_khr_fp64 extension to be enabled */
-                CLOS << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n\n";
+    // Pair each array scanned out of place with its unnamed partner, the
+    // first in map order; warn if there was more than one to choose from
+    for (std::vector<ScanVar>::iterator V = scanVars.begin(), VE = scanVars.end(); V != VE; ++V) {
+        unsigned MapType = MapClauseTypeValues[V->In];
+        if (MapType != OMP_TGT_MAPTYPE_TO && MapType != OMP_TGT_MAPTYPE_FROM) continue;
+        unsigned Partner = (MapType == OMP_TGT_MAPTYPE_TO) ? OMP_TGT_MAPTYPE_FROM : OMP_TGT_MAPTYPE_TO;
+        int First = -1;
+        unsigned Candidates = 0;
+        for (unsigned j = 0; j < MapClauseTypeValues.size(); j++) {
+            if (named[j] || MapClauseTypeValues[j] != Partner) continue;
+            if (First < 0) First = j;
+            Candidates++;
+        }
+        if (First < 0) continue;
+        if (Candidates > 1) {
+            CGM.getDiags().Report(V->Var->getExprLoc(), diag::warn_mptogpu_scan_partner_ambiguous)
+                << (MapType == OMP_TGT_MAPTYPE_TO ? 0 : 1)
+                << vectorMap[cast<llvm::User>(MapClausePointerValues[V->In])->getOperand(0)]
+                << vectorMap[cast<llvm::User>(MapClausePointerValues[First])->getOperand(0)]
+                << Candidates << V->Var->getSourceRange();
+        }
+        named[First] = true;
+        if (MapType == OMP_TGT_MAPTYPE_TO)
+            V->Out = First;
+        else
+            V->In = First;
+    }
 
-                /* Dump the IncludeStr, if any */
-                std::string includeContents = CGM.OpenMPSupport.getIncludeStr();
-                if (includeContents != "") {
-                    CLOS << includeContents;
-                }
+    // Create the unique filename that refers to kernel file
+    llvm::raw_fd_ostream CLOS(CGM.OpenMPSupport.createTempFile(), true);
+    const std::string FileName = CGM.OpenMPSupport.getTempName();
+    const std::string clName = FileName + ".cl";
 
-                std::string initializer;
-                switch (op) {
-                    case OMPC_SCAN_add:
-                    case OMPC_SCAN_sub:
-                        initializer = "0";
-                        break;
-                    case OMPC_SCAN_mult:
-                        initializer = "1";
-                        break;
-                    default:
-                        initializer = "";
-                }
-                if (initializer == "") {
-                    // custom initializer is already inserted in include file
-                    templateId += 2;  /* signal user-defined operation */
-                } else {
-                    CLOS << "\n#define _initializer " << initializer;
-                }
+    // use of type 'double' requires cl_khr_fp64 extension to be enabled
+    CLOS << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n\n";
 
-                CLOS << "\n#define _dataType_ " << scanVarType.substr(0, scanVarType.find_last_of(' ')) << "\n";
-                CLOS.close();
-
-                /* Generate code to compile the kernel file */
-                llvm::Value *FileStrScan = Builder.CreateGlobalStringPtr(clNameScan);
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_create_program(), FileStrScan);
-
-                /* Generate code to build the first Kernel*/
-                std::string KernelName = "kernel_0";
-                llvm::Value *FunctionKernel_0 = Builder.CreateGlobalStringPtr(KernelName);
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_create_kernel(), FunctionKernel_0);
-
-                /* Generate code for calling the 1st kernel */
-                llvm::Value *Args[] = {Builder.getInt32(0), Builder.getInt32(idxInput)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_arg(), Args);
-                llvm::Value *Args2[] = {Builder.getInt32(1), Builder.getInt32(idxAux)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_arg(), Args2);
-                llvm::Value *BVScan = Builder.CreateBitCast(T1, CGM.VoidPtrTy);
-                llvm::Value *CArgScan[] = {Builder.getInt32(2), Builder.getInt32(
-                        (dyn_cast<llvm::AllocaInst>(T1)->getAllocatedType())->getPrimitiveSizeInBits() / 8), BVScan};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_hostArg(), CArgScan);
-
-                // SLT = max(1, LT/2).
-                llvm::Value *LB = Builder.CreateLoad(B1);
-                llvm::Value *LST = Builder.CreateLoad(ST);
-                llvm::Value *GroupSize[] = {Builder.CreateIntCast(LB, CGM.Int32Ty, false),
-                                            Builder.getInt32(0),
-                                            Builder.getInt32(0),
-                                            Builder.CreateIntCast(LST, CGM.Int32Ty, false),
-                                            Builder.getInt32(0),
-                                            Builder.getInt32(0),
-                                            Builder.getInt32(1)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_execute_tiled_kernel(), GroupSize);
-
-                /* Generate code for calling the 2nd kernel */
-                KernelName = "kernel_1";
-                llvm::Value *FunctionKernel_1 = Builder.CreateGlobalStringPtr(KernelName);
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_create_kernel(), FunctionKernel_1);
-                llvm::Value *Args3[] = {Builder.getInt32(0), Builder.getInt32(idxAux)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_arg(), Args3);
-                llvm::Value *BVScan2 = Builder.CreateBitCast(B1, CGM.VoidPtrTy);
-                llvm::Value *CArgScan2[] = {Builder.getInt32(1), Builder.getInt32(
-                        (dyn_cast<llvm::AllocaInst>(B1)->getAllocatedType())->getPrimitiveSizeInBits() / 8), BVScan2};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_hostArg(), CArgScan2);
-
-                // SLB = max(1, LB/2).
-                llvm::Value *LSB = Builder.CreateLoad(SB);
-                llvm::Value *GroupSize2[] = {Builder.getInt32(1),
-                                             Builder.getInt32(0),
-                                             Builder.getInt32(0),
-                                             Builder.CreateIntCast(LSB, CGM.Int32Ty, false),
-                                             Builder.getInt32(0),
-                                             Builder.getInt32(0),
-                                             Builder.getInt32(1)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_execute_tiled_kernel(), GroupSize2);
-
-                /* Generate code for calling the 3th Kernel */
-                KernelName = "kernel_2";
-                llvm::Value *FunctionKernel_2 = Builder.CreateGlobalStringPtr(KernelName);
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_create_kernel(), FunctionKernel_2);
-                int pos = 0;
-                llvm::Value *Args5[] = {Builder.getInt32(pos), Builder.getInt32(idxOutput)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_arg(), Args5);
-                if (idxInput != idxOutput) {
-                    pos++;
-                    llvm::Value *Args5a[] = {Builder.getInt32(pos), Builder.getInt32(idxInput)};
-                    Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_arg(), Args5a);
-                }
-                pos++;
-                llvm::Value *Args6[] = {Builder.getInt32(pos), Builder.getInt32(idxAux)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_set_kernel_arg(), Args6);
-
-                llvm::Value *LT = Builder.CreateLoad(T1);
-                llvm::Value *GroupSize3[] = {Builder.CreateIntCast(LB, CGM.Int32Ty, false),
-                                             Builder.getInt32(0),
-                                             Builder.getInt32(0),
-                                             Builder.CreateIntCast(LT, CGM.Int32Ty, false),
-                                             Builder.getInt32(0),
-                                             Builder.getInt32(0),
-                                             Builder.getInt32(1)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_execute_tiled_kernel(), GroupSize3);
-
-                /* release the Aux buffer */
-                llvm::Value *Aux[] = {Builder.getInt32(idxAux)};
-                Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_release_buffer(), Aux);
-
-                /* Build the kernel file */
-                const std::string generator = "$LLVM_INCLUDE_PATH/scan/generator " + FileNameScan + " " +
-                                              std::to_string(templateId) + " '" + operatorName + "' ";
-                std::system(generator.c_str());
-            }
+    // Dump the IncludeStr, if any
+    std::string includeContents = CGM.OpenMPSupport.getIncludeStr();
+    if (includeContents != "") {
+        CLOS << includeContents << "\n";
+    }
+
+    // Dump the user types that are scanned
+    deftypes.clear();
+    for (std::vector<ScanVar>::iterator V = scanVars.begin(), VE = scanVars.end(); V != VE; ++V) {
+        if (!V->Elem->isRecordType() || dumpedDefType(&V->Elem)) continue;
+        QualType B = V->Elem.getCanonicalType();
+        const RecordType *RT = B->getAs<RecordType>();
+        RT->getDecl()->getDefinition()->print(CLOS);
+        CLOS << ";\n";
+        if (B.getAsString().compare(V->Type) != 0) {
+            CLOS << "typedef " << B.getAsString() << " " << V->Type << ";\n";
         }
-        return;
+    }
+
+    for (unsigned k = 0; k < scanVars.size(); k++) {
+        EmitCLScanKernels(CLOS, scanVars[k], k);
+    }
+    CLOS.close();
+    std::rename(FileName.c_str(), clName.c_str());
+
+    // Lower the scan kernels like any other kernel file: SPIR targets embed
+    // the encoded image, not the OpenCL source
+    if (CGM.getMPtoGPURuntime().checkKernelTools(S.getLocStart(), false, false))
+        CGM.getMPtoGPURuntime().enqueueKernelJob(
+                S.getLocStart(), FileName, false, CGM.getLangOpts().SchdDebug,
+                CGM.getLangOpts().OMPtoGPUTriple);
+
+    // Generate code to scan each variable
+    for (unsigned k = 0; k < scanVars.size(); k++) {
+        const ScanVar &SV = scanVars[k];
+        llvm::Value *Block = EmitKernelHandleValue(*this, FileName, "_scan_block_" + std::to_string(k));
+        llvm::Value *Add = EmitKernelHandleValue(*this, FileName, "_scan_add_" + std::to_string(k));
+        llvm::Value *Size = Builder.CreateIntCast(MapClauseSizeValues[SV.In], CGM.Int64Ty, false);
+        llvm::Value *Args[] = {Block, Add,
+                               Builder.getInt32(SV.In),
+                               Builder.getInt32(SV.Out),
+                               Builder.getInt32(SV.Flags),
+                               Builder.CreateUDiv(Size, Builder.getInt64(SV.Bytes)),
+                               Builder.getInt32(SV.Bytes),
+                               Builder.getInt32(SV.FlagBytes),
+                               Builder.getInt32(SV.Exclusive)};
+        EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_scan(), Args);
     }
 }
 
@@ -6540,8 +8337,8 @@ void CodeGenFunction::EmitSyncMapClauses(const int VType) {
             llvm::Value *Args[] = {MapClauseSizeValues[i],
                                    VMapPos,
                                    MapClausePointerValues[i]};
-            Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_read_buffer(), Args);
-            //llvm::errs() << "cl_read_buffer " << *MapClausePointerValues[i] << "\n";
+            // The runtime skips the copy while an enclosing region still maps it
+            Status = EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_read_mapped(), Args);
         }
     }
     //llvm::errs() << "Leave EmitSyncMapClauses\n";
@@ -6563,6 +8360,61 @@ void CodeGenFunction::MapStmts(const Stmt *ST, llvm::Value * val) {
   }	
 }
 
+//
+// Emit the body of a target [data] region for the accelerator. With
+// -kernel-fusion, runs of adjacent 'parallel for' loops with the same
+// iteration space and no dependence between their iterations become a
+// single kernel (see fusedLoops); anything else is emitted as usual
+//
+void CodeGenFunction::EmitTargetBodytoGPU(const Stmt *Body) {
+    const CompoundStmt *CS = dyn_cast<CompoundStmt>(Body);
+    if (!CGM.getLangOpts().KernelFusion || !CS ||
+        (isTargetDataIf && TargetDataIfRegion == 2)) {
+        EmitStmt(Body);
+        return;
+    }
+
+    LexicalScope Scope(*this, CS->getSourceRange());
+    CompoundStmt::const_body_iterator I = CS->body_begin(), E = CS->body_end();
+    while (I != E) {
+        SmallVector<const OMPExecutableDirective *, 4> Group;
+        std::vector<std::vector<LoopUse> > Uses;
+        std::string Space;
+        CompoundStmt::const_body_iterator J = I;
+        if (const OMPExecutableDirective *D = getFusibleLoop(*I)) {
+            Uses.resize(1);
+            if (describeFusibleLoop(*this, *D, Space, Uses[0])) {
+                Group.push_back(D);
+                for (J = I + 1; J != E; ++J) {
+                    const OMPExecutableDirective *Next = getFusibleLoop(*J);
+                    std::string NextSpace;
+                    Uses.resize(Group.size() + 1);
+                    if (!Next || !describeFusibleLoop(*this, *Next, NextSpace, Uses.back()) ||
+                        NextSpace != Space || !canFuseLoops(Uses))
+                        break;
+                    Group.push_back(Next);
+                }
+            }
+        }
+
+        if (Group.size() < 2) {
+            EmitStmt(*I);
+            ++I;
+            continue;
+        }
+
+        CGM.getDiags().Report(Group[0]->getLocStart(), diag::remark_mptogpu_loops_fused)
+            << (unsigned) Group.size();
+        fusedLoops.assign(Group.begin() + 1, Group.end());
+        if (isa<OMPParallelForSimdDirective>(Group[0]))
+            EmitOMPtoOpenCLParallelFor(OMPD_parallel_for_simd, OMPD_for_simd, *Group[0]);
+        else
+            EmitOMPtoOpenCLParallelFor(OMPD_parallel_for, OMPD_for, *Group[0]);
+        fusedLoops.clear();
+        I = J;
+    }
+}
+
 void CodeGenFunction::EmitInheritedMap(int init, int count) {
 	
   ArrayRef<llvm::Value*> MapClausePointerValues;
@@ -6614,42 +8466,101 @@ void CodeGenFunction::EmitInheritedMap(int init, int count) {
 
 }
 
+//
+// The host address of the map clause range [Begin, End) as a void pointer
+// (VLoc) and its size in bytes as i64 (VSize). Size keeps the size before
+// the cast, a constant when the range has a known size
+//
+static void EmitMapRange(CodeGenFunction &CGF, const Expr *Begin, const Expr *End,
+                         llvm::Value *&VLoc, llvm::Value *&VSize, llvm::Value *&Size) {
+    CGBuilderTy &Builder = CGF.Builder;
+    llvm::Value *RB = CGF.EmitAnyExprToTemp(Begin).getScalarVal();
+    llvm::Value *RE = CGF.EmitAnyExprToTemp(End).getScalarVal();
+
+    // Subtract the two pointers to obtain the size
+    Size = RE;
+    if (!isa<llvm::ConstantInt>(RE)) {
+        llvm::Type *LongTy = CGF.ConvertType(CGF.getContext().LongTy);
+        llvm::Value *RBI = Builder.CreatePtrToInt(RB, LongTy);
+        llvm::Value *REI = Builder.CreatePtrToInt(RE, LongTy);
+        Size = Builder.CreateSub(REI, RBI);
+    }
+
+    // Get the pointer to the alloca instruction
+    llvm::Value *BC = RB->stripPointerCasts();
+    // Check if the stripped pointer is already a load instruction, otherwise must
+    llvm::Value *VLd = BC;
+    if (!isa<llvm::AllocaInst>(BC) && !isa<llvm::LoadInst>(BC)) {
+        if (!isa<llvm::GetElementPtrInst>(BC)) {
+            llvm::Value *Idxs[] = {Builder.getInt32(0), Builder.getInt32(0)};
+            VLd = Builder.CreateInBoundsGEP(BC, Idxs);
+        }
+    }
+
+    VLoc = Builder.CreateBitCast(VLd, CGF.CGM.VoidPtrTy);
+    VSize = Builder.CreateIntCast(Size, CGF.CGM.Int64Ty, false);
+}
+
+//
+// The map type of item i of the map clause C on the region Region. Copy
+// only what the region needs: a variable it never stores to is not copied
+// back, and one it never reads is not copied in when its stores cover
+// every element (see MapUseScanner). Reduced tells which of the two cases
+// reduced a tofrom map (0 or 1), or is -1
+//
+static int getMapType(ASTContext &Ctx, const OMPMapClause &C, unsigned i,
+                      const Stmt *Region, int &Reduced) {
+    int VType;
+    switch (C.getKind()) {
+        default:
+            llvm_unreachable("(target [data] map) Unknown clause type!");
+            break;
+        case OMPC_MAP_unknown:
+        case OMPC_MAP_tofrom:
+            VType = OMP_TGT_MAPTYPE_TOFROM;
+            break;
+        case OMPC_MAP_to:
+            VType = OMP_TGT_MAPTYPE_TO;
+            break;
+        case OMPC_MAP_from:
+            VType = OMP_TGT_MAPTYPE_FROM;
+            break;
+        case OMPC_MAP_alloc:
+            VType = OMP_TGT_MAPTYPE_ALLOC;
+            break;
+    }
+
+    Reduced = -1;
+    std::vector<MapExtent> Dims;
+    const VarDecl *VD = getMapExtents(Ctx, C.getVars()[i], Dims);
+    if (VType != OMP_TGT_MAPTYPE_TOFROM || !VD) return VType;
+
+    MapUseScanner Scanner(Ctx, Region, VD);
+    MapUse Use = Scanner.scan(Dims);
+    if (!Use.Written) {
+        VType = OMP_TGT_MAPTYPE_TO;
+        Reduced = 0;
+    } else if (!Use.Read && Use.Covered) {
+        VType = OMP_TGT_MAPTYPE_FROM;
+        Reduced = 1;
+    }
+    return VType;
+}
+
 //
 // Emit RuntimeCalls for Map Clauses in omp target map directive
 //
 void CodeGenFunction::EmitMapClausetoGPU(const bool DataDirective,
                                          const OMPMapClause &C,
-                                         const OMPExecutableDirective &) {
+                                         const OMPExecutableDirective &S) {
 
     ArrayRef<const Expr *> RangeBegin = C.getCopyingStartAddresses();
     ArrayRef<const Expr *> RangeEnd = C.getCopyingSizesEndAddresses();
+    ArrayRef<const Expr *> Vars = C.getVars();
 
     for (unsigned i = 0; i < RangeBegin.size(); ++i) {
-        llvm::Value *RB = EmitAnyExprToTemp(RangeBegin[i]).getScalarVal();
-        llvm::Value *RE = EmitAnyExprToTemp(RangeEnd[i]).getScalarVal();
-
-        // Subtract the two pointers to obtain the size
-        llvm::Value *Size = RE;
-        if (!isa<llvm::ConstantInt>(RE)) {
-            llvm::Type *LongTy = ConvertType(CGM.getContext().LongTy);
-            llvm::Value *RBI = Builder.CreatePtrToInt(RB, LongTy);
-            llvm::Value *REI = Builder.CreatePtrToInt(RE, LongTy);
-            Size = Builder.CreateSub(REI, RBI);
-        }
-
-        // Get the pointer to the alloca instruction
-        llvm::Value *BC = RB->stripPointerCasts();
-        // Check if the stripped pointer is already a load instruction, otherwise must
-        llvm::Value *VLd = BC;
-        if (!isa<llvm::AllocaInst>(BC) && !isa<llvm::LoadInst>(BC)) {
-            if (!isa<llvm::GetElementPtrInst>(BC)) {
-                llvm::Value *Idxs[] = {Builder.getInt32(0), Builder.getInt32(0)};
-                VLd = Builder.CreateInBoundsGEP(BC, Idxs);
-            }
-        }
-
-        llvm::Value *VLoc = Builder.CreateBitCast(VLd, CGM.VoidPtrTy);
-        llvm::Value *VSize = Builder.CreateIntCast(Size, CGM.Int64Ty, false);
+        llvm::Value *VLoc, *VSize, *Size;
+        EmitMapRange(*this, RangeBegin[i], RangeEnd[i], VLoc, VSize, Size);
 
         const Stmt *ST = dyn_cast<Stmt>(RangeBegin[i]);
         MapStmts(ST, VLoc);
@@ -6658,25 +8569,24 @@ void CodeGenFunction::EmitMapClausetoGPU(const bool DataDirective,
         if (isa<CastExpr>(E)) E = cast<CastExpr>(E)->getSubExprAsWritten();
         QualType VQual = E->getType();
 
-        int VType;
-        switch (C.getKind()) {
-            default:
-                llvm_unreachable("(target [data] map) Unknown clause type!");
-                break;
-            case OMPC_MAP_unknown:
-            case OMPC_MAP_tofrom:
-                VType = OMP_TGT_MAPTYPE_TOFROM;
-                break;
-            case OMPC_MAP_to:
-                VType = OMP_TGT_MAPTYPE_TO;
-                break;
-            case OMPC_MAP_from:
-                VType = OMP_TGT_MAPTYPE_FROM;
-                break;
-            case OMPC_MAP_alloc:
-                VType = OMP_TGT_MAPTYPE_ALLOC;
-                break;
+        int Reduced;
+        int VType = getMapType(getContext(), C, i, S.getAssociatedStmt(), Reduced);
+        if (Reduced >= 0) {
+            std::vector<MapExtent> Dims;
+            const VarDecl *VD = getMapExtents(getContext(), Vars[i], Dims);
+            uint64_t Bytes = 0;
+            if (llvm::ConstantInt *CI = dyn_cast<llvm::ConstantInt>(Size)) {
+                Bytes = CI->getZExtValue();
+            } else {
+                QualType Elem = getScanElementType(getContext(), VD->getType());
+                Bytes = Elem->isIncompleteType() ? 0 : getContext().getTypeSizeInChars(Elem).getQuantity();
+                for (unsigned d = 0; d < Dims.size(); ++d)
+                    Bytes = Dims[d].Known ? Bytes * Dims[d].Size : 0;
+            }
+            CGM.getDiags().Report(Vars[i]->getExprLoc(), diag::remark_mptogpu_map_reduced)
+                << VD->getName() << Reduced << (Bytes ? 1 : 0) << llvm::utostr(Bytes);
         }
+
         //llvm::errs() << "InsertMapPos " << i << ": " << *VLoc << "\n";
         //Save the position of location in the [data] map clause
         //This also define the buffer index (used to offloading)
@@ -6684,6 +8594,253 @@ void CodeGenFunction::EmitMapClausetoGPU(const bool DataDirective,
     }
 }
 
+//
+// Estimates, at the entry of a target region, the work of the loops it
+// offloads: the operators, element accesses and calls (CallOps each) of
+// their bodies times the trip counts of the loops around them, and the
+// number of kernel launches. The bounds of those loops must be expressions
+// of globals or of variables the region captures that the region does not
+// change; otherwise the work is unknown and estimate returns false
+//
+class WorkEstimator {
+public:
+    WorkEstimator(CodeGenFunction &CGF, const CapturedStmt *Region)
+        : CGF(CGF), Region(Region), Failed(false) {}
+
+    bool estimate(llvm::Value *&Ops, llvm::Value *&Launches) {
+        Scale = count(1);
+        Total = Kernels = count(0);
+        region(Region->getCapturedStmt());
+        if (Failed || Kernels == count(0)) return false;
+        Ops = Total;
+        Launches = Kernels;
+        return true;
+    }
+
+private:
+    static const uint64_t CallOps = 4;
+
+    void region(const Stmt *S);
+    llvm::Value *work(const Stmt *S);
+    llvm::Value *trips(const ForStmt *FS);
+    bool isInvariant(const Expr *E);
+    static bool hasDirective(const Stmt *S);
+    llvm::Value *count(uint64_t N) { return CGF.Builder.getInt64(N); }
+    llvm::Value *add(llvm::Value *A, llvm::Value *B) { return CGF.Builder.CreateAdd(A, B); }
+    llvm::Value *mul(llvm::Value *A, llvm::Value *B) { return CGF.Builder.CreateMul(A, B); }
+
+    CodeGenFunction &CGF;
+    const CapturedStmt *Region;
+    llvm::Value *Scale;
+    llvm::Value *Total;
+    llvm::Value *Kernels;
+    bool Failed;
+};
+
+bool WorkEstimator::hasDirective(const Stmt *S) {
+    if (!S) return false;
+    if (isa<OMPExecutableDirective>(S)) return true;
+    for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+        if (hasDirective(*I)) return true;
+    return false;
+}
+
+//
+// The statements of the region outside the offloaded loops run on the host
+// either way: only the loops around the kernels count, as a Scale on them
+// (nullptr when their trip count is unknown)
+//
+void WorkEstimator::region(const Stmt *S) {
+    if (!S || Failed) return;
+
+    if (const OMPExecutableDirective *D = dyn_cast<OMPExecutableDirective>(S)) {
+        if (const OMPParallelDirective *PD = dyn_cast<OMPParallelDirective>(D)) {
+            const Stmt *Body = cast<CapturedStmt>(PD->getAssociatedStmt())->getCapturedStmt();
+            D = dyn_cast<OMPForDirective>(Body);
+        } else if (!isa<OMPParallelForDirective>(D) && !isa<OMPParallelForSimdDirective>(D)) {
+            D = nullptr;
+        }
+        if (!D || !Scale) {
+            Failed = true;
+            return;
+        }
+        llvm::Value *W = work(D->getAssociatedStmt());
+        Total = add(Total, mul(Scale, W));
+        Kernels = add(Kernels, Scale);
+        return;
+    }
+
+    llvm::Value *Saved = Scale;
+    if (const ForStmt *FS = dyn_cast<ForStmt>(S)) {
+        if (!hasDirective(FS->getBody())) return;
+        llvm::Value *T = Scale ? trips(FS) : nullptr;
+        Scale = T ? mul(Scale, T) : nullptr;
+        region(FS->getBody());
+    } else if (isa<WhileStmt>(S) || isa<DoStmt>(S)) {
+        Scale = nullptr;
+        for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+            region(*I);
+    } else if (const CapturedStmt *CS = dyn_cast<CapturedStmt>(S)) {
+        region(CS->getCapturedStmt());
+    } else {
+        for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+            region(*I);
+    }
+    Scale = Saved;
+}
+
+llvm::Value *WorkEstimator::work(const Stmt *S) {
+    if (!S || Failed) return count(0);
+
+    if (const ForStmt *FS = dyn_cast<ForStmt>(S)) {
+        llvm::Value *T = trips(FS);
+        if (!T) {
+            Failed = true;
+            return count(0);
+        }
+        llvm::Value *Body = add(work(FS->getBody()), add(work(FS->getCond()), work(FS->getInc())));
+        return add(work(FS->getInit()), mul(T, Body));
+    }
+    if (isa<WhileStmt>(S) || isa<DoStmt>(S) || isa<GotoStmt>(S) || isa<IndirectGotoStmt>(S)) {
+        Failed = true;
+        return count(0);
+    }
+    if (const CapturedStmt *CS = dyn_cast<CapturedStmt>(S))
+        return work(CS->getCapturedStmt());
+    if (const OMPExecutableDirective *D = dyn_cast<OMPExecutableDirective>(S))
+        return work(D->getAssociatedStmt());
+
+    uint64_t N = 0;
+    if (const BinaryOperator *BO = dyn_cast<BinaryOperator>(S))
+        N = BO->getOpcode() == BO_Comma ? 0 : BO->isCompoundAssignmentOp() ? 2 : 1;
+    else if (const UnaryOperator *UO = dyn_cast<UnaryOperator>(S))
+        N = UO->isIncrementDecrementOp() || UO->isArithmeticOp() ? 1 : 0;
+    else if (isa<ArraySubscriptExpr>(S))
+        N = 1;
+    else if (isa<CallExpr>(S))
+        N = CallOps;
+
+    llvm::Value *W = count(N);
+    for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+        W = add(W, work(*I));
+    return W;
+}
+
+//
+// The trip count of a canonical loop with invariant bounds, or nullptr
+//
+llvm::Value *WorkEstimator::trips(const ForStmt *FS) {
+    MapLoop L;
+    if (!getMapLoop(FS, L) || !isInvariant(L.Lower) || !isInvariant(L.Upper))
+        return nullptr;
+
+    CGBuilderTy &Builder = CGF.Builder;
+    llvm::Value *Lo = Builder.CreateIntCast(CGF.EmitScalarExpr(L.Lower), CGF.Int64Ty,
+                                            L.Lower->getType()->isSignedIntegerOrEnumerationType());
+    llvm::Value *Up = Builder.CreateIntCast(CGF.EmitScalarExpr(L.Upper), CGF.Int64Ty,
+                                            L.Upper->getType()->isSignedIntegerOrEnumerationType());
+    llvm::Value *T = Builder.CreateSub(Up, Lo);
+    if (L.Inclusive) T = add(T, count(1));
+    return Builder.CreateSelect(Builder.CreateICmpSGT(T, count(0)), T, count(0));
+}
+
+//
+// E can be evaluated at the entry of the region and gives the same value
+// anywhere in it: no calls, stores or loads through memory, and only
+// variables that the region leaves alone
+//
+bool WorkEstimator::isInvariant(const Expr *E) {
+    if (!E->getType()->isIntegralOrEnumerationType()) return false;
+
+    SmallVector<const Stmt *, 8> Work(1, E);
+    while (!Work.empty()) {
+        const Stmt *S = Work.pop_back_val();
+        if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S)) {
+            if (isa<EnumConstantDecl>(DRE->getDecl())) continue;
+            const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl());
+            if (!VD || (!VD->hasGlobalStorage() && !Region->capturesVariable(VD)))
+                return false;
+            MapUseScanner Use(CGF.getContext(), Region->getCapturedStmt(), VD);
+            if (Use.scan(std::vector<MapExtent>()).Written) return false;
+            continue;
+        }
+        const BinaryOperator *BO = dyn_cast<BinaryOperator>(S);
+        const UnaryOperator *UO = dyn_cast<UnaryOperator>(S);
+        if (!isa<Expr>(S) || isa<CallExpr>(S) || isa<ArraySubscriptExpr>(S) ||
+            isa<MemberExpr>(S) || isa<StmtExpr>(S) || (BO && BO->isAssignmentOp()) ||
+            (UO && (UO->isIncrementDecrementOp() || UO->getOpcode() == UO_Deref)))
+            return false;
+        for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end(); I != E; ++I)
+            if (*I) Work.push_back(*I);
+    }
+    return true;
+}
+
+//
+// With -offload-dispatch, the condition under which the target region S
+// runs on the device: _cl_offload_profitable weighs the launches, the work
+// of its loops (see WorkEstimator) and the copies of its maps against the
+// host threads. Returns nullptr when the work is not known at the entry of
+// the region, which is then always offloaded
+//
+static llvm::Value *EmitOffloadDispatch(CodeGenFunction &CGF, const OMPExecutableDirective &S) {
+    CodeGenModule &CGM = CGF.CGM;
+    CGBuilderTy &Builder = CGF.Builder;
+    const CapturedStmt *CS = cast<CapturedStmt>(S.getAssociatedStmt());
+
+    llvm::Value *Ops, *Launches;
+    WorkEstimator Estimator(CGF, CS);
+    bool Known = Estimator.estimate(Ops, Launches);
+    CGM.getDiags().Report(S.getLocStart(), diag::remark_mptogpu_dispatch) << (Known ? 1 : 0);
+    if (!Known) return nullptr;
+
+    // The ranges of the map clauses, as EmitMapClausetoGPU gets them
+    SmallVector<llvm::Value *, 8> Locs, Sizes;
+    SmallVector<uint32_t, 8> Types;
+    for (ArrayRef<OMPClause *>::iterator I = S.clauses().begin(),
+                 E = S.clauses().end();
+         I != E; ++I) {
+        if ((*I)->getClauseKind() != OMPC_map) continue;
+        const OMPMapClause &C = cast<OMPMapClause>(*(*I));
+        ArrayRef<const Expr *> RangeBegin = C.getCopyingStartAddresses();
+        ArrayRef<const Expr *> RangeEnd = C.getCopyingSizesEndAddresses();
+        for (unsigned i = 0; i < RangeBegin.size(); ++i) {
+            llvm::Value *VLoc, *VSize, *Size;
+            int Reduced;
+            EmitMapRange(CGF, RangeBegin[i], RangeEnd[i], VLoc, VSize, Size);
+            Locs.push_back(VLoc);
+            Sizes.push_back(VSize);
+            Types.push_back(getMapType(CGF.getContext(), C, i, CS, Reduced));
+        }
+    }
+
+    unsigned NMaps = Locs.size();
+    llvm::Value *LocArray = CGF.CreateTempAlloca(
+        llvm::ArrayType::get(CGM.VoidPtrTy, std::max(NMaps, 1u)), "cl.dispatch.locs");
+    llvm::Value *SizeArray = CGF.CreateTempAlloca(
+        llvm::ArrayType::get(CGM.Int64Ty, std::max(NMaps, 1u)), "cl.dispatch.sizes");
+    for (unsigned i = 0; i < NMaps; ++i) {
+        Builder.CreateStore(Locs[i], Builder.CreateConstInBoundsGEP2_32(LocArray, 0, i));
+        Builder.CreateStore(Sizes[i], Builder.CreateConstInBoundsGEP2_32(SizeArray, 0, i));
+    }
+    if (Types.empty()) Types.push_back(OMP_TGT_MAPTYPE_ALLOC);
+    llvm::Constant *Init =
+        llvm::ConstantDataArray::get(CGM.getLLVMContext(), Types);
+    llvm::GlobalVariable *Table = new llvm::GlobalVariable(
+        CGM.getModule(), Init->getType(), true,
+        llvm::GlobalValue::PrivateLinkage, Init, ".cl_maptypes");
+    Table->setUnnamedAddr(true);
+
+    llvm::Value *Args[] = {Ops, Builder.CreateTrunc(Launches, CGM.Int32Ty),
+                           Builder.getInt32(NMaps),
+                           Builder.CreateConstInBoundsGEP2_32(LocArray, 0, 0),
+                           Builder.CreateConstInBoundsGEP2_32(SizeArray, 0, 0),
+                           Builder.CreateConstInBoundsGEP2_32(Table, 0, 0)};
+    llvm::Value *Profitable =
+        CGF.EmitRuntimeCall(CGM.getMPtoGPURuntime().cl_offload_profitable(), Args);
+    return Builder.CreateICmpNE(Profitable, Builder.getInt32(0));
+}
+
 //
 // Generate the instructions for '#pragma omp target' directive.
 //
@@ -6755,8 +8912,29 @@ void CodeGenFunction::EmitOMPTargetDirective(const OMPTargetDirective &S) {
                         }
                     }
 
+                    // With -offload-dispatch the runtime cost model may run
+                    // the region on the host, through the else block, when
+                    // the if clause (if any) holds. Regions inside target
+                    // data keep their data on the device
+                    bool dispatch = CGM.getLangOpts().OffloadDispatch && targetDataDepth == 0;
+                    llvm::BasicBlock *DispatchBlock = ThenBlock;
+                    if (hasIfClause && dispatch)
+                        DispatchBlock = createBasicBlock("omp.dispatch");
+                    if (hasIfClause)
+                        EmitBranchOnBoolExpr(cast<OMPIfClause>(IC)->getCondition(), DispatchBlock, ElseBlock, 0);
+                    if (dispatch) {
+                        if (hasIfClause) EmitBlock(DispatchBlock);
+                        llvm::Value *OnDevice = EmitOffloadDispatch(*this, S);
+                        if (OnDevice) {
+                            Builder.CreateCondBr(OnDevice, ThenBlock, ElseBlock);
+                            hostDispatch = true;
+                            isTargetDataIf = true;
+                            hasIfClause = true;
+                        } else if (hasIfClause) {
+                            EmitBranch(ThenBlock);
+                        }
+                    }
                     if (hasIfClause) {
-                        EmitBranchOnBoolExpr(cast<OMPIfClause>(IC)->getCondition(), ThenBlock, ElseBlock, 0);
                         TargetDataIfRegion = 1;
                         EmitBlock(ThenBlock);
                     }
@@ -6794,7 +8972,7 @@ void CodeGenFunction::EmitOMPTargetDirective(const OMPTargetDirective &S) {
             }
         }
 
-        EmitStmt(CS->getCapturedStmt());
+        EmitTargetBodytoGPU(CS->getCapturedStmt());
 
         if (regionStarted || emptyTarget) {
             EmitSyncMapClauses(OMP_TGT_MAPTYPE_FROM);
@@ -6813,6 +8991,7 @@ void CodeGenFunction::EmitOMPTargetDirective(const OMPTargetDirective &S) {
             EmitBranch(ContBlock);
             TargetDataIfRegion = 0;
             isTargetDataIf = false;
+            hostDispatch = false;
             EmitBlock(ContBlock, true);
         }
         //llvm::errs() << "Leave EmitOMPTargetDirective\n";
@@ -7134,6 +9313,7 @@ void CodeGenFunction::EmitOMPTargetDataDirective(const OMPTargetDataDirective &S
     if (CGM.getLangOpts().MPtoGPU) {
         //llvm::errs() << "Enter EmitOMPTargetDataDirective\n";
         insideTarget = true;
+        targetDataDepth++;
         CGM.OpenMPSupport.startOpenMPRegion(true);
 
         //First, look for the if clause in the target directive
@@ -7186,7 +9366,7 @@ void CodeGenFunction::EmitOMPTargetDataDirective(const OMPTargetDataDirective &S
             }
         }
 
-        EmitStmt(CS->getCapturedStmt());
+        EmitTargetBodytoGPU(CS->getCapturedStmt());
         EmitSyncMapClauses(OMP_TGT_MAPTYPE_FROM);
 
         ReleaseBuffers(first, count);
@@ -7197,6 +9377,7 @@ void CodeGenFunction::EmitOMPTargetDataDirective(const OMPTargetDataDirective &S
 
         CGM.OpenMPSupport.endOpenMPRegion();
         insideTarget = false;
+        targetDataDepth--;
         //llvm::errs() << "Leave EmitOMPTargetDataDirective\n";
     }
 }
@@ -2193,6 +2193,7 @@ public:
   void EmitMapClausetoGPU(const bool DataDirective,
 			  const OMPMapClause &C,
 			  const OMPExecutableDirective &S);
+  void EmitTargetBodytoGPU(const Stmt *Body);
   
   unsigned int GetMapPosition(const llvm::Value *MapPointer,
 			      const llvm::Value *MapSize);
@@ -347,6 +347,12 @@ void CodeGenModule::Release() {
   if (getCodeGenOpts().ProfileInstrGenerate)
     if (llvm::Function *PGOInit = CodeGenPGO::emitInitialization(*this))
       AddGlobalCtor(PGOInit, 0);
+  if (MPtoGPURuntime) {
+    // The registration embeds the kernel images: join their generation first
+    MPtoGPURuntime->finishKernelJobs();
+    if (llvm::Function *CLRegister = MPtoGPURuntime->emitRegistrationFunction())
+      AddGlobalCtor(CLRegister);
+  }
   if (PGOReader && PGOStats.hasDiagnostics())
     PGOStats.reportDiagnostics(getDiags(), getCodeGenOpts().MainFileName);
   EmitCtorList(GlobalCtors, "llvm.global_ctors");
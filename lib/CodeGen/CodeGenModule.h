@@ -23,6 +23,7 @@
 #include "clang/AST/GlobalDecl.h"
 #include "clang/AST/Mangle.h"
 #include "clang/Basic/ABI.h"
+#include "clang/Basic/CharInfo.h"
 #include "clang/Basic/LangOptions.h"
 #include "clang/Basic/Module.h"
 #include "llvm/ADT/DenseMap.h"
@@ -284,6 +285,10 @@ class CodeGenModule : public CodeGenTypeCache {
     // Name of the include file used by omp declare scan & omp declare target constructs
     std::string IncludeStr = "";
 
+    // Declare reductions and scans whose macros are in IncludeStr, by name
+    // and type (see getCLOperatorName)
+    llvm::StringMap<bool> CLOperators;
+
   CodeGenTBAA *TBAA;
   
   mutable const TargetCodeGenInfo *TheTargetCodeGenInfo;
@@ -1463,6 +1468,27 @@ public:
           CGM.IncludeStr += incStr;
       }
 
+      /// Prefix of the OpenCL macros of the declare reduction or scan Name
+      /// for the type Ty: <Name>_<type>_combiner and <Name>_<type>_initializer
+      /// (see EmitOMPDeclareReduction). A name declared for several types
+      /// gets macros of its own for each of them.
+      static std::string getCLOperatorName(StringRef Name, QualType Ty) {
+        std::string Id = Name.str() + "_" +
+                         Ty.getCanonicalType().getUnqualifiedType().getAsString();
+        for (std::string::iterator I = Id.begin(), E = Id.end(); I != E; ++I)
+          if (!isAlphanumeric(*I))
+            *I = '_';
+        return Id;
+      }
+
+      void addCLOperator(StringRef Name, QualType Ty) {
+        CGM.CLOperators[getCLOperatorName(Name, Ty)] = true;
+      }
+
+      bool hasCLOperator(StringRef Name, QualType Ty) {
+        return CGM.CLOperators.count(getCLOperatorName(Name, Ty));
+      }
+
   };
 
   OpenMPSupportStackTy OpenMPSupport;
@@ -2585,6 +2585,16 @@ void Clang::ConstructJob(Compilation &C, const JobAction &JA,
     CmdArgs.push_back(Args.MakeArgString("-tile-size=" + tile));
   }
 
+  // pass the fusion of adjacent target loops (opt-in)
+  if (Args.hasArg(options::OPT_kernel_fusion)) {
+    CmdArgs.push_back("-kernel-fusion");
+  }
+
+  // pass the run-time choice between device and host (opt-in)
+  if (Args.hasArg(options::OPT_offload_dispatch)) {
+    CmdArgs.push_back("-offload-dispatch");
+  }
+
   if (Arg *A = Args.getLastArg(options::OPT_rtl_mode_EQ)) {
     StringRef rtlmode = A->getValue();
     CmdArgs.push_back(Args.MakeArgString("-rtl-mode=" + rtlmode));
@@ -1576,6 +1576,8 @@ static void ParseLangArgs(LangOptions &Opts, ArgList &Args, InputKind IK,
     StringRef(A->getValue()).getAsInteger(0, tileSize);
   }    
   Opts.TileSize = tileSize;
+  Opts.KernelFusion = Args.hasArg(OPT_kernel_fusion);
+  Opts.OffloadDispatch = Args.hasArg(OPT_offload_dispatch);
 
   Opts.setRtlMode(LangOptions::RTL_none); // default value
   if (Arg *A = Args.getLastArg(options::OPT_rtl_mode_EQ)) {
@@ -17,6 +17,10 @@
 #include <math.h>
 #include "cldevice.h"
 #include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
@@ -40,19 +44,27 @@ extern "C" {
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
+// Per-thread state: every host thread that drives target regions has its
+// own buffer table, selected device, current program and kernel, and its own
+// cl_kernel objects (clSetKernelArg is not safe on a kernel shared by two
+// threads). The tables shared by all threads (programs, kernel registry,
+// buffer pool, present table, tuning) are guarded by _rtl_lock, a recursive
+// lock, which program builds do not hold (see _cl_build_program); the
+// staging ring of each device by _stage_lock. Split mode keeps a
+// single argument record and is meant for one host thread at a time.
 cl_device_id *_device = NULL;
 cl_context *_context = NULL;
 cl_command_queue *_cmd_queue = NULL;
-cl_mem *_locs = NULL;
+__thread cl_mem *_locs = NULL;
 
 cl_platform_id _platform;
-cl_program *_program;
-cl_kernel *_kernel;
+__thread cl_program *_program = NULL;
+__thread cl_kernel *_kernel = NULL;
 cl_uint _ndevices;
-cl_uint _clid;
-cl_int _status;
+__thread cl_uint _clid;
+__thread cl_int _status;
 
-cl_uint _kerid;
+__thread cl_uint _kerid;
 cl_uint _nkernels;
 cl_uint _sentinel;
 char **_strprog;
@@ -60,17 +72,269 @@ char **_strprog;
 int _spir_support;
 int _gpu_present;
 int _cpu_present;
-int _upperid;
-int _curid;
+__thread int _upperid;
+__thread int _curid;
 int _verbose;
 int _profile;
+int _async;
 int _work_group[9] = {128, 1, 1, 256, 1, 1, 32, 8, 1};
+// _work_group fitted to the limits of each device: 9 per device, filled at
+// _cldevice_init (see _cl_query_work_items)
+int *_dev_work_group = NULL;
 int _block_sizes[11] = {2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048};
 
-// max work items in each dimmension for current device (_clid)
-int _max_work_items[3] = {128, 1, 1};
-
-cl_event _global_event;
+// max work items in each dimmension of each device: 3 per device, filled
+// at _cldevice_init (threads select devices independently)
+int *_max_work_items = NULL;
+
+__thread cl_event _global_event;
+
+pthread_mutex_t _rtl_lock;
+pthread_once_t _rtl_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t *_stage_lock = NULL;
+
+// the device new threads start on: the last one selected
+cl_uint _default_clid;
+
+// eager builds: programs registered by the global ctors codegen emits are
+// built for the default device by worker threads started at _cldevice_init.
+// A job is queued (0), building (1), built (2) or handed to the program
+// registry (3); _build_lock and _build_cond guard the job table and
+// _prog_state only, so a thread waiting for a build holds no other lock the
+// workers need.
+int _prebuild;
+char **_pb_name = NULL;
+cl_program *_pb_program = NULL;
+int *_pb_state = NULL;
+int _npb;
+int _maxpb;
+cl_uint _pb_device;
+pthread_t *_pb_worker = NULL;
+int _npb_worker;
+pthread_mutex_t _build_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _build_cond = PTHREAD_COND_INITIALIZER;
+
+// kernel images embedded in the host executable, registered by the same
+// ctors and also guarded by _build_lock. The data is owned by the executable.
+// CLDEVICE_EMBEDDED=0 ignores them and loads the kernel files instead.
+int _embedded;
+char **_img_name = NULL;
+int *_img_kind = NULL;
+const unsigned char **_img_data = NULL;
+size_t *_img_size = NULL;
+int _nimg;
+int _maximg;
+
+// size of the per-thread views of _program/_kernel and _kh_kernel, and the
+// slot of the thread in _threads, which keeps every thread's tables so that
+// _cldevice_finish can release them (-1 until the thread is set up). The
+// slot is only valid in the generation it was taken: _cldevice_finish
+// starts a new one, since it releases the tables of every thread
+__thread cl_uint _thread_nkernels;
+__thread cl_uint _thread_maxhandles;
+__thread int _thread_slot = -1;
+__thread unsigned _thread_generation;
+unsigned _rtl_generation;
+
+typedef struct {
+    cl_mem *locs;
+    cl_event *locs_event;
+    void **locs_host;
+    struct _cl_stream_map *locs_stream;
+    int *argbufs;
+    cl_program *program;
+    cl_kernel *kernel;
+    cl_kernel *kh_kernel;
+    struct _cl_arg_cache *kh_args;
+    cl_uint maxhandles;
+} _cl_thread_state;
+
+_cl_thread_state *_threads = NULL;
+int _nthreads;
+int _maxthreads;
+
+// async mode: per-device transfer queues and, for each buffer id, the event
+// of the last command that touched it. Buffers bound to the next kernel launch
+// are collected in _argbufs so the launch can wait only on those.
+cl_command_queue *_xfer_queue = NULL;
+__thread cl_event *_locs_event = NULL;
+__thread int *_argbufs = NULL;
+__thread int _nargbufs;
+__thread int _maxargbufs;
+
+// split mode: the x-dimension of a kernel is shared among all devices. The
+// arguments of the current kernel are recorded to be replayed on the helper
+// devices; programs, kernels and measured throughput are kept per
+// (kernel id, device) pair. _split_streams is the table of the arrays of
+// the launch in progress, if it has one (see _cl_launch_stream): it tells
+// which elements each slice reads and stores.
+int _split;
+int *_arg_buf = NULL;
+size_t *_arg_size = NULL;
+char **_arg_val = NULL;
+int _nargs;
+int _maxargs;
+double *_split_rate = NULL;
+cl_program *_split_program = NULL;
+cl_kernel *_split_kernel = NULL;
+const _cl_stream_desc *_split_streams = NULL;
+int _split_nstreams;
+int _split_loop;
+
+// directory of the persistent program cache, NULL if disabled
+char *_cache_dir = NULL;
+
+// program registry: open addressing table from program name to program id
+// (_kerid). A slot holds id + 1, 0 means empty. _program_all keeps the program
+// object built for each (program id, device) pair; _program is the view of
+// the calling thread for its device. _prog_state tells whether the entry is
+// not built (0), being built (1) or built (2): builds run outside _rtl_lock,
+// so _prog_state is guarded by _build_lock (and resized under both locks).
+cl_uint *_prog_slot = NULL;
+cl_uint _prog_cap;
+cl_program *_program_all = NULL;
+int *_prog_state = NULL;
+
+// kernel registry: a handle names a (program id, kernel name) pair and owns
+// one cl_kernel per device and thread. Handles are stable for the whole
+// execution, so codegen can resolve them once per launch site.
+cl_uint *_kh_slot = NULL;
+cl_uint _kh_cap;
+cl_uint *_kh_prog = NULL;
+char **_kh_name = NULL;
+__thread cl_kernel *_kh_kernel = NULL;
+cl_uint _nhandles;
+cl_uint _maxhandles;
+__thread int _kh_current = -1;
+
+// batched launches: the arguments last set on each (handle, device) kernel
+// of the calling thread, so that _cl_launch only calls clSetKernelArg for the
+// ones that changed. Values of up to ARG_KEPT bytes are kept (a cl_mem, a
+// scalar, the size of a local array); larger ones are set on every launch.
+#define ARG_KEPT 16
+typedef struct _cl_arg_cache {
+    int nargs;
+    unsigned char *len;   // bytes kept for each argument, 0 if unknown
+    char *val;            // ARG_KEPT bytes for each argument
+} _cl_arg_cache;
+__thread _cl_arg_cache *_kh_args = NULL;
+
+// work-group sizing: the local range chosen for each (handle, device) pair,
+// three sizes per entry, and the number of dimensions it was chosen for
+// (0 while not computed yet).
+int _autowg;
+size_t *_kh_local = NULL;
+cl_uint *_kh_ldim = NULL;
+
+// autotuning: the first launches of each kernel try every candidate local
+// range _tune times, timed by profiling events. _kh_trial counts the trials
+// of each (handle, device) pair (-1 once tuned) and _kh_best keeps the best
+// time, whose range is in _kh_local. Winners are kept in the tuning
+// database, <cache dir>/tuning.db, and reused by later runs. Only the
+// launches sized by _cl_execute_kernel are tuned: tiled launches keep the
+// block sizes of the polyhedral kernel, and split launches (CLDEVICE_SPLIT)
+// use the stored or heuristic range without timing candidates.
+int _tune;
+int *_kh_trial = NULL;
+double *_kh_best = NULL;
+__thread int _tune_entry = -1;
+__thread size_t _tune_local[3];
+uint64_t *_tdb_key = NULL;
+size_t *_tdb_local = NULL;
+int _ntdb;
+int _maxtdb;
+
+static const size_t _tune_shapes1[] = {32, 64, 128, 256, 512, 1024};
+static const size_t _tune_shapes2[][2] = {{8, 8}, {16, 4}, {16, 8}, {16, 16}, {32, 4},
+                                          {32, 8}, {32, 16}, {64, 4}, {64, 8}};
+
+// buffer pool: per device free lists of buffers indexed by kind (read-write
+// or read-only) and size class. Classes go in POOL_STEPS steps between two
+// powers of two (see _cl_pool_size), so a buffer wastes at most a quarter
+// of its size. Sizes above the device allocation limit are not pooled.
+#define POOL_STEPS 4
+#define POOL_CLASSES (48 * POOL_STEPS)
+#define POOL_MIN_CLASS (8 * POOL_STEPS)
+int _pool;
+cl_mem **_pool_list = NULL;
+int *_pool_count = NULL;
+int *_pool_cap = NULL;
+uint64_t *_pool_held = NULL;
+uint64_t *_pool_limit = NULL;
+uint64_t *_pool_maxalloc = NULL;
+uint64_t _pool_hits;
+uint64_t _pool_misses;
+
+// present table: host ranges [_pt_begin, _pt_end) already on a device, sorted
+// by address, with the buffer that holds them and a reference count. For each
+// buffer id, _locs_host keeps the host address it maps (NULL if untracked).
+int _present;
+uintptr_t *_pt_begin = NULL;
+uintptr_t *_pt_end = NULL;
+cl_mem *_pt_mem = NULL;
+cl_uint *_pt_dev = NULL;
+int *_pt_ref = NULL;
+int _npresent;
+int _maxpresent;
+__thread void **_locs_host = NULL;
+
+// zero-copy: on host-unified devices mapped arrays are wrapped in place
+int _zerocopy;
+
+// pinned staging: two CL_MEM_ALLOC_HOST_PTR buffers per device, kept mapped,
+// that double-buffer transfers larger than _chunk bytes
+int _pinned;
+size_t _chunk;
+cl_mem *_stage_mem = NULL;
+void **_stage_ptr = NULL;
+
+// streaming: a map the device cannot hold is not copied. _locs_stream keeps
+// its host array, size and map type (STREAM_TO/STREAM_FROM bits), and the
+// loops that use it move one slice per tile through a ring of _stream_depth
+// device buffers (see _cl_launch_stream). size is 0 for resident buffers.
+#define STREAM_TO   1
+#define STREAM_FROM 2
+typedef struct _cl_stream_map {
+    void *host;
+    uint64_t size;
+    int map;
+} _cl_stream_map;
+
+int _stream;
+int _stream_depth;
+int64_t _stream_tile;
+__thread _cl_stream_map *_locs_stream = NULL;
+
+// offload dispatch: target regions built with -offload-dispatch run on the
+// device only if _cl_offload_profitable expects it to be faster than the
+// host threads. The model takes, per device, the bandwidth of each copy
+// direction, the launch overhead and the operation rates of the device and
+// of one host thread, calibrated on first use by timing _cl_cal_source
+// (a[i] = a[i] * s + b[i] is CALIBRATE_OPS operations as codegen counts
+// them). Results are kept per machine in <cache dir>/calibration.db.
+#define CALIBRATE_BYTES    (16 << 20)
+#define CALIBRATE_REPS     4
+#define CALIBRATE_LAUNCHES 32
+#define CALIBRATE_OPS      6
+// device_rate of a device some thread is calibrating
+#define CALIBRATE_PENDING  -2
+
+static const char *_cl_cal_source =
+    "__kernel void _cl_calibrate(__global float *a, __global const float *b, float s) {\n"
+    "    size_t i = get_global_id(0);\n"
+    "    a[i] = a[i] * s + b[i];\n"
+    "}\n";
+
+int _dispatch;
+_cl_calibration *_cal = NULL;
+volatile float _cal_sink;
+
+// vector kernels: loops built with -opt-poly=vectorize also get _v2, _v4,
+// _v8 and _v16 versions working on vloadn/vstoren; _cl_vector_width picks
+// one from the preferred widths of the selected device, 4 per device in
+// _vec_width (0 = not queried yet). CLDEVICE_VECTOR caps the width.
+int _vector;
+int *_vec_width = NULL;
 
 enum RtlModeOptions {
     RTL_none, RTL_verbose, RTL_profile, RTL_all
@@ -83,6 +347,35 @@ double t_start, t_end;
 
 int DCAO_flag_dbg = 0;
 
+// profiling trace: every profiled command gets a CL_COMPLETE callback that
+// adds its time to the totals above and, with CLDEVICE_TRACE=<file>, keeps
+// its timestamps for the Chrome trace written by _cldevice_finish.
+#define TRACE_KERNEL 0
+#define TRACE_WRITE  1
+#define TRACE_READ   2
+#define TRACE_MAP    3
+#define TRACE_UNMAP  4
+
+typedef struct {
+    const char *name;
+    int kind;
+    int id;
+    uint64_t bytes;
+    cl_uint device;
+    cl_ulong queued, submit, start, end;
+} _cl_trace_rec;
+
+static const char *_trace_cat[] = {"kernel", "write", "read", "map", "unmap"};
+static double *_trace_total[] = {&_kernel_time, &_write_time, &_read_time, &_map_time, &_unmap_time};
+
+char *_trace_file = NULL;
+_cl_trace_rec *_trace = NULL;
+int _ntrace;
+int _maxtrace;
+int _trace_pending;
+pthread_mutex_t _trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _trace_idle = PTHREAD_COND_INITIALIZER;   // _trace_pending dropped to 0
+
 cl_mem *_locs_shared_buffer = NULL; 
 int _upperid_shared_buffer;
 int _curid_shared_buffer;
@@ -248,6 +541,87 @@ void _clErrorCode(cl_int status) {
     }
 }
 
+///
+/// Auxiliary Function. Return the integer value of an environment
+/// variable or defval if it is not set.
+///
+int _cl_getenv_int(const char *name, int defval) {
+    const char *str = getenv(name);
+    if (str == NULL || *str == '\0') return defval;
+    return atoi(str);
+}
+
+///
+/// Auxiliary Function. Return the queue used for host <-> device copies.
+/// In async mode transfers go to their own queue so they can overlap kernels.
+///
+cl_command_queue _cl_transfer_queue() {
+    return (_async) ? _xfer_queue[_clid] : _cmd_queue[_clid];
+}
+
+///
+/// Auxiliary Function. Record ev as the last command that touched buffer id.
+///
+void _cl_set_buffer_event(int id, cl_event ev) {
+    if (_locs_event[id] != NULL) clReleaseEvent(_locs_event[id]);
+    if (ev != NULL) clRetainEvent(ev);
+    _locs_event[id] = ev;
+}
+
+///
+/// Auxiliary Function. Wait (on host) for the pending command on buffer id.
+///
+void _cl_wait_buffer(int id) {
+    if (_locs_event[id] != NULL) {
+        clWaitForEvents(1, &_locs_event[id]);
+        clReleaseEvent(_locs_event[id]);
+        _locs_event[id] = NULL;
+    }
+}
+
+///
+/// Auxiliary Function. Remember that buffer id is bound to the next kernel.
+///
+void _cl_bind_buffer(int id) {
+    int i;
+    for (i = 0; i < _nargbufs; i++)
+        if (_argbufs[i] == id) return;
+    if (_nargbufs == _maxargbufs) {
+        _maxargbufs = (_maxargbufs == 0) ? 16 : 2 * _maxargbufs;
+        _argbufs = (int *) realloc(_argbufs, _maxargbufs * sizeof(int));
+        _cl_thread_sync();
+    }
+    _argbufs[_nargbufs++] = id;
+}
+
+///
+/// Auxiliary Function. After a kernel launch, its event becomes the pending
+/// command of every buffer bound to it. Also frees the wait list.
+///
+void _cl_kernel_launched(cl_event *wait) {
+    int i;
+    if (_status == CL_SUCCESS) {
+        clFlush(_cmd_queue[_clid]);
+        for (i = 0; i < _nargbufs; i++)
+            _cl_set_buffer_event(_argbufs[i], _global_event);
+    }
+    _nargbufs = 0;
+    free(wait);
+}
+
+///
+/// Auxiliary Function. Fill list with the pending events of the buffers
+/// bound to the next kernel and return how many they are.
+///
+cl_uint _cl_kernel_waitlist(cl_event *list) {
+    cl_uint n = 0;
+    int i;
+    for (i = 0; i < _nargbufs; i++)
+        if (_locs_event[_argbufs[i]] != NULL)
+            list[n++] = _locs_event[_argbufs[i]];
+    return n;
+}
+
 
 void _cldevice_details(cl_device_id id,
                        cl_device_info param_name,
@@ -404,6 +778,124 @@ void _cldevice_details(cl_device_id id,
     }
 }
 
+///
+/// Auxiliary Function. Create the runtime lock, which is recursive so that
+/// entry points holding it can call each other.
+///
+void _cl_lock_init() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&_rtl_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+///
+/// Auxiliary Function. Publish the tables of the calling thread in _threads
+/// after they have been (re)allocated.
+///
+void _cl_thread_sync() {
+    if (_thread_slot < 0) return;
+    pthread_mutex_lock(&_rtl_lock);
+    _cl_thread_state *t = &_threads[_thread_slot];
+    t->locs = _locs;
+    t->locs_event = _locs_event;
+    t->locs_host = _locs_host;
+    t->locs_stream = _locs_stream;
+    t->argbufs = _argbufs;
+    t->program = _program;
+    t->kernel = _kernel;
+    t->kh_kernel = _kh_kernel;
+    t->kh_args = _kh_args;
+    t->maxhandles = _thread_maxhandles;
+    pthread_mutex_unlock(&_rtl_lock);
+}
+
+///
+/// Auxiliary Function. Grow the program, kernel and cl_kernel views of the
+/// calling thread to the size of the shared registries.
+///
+void _cl_thread_grow() {
+    int grown = 0;
+
+    pthread_mutex_lock(&_rtl_lock);
+    if (_thread_nkernels < _nkernels) {
+        _program = (cl_program *) realloc(_program, _nkernels * sizeof(cl_program));
+        _kernel = (cl_kernel *) realloc(_kernel, _nkernels * sizeof(cl_kernel));
+        memset(_program + _thread_nkernels, 0, (_nkernels - _thread_nkernels) * sizeof(cl_program));
+        memset(_kernel + _thread_nkernels, 0, (_nkernels - _thread_nkernels) * sizeof(cl_kernel));
+        _thread_nkernels = _nkernels;
+        grown = 1;
+    }
+    if (_thread_maxhandles < _maxhandles) {
+        _kh_kernel = (cl_kernel *) realloc(_kh_kernel, _maxhandles * _ndevices * sizeof(cl_kernel));
+        memset(_kh_kernel + _thread_maxhandles * _ndevices, 0,
+               (_maxhandles - _thread_maxhandles) * _ndevices * sizeof(cl_kernel));
+        _kh_args = (_cl_arg_cache *) realloc(_kh_args, _maxhandles * _ndevices * sizeof(_cl_arg_cache));
+        memset(_kh_args + _thread_maxhandles * _ndevices, 0,
+               (_maxhandles - _thread_maxhandles) * _ndevices * sizeof(_cl_arg_cache));
+        _thread_maxhandles = _maxhandles;
+        grown = 1;
+    }
+    if (grown) _cl_thread_sync();
+    pthread_mutex_unlock(&_rtl_lock);
+}
+
+///
+/// Auxiliary Function. Drop the tables of the calling thread, which
+/// _cldevice_finish released, so that _cl_thread_init sets up new ones.
+///
+void _cl_thread_reset() {
+    _thread_slot = -1;
+    _thread_nkernels = _thread_maxhandles = 0;
+    _locs = NULL;
+    _locs_event = NULL;
+    _locs_host = NULL;
+    _locs_stream = NULL;
+    _argbufs = NULL;
+    _maxargbufs = 0;
+    _program = NULL;
+    _kernel = NULL;
+    _kh_kernel = NULL;
+    _kh_args = NULL;
+}
+
+///
+/// Auxiliary Function. Give the calling thread its own region state the
+/// first time it enters the runtime (or the runtime is initialized again):
+/// an empty buffer table, no current kernel, and the device selected last.
+///
+void _cl_thread_init() {
+    if (_thread_slot >= 0 && _thread_generation == _rtl_generation) return;
+    pthread_once(&_rtl_once, _cl_lock_init);
+    if (_thread_slot >= 0) _cl_thread_reset();
+
+    pthread_mutex_lock(&_rtl_lock);
+    if (_nthreads == _maxthreads) {
+        _maxthreads = (_maxthreads == 0) ? 8 : 2 * _maxthreads;
+        _threads = (_cl_thread_state *) realloc(_threads, _maxthreads * sizeof(_cl_thread_state));
+    }
+    _thread_slot = _nthreads++;
+    _thread_generation = _rtl_generation;
+    memset(&_threads[_thread_slot], 0, sizeof(_cl_thread_state));
+    _clid = _default_clid;
+    pthread_mutex_unlock(&_rtl_lock);
+
+    _kerid = -1;
+    _kh_current = -1;
+    _tune_entry = -1;
+    _nargbufs = 0;
+    _upperid = 16;
+    _locs = (cl_mem *) calloc(_upperid, sizeof(cl_mem));
+    _locs_event = (cl_event *) calloc(_upperid, sizeof(cl_event));
+    _locs_host = (void **) calloc(_upperid, sizeof(void *));
+    _locs_stream = (_cl_stream_map *) calloc(_upperid, sizeof(_cl_stream_map));
+    _curid = -1;    // points to invalid location
+    _cl_thread_grow();
+    _cl_thread_sync();
+    if (_verbose) printf("<rtl> Runtime state for host thread %d on device %u\n", _thread_slot, _clid);
+}
+
 ///
 /// Initialize cldevice
 ///
@@ -418,6 +910,70 @@ void _cldevice_init(int rtlmode) {
     _profile = (rtlmode == RTL_profile) || (rtlmode == RTL_all);
 
     if(DCAO_flag_dbg) _profile = 1;
+    pthread_once(&_rtl_once, _cl_lock_init);
+
+    // CLDEVICE_TRACE=<file> profiles every command and writes a Chrome trace
+    // (chrome://tracing) of them to file at _cldevice_finish
+    free(_trace_file);
+    _trace_file = NULL;
+    if (getenv("CLDEVICE_TRACE") != NULL && *getenv("CLDEVICE_TRACE") != '\0') {
+        _trace_file = strdup(getenv("CLDEVICE_TRACE"));
+        _profile = 1;
+    }
+    _ntrace = 0;
+    _trace_pending = 0;
+
+    // CLDEVICE_ASYNC=1 chains copies and kernels by events instead of
+    // blocking on each command
+    _async = _cl_getenv_int("CLDEVICE_ASYNC", 0);
+
+    // CLDEVICE_SPLIT=1 shares the 1-D parallel loops whose arrays are only
+    // subscripted by the counter plus a constant among all devices
+    _split = _cl_getenv_int("CLDEVICE_SPLIT", 0);
+
+    if (_cache_dir == NULL) _cl_cache_init();
+
+    // CLDEVICE_TUNE=n times every candidate work-group n times on the first
+    // launches of each kernel; tuned ranges are reused even when it is unset
+    _tune = _cl_getenv_int("CLDEVICE_TUNE", 0);
+    if (_tune < 0) _tune = 0;
+    _cl_tune_load();
+
+    // CLDEVICE_POOL=0 allocates and releases every buffer as before
+    _pool = _cl_getenv_int("CLDEVICE_POOL", 1);
+
+    // CLDEVICE_PRESENT=0 copies every mapped range, even if already present
+    _present = _cl_getenv_int("CLDEVICE_PRESENT", 1);
+
+    // CLDEVICE_PINNED=1 stages large transfers through pinned memory, in
+    // chunks of CLDEVICE_CHUNK_KB kilobytes
+    _pinned = _cl_getenv_int("CLDEVICE_PINNED", 0);
+    _chunk = (size_t) _cl_getenv_int("CLDEVICE_CHUNK_KB", 4096) << 10;
+    if (_chunk == 0) _chunk = (size_t) 4096 << 10;
+
+    // CLDEVICE_ZEROCOPY=1 wraps mapped arrays with CL_MEM_USE_HOST_PTR on
+    // devices with host-unified memory, so they are never copied
+    _zerocopy = _cl_getenv_int("CLDEVICE_ZEROCOPY", 0);
+
+    // CLDEVICE_STREAM=0 fails the maps larger than the device allocation
+    // limit, 2 streams every map. Streamed loops cut their iterations in
+    // tiles of CLDEVICE_STREAM_TILE (0 sizes them from the device memory)
+    // and keep CLDEVICE_STREAM_DEPTH tiles in flight.
+    _stream = _cl_getenv_int("CLDEVICE_STREAM", 1);
+    _stream_tile = _cl_getenv_int("CLDEVICE_STREAM_TILE", 0);
+    _stream_depth = _cl_getenv_int("CLDEVICE_STREAM_DEPTH", 3);
+    if (_stream_depth < 2) _stream_depth = 2;
+
+    // CLDEVICE_DISPATCH=0 offloads every target region, 2 runs them all on
+    // the host; 1 lets the cost model choose (see _cl_offload_profitable)
+    _dispatch = _cl_getenv_int("CLDEVICE_DISPATCH", 1);
+
+    // CLDEVICE_VECTOR=1 runs the scalar kernels of vectorized loops, a
+    // larger value caps the vector width taken from the device
+    _vector = _cl_getenv_int("CLDEVICE_VECTOR", 16);
+
+    // CLDEVICE_AUTOWG=0 falls back to the static _work_group table
+    _autowg = _cl_getenv_int("CLDEVICE_AUTOWG", 1);
 
     _kernel_time = _write_time = _read_time = _map_time = _unmap_time = _buffer_time =  0;
 
@@ -470,6 +1026,9 @@ void _cldevice_init(int rtlmode) {
         _device = (cl_device_id *) calloc(_ndevices, sizeof(cl_device_id));
         _context = (cl_context *) calloc(_ndevices, sizeof(cl_context));
         _cmd_queue = (cl_command_queue *) calloc(_ndevices, sizeof(cl_command_queue));
+        _xfer_queue = (cl_command_queue *) calloc(_ndevices, sizeof(cl_command_queue));
+        _max_work_items = (int *) calloc(3 * _ndevices, sizeof(int));
+        _dev_work_group = (int *) calloc(9 * _ndevices, sizeof(int));
         _gpu_present = 0;
 
         if (_status == CL_SUCCESS) {
@@ -564,8 +1123,9 @@ void _cldevice_init(int rtlmode) {
 
             if (_device[i] != NULL) {
                 cl_command_queue_properties properties;
+                _cl_query_work_items(i);
                 // enabling profile if set (i.e. rtlmode == profile or all)
-                properties = _profile ? CL_QUEUE_PROFILING_ENABLE : 0;
+                properties = (_profile || _tune) ? CL_QUEUE_PROFILING_ENABLE : 0;
 
                 //Create one OpenCL context for each device in the platform
                 _context[i] = clCreateContext(NULL, 1, &_device[i], NULL, NULL, &_status);
@@ -580,30 +1140,65 @@ void _cldevice_init(int rtlmode) {
                     fprintf(stderr, "<rtl> Failed to create commandQueue for device %u.\n", i);
                     _clErrorCode(_status);
                 }
+
+                //In async mode, host <-> device copies use a second queue
+                if (_async) {
+                    _xfer_queue[i] = clCreateCommandQueue(_context[i], _device[i], properties, &_status);
+                    if (_status != CL_SUCCESS) {
+                        fprintf(stderr, "<rtl> Failed to create transfer queue for device %u.\n", i);
+                        _clErrorCode(_status);
+                        _xfer_queue[i] = _cmd_queue[i];
+                    }
+                }
             }
         }
 
     }
 
+    if (_pool && _pool_list == NULL) _cl_pool_init();
+
+    if (_pinned && _stage_mem == NULL) {
+        _stage_mem = (cl_mem *) calloc(2 * _ndevices, sizeof(cl_mem));
+        _stage_ptr = (void **) calloc(2 * _ndevices, sizeof(void *));
+        _stage_lock = (pthread_mutex_t *) malloc(_ndevices * sizeof(pthread_mutex_t));
+        for (i = 0; i < _ndevices; i++) pthread_mutex_init(&_stage_lock[i], NULL);
+    }
+
     // Allocate room to handle program and kernel objects
     _nkernels = 16;
-    _program = (cl_program *) calloc(_nkernels, sizeof(cl_program));
-    _kernel = (cl_kernel *) calloc(_nkernels, sizeof(cl_kernel));
+    _program_all = (cl_program *) calloc(_nkernels * _ndevices, sizeof(cl_program));
+    _prog_state = (int *) calloc(_nkernels * _ndevices, sizeof(int));
     _strprog = (char **) calloc(_nkernels, sizeof(char *));
     _sentinel = 0;  // points to first free slot to handle kernel/program objects
-    _kerid = -1; // points to invalid id of kernel/program
+    if (_split) _cl_split_resize(0, _nkernels);
 
-    // Allocate room to handle buffer memory locations
-    _upperid = 16;
-    _locs = (cl_mem *) calloc(_upperid, sizeof(cl_mem));
-    _curid = -1;    // points to invalid location
+    // Allocate the program and kernel registries
+    _prog_cap = 64;
+    _prog_slot = (cl_uint *) calloc(_prog_cap, sizeof(cl_uint));
+    _kh_cap = 64;
+    _kh_slot = (cl_uint *) calloc(_kh_cap, sizeof(cl_uint));
+    _nhandles = 0;
+    _maxhandles = 0;
 
     // initialize default device to 0 (CPU) unless CPU is not present
     if (_cpu_present) {
-        _clid = 0;
+        _default_clid = 0;
     } else {
-        _clid = 1; // At least, one accelerator is present & was mapped to device 1
+        _default_clid = 1; // At least, one accelerator is present & was mapped to device 1
     }
+
+    // Allocate room to handle buffer memory locations of the main thread
+    _cl_thread_init();
+
+    // CLDEVICE_EMBEDDED=0 loads the kernel files even if the executable
+    // embeds their images
+    _embedded = _cl_getenv_int("CLDEVICE_EMBEDDED", 1);
+    if (_verbose && _nimg > 0) printf("<rtl> %d embedded kernel images%s\n", _nimg,
+                                      (_embedded) ? "" : " (ignored)");
+
+    // CLDEVICE_PREBUILD=n builds the registered programs on n threads
+    _prebuild = _cl_getenv_int("CLDEVICE_PREBUILD", 0);
+    _cl_prebuild_start();
 }
 
 ///
@@ -617,14 +1212,66 @@ void _cldevice_finish() {
     for (i = 0; i < _ndevices; i++) {
         _status = clFlush(_cmd_queue[i]);
         _status = clFinish(_cmd_queue[i]);
+        if (_async && _xfer_queue[i] != _cmd_queue[i]) {
+            _status = clFinish(_xfer_queue[i]);
+            _status = clReleaseCommandQueue(_xfer_queue[i]);
+        }
     }
 
+    // Collect the profiling callbacks, which still need the kernel names
+    if (_profile) _cl_trace_finish();
+    _cl_prebuild_finish();
+
     // Release OpenCL allocated objects
+    // _kernel only points into the kernel registry, whose objects are owned
+    // by the thread tables; _program is a view of _program_all
+    int t;
+    for (t = 0; t < _nthreads; t++) {
+        _cl_thread_state *ts = &_threads[t];
+        for (i = 0; i < ts->maxhandles * _ndevices; i++) {
+            if (ts->kh_kernel[i] != NULL) _status = clReleaseKernel(ts->kh_kernel[i]);
+            free(ts->kh_args[i].len);
+            free(ts->kh_args[i].val);
+        }
+        free(ts->kh_kernel);
+        free(ts->kh_args);
+        free(ts->program);
+        free(ts->kernel);
+        free(ts->locs);
+        free(ts->locs_event);
+        free(ts->locs_host);
+        free(ts->locs_stream);
+        free(ts->argbufs);
+    }
+    free(_threads);
+    _threads = NULL;
+    _nthreads = _maxthreads = 0;
+    _rtl_generation++;
+    _cl_thread_reset();
+
+    for (i = 0; i < _nhandles; i++) {
+        free(_kh_name[i]);
+    }
+    for (i = 0; i < _sentinel * _ndevices; i++) {
+        if (_program_all[i] != NULL) _status = clReleaseProgram(_program_all[i]);
+    }
     for (i = 0; i < _sentinel; i++) {
-        _status = clReleaseKernel(_kernel[i]);
-        _status = clReleaseProgram(_program[i]);
+        free(_strprog[i]);
     }
 
+    if (_split) {
+        for (i = 0; i < _sentinel * _ndevices; i++) {
+            if (_split_kernel[i] != NULL) clReleaseKernel(_split_kernel[i]);
+            if (_split_program[i] != NULL) clReleaseProgram(_split_program[i]);
+        }
+        free(_split_kernel);
+        free(_split_program);
+        free(_split_rate);
+    }
+
+    if ((_verbose || _profile) && _pool) _cl_pool_stats();
+    if (_pool) _cl_pool_finish();
+
     for (i = 0; i < _ndevices; i++) {
         _status = clReleaseCommandQueue(_cmd_queue[i]);
         _status = clReleaseContext(_context[i]);
@@ -633,11 +1280,60 @@ void _cldevice_finish() {
     if(_profile) _cl_prints();
 
     free(_cmd_queue);
+    if (_stage_mem != NULL) {
+        for (i = 0; i < 2 * _ndevices; i++)
+            if (_stage_mem[i] != NULL) clReleaseMemObject(_stage_mem[i]);
+        for (i = 0; i < _ndevices; i++) pthread_mutex_destroy(&_stage_lock[i]);
+        free(_stage_mem);
+        free(_stage_ptr);
+        free(_stage_lock);
+        _stage_mem = NULL;
+        _stage_lock = NULL;
+    }
+
+    free(_xfer_queue);
+    free(_pt_begin);
+    free(_pt_end);
+    free(_pt_mem);
+    free(_pt_dev);
+    free(_pt_ref);
     free(_context);
     free(_device);
-    free(_program);
-    free(_kernel);
+    free(_max_work_items);
+    _max_work_items = NULL;
+    free(_dev_work_group);
+    _dev_work_group = NULL;
+    free(_program_all);
+    free(_prog_state);
+    _prog_state = NULL;
     free(_strprog);
+    free(_prog_slot);
+    free(_kh_slot);
+    free(_kh_prog);
+    free(_kh_name);
+    free(_kh_local);
+    free(_kh_ldim);
+    free(_kh_trial);
+    free(_kh_best);
+    free(_tdb_key);
+    free(_tdb_local);
+    free(_cal);
+    _cal = NULL;
+    free(_vec_width);
+    _vec_width = NULL;
+    _kh_trial = NULL;
+    _kh_best = NULL;
+    _tdb_key = NULL;
+    _tdb_local = NULL;
+    _ntdb = _maxtdb = 0;
+    _tune_entry = -1;
+    _kh_prog = NULL;
+    _kh_name = NULL;
+    _kh_local = NULL;
+    _kh_ldim = NULL;
+    _kh_current = -1;
+    free(_cache_dir);
+    _cache_dir = NULL;
 }
 
 ///
@@ -688,11 +1384,13 @@ cl_program _create_fromSource(cl_context context,
 }
 
 ///
-///  Attempt to create the program object from a cached binary.
+///  Attempt to create the program object from a binary, building it
+///  with the given options.
 ///
-cl_program _create_fromBinary(cl_context context,
-                              cl_device_id device,
-                              const char *fileName) {
+cl_program _create_fromBinaryWithOptions(cl_context context,
+                                         cl_device_id device,
+                                         const char *fileName,
+                                         const char *flags) {
 
     FILE *fp = fopen(fileName, "rb");
     if (fp == NULL) {
@@ -733,10 +1431,6 @@ cl_program _create_fromBinary(cl_context context,
         return NULL;
     }
 
-    const char *flags = NULL;
-    if (_spir_support) {
-        flags = "-x spir";
-    }
     errNum = clBuildProgram(program, 1, &device, flags, NULL, NULL);
 
     if (errNum != CL_SUCCESS) {
@@ -757,6 +1451,19 @@ cl_program _create_fromBinary(cl_context context,
     return program;
 }
 
+///
+///  Attempt to create the program object from a binary (spir or aocx).
+///
+cl_program _create_fromBinary(cl_context context,
+                              cl_device_id device,
+                              const char *fileName) {
+    const char *flags = NULL;
+    if (_spir_support) {
+        flags = "-x spir";
+    }
+    return _create_fromBinaryWithOptions(context, device, fileName, flags);
+}
+
 ///
 ///  Retrieve program binary for all of the devices attached to
 ///  the program and store the one for the device passed in
@@ -826,6 +1533,10 @@ int _save_toBinary(cl_program program,
         // Store the binary just for the device requested.
         if (devices[i] == device) {
             FILE *fp = fopen(fileName, "wb");
+            if (fp == NULL) {
+                errNum = CL_INVALID_VALUE;
+                break;
+            }
             fwrite(programBinaries[i], 1, programBinarySizes[i], fp);
             fclose(fp);
             break;
@@ -839,7 +1550,208 @@ int _save_toBinary(cl_program program,
         free(programBinaries[i]);
     }
     free(programBinaries);
-    return 1;
+    return errNum == CL_SUCCESS;
+}
+
+///
+/// Auxiliary Function. Chain size bytes of data into the 64-bit FNV-1a hash h.
+///
+uint64_t _cl_hash(uint64_t h, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *) data;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+///
+/// Auxiliary Function. Set _cache_dir to $XDG_CACHE_HOME/mptogpu (or
+/// $HOME/.cache/mptogpu), creating it if needed. CLDEVICE_CACHE=0 or an
+/// unusable directory leaves the program cache disabled.
+///
+void _cl_cache_init() {
+    const char *base = getenv("XDG_CACHE_HOME");
+    char path[1024];
+
+    _cache_dir = NULL;
+    if (!_cl_getenv_int("CLDEVICE_CACHE", 1)) return;
+
+    if (base != NULL && *base != '\0') {
+        snprintf(path, sizeof(path), "%s", base);
+    } else {
+        base = getenv("HOME");
+        if (base == NULL || *base == '\0') return;
+        snprintf(path, sizeof(path), "%s/.cache", base);
+    }
+    mkdir(path, 0755);
+    strncat(path, "/mptogpu", sizeof(path) - strlen(path) - 1);
+    mkdir(path, 0755);
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        if (_verbose) printf("<rtl> Program cache disabled: can not use %s.\n", path);
+        return;
+    }
+    _cache_dir = strdup(path);
+    if (_verbose) printf("<rtl> Program cache at %s.\n", _cache_dir);
+}
+
+///
+/// Auxiliary Function. Create and build the program object for size bytes of
+/// image, holding OpenCL source, spir, aocx or SPIR-V code (kind is one of
+/// _CL_IMAGE_*). name is only used in messages.
+///
+cl_program _create_fromMemory(cl_context context,
+                              cl_device_id device,
+                              const char *name,
+                              const unsigned char *image,
+                              size_t size,
+                              int kind) {
+    cl_int errNum = CL_SUCCESS;
+    cl_int binaryStatus = CL_SUCCESS;
+    cl_program program = NULL;
+    const char *flags = NULL;
+
+    switch (kind) {
+    case _CL_IMAGE_SOURCE:
+        program = clCreateProgramWithSource(context, 1, (const char **) &image, &size, &errNum);
+        break;
+    case _CL_IMAGE_SPIR:
+        if (_spir_support) flags = "-x spir";
+        /* fall through */
+    case _CL_IMAGE_AOCX:
+        program = clCreateProgramWithBinary(context, 1, &device, &size, &image,
+                                            &binaryStatus, &errNum);
+        break;
+    case _CL_IMAGE_SPIRV:
+#ifdef CL_VERSION_2_1
+        program = clCreateProgramWithIL(context, image, size, &errNum);
+#else
+        errNum = CL_INVALID_VALUE;
+#endif
+        break;
+    }
+
+    if (program == NULL || errNum != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+        fprintf(stderr, "<rtl> Error loading %s.\n", name);
+        if (program != NULL) clReleaseProgram(program);
+        return NULL;
+    }
+
+    errNum = clBuildProgram(program, 1, &device, flags, NULL, NULL);
+    if (errNum != CL_SUCCESS) {
+        // Determine the reason for the error
+        char buildLog[16384];
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG,
+                              sizeof(buildLog), buildLog, NULL);
+
+        fprintf(stderr, "<rtl> Error building %s : %s\n", name, buildLog);
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+///
+/// Create the program object for size bytes of image (kind is one of
+/// _CL_IMAGE_*) going through the program cache. Entries are keyed by the
+/// content of the image, the device name, the driver version and the build
+/// options, and are written to a temporary file then renamed, so concurrent
+/// processes never see a partial entry. A missing or broken entry is a miss.
+/// aocx images are device binaries already and are not cached.
+///
+cl_program _create_fromImage(cl_context context,
+                             cl_device_id device,
+                             const char *name,
+                             const unsigned char *image,
+                             size_t size,
+                             int kind) {
+    const char *flags = (kind == _CL_IMAGE_SPIR && _spir_support) ? "-x spir" : "";
+    char entry[1024];
+    char info[1024];
+    cl_program program;
+
+    if (_cache_dir == NULL || kind == _CL_IMAGE_AOCX) {
+        return _create_fromMemory(context, device, name, image, size, kind);
+    }
+
+    uint64_t key = _cl_hash(14695981039346656037ULL, image, size);
+    memset(info, '\0', sizeof(info));
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(info) - 1, info, NULL);
+    key = _cl_hash(key, info, strlen(info) + 1);
+    memset(info, '\0', sizeof(info));
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(info) - 1, info, NULL);
+    key = _cl_hash(key, info, strlen(info) + 1);
+    key = _cl_hash(key, flags, strlen(flags) + 1);
+
+    const char *base = strrchr(name, '/');
+    base = (base == NULL) ? name : base + 1;
+    snprintf(entry, sizeof(entry), "%s/%s-%016llx.bin", _cache_dir, base, (unsigned long long) key);
+
+    if (_does_file_exist(entry)) {
+        program = _create_fromBinaryWithOptions(context, device, entry, NULL);
+        if (program != NULL) {
+            if (_verbose) printf("<rtl> Program cache hit: %s.\n", entry);
+            return program;
+        }
+        remove(entry);
+    }
+
+    program = _create_fromMemory(context, device, name, image, size, kind);
+    if (program == NULL) return NULL;
+
+    // mkstemp reserves a name no other thread or process is writing to;
+    // the entry only appears once the rename publishes it whole
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", entry);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        fprintf(stderr, "<rtl> Failed to store %s in the program cache.\n", name);
+        return program;
+    }
+    close(fd);
+    if (_save_toBinary(program, device, tmp) && rename(tmp, entry) == 0) {
+        if (_verbose) printf("<rtl> Program cache store: %s.\n", entry);
+    } else {
+        fprintf(stderr, "<rtl> Failed to store %s in the program cache.\n", name);
+        remove(tmp);
+    }
+    return program;
+}
+
+///
+/// Create the program object for fileName (OpenCL source if is_source, spir
+/// otherwise) going through the program cache.
+///
+cl_program _create_fromCache(cl_context context,
+                             cl_device_id device,
+                             const char *fileName,
+                             int is_source) {
+    cl_program program;
+
+    if (_cache_dir == NULL) {
+        return (is_source) ? _create_fromSource(context, device, fileName)
+                           : _create_fromBinary(context, device, fileName);
+    }
+
+    FILE *file = fopen(fileName, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "<rtl> Failed to open file for reading: %s\n", fileName);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t fsize = ftell(file);
+    rewind(file);
+    unsigned char *buffer = (unsigned char *) calloc(fsize + 1, sizeof(char));
+    fread(buffer, sizeof(char), fsize, file);
+    fclose(file);
+
+    program = _create_fromImage(context, device, fileName, buffer, fsize,
+                                (is_source) ? _CL_IMAGE_SOURCE : _CL_IMAGE_SPIR);
+    free(buffer);
+    return program;
 }
 
 ///
@@ -865,15 +1777,68 @@ cl_uint _get_default_device() {
     return _clid;
 }
 
+///
+/// Auxiliary Function. Fill the entries of device d in _max_work_items, or
+/// keep the defaults (128, 1, 1) if the device does not report them, then
+/// fit its copy of the _work_group map (in _dev_work_group) to them.
+///
+void _cl_query_work_items(cl_uint d) {
+    size_t sizes[3] = {128, 1, 1};
+    size_t param_size = 0;
+    int i;
+
+    if (clGetDeviceInfo(_device[d], CL_DEVICE_MAX_WORK_ITEM_SIZES, 0, NULL, &param_size) == CL_SUCCESS &&
+        param_size > 0) {
+        size_t *ret = (size_t *) alloca(param_size);
+        if (clGetDeviceInfo(_device[d], CL_DEVICE_MAX_WORK_ITEM_SIZES, param_size, ret, NULL) == CL_SUCCESS) {
+            for (i = 0; i < 3 && i < (int) (param_size / sizeof(size_t)); i++) sizes[i] = ret[i];
+        }
+    } else {
+        fprintf(stderr, "<rtl> Warning: Unable to obtain MAX_WORK_ITEM_SIZES for device %u.\n", d);
+    }
+    for (i = 0; i < 3; i++) _max_work_items[3 * d + i] = (int) sizes[i];
+
+    // checking the default work_group map.
+    //     cpu     {0:128, 1:1, 2:1}
+    //     gpu 1-d {3:512, 4:1, 5:1}
+    //     gpu 2-d {6:32, 7:16, 8:1};
+    int *wg = &_dev_work_group[9 * d];
+    memcpy(wg, _work_group, sizeof(_work_group));
+    int j = 0;
+    if (d == 1) j = 3;  // >=1 ??
+
+    // assert y-dimmension according selected device
+    if ((int) sizes[1] < wg[j + 1]) {
+        wg[j + 1] = (int) sizes[1];
+    }
+
+    // assert x-dimmension * y-dimmension for selected device
+    if ((int) sizes[0] < wg[j] * wg[j + 1]) {
+        wg[j + 1] /= 2;
+    }
+    if ((int) sizes[0] < wg[j] * wg[j + 1]) {
+        wg[j] /= 2;
+    }
+    if ((int) sizes[0] > 2 * wg[j] * wg[j + 1]) {
+        if ((int) sizes[1] > 2 * wg[j + 1])
+            wg[j + 1] *= 2;
+    }
+    if ((int) sizes[0] > 2 * wg[j] * wg[j + 1] &&
+        d != 0) {
+        wg[j] *= 2;
+    }
+    if ((int) sizes[0] > 2 * wg[j] * wg[j + 1]) {
+        if ((int) sizes[1] > 2 * wg[j + 1])
+            wg[j + 1] *= 2;
+    }
+}
+
 ///
 /// Set the device id
 ///
 void _set_default_device(cl_uint id) {
 
-    cl_int status = 0;
-    size_t param_size = 0;
-    cl_uint maxWIDimensions;
-
+    _cl_thread_init();
     if ((id == 0) && (!_cpu_present)) {
         _clid = 1;
         fprintf(stderr, "<rtl> Warning: CPU is not set, run on device 1 instead.\n");
@@ -895,72 +1860,623 @@ void _set_default_device(cl_uint id) {
         fprintf(stderr, "<rtl> Warning: Device id is invalid, run on device %u instead.\n", _clid);
     } else
         _clid = id;
+    pthread_mutex_lock(&_rtl_lock);
+    _default_clid = _clid;
+    pthread_mutex_unlock(&_rtl_lock);
+    // The work-group map of every device was fitted at _cldevice_init: the
+    // shared tables are not changed here (see _cl_query_work_items)
+}
 
-    // Get the maximum number of work-items in each dimension for all devices
-    status = clGetDeviceInfo(_device[_clid], CL_DEVICE_MAX_WORK_ITEM_SIZES, 0, NULL, &param_size);
-    if (status != CL_SUCCESS) {
-        fprintf(stderr, "<rtl> Warning: Unable to obtain MAX_WORK_ITEM_SIZES for device %u.\n", _clid);
+///
+/// Auxiliary Function. Return the bytes of the buffers of class c:
+/// 2^(c / POOL_STEPS) times 1, 1.25, 1.5 or 1.75.
+///
+size_t _cl_pool_size(int c) {
+    return ((size_t) (POOL_STEPS + c % POOL_STEPS) << (c / POOL_STEPS)) / POOL_STEPS;
+}
+
+///
+/// Auxiliary Function. Return the size class of a buffer of size bytes: the
+/// smallest class (at least POOL_MIN_CLASS) that holds it.
+///
+int _cl_pool_class(size_t size) {
+    int c = POOL_MIN_CLASS;
+    while (c < POOL_CLASSES - 1 && _cl_pool_size(c) < size) c++;
+    return c;
+}
+
+///
+/// Auxiliary Function. Release free buffers of device d, largest classes
+/// first, until the pool holds at most limit bytes.
+///
+void _cl_pool_trim(cl_uint d, uint64_t limit) {
+    int c, k;
+    for (c = POOL_CLASSES - 1; c >= 0 && _pool_held[d] > limit; c--) {
+        for (k = 0; k < 2; k++) {
+            int slot = (d * 2 + k) * POOL_CLASSES + c;
+            while (_pool_count[slot] > 0 && _pool_held[d] > limit) {
+                clReleaseMemObject(_pool_list[slot][--_pool_count[slot]]);
+                _pool_held[d] -= _cl_pool_size(c);
+            }
+        }
+    }
+}
+
+///
+/// Allocate a buffer on the selected device. With the pool enabled the size
+/// is rounded up to its class and a free buffer of that class is reused if
+/// there is one. A rounded size the device cannot allocate gets a buffer of
+/// the exact size, which is released rather than pooled when freed.
+///
+cl_mem _cl_pool_alloc(cl_mem_flags flags, size_t size, cl_int *status) {
+    cl_mem mem;
+
+    if (!_pool) return clCreateBuffer(_context[_clid], flags, size, NULL, status);
+
+    int c = _cl_pool_class(size);
+    size_t bytes = _cl_pool_size(c);
+    if (bytes > _pool_maxalloc[_clid]) return clCreateBuffer(_context[_clid], flags, size, NULL, status);
+
+    int slot = (_clid * 2 + (flags == CL_MEM_READ_ONLY)) * POOL_CLASSES + c;
+    pthread_mutex_lock(&_rtl_lock);
+    if (_pool_count[slot] > 0) {
+        _pool_hits++;
+        _pool_held[_clid] -= bytes;
+        *status = CL_SUCCESS;
+        mem = _pool_list[slot][--_pool_count[slot]];
+        pthread_mutex_unlock(&_rtl_lock);
+        return mem;
+    }
+    _pool_misses++;
+    pthread_mutex_unlock(&_rtl_lock);
+
+    mem = clCreateBuffer(_context[_clid], flags, bytes, NULL, status);
+    if (*status == CL_MEM_OBJECT_ALLOCATION_FAILURE || *status == CL_OUT_OF_RESOURCES) {
+        // Give the memory held by the pool back to the device and retry
+        pthread_mutex_lock(&_rtl_lock);
+        _cl_pool_trim(_clid, 0);
+        pthread_mutex_unlock(&_rtl_lock);
+        mem = clCreateBuffer(_context[_clid], flags, bytes, NULL, status);
+    }
+    if (*status != CL_SUCCESS) mem = clCreateBuffer(_context[_clid], flags, size, NULL, status);
+    return mem;
+}
+
+///
+/// Give a buffer back to the pool of its device, or release it if the pool
+/// is disabled. Above the high-water mark the pool is trimmed to half of it.
+///
+void _cl_pool_free(cl_mem mem) {
+    cl_context context;
+    cl_mem_flags flags;
+    size_t size;
+    cl_uint d;
+
+    if (!_pool) {
+        clReleaseMemObject(mem);
         return;
     }
 
-    size_t *ret = (size_t *) alloca(sizeof(size_t) * param_size);
-    status = clGetDeviceInfo(_device[_clid], CL_DEVICE_MAX_WORK_ITEM_SIZES, param_size, ret, NULL);
-    status = clGetDeviceInfo(_device[_clid], CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(cl_uint), &maxWIDimensions,
-                             NULL);
-    if (status != CL_SUCCESS) {
-        fprintf(stderr, "<rtl> Warning: Unable to obtain MAX_WORK_ITEM_DIMENSIONS for device %u.\n", _clid);
+    clGetMemObjectInfo(mem, CL_MEM_CONTEXT, sizeof(cl_context), &context, NULL);
+    clGetMemObjectInfo(mem, CL_MEM_FLAGS, sizeof(cl_mem_flags), &flags, NULL);
+    clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+    for (d = 0; d < _ndevices && _context[d] != context; d++);
+
+    int c = _cl_pool_class(size);
+    if (d == _ndevices || _cl_pool_size(c) != size || (flags & CL_MEM_USE_HOST_PTR)) {
+        clReleaseMemObject(mem);
         return;
     }
 
-    int i;
-    // Update the _max_work_items for the current device
-    for (i = 0; i < maxWIDimensions; ++i) {
-        _max_work_items[i] = ret[i];
+    int slot = (d * 2 + (flags == CL_MEM_READ_ONLY)) * POOL_CLASSES + c;
+    pthread_mutex_lock(&_rtl_lock);
+    if (_pool_count[slot] == _pool_cap[slot]) {
+        _pool_cap[slot] = (_pool_cap[slot] == 0) ? 4 : 2 * _pool_cap[slot];
+        _pool_list[slot] = (cl_mem *) realloc(_pool_list[slot], _pool_cap[slot] * sizeof(cl_mem));
     }
+    _pool_list[slot][_pool_count[slot]++] = mem;
+    _pool_held[d] += size;
 
-    // checking the default work_group map.
-    //     cpu     {0:128, 1:1, 2:1}
-    //     gpu 1-d {3:512, 4:1, 5:1}
-    //     gpu 2-d {6:32, 7:16, 8:1};
-    i = 0;
-    int j = 0;
-    if (_clid == 1) j = 3;  // >=1 ??
+    if (_pool_held[d] > _pool_limit[d]) _cl_pool_trim(d, _pool_limit[d] / 2);
+    pthread_mutex_unlock(&_rtl_lock);
+}
 
-    // assert y-dimmension according selected device
-    if ((int) ret[i + 1] < _work_group[j + 1]) {
-        _work_group[j + 1] = (int) ret[i + 1];
+///
+/// Auxiliary Function. Allocate the pool tables. The high-water mark is
+/// CLDEVICE_POOL_MB megabytes, or a quarter of the device global memory.
+///
+void _cl_pool_init() {
+    cl_uint d;
+    cl_ulong gmem, maxalloc;
+    int mb = _cl_getenv_int("CLDEVICE_POOL_MB", 0);
+
+    _pool_list = (cl_mem **) calloc(_ndevices * 2 * POOL_CLASSES, sizeof(cl_mem *));
+    _pool_count = (int *) calloc(_ndevices * 2 * POOL_CLASSES, sizeof(int));
+    _pool_cap = (int *) calloc(_ndevices * 2 * POOL_CLASSES, sizeof(int));
+    _pool_held = (uint64_t *) calloc(_ndevices, sizeof(uint64_t));
+    _pool_limit = (uint64_t *) calloc(_ndevices, sizeof(uint64_t));
+    _pool_maxalloc = (uint64_t *) calloc(_ndevices, sizeof(uint64_t));
+    _pool_hits = _pool_misses = 0;
+
+    for (d = 0; d < _ndevices; d++) {
+        if (_device[d] != NULL &&
+            clGetDeviceInfo(_device[d], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxalloc, NULL) == CL_SUCCESS)
+            _pool_maxalloc[d] = maxalloc;
+        else
+            _pool_maxalloc[d] = (uint64_t) 128 << 20;
+        if (mb > 0) {
+            _pool_limit[d] = (uint64_t) mb << 20;
+        } else if (_device[d] != NULL &&
+                   clGetDeviceInfo(_device[d], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &gmem, NULL) == CL_SUCCESS) {
+            _pool_limit[d] = gmem / 4;
+        } else {
+            _pool_limit[d] = (uint64_t) 256 << 20;
+        }
     }
+}
 
-    // assert x-dimmension * y-dimmension for selected device
-    if ((int) ret[i] < _work_group[j] * _work_group[j + 1]) {
-        _work_group[j + 1] /= 2;
+///
+/// Auxiliary Function. Release every buffer held by the pool and its tables.
+///
+void _cl_pool_finish() {
+    cl_uint d;
+    int i;
+
+    for (d = 0; d < _ndevices; d++) _cl_pool_trim(d, 0);
+    for (i = 0; i < (int) _ndevices * 2 * POOL_CLASSES; i++) free(_pool_list[i]);
+    free(_pool_list);
+    free(_pool_count);
+    free(_pool_cap);
+    free(_pool_held);
+    free(_pool_limit);
+    free(_pool_maxalloc);
+    _pool_list = NULL;
+    _pool_maxalloc = NULL;
+}
+
+///
+/// Print the pool counters: hit rate and bytes held on each device.
+///
+void _cl_pool_stats() {
+    cl_uint d;
+    uint64_t total = _pool_hits + _pool_misses;
+    printf("[POOL] - %llu allocations, %llu hits (%.1f%%)\n", total, _pool_hits,
+           (total) ? 100.0 * _pool_hits / total : 0.0);
+    for (d = 0; d < _ndevices; d++)
+        if (_pool_held[d] > 0) printf("[POOL] - device %u holds %llu bytes\n", d, _pool_held[d]);
+}
+
+///
+/// Auxiliary Function. Return the index of the present table entry whose
+/// host range starts at or before addr (the only one that may hold it), or
+/// -1 if there is none.
+///
+int _cl_present_find(uintptr_t addr) {
+    int lo = 0, hi = _npresent - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (_pt_begin[mid] <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+///
+/// Auxiliary Function. Return the present table entry that buffer id refers
+/// to, or -1 if the buffer is not tracked.
+///
+int _cl_present_entry(int id) {
+    if (_locs_host[id] == NULL) return -1;
+    return _cl_present_find((uintptr_t) _locs_host[id]);
+}
+
+///
+/// Auxiliary Function. If [loc, loc + size) is already present on the
+/// selected device, bind buffer _curid to it (the whole buffer or a
+/// sub-buffer), bump the reference count and return 1. Return 0 otherwise.
+///
+int _cl_present_map(uint64_t size, void *loc) {
+    uintptr_t begin = (uintptr_t) loc;
+
+    pthread_mutex_lock(&_rtl_lock);
+    int e = _cl_present_find(begin);
+    if (e < 0 || begin + size > _pt_end[e] || _pt_dev[e] != _clid) {
+        pthread_mutex_unlock(&_rtl_lock);
+        return 0;
+    }
+
+    size_t offset = begin - _pt_begin[e];
+    if (offset == 0 && begin + size == _pt_end[e]) {
+        _locs[_curid] = _pt_mem[e];
+    } else {
+        // A sub-buffer must start at an address aligned to the device base
+        cl_uint align = 0;
+        cl_buffer_region region;
+        clGetDeviceInfo(_device[_clid], CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align, NULL);
+        if (align != 0 && offset % (align / 8) == 0) {
+            region.origin = offset;
+            region.size = size;
+            _locs[_curid] = clCreateSubBuffer(_pt_mem[e], CL_MEM_READ_WRITE,
+                                              CL_BUFFER_CREATE_TYPE_REGION, &region, &_status);
+        }
+        if (align == 0 || offset % (align / 8) != 0 || _status != CL_SUCCESS) {
+            pthread_mutex_unlock(&_rtl_lock);
+            return 0;
+        }
+    }
+
+    // In async mode the new id must also wait for pending copies and kernels
+    // on the buffers that share this entry
+    if (_async) {
+        int j;
+        for (j = 0; j < _curid; j++)
+            if (_locs_event[j] != NULL && _cl_present_entry(j) == e)
+                _cl_set_buffer_event(_curid, _locs_event[j]);
+    }
+
+    _pt_ref[e]++;
+    _locs_host[_curid] = loc;
+    if (_verbose)
+        printf("<rtl> %llu bytes at %p are present, buffer %d reuses them (refcount %d)\n",
+               size, loc, _curid, _pt_ref[e]);
+    pthread_mutex_unlock(&_rtl_lock);
+    return 1;
+}
+
+///
+/// Auxiliary Function. Record buffer _curid as the device copy of
+/// [loc, loc + size). Ranges that overlap an entry partially are left out.
+///
+void _cl_present_insert(uint64_t size, void *loc) {
+    uintptr_t begin = (uintptr_t) loc;
+
+    pthread_mutex_lock(&_rtl_lock);
+    int e = _cl_present_find(begin);
+    if ((e >= 0 && _pt_end[e] > begin) ||
+        (e + 1 < _npresent && _pt_begin[e + 1] < begin + size)) {
+        pthread_mutex_unlock(&_rtl_lock);
+        return;
+    }
+
+    if (_npresent == _maxpresent) {
+        _maxpresent = (_maxpresent == 0) ? 16 : 2 * _maxpresent;
+        _pt_begin = (uintptr_t *) realloc(_pt_begin, _maxpresent * sizeof(uintptr_t));
+        _pt_end = (uintptr_t *) realloc(_pt_end, _maxpresent * sizeof(uintptr_t));
+        _pt_mem = (cl_mem *) realloc(_pt_mem, _maxpresent * sizeof(cl_mem));
+        _pt_dev = (cl_uint *) realloc(_pt_dev, _maxpresent * sizeof(cl_uint));
+        _pt_ref = (int *) realloc(_pt_ref, _maxpresent * sizeof(int));
+    }
+
+    int n = _npresent - (e + 1);
+    memmove(_pt_begin + e + 2, _pt_begin + e + 1, n * sizeof(uintptr_t));
+    memmove(_pt_end + e + 2, _pt_end + e + 1, n * sizeof(uintptr_t));
+    memmove(_pt_mem + e + 2, _pt_mem + e + 1, n * sizeof(cl_mem));
+    memmove(_pt_dev + e + 2, _pt_dev + e + 1, n * sizeof(cl_uint));
+    memmove(_pt_ref + e + 2, _pt_ref + e + 1, n * sizeof(int));
+    e++;
+    _pt_begin[e] = begin;
+    _pt_end[e] = begin + size;
+    _pt_mem[e] = _locs[_curid];
+    _pt_dev[e] = _clid;
+    _pt_ref[e] = 1;
+    _npresent++;
+    _locs_host[_curid] = loc;
+    pthread_mutex_unlock(&_rtl_lock);
+}
+
+///
+/// Auxiliary Function. Drop the reference of buffer id. The device memory
+/// goes back to the pool only when the last reference is released.
+///
+void _cl_present_release(int id) {
+    pthread_mutex_lock(&_rtl_lock);
+    int e = _cl_present_entry(id);
+
+    _locs_host[id] = NULL;
+    _cl_arg_drop(_locs[id]);
+    if (e < 0) {
+        pthread_mutex_unlock(&_rtl_lock);
+        _cl_pool_free(_locs[id]);
+        return;
     }
-    if ((int) ret[i] < _work_group[j] * _work_group[j + 1]) {
-        _work_group[j] /= 2;
+
+    if (_locs[id] != _pt_mem[e]) clReleaseMemObject(_locs[id]);
+    if (--_pt_ref[e] > 0) {
+        pthread_mutex_unlock(&_rtl_lock);
+        return;
+    }
+
+    _cl_pool_free(_pt_mem[e]);
+    int n = _npresent - (e + 1);
+    memmove(_pt_begin + e, _pt_begin + e + 1, n * sizeof(uintptr_t));
+    memmove(_pt_end + e, _pt_end + e + 1, n * sizeof(uintptr_t));
+    memmove(_pt_mem + e, _pt_mem + e + 1, n * sizeof(cl_mem));
+    memmove(_pt_dev + e, _pt_dev + e + 1, n * sizeof(cl_uint));
+    memmove(_pt_ref + e, _pt_ref + e + 1, n * sizeof(int));
+    _npresent--;
+    pthread_mutex_unlock(&_rtl_lock);
+}
+
+///
+/// Copy buffer id back to the host at the end of a map region. Nothing is
+/// copied while an enclosing region still maps the same host range; its own
+/// final release does the copy.
+///
+int _cl_read_mapped(uint64_t size, int id, void *loc) {
+    pthread_mutex_lock(&_rtl_lock);
+    int e = _cl_present_entry(id);
+    int shared = e >= 0 && _pt_ref[e] > 1;
+    pthread_mutex_unlock(&_rtl_lock);
+    if (shared) {
+        if (_verbose) printf("<rtl> Buffer %d is still mapped, skipping copy back\n", id);
+        return 1;
+    }
+    return _cl_read_buffer(size, id, loc);
+}
+
+///
+/// Auxiliary Function. Return true if large transfers to the selected device
+/// go through the pinned staging ring.
+///
+int _cl_staging(uint64_t size) {
+    cl_device_type type;
+    if (!_pinned || size <= _chunk) return 0;
+    clGetDeviceInfo(_device[_clid], CL_DEVICE_TYPE, sizeof(cl_device_type), &type, NULL);
+    if (type & CL_DEVICE_TYPE_CPU) return 0;
+
+    // Create the ring of the device on first use
+    pthread_mutex_lock(&_stage_lock[_clid]);
+    if (_stage_mem[_clid * 2 + 1] == NULL) {
+        int k;
+        for (k = 0; k < 2; k++) {
+            cl_mem mem = clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                        _chunk, NULL, &_status);
+            if (_status == CL_SUCCESS) {
+                _stage_ptr[_clid * 2 + k] = clEnqueueMapBuffer(_cmd_queue[_clid], mem, CL_TRUE,
+                                                               CL_MAP_READ | CL_MAP_WRITE, 0, _chunk,
+                                                               0, NULL, NULL, &_status);
+                if (_status != CL_SUCCESS) clReleaseMemObject(mem);
+            }
+            if (_status != CL_SUCCESS) {
+                if (k == 1) clReleaseMemObject(_stage_mem[_clid * 2]);
+                _stage_mem[_clid * 2] = NULL;
+                pthread_mutex_unlock(&_stage_lock[_clid]);
+                return 0;
+            }
+            _stage_mem[_clid * 2 + k] = mem;
+        }
+        if (_verbose) printf("<rtl> Staging ring of 2 x %lu bytes on device %u\n", _chunk, _clid);
+    }
+    pthread_mutex_unlock(&_stage_lock[_clid]);
+    return 1;
+}
+
+///
+/// Auxiliary Function. Copy size bytes from src to buffer dst in chunks,
+/// alternating between the two pinned staging buffers so that filling one
+/// overlaps the transfer of the other. If event is not NULL it receives the
+/// (already complete) event of the last chunk.
+///
+cl_int _cl_staged_write(cl_command_queue queue, cl_mem dst, uint64_t size,
+                        const void *src, cl_event *event) {
+    cl_event ev[2] = {NULL, NULL};
+    cl_int status = CL_SUCCESS;
+    uint64_t off;
+    int k = 0;
+
+    pthread_mutex_lock(&_stage_lock[_clid]);
+    for (off = 0; off < size && status == CL_SUCCESS; off += _chunk, k ^= 1) {
+        size_t len = min((uint64_t) _chunk, size - off);
+        if (ev[k] != NULL) {
+            clWaitForEvents(1, &ev[k]);
+            clReleaseEvent(ev[k]);
+            ev[k] = NULL;
+        }
+        memcpy(_stage_ptr[_clid * 2 + k], (const char *) src + off, len);
+        status = clEnqueueWriteBuffer(queue, dst, CL_FALSE, off, len,
+                                      _stage_ptr[_clid * 2 + k], 0, NULL, &ev[k]);
+        clFlush(queue);
+    }
+
+    // The last chunk went through slot ((size - 1) / _chunk) % 2
+    for (k = 0; k < 2; k++) {
+        if (ev[k] == NULL) continue;
+        clWaitForEvents(1, &ev[k]);
+        if (event != NULL && k == ((size - 1) / _chunk) % 2) *event = ev[k];
+        else clReleaseEvent(ev[k]);
+    }
+    pthread_mutex_unlock(&_stage_lock[_clid]);
+    return status;
+}
+
+///
+/// Auxiliary Function. Copy size bytes of buffer src to dst in chunks through
+/// the pinned staging buffers: the transfer of the next chunk overlaps the
+/// host copy of the current one. The first chunk waits on the given events.
+///
+cl_int _cl_staged_read(cl_command_queue queue, cl_mem src, uint64_t size, void *dst,
+                       cl_uint nwait, const cl_event *wait, cl_event *event) {
+    cl_event ev[2] = {NULL, NULL};
+    cl_int status;
+    uint64_t off;
+    int k = 0;
+
+    pthread_mutex_lock(&_stage_lock[_clid]);
+    status = clEnqueueReadBuffer(queue, src, CL_FALSE, 0, min((uint64_t) _chunk, size),
+                                 _stage_ptr[_clid * 2], nwait, wait, &ev[0]);
+    for (off = 0; off < size && status == CL_SUCCESS; off += _chunk, k ^= 1) {
+        size_t len = min((uint64_t) _chunk, size - off);
+        if (off + _chunk < size) {
+            status = clEnqueueReadBuffer(queue, src, CL_FALSE, off + _chunk,
+                                         min((uint64_t) _chunk, size - off - _chunk),
+                                         _stage_ptr[_clid * 2 + (k ^ 1)], 0, NULL, &ev[k ^ 1]);
+        }
+        clFlush(queue);
+        clWaitForEvents(1, &ev[k]);
+        memcpy((char *) dst + off, _stage_ptr[_clid * 2 + k], len);
+        if (event != NULL && off + _chunk >= size) *event = ev[k];
+        else clReleaseEvent(ev[k]);
+        ev[k] = NULL;
     }
-    if ((int) ret[i] > 2 * _work_group[j] * _work_group[j + 1]) {
-        if ((int) ret[i + 1] > 2 * _work_group[j + 1])
-            _work_group[j + 1] *= 2;
+    if (ev[k] != NULL) {
+        clWaitForEvents(1, &ev[k]);
+        clReleaseEvent(ev[k]);
+    }
+    pthread_mutex_unlock(&_stage_lock[_clid]);
+    return status;
+}
+
+///
+/// Auxiliary Function. Return true if device d shares its memory with the
+/// host (CL_DEVICE_HOST_UNIFIED_MEMORY).
+///
+int _cl_host_unified(cl_uint d) {
+    cl_bool unified = CL_FALSE;
+    if (_device[d] == NULL) return 0;
+    clGetDeviceInfo(_device[d], CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unified, NULL);
+    return unified == CL_TRUE;
+}
+
+///
+/// Auxiliary Function. Return true if the buffer for loc should wrap the host
+/// array itself (CL_MEM_USE_HOST_PTR) instead of copying it: in zero-copy
+/// mode on host-unified devices, and in pinned mode on CPU devices when loc
+/// meets the device base address alignment.
+///
+int _cl_wrap_host_ok(uint64_t size, void *loc) {
+    cl_device_type type;
+    cl_uint align = 0;
+
+    if (loc == NULL) return 0;
+    if (_zerocopy && _cl_host_unified(_clid)) return 1;
+    if (!_pinned) return 0;
+    clGetDeviceInfo(_device[_clid], CL_DEVICE_TYPE, sizeof(cl_device_type), &type, NULL);
+    if (!(type & CL_DEVICE_TYPE_CPU)) return 0;
+    clGetDeviceInfo(_device[_clid], CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align, NULL);
+    return align >= 8 && ((uintptr_t) loc) % (align / 8) == 0;
+}
+
+///
+/// Auxiliary Function. Create buffer _curid over the host array loc. Nothing
+/// is copied; map/unmap keeps host and device views coherent.
+///
+int _cl_offload_wrapped(uint64_t size, void *loc) {
+
+    if(_profile) t_start = _cl_rtclock();
+
+    _locs[_curid] = clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                                   size, loc, &_status);
+
+    if(_profile){
+      t_end = _cl_rtclock();
+      _buffer_time += t_end - t_start;
     }
-    if ((int) ret[i] > 2 * _work_group[j] * _work_group[j + 1] &&
-        _clid != 0) {
-        _work_group[j] *= 2;
+
+    if (_status != CL_SUCCESS) {
+        fprintf(stderr, "<rtl> Failed wrapping %llu host bytes into buffer %d.\n", size, _curid);
+        _clErrorCode(_status);
+        _curid--;
+        return 0;
     }
-    if ((int) ret[i] > 2 * _work_group[j] * _work_group[j + 1]) {
-        if ((int) ret[i + 1] > 2 * _work_group[j + 1])
-            _work_group[j + 1] *= 2;
+
+    if (_present) _cl_present_insert(size, loc);
+    if (_verbose) printf("<rtl> Wrapping %llu host bytes into buffer %d\n", size, _curid);
+    return 1;
+}
+
+///
+/// Auxiliary Function. Return true if buffer id wraps the host array loc.
+///
+int _cl_is_wrapped(int id, void *loc) {
+    cl_mem_flags flags = 0;
+    void *ptr = NULL;
+    clGetMemObjectInfo(_locs[id], CL_MEM_FLAGS, sizeof(cl_mem_flags), &flags, NULL);
+    if (!(flags & CL_MEM_USE_HOST_PTR)) return 0;
+    clGetMemObjectInfo(_locs[id], CL_MEM_HOST_PTR, sizeof(void *), &ptr, NULL);
+    return ptr == loc;
+}
+
+///
+/// Auxiliary Function. Make a wrapped buffer coherent with its host array:
+/// CL_MAP_READ publishes the device writes to the host, CL_MAP_WRITE the
+/// host writes to the device.
+///
+cl_int _cl_sync_wrapped(int id, uint64_t size, cl_map_flags flags,
+                        cl_uint nwait, const cl_event *wait, cl_event *event) {
+    cl_int status;
+    cl_event map_event;
+    void *ptr = clEnqueueMapBuffer(_cl_transfer_queue(), _locs[id], CL_TRUE, flags, 0, size,
+                                   nwait, wait, (_profile) ? &map_event : NULL, &status);
+    if (status != CL_SUCCESS) return status;
+    if (_profile) {
+        _cl_trace("_cl_sync_wrapped", map_event, TRACE_MAP, id, size);
+        clReleaseEvent(map_event);
     }
+    if (_verbose) printf("<rtl> Mapping wrapped buffer %d (%llu bytes)\n", id, size);
+    status = clEnqueueUnmapMemObject(_cl_transfer_queue(), _locs[id], ptr, 0, NULL, event);
+    if (status == CL_SUCCESS && event == NULL) status = clFinish(_cl_transfer_queue());
+    else if (status == CL_SUCCESS) status = clWaitForEvents(1, event);
+    return status;
+}
+
+///
+/// Auxiliary Function. Return true if a map of size bytes is streamed
+/// instead of copied: the ones larger than the allocation limit of the
+/// selected device (all of them with CLDEVICE_STREAM=2).
+///
+int _cl_stream_ok(uint64_t size) {
+    cl_ulong limit = 0;
+    if (_stream <= 0) return 0;
+    if (_stream > 1) return 1;
+    clGetDeviceInfo(_device[_clid], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &limit, NULL);
+    return limit > 0 && size > limit;
+}
+
+///
+/// Auxiliary Function. Make buffer _curid a streamed map of the host array
+/// loc (map is a mask of STREAM_TO and STREAM_FROM). Nothing is allocated
+/// or copied: the host array stays the only full copy.
+///
+int _cl_offload_streamed(uint64_t size, void *loc, int map) {
+    _locs[_curid] = NULL;
+    _locs_stream[_curid].host = loc;
+    _locs_stream[_curid].size = size;
+    _locs_stream[_curid].map = map;
+    if (_verbose) printf("<rtl> Streaming buffer %d of %llu bytes from the host\n", _curid, size);
+    return 1;
+}
 
+///
+/// Auxiliary Function. Return true if buffer id can be passed whole to a
+/// kernel, i.e., it is not streamed.
+///
+int _cl_resident(int id) {
+    if (_locs_stream[id].size == 0) return 1;
+    fprintf(stderr, "<rtl> Buffer %d (%llu bytes) does not fit on device %d and %s cannot stream it.\n",
+            id, _locs_stream[id].size, _clid, _cl_kernel_name());
+    return 0;
 }
 
 ///
 /// Auxiliary Function. Increments the current Id. Resize the room if necessary
 ///
 void _inc_curid() {
+    _cl_thread_init();
     _curid++;
     if (_curid == _upperid) {
         _upperid *= 2;
         _locs = (cl_mem *) realloc(_locs, _upperid * sizeof(cl_mem));
+        _locs_event = (cl_event *) realloc(_locs_event, _upperid * sizeof(cl_event));
+        memset(_locs_event + _curid, 0, (_upperid - _curid) * sizeof(cl_event));
+        _locs_host = (void **) realloc(_locs_host, _upperid * sizeof(void *));
+        memset(_locs_host + _curid, 0, (_upperid - _curid) * sizeof(void *));
+        _locs_stream = (_cl_stream_map *) realloc(_locs_stream, _upperid * sizeof(_cl_stream_map));
+        memset(_locs_stream + _curid, 0, (_upperid - _curid) * sizeof(_cl_stream_map));
+        _cl_thread_sync();
     }
 }
 
@@ -973,8 +2489,7 @@ int _cl_create_write_only(uint64_t size) {
 
     if(_profile) t_start = _cl_rtclock();
 
-    _locs[_curid] = clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE,
-                                   size, NULL, &_status);
+    _locs[_curid] = _cl_pool_alloc(CL_MEM_READ_WRITE, size, &_status);
     
     if(_profile){ 
       t_end = _cl_rtclock();
@@ -997,11 +2512,19 @@ int _cl_create_write_only(uint64_t size) {
 ///
 int _cl_offloading_write_only(uint64_t size, void *loc) {
     _inc_curid();
+
+    // Already on the device: reuse it without copying
+    if (_present && _cl_present_map(size, loc)) return 1;
+
+    // Too large for the device: the loops that use it stream it
+    if (_cl_stream_ok(size)) return _cl_offload_streamed(size, loc, STREAM_FROM);
+
+    // CPU devices work on the host array itself when it is aligned
+    if (_cl_wrap_host_ok(size, loc)) return _cl_offload_wrapped(size, loc);
     
     if(_profile) t_start = _cl_rtclock();
 
-    _locs[_curid] = clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE,
-                                   size, NULL, &_status);
+    _locs[_curid] = _cl_pool_alloc(CL_MEM_READ_WRITE, size, &_status);
 
     if(_profile){ 
       t_end = _cl_rtclock();
@@ -1014,6 +2537,7 @@ int _cl_offloading_write_only(uint64_t size, void *loc) {
         _curid--;
         return 0;
     }
+    if (_present) _cl_present_insert(size, loc);
     if (_verbose) printf("<rtl> Creating a write-only buffer %d of %llu bytes\n", _curid, size);
     return 1;
 }
@@ -1026,8 +2550,7 @@ int _cl_create_read_only(uint64_t size) {
     
     if(_profile) t_start = _cl_rtclock();
 
-    _locs[_curid] = clCreateBuffer(_context[_clid], CL_MEM_READ_ONLY,
-                                   size, NULL, &_status);
+    _locs[_curid] = _cl_pool_alloc(CL_MEM_READ_ONLY, size, &_status);
 
     if(_profile){ 
       t_end = _cl_rtclock();
@@ -1049,28 +2572,43 @@ int _cl_create_read_only(uint64_t size) {
 ///
 int _cl_offloading_read_only(uint64_t size, void *loc) {
     _inc_curid();
+
+    // Already on the device: reuse it without copying
+    if (_present && _cl_present_map(size, loc)) return 1;
+
+    // Too large for the device: the loops that use it stream it
+    if (_cl_stream_ok(size)) return _cl_offload_streamed(size, loc, STREAM_TO);
+
+    // CPU devices work on the host array itself when it is aligned
+    if (_cl_wrap_host_ok(size, loc)) return _cl_offload_wrapped(size, loc);
     
     if(_profile) t_start = _cl_rtclock();
 
-    _locs[_curid] = clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE,
-                                   size, NULL, &_status);
+    _locs[_curid] = _cl_pool_alloc(CL_MEM_READ_WRITE, size, &_status);
     
     if(_profile){ 
       t_end = _cl_rtclock();
       _buffer_time += t_end - t_start;
     }
 
-    _status = clEnqueueWriteBuffer
-            (
-                    _cmd_queue[_clid],
-                    _locs[_curid], CL_TRUE,
-                    0,
-                    size,
-                    loc,
-                    0,
-                    NULL,
-                    (_profile) ? &_global_event : NULL
-            );
+    // In async mode the copy does not block the host: the kernel that
+    // uses this buffer waits for its event instead
+    if (_cl_staging(size)) {
+        _status = _cl_staged_write(_cl_transfer_queue(), _locs[_curid], size, loc,
+                                   (_profile || _async) ? &_global_event : NULL);
+    } else {
+        _status = clEnqueueWriteBuffer
+                (
+                        _cl_transfer_queue(),
+                        _locs[_curid], (_async) ? CL_FALSE : CL_TRUE,
+                        0,
+                        size,
+                        loc,
+                        0,
+                        NULL,
+                        (_profile || _async) ? &_global_event : NULL
+                );
+    }
 
     if (_status != CL_SUCCESS) {
         fprintf(stderr, "<rtl> Failed writing %llu bytes into buffer %d.\n", size, _curid);
@@ -1079,10 +2617,19 @@ int _cl_offloading_read_only(uint64_t size, void *loc) {
         return 0;
     }
 
+    if (_async) {
+        clFlush(_cl_transfer_queue());
+        _cl_set_buffer_event(_curid, _global_event);
+    }
+
     if (_profile) {
-        _write_time += _cl_profile("_cl_offloading_read_only", _global_event);
+        _cl_trace("_cl_offloading_read_only", _global_event, TRACE_WRITE, _curid, size);
     }
 
+    if (_async) clReleaseEvent(_global_event);
+
+    if (_present) _cl_present_insert(size, loc);
+
     if (_verbose) {
         printf("<rtl> Offloading %llu bytes to buffer %d\n", size, _curid);
     }
@@ -1098,8 +2645,7 @@ int _cl_create_read_write(uint64_t size) {
 
     if(_profile) t_start = _cl_rtclock();
 
-    _locs[_curid] = clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE,
-                                   size, NULL, &_status);
+    _locs[_curid] = _cl_pool_alloc(CL_MEM_READ_WRITE, size, &_status);
     if(_profile){
       t_end = _cl_rtclock();
        _buffer_time += t_end - t_start;
@@ -1121,28 +2667,41 @@ int _cl_create_read_write(uint64_t size) {
 int _cl_offloading_read_write(uint64_t size, void *loc) {
     _inc_curid();
 
+    // Already on the device: reuse it without copying
+    if (_present && _cl_present_map(size, loc)) return 1;
+
+    // Too large for the device: the loops that use it stream it
+    if (_cl_stream_ok(size)) return _cl_offload_streamed(size, loc, STREAM_TO | STREAM_FROM);
+
+    // CPU devices work on the host array itself when it is aligned
+    if (_cl_wrap_host_ok(size, loc)) return _cl_offload_wrapped(size, loc);
+
     if(_profile) t_start = _cl_rtclock();
 
-    _locs[_curid] = clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE,
-                                   size, NULL, &_status);
+    _locs[_curid] = _cl_pool_alloc(CL_MEM_READ_WRITE, size, &_status);
     
     if(_profile){
       t_end = _cl_rtclock();
        _buffer_time += t_end - t_start;
     }
 
-    _status = clEnqueueWriteBuffer
-            (
-                    _cmd_queue[_clid],
-                    _locs[_curid],
-                    CL_TRUE,
-                    0,
-                    size,
-                    loc,
-                    0,
-                    NULL,
-                    (_profile) ? &_global_event : NULL
-            );
+    if (_cl_staging(size)) {
+        _status = _cl_staged_write(_cl_transfer_queue(), _locs[_curid], size, loc,
+                                   (_profile || _async) ? &_global_event : NULL);
+    } else {
+        _status = clEnqueueWriteBuffer
+                (
+                        _cl_transfer_queue(),
+                        _locs[_curid],
+                        (_async) ? CL_FALSE : CL_TRUE,
+                        0,
+                        size,
+                        loc,
+                        0,
+                        NULL,
+                        (_profile || _async) ? &_global_event : NULL
+                );
+    }
 
     if (_status != CL_SUCCESS) {
         fprintf(stderr, "<rtl> Failed writing %llu bytes into buffer %d.\n", size, _curid);
@@ -1151,10 +2710,19 @@ int _cl_offloading_read_write(uint64_t size, void *loc) {
         return 0;
     }
 
+    if (_async) {
+        clFlush(_cl_transfer_queue());
+        _cl_set_buffer_event(_curid, _global_event);
+    }
+
     if (_profile) {
-        _write_time += _cl_profile("_cl_offloading_read_write", _global_event);
+        _cl_trace("_cl_offloading_read_write", _global_event, TRACE_WRITE, _curid, size);
     }
 
+    if (_async) clReleaseEvent(_global_event);
+
+    if (_present) _cl_present_insert(size, loc);
+
     if (_verbose) {
         printf("<rtl> Creating read-write buffer %d of size: %llu\n", _curid, size);
     }
@@ -1167,221 +2735,1947 @@ int _cl_offloading_read_write(uint64_t size, void *loc) {
 ///
 int _cl_read_buffer(uint64_t size, int id, void *loc) {
 
-    _status = clEnqueueReadBuffer(_cmd_queue[_clid],
-                                  _locs[id],
-                                  CL_TRUE,
-                                  0,
-                                  size,
-                                  loc,
-                                  0,
-                                  NULL,
-                                  (_profile) ? &_global_event : NULL
-    );
+    // Streamed loops leave their results in the host array
+    if (_locs_stream[id].size) {
+        if (_verbose) printf("<rtl> Buffer %d is streamed, nothing to read\n", id);
+        return 1;
+    }
+
+    // Reads are the synchronization point: wait for the last command on
+    // the buffer, then block until the data reaches the host
+    int pending = _async && _locs_event[id] != NULL;
+    if (_cl_is_wrapped(id, loc)) {
+        _status = _cl_sync_wrapped(id, size, CL_MAP_READ, pending ? 1 : 0,
+                                   pending ? &_locs_event[id] : NULL,
+                                   (_profile) ? &_global_event : NULL);
+    } else if (_cl_staging(size)) {
+        _status = _cl_staged_read(_cl_transfer_queue(), _locs[id], size, loc,
+                                  pending ? 1 : 0, pending ? &_locs_event[id] : NULL,
+                                  (_profile) ? &_global_event : NULL);
+    } else {
+        _status = clEnqueueReadBuffer(_cl_transfer_queue(),
+                                      _locs[id],
+                                      CL_TRUE,
+                                      0,
+                                      size,
+                                      loc,
+                                      pending ? 1 : 0,
+                                      pending ? &_locs_event[id] : NULL,
+                                      (_profile) ? &_global_event : NULL
+        );
+    }
+    if (pending) _cl_set_buffer_event(id, NULL);
+
+    if (_status != CL_SUCCESS) {
+        fprintf(stderr, "<rtl> Failed reading %llu bytes from buffer %d.\n", size, id);
+        _clErrorCode(_status);
+        return 0;
+    }
+
+    if (_profile) {
+        _cl_trace("_cl_read_buffer", _global_event, TRACE_READ, id, size);
+    }
+
+    if (_verbose) {
+        printf("<rtl> Reading %llu bytes from buffer %d\n", size, id);
+    }
+
+    return 1;
+}
+
+///
+/// Write (sync) the host variable to cl_memory given by index
+///
+int _cl_write_buffer(uint64_t size, int id, void *loc) {
+
+    // Streamed loops read the host array itself
+    if (_locs_stream[id].size) {
+        if (_verbose) printf("<rtl> Buffer %d is streamed, nothing to write\n", id);
+        return 1;
+    }
+
+    int pending = _async && _locs_event[id] != NULL;
+    if (_cl_is_wrapped(id, loc)) {
+        _status = _cl_sync_wrapped(id, size, CL_MAP_WRITE, pending ? 1 : 0,
+                                   pending ? &_locs_event[id] : NULL,
+                                   (_profile) ? &_global_event : NULL);
+    } else if (_cl_staging(size)) {
+        if (pending) clWaitForEvents(1, &_locs_event[id]);
+        _status = _cl_staged_write(_cl_transfer_queue(), _locs[id], size, loc,
+                                   (_profile) ? &_global_event : NULL);
+    } else {
+        _status = clEnqueueWriteBuffer(_cl_transfer_queue(),
+                                       _locs[id],
+                                       CL_TRUE,
+                                       0,
+                                       size,
+                                       loc,
+                                       pending ? 1 : 0,
+                                       pending ? &_locs_event[id] : NULL,
+                                       (_profile) ? &_global_event : NULL);
+    }
+    if (pending) _cl_set_buffer_event(id, NULL);
+
+    if (_status != CL_SUCCESS) {
+        fprintf(stderr, "<rtl> Failed writing %llu bytes into buffer %d.\n", size, id);
+        _clErrorCode(_status);
+        return 0;
+    }
+
+    if (_profile) {
+        _cl_trace("_cl_write_buffer", _global_event, TRACE_WRITE, id, size);
+    }
+
+    if (_verbose) {
+        printf("<rtl> Writing %llu bytes into buffer %d\n", size, id);
+    }
+    return 1;
+}
+
+///
+/// Auxiliary Function.
+/// Return true if program object was created before.
+///
+int _program_created(const char *str) {
+
+    cl_uint mask = _prog_cap - 1;
+    cl_uint i = (cl_uint) _cl_hash(14695981039346656037ULL, str, strlen(str)) & mask;
+
+    while (_prog_slot[i] != 0) {
+        if (strcmp(str, _strprog[_prog_slot[i] - 1]) == 0) {
+            _kerid = _prog_slot[i] - 1;
+            return 1;
+        }
+        i = (i + 1) & mask;
+    }
+
+    _kerid = _sentinel++;
+    if (_sentinel == _nkernels) {
+        _nkernels *= 2;
+        _program_all = (cl_program *) realloc(_program_all, _nkernels * _ndevices * sizeof(cl_program));
+        _strprog = (char **) realloc(_strprog, _nkernels * sizeof(char *));
+        memset(_program_all + _sentinel * _ndevices, 0,
+               (_nkernels - _sentinel) * _ndevices * sizeof(cl_program));
+        pthread_mutex_lock(&_build_lock);
+        _prog_state = (int *) realloc(_prog_state, _nkernels * _ndevices * sizeof(int));
+        memset(_prog_state + _sentinel * _ndevices, 0,
+               (_nkernels - _sentinel) * _ndevices * sizeof(int));
+        pthread_mutex_unlock(&_build_lock);
+        if (_split) _cl_split_resize(_nkernels / 2, _nkernels);
+    }
+    _strprog[_kerid] = strdup(str);
+    _prog_slot[i] = _kerid + 1;
+
+    // Keep the load factor under 1/2
+    if (2 * _sentinel > _prog_cap) {
+        cl_uint j;
+        _prog_cap *= 2;
+        mask = _prog_cap - 1;
+        free(_prog_slot);
+        _prog_slot = (cl_uint *) calloc(_prog_cap, sizeof(cl_uint));
+        for (j = 0; j < _sentinel; j++) {
+            i = (cl_uint) _cl_hash(14695981039346656037ULL, _strprog[j], strlen(_strprog[j])) & mask;
+            while (_prog_slot[i] != 0) i = (i + 1) & mask;
+            _prog_slot[i] = j + 1;
+        }
+    }
+    return 0;
+}
+
+///
+/// Auxiliary Function. Return the handle of kernel name inside program prog,
+/// registering the pair if it is new.
+///
+int _cl_kernel_lookup(cl_uint prog, const char *name) {
+
+    pthread_mutex_lock(&_rtl_lock);
+    uint64_t h = _cl_hash(14695981039346656037ULL, &prog, sizeof(prog));
+    cl_uint mask = _kh_cap - 1;
+    cl_uint i;
+
+    h = _cl_hash(h, name, strlen(name));
+    i = (cl_uint) h & mask;
+    while (_kh_slot[i] != 0) {
+        cl_uint k = _kh_slot[i] - 1;
+        if (_kh_prog[k] == prog && strcmp(name, _kh_name[k]) == 0) {
+            pthread_mutex_unlock(&_rtl_lock);
+            return k;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if (_nhandles == _maxhandles) {
+        _maxhandles = (_maxhandles == 0) ? 16 : 2 * _maxhandles;
+        _kh_prog = (cl_uint *) realloc(_kh_prog, _maxhandles * sizeof(cl_uint));
+        _kh_name = (char **) realloc(_kh_name, _maxhandles * sizeof(char *));
+        _kh_local = (size_t *) realloc(_kh_local, 3 * _maxhandles * _ndevices * sizeof(size_t));
+        _kh_ldim = (cl_uint *) realloc(_kh_ldim, _maxhandles * _ndevices * sizeof(cl_uint));
+        memset(_kh_ldim + _nhandles * _ndevices, 0,
+               (_maxhandles - _nhandles) * _ndevices * sizeof(cl_uint));
+        _kh_trial = (int *) realloc(_kh_trial, _maxhandles * _ndevices * sizeof(int));
+        _kh_best = (double *) realloc(_kh_best, _maxhandles * _ndevices * sizeof(double));
+    }
+    _kh_prog[_nhandles] = prog;
+    _kh_name[_nhandles] = strdup(name);
+    _kh_slot[i] = ++_nhandles;
+
+    // Keep the load factor under 1/2
+    if (2 * _nhandles > _kh_cap) {
+        cl_uint j;
+        _kh_cap *= 2;
+        mask = _kh_cap - 1;
+        free(_kh_slot);
+        _kh_slot = (cl_uint *) calloc(_kh_cap, sizeof(cl_uint));
+        for (j = 0; j < _nhandles; j++) {
+            h = _cl_hash(14695981039346656037ULL, &_kh_prog[j], sizeof(cl_uint));
+            h = _cl_hash(h, _kh_name[j], strlen(_kh_name[j]));
+            i = (cl_uint) h & mask;
+            while (_kh_slot[i] != 0) i = (i + 1) & mask;
+            _kh_slot[i] = j + 1;
+        }
+    }
+    pthread_mutex_unlock(&_rtl_lock);
+    return _nhandles - 1;
+}
+
+
+///
+/// Auxiliary Function. Return true if file exist.
+///
+int _does_file_exist(const char *filename) {
+    struct stat st;
+    int result = stat(filename, &st);
+    return result == 0;
+}
+
+///
+/// Create OpenCL program - first attempt to load cached binary.
+/// If that is not available, then create the program from source
+/// and store the binary for future use. Return 1, if success and
+/// 0, otherwise.
+///
+int _cl_create_program(char *str) {
+
+    cl_program program;
+    cl_uint prog;
+
+    _cl_thread_init();
+    pthread_mutex_lock(&_rtl_lock);
+
+    // Sets the handle (_kerid) if program was created before. Each device
+    // gets its own build, shared by all threads running on it
+    _program_created(str);
+    prog = _kerid;
+    _cl_thread_grow();
+    program = _program_all[prog * _ndevices + _clid];
+    pthread_mutex_unlock(&_rtl_lock);
+
+    if (program == NULL) program = _cl_build_program(prog, str);
+    _program[prog] = program;
+    return program != NULL;
+}
+
+///
+/// Auxiliary Function. Build program prog (named str) for the selected
+/// device once: the first thread that needs it builds it holding no lock, so
+/// that the other threads keep launching, and those that need it too wait
+/// for that build. The caller must not hold _rtl_lock. Return the program,
+/// or NULL on failure (a later call tries again).
+///
+cl_program _cl_build_program(cl_uint prog, const char *str) {
+    cl_uint slot = prog * _ndevices + _clid;
+    cl_program program = NULL;
+
+    pthread_mutex_lock(&_build_lock);
+    while (_prog_state[slot] == 1) pthread_cond_wait(&_build_cond, &_build_lock);
+    if (_prog_state[slot] == 2) {
+        pthread_mutex_unlock(&_build_lock);
+        pthread_mutex_lock(&_rtl_lock);
+        program = _program_all[slot];
+        pthread_mutex_unlock(&_rtl_lock);
+        return program;
+    }
+    _prog_state[slot] = 1;
+    pthread_mutex_unlock(&_build_lock);
+
+    if (!_cl_prebuilt(str, &program)) program = _cl_load_program(str);
+
+    pthread_mutex_lock(&_rtl_lock);
+    _program_all[slot] = program;
+    pthread_mutex_unlock(&_rtl_lock);
+    pthread_mutex_lock(&_build_lock);
+    _prog_state[slot] = (program != NULL) ? 2 : 0;
+    pthread_cond_broadcast(&_build_cond);
+    pthread_mutex_unlock(&_build_lock);
+    return program;
+}
+
+///
+/// Auxiliary Function. Return the index of the image of program str of the
+/// given kind, or -1 if the executable does not embed it.
+///
+int _cl_find_image(const char *str, int kind) {
+    int i;
+    if (!_embedded) return -1;
+    pthread_mutex_lock(&_build_lock);
+    for (i = 0; i < _nimg; i++) {
+        if (_img_kind[i] == kind && strcmp(_img_name[i], str) == 0) break;
+    }
+    pthread_mutex_unlock(&_build_lock);
+    return (i < _nimg) ? i : -1;
+}
+
+///
+/// Auxiliary Function. Return 1 (=true) if device d consumes SPIR-V.
+///
+int _cl_il_support(cl_uint d) {
+#ifdef CL_VERSION_2_1
+    char il[256];
+    size_t len = 0;
+    if (clGetDeviceInfo(_device[d], CL_DEVICE_IL_VERSION, sizeof(il), il, &len) != CL_SUCCESS)
+        return 0;
+    return len > 1;
+#else
+    return 0;
+#endif
+}
+
+///
+/// Auxiliary Function. Build program str for device d from the images the
+/// executable embeds, in the order the kernel files are looked for: spir
+/// (or SPIR-V), then aocx, then OpenCL source. If portable, only images any
+/// device can load are tried. Return NULL if there is none (or all fail).
+///
+cl_program _cl_image_program(const char *str, cl_uint d, int portable) {
+    static const int order[] = {_CL_IMAGE_SPIR, _CL_IMAGE_SPIRV, _CL_IMAGE_AOCX, _CL_IMAGE_SOURCE};
+    static const char *suffix[] = {".cl", ".bc", ".aocx", ".spv"};
+    char name[1024];
+    cl_program program = NULL;
+    int k;
+
+    for (k = 0; k < 4 && program == NULL; k++) {
+        int kind = order[k];
+        if (kind == _CL_IMAGE_SPIR && !_spir_support) continue;
+        if (kind == _CL_IMAGE_SPIRV && !_cl_il_support(d)) continue;
+        if (kind == _CL_IMAGE_AOCX && portable) continue;
+        int i = _cl_find_image(str, kind);
+        if (i < 0) continue;
+        if (_verbose)
+            printf("<rtl> Creating the program object for %s from its embedded image.\n", str);
+        snprintf(name, sizeof(name), "%s%s", str, suffix[kind]);
+        program = _create_fromImage(_context[d], _device[d], name,
+                                    _img_data[i], _img_size[i], kind);
+    }
+    return program;
+}
+
+///
+/// Auxiliary Function. Build program str for the selected device from its
+/// spir binary, aocx image or source, in that order. Return NULL on failure.
+///
+cl_program _cl_load_program(const char *str) {
+
+    cl_program program = _cl_image_program(str, _clid, 0);
+    int fsize = strlen(str);
+
+    if (program != NULL) return program;
+
+    char *cl_file = calloc(fsize + 4, sizeof(char));
+    char *bc_file = calloc(fsize + 4, sizeof(char));
+    char *aocx_file = calloc(fsize + 6, sizeof(char));
+
+    strcpy(cl_file, str);
+    strcpy(bc_file, str);
+    strcpy(aocx_file, str);
+
+    strcat(bc_file, ".bc");
+    strcat(cl_file, ".cl");
+    strcat(aocx_file, ".aocx");
+
+    if (_does_file_exist(bc_file)) {
+        //Attempting to create program from spir binary
+        if (_verbose)
+            printf("<rtl> Creating the program object for %s.\n", str);
+
+        program = _create_fromCache(_context[_clid],
+                                    _device[_clid],
+                                    bc_file, 0);
+    } else if (_does_file_exist(aocx_file)) {
+        //Attempting to create program from aocx
+        if (_verbose)
+            printf("<rtl> Creating the program object for %s.\n", str);
+
+        program = _create_fromBinary(_context[_clid],
+                                     _device[_clid],
+                                     aocx_file);
+    }
+
+    //Binary not loaded, create from source (or from its cached build)
+    if (program == NULL) {
+        program = _create_fromCache(_context[_clid],
+                                    _device[_clid],
+                                    cl_file, 1);
+    }
+    free(cl_file);
+    free(bc_file);
+    free(aocx_file);
+    if (program == NULL) {
+        fprintf(stderr, "<rtl> Attempting to create program object failed.\n");
+    }
+    return program;
+}
+
+///
+/// Register program str (the base name of its kernel file) so that it can be
+/// built ahead of its first use. Called by the global ctors that codegen
+/// emits, i.e. before _cldevice_init.
+///
+void _cl_register_program(char *str) {
+    int i;
+    pthread_mutex_lock(&_build_lock);
+    for (i = 0; i < _npb && strcmp(_pb_name[i], str) != 0; i++);
+    if (i == _npb) {
+        if (_npb == _maxpb) {
+            _maxpb = (_maxpb == 0) ? 16 : 2 * _maxpb;
+            _pb_name = (char **) realloc(_pb_name, _maxpb * sizeof(char *));
+            _pb_program = (cl_program *) realloc(_pb_program, _maxpb * sizeof(cl_program));
+            _pb_state = (int *) realloc(_pb_state, _maxpb * sizeof(int));
+        }
+        _pb_name[_npb] = strdup(str);
+        _pb_program[_npb] = NULL;
+        _pb_state[_npb] = 0;
+        _npb++;
+    }
+    pthread_mutex_unlock(&_build_lock);
+}
+
+///
+/// Register the kernel image of program str: size bytes of OpenCL source,
+/// spir, aocx or SPIR-V code (kind is one of _CL_IMAGE_*) embedded in the
+/// host executable. Called by the global ctors that codegen emits.
+///
+void _cl_register_image(char *str, int kind, char *image, uint64_t size) {
+    pthread_mutex_lock(&_build_lock);
+    if (_nimg == _maximg) {
+        _maximg = (_maximg == 0) ? 16 : 2 * _maximg;
+        _img_name = (char **) realloc(_img_name, _maximg * sizeof(char *));
+        _img_kind = (int *) realloc(_img_kind, _maximg * sizeof(int));
+        _img_data = (const unsigned char **) realloc(_img_data, _maximg * sizeof(unsigned char *));
+        _img_size = (size_t *) realloc(_img_size, _maximg * sizeof(size_t));
+    }
+    _img_name[_nimg] = strdup(str);
+    _img_kind[_nimg] = kind;
+    _img_data[_nimg] = (const unsigned char *) image;
+    _img_size[_nimg] = size;
+    _nimg++;
+    pthread_mutex_unlock(&_build_lock);
+}
+
+///
+/// Auxiliary Function. Build job i on the calling thread and publish it.
+///
+void _cl_prebuild_job(int i) {
+    char file[1024];
+    cl_program program = NULL;
+
+    snprintf(file, sizeof(file), "%s.cl", _pb_name[i]);
+    if (!_does_file_exist(file)) snprintf(file, sizeof(file), "%s.bc", _pb_name[i]);
+    if (!_does_file_exist(file)) snprintf(file, sizeof(file), "%s.aocx", _pb_name[i]);
+    if (_does_file_exist(file) || _cl_find_image(_pb_name[i], _CL_IMAGE_SOURCE) >= 0 ||
+        _cl_find_image(_pb_name[i], _CL_IMAGE_SPIR) >= 0 ||
+        _cl_find_image(_pb_name[i], _CL_IMAGE_AOCX) >= 0)
+        program = _cl_load_program(_pb_name[i]);
+
+    pthread_mutex_lock(&_build_lock);
+    _pb_program[i] = program;
+    _pb_state[i] = 2;
+    pthread_cond_broadcast(&_build_cond);
+    pthread_mutex_unlock(&_build_lock);
+    if (_verbose) printf("<rtl> Prebuilt %s on device %u%s\n", _pb_name[i], _pb_device,
+                         (program == NULL) ? " (failed)" : "");
+}
+
+///
+/// Auxiliary Function. Worker thread: build queued jobs until none is left.
+///
+void *_cl_prebuild_worker(void *arg) {
+    int i;
+    _clid = _pb_device;
+    for (;;) {
+        pthread_mutex_lock(&_build_lock);
+        for (i = 0; i < _npb && _pb_state[i] != 0; i++);
+        if (i < _npb) _pb_state[i] = 1;
+        pthread_mutex_unlock(&_build_lock);
+        if (i == _npb) return NULL;
+        _cl_prebuild_job(i);
+    }
+}
+
+///
+/// Auxiliary Function. Start the workers that build the registered programs
+/// for the default device, CLDEVICE_PREBUILD of them.
+///
+void _cl_prebuild_start() {
+    int i;
+    if (_prebuild <= 0 || _npb == 0 || _pb_worker != NULL) return;
+    _pb_device = _default_clid;
+    _npb_worker = (_prebuild < _npb) ? _prebuild : _npb;
+    _pb_worker = (pthread_t *) calloc(_npb_worker, sizeof(pthread_t));
+    for (i = 0; i < _npb_worker; i++) {
+        if (pthread_create(&_pb_worker[i], NULL, _cl_prebuild_worker, NULL) != 0) {
+            fprintf(stderr, "<rtl> Warning: Unable to start build worker %d.\n", i);
+            break;
+        }
+    }
+    _npb_worker = i;
+    if (_verbose) printf("<rtl> Building %d programs on %d threads\n", _npb, _npb_worker);
+}
+
+///
+/// Auxiliary Function. If program str has a prebuild job for the selected
+/// device, wait for it (or run it, if no worker took it yet) and return the
+/// program through program. Return 0 (=false) if there is no such job.
+///
+int _cl_prebuilt(const char *str, cl_program *program) {
+    int i;
+
+    if (_pb_worker == NULL || _clid != _pb_device) return 0;
+    pthread_mutex_lock(&_build_lock);
+    for (i = 0; i < _npb && strcmp(_pb_name[i], str) != 0; i++);
+    if (i == _npb || _pb_state[i] == 3) {
+        pthread_mutex_unlock(&_build_lock);
+        return 0;
+    }
+    if (_pb_state[i] == 0) {
+        _pb_state[i] = 1;
+        pthread_mutex_unlock(&_build_lock);
+        _cl_prebuild_job(i);
+        pthread_mutex_lock(&_build_lock);
+    }
+    if (_pb_state[i] == 1 && _verbose) printf("<rtl> Waiting for the build of %s\n", str);
+    while (_pb_state[i] == 1) pthread_cond_wait(&_build_cond, &_build_lock);
+    *program = _pb_program[i];
+    _pb_program[i] = NULL;
+    _pb_state[i] = 3;
+    pthread_mutex_unlock(&_build_lock);
+    return *program != NULL;
+}
+
+///
+/// Auxiliary Function. Join the build workers and release the programs that
+/// were built but never used.
+///
+void _cl_prebuild_finish() {
+    int i;
+    for (i = 0; i < _npb_worker; i++) pthread_join(_pb_worker[i], NULL);
+    free(_pb_worker);
+    _pb_worker = NULL;
+    _npb_worker = 0;
+    for (i = 0; i < _npb; i++) {
+        if (_pb_program[i] != NULL) clReleaseProgram(_pb_program[i]);
+        _pb_program[i] = NULL;
+        _pb_state[i] = 0;
+    }
+}
+
+///
+/// Create OpenCL kernel. Return 1 (=true), if success
+///
+int _cl_create_kernel(char *str) {
+    _cl_thread_init();
+    pthread_mutex_lock(&_rtl_lock);
+    int status = _cl_select_kernel(_cl_kernel_lookup(_kerid, str));
+    pthread_mutex_unlock(&_rtl_lock);
+    return status;
+}
+
+///
+/// Auxiliary Function. Make the kernel given by handle the current one on
+/// the selected device, creating the cl_kernel of the calling thread only
+/// the first time. The caller holds _rtl_lock.
+///
+int _cl_select_kernel(int handle) {
+
+    _cl_thread_grow();
+    cl_kernel *kernel = &_kh_kernel[handle * _ndevices + _clid];
+
+    if (*kernel == NULL) {
+        if (_verbose) printf("<rtl> Creating the kernel object for %s.\n", _kh_name[handle]);
+        *kernel = clCreateKernel(_program[_kerid], _kh_name[handle], NULL);
+        if (*kernel == NULL) {
+            fprintf(stderr, "<rtl> Failed to create kernel object.\n");
+            return 0;
+        }
+    }
+
+    // The helper devices get the new kernel object lazily
+    if (_split) {
+        if (_kernel[_kerid] != *kernel) {
+            cl_uint d;
+            for (d = 0; d < _ndevices; d++) {
+                if (_split_kernel[_kerid * _ndevices + d] != NULL) {
+                    clReleaseKernel(_split_kernel[_kerid * _ndevices + d]);
+                    _split_kernel[_kerid * _ndevices + d] = NULL;
+                }
+            }
+        }
+        _nargs = 0;
+    }
+
+    _kernel[_kerid] = *kernel;
+    _kh_current = handle;
+    return 1;
+}
+
+///
+/// Return a stable handle for kernel inside program prog, creating the
+/// program if needed, or -1 on failure. Codegen calls it once per launch site.
+///
+int _cl_kernel_handle(char *prog, char *kernel) {
+    int handle = -1;
+    _cl_thread_init();
+    if (_cl_create_program(prog)) handle = _cl_kernel_lookup(_kerid, kernel);
+    return handle;
+}
+
+///
+/// Make the kernel given by handle the current one. Return 1 (=true), if success
+///
+int _cl_use_kernel(int handle) {
+    int status = 0;
+    char *str;
+
+    _cl_thread_init();
+    pthread_mutex_lock(&_rtl_lock);
+    if (handle < 0 || handle >= (int) _nhandles) {
+        fprintf(stderr, "<rtl> Invalid kernel handle %d.\n", handle);
+        pthread_mutex_unlock(&_rtl_lock);
+        return 0;
+    }
+    _kerid = _kh_prog[handle];
+    _cl_thread_grow();
+    _program[_kerid] = _program_all[_kerid * _ndevices + _clid];
+    str = _strprog[_kerid];
+    pthread_mutex_unlock(&_rtl_lock);
+
+    // The first launch on this device builds the program without the lock
+    if (_program[_kerid] == NULL && !_cl_create_program(str)) return 0;
+
+    pthread_mutex_lock(&_rtl_lock);
+    status = _cl_select_kernel(handle);
+    pthread_mutex_unlock(&_rtl_lock);
+    return status;
+}
+
+///
+/// Set the kernel arguments for cl_mem buffers
+///
+int _cl_set_kernel_args(int nargs) {
+    int i;
+    for (i = 0; i < nargs; i++) {
+        if (!_cl_resident(i)) return 0;
+        _status |= clSetKernelArg(_kernel[_kerid], i, sizeof(cl_mem), &_locs[i]);
+        if (_status != CL_SUCCESS) {
+            fprintf(stderr, "<rtl> Error setting buffer %d to kernel in pos %d.\n", i, i);
+            _clErrorCode(_status);
+            return 0;
+        }
+        if (_async) _cl_bind_buffer(i);
+        if (_split) _cl_record_arg(i, i, sizeof(cl_mem), NULL);
+        _cl_arg_forget(i);
+        if (_verbose) printf("<rtl> Pass buffer %d to kernel in pos %d\n", i, i);
+    }
+    return 1;
+}
+
+///
+/// Set the kernel argument for cl_mem buffer given by index
+///
+int _cl_set_kernel_arg(int pos, int index) {
+    if (!_cl_resident(index)) return 0;
+    _status |= clSetKernelArg(_kernel[_kerid], pos, sizeof(cl_mem), &_locs[index]);
+    if (_status != CL_SUCCESS) {
+        fprintf(stderr, "<rtl> Error setting buffer %d to kernel in pos %d.\n", index, pos);
+        _clErrorCode(_status);
+        return 0;
+    }
+    if (_async) _cl_bind_buffer(index);
+    if (_split) _cl_record_arg(pos, index, sizeof(cl_mem), NULL);
+    _cl_arg_forget(pos);
+    if (_verbose) printf("<rtl> Pass buffer %d to kernel in pos %d\n", index, pos);
+    return 1;
+}
+
+///
+/// Set the kernel arguments for host args
+///
+int _cl_set_kernel_hostArg(int pos, int size, void *loc) {
+    _status = clSetKernelArg(_kernel[_kerid], pos, size, loc);
+    if (_status != CL_SUCCESS) {
+        fprintf(stderr, "<rtl> Error setting host args on device.\n");
+        _clErrorCode(_status);
+        return 0;
+    }
+    if (_split) _cl_record_arg(pos, -1, size, loc);
+    _cl_arg_forget(pos);
+    return 1;
+}
+
+///
+/// Auxiliary Function. The argument at position pos of the current kernel
+/// was set outside _cl_launch: the next batched launch must set it again.
+///
+void _cl_arg_forget(int pos) {
+    if (_kh_current < 0) return;
+    _cl_arg_cache *c = &_kh_args[_kh_current * _ndevices + _clid];
+    if (pos < c->nargs) c->len[pos] = 0;
+}
+
+///
+/// Auxiliary Function. The buffer mem is about to be released or pooled:
+/// forget it wherever the calling thread's launches set it, since the
+/// driver may hand the same cl_mem value to a later buffer.
+///
+void _cl_arg_drop(cl_mem mem) {
+    cl_uint i;
+    int pos;
+    for (i = 0; i < _thread_maxhandles * _ndevices; i++) {
+        _cl_arg_cache *c = &_kh_args[i];
+        for (pos = 0; pos < c->nargs; pos++)
+            if (c->len[pos] == sizeof(cl_mem) && memcmp(c->val + pos * ARG_KEPT, &mem, sizeof(cl_mem)) == 0)
+                c->len[pos] = 0;
+    }
+}
+
+///
+/// Auxiliary Function. Return 1 if the argument at position pos of c was
+/// last set to the size bytes at val, otherwise remember them and return 0.
+///
+static int _cl_arg_same(_cl_arg_cache *c, int pos, const void *val, size_t size) {
+    char *slot = c->val + pos * ARG_KEPT;
+    if (size > ARG_KEPT) {
+        c->len[pos] = 0;
+        return 0;
+    }
+    if (c->len[pos] == size && memcmp(slot, val, size) == 0) return 1;
+    memcpy(slot, val, size);
+    c->len[pos] = size;
+    return 0;
+}
+
+///
+/// Launch the kernel given by handle with the nargs arguments described by
+/// the constant table desc. A _CL_ARG_BUFFER argument passes the buffer
+/// desc[i].index; a _CL_ARG_HOST one the desc[i].size bytes at vals[i]; a
+/// _CL_ARG_LOCAL one a local array of desc[i].size bytes times the int at
+/// vals[i]. Arguments that did not change since the previous launch of the
+/// kernel on this thread and device are not set again. ndrange holds
+/// {dim, size0, size1, size2, block0, block1, block2}: without blocks the
+/// kernel runs as with _cl_execute_kernel, otherwise as with
+/// _cl_execute_tiled_kernel (sizes are then counts of work-groups).
+/// Return 1 (=true), if success
+///
+int _cl_launch(int handle, int nargs, const _cl_arg_desc *desc, void **vals, const int64_t *ndrange) {
+    cl_kernel kernel = NULL;
+    int i;
+
+    // The kernel is usually still the current one
+    if (handle >= 0 && handle == _kh_current && _kerid < _thread_nkernels)
+        kernel = _kh_kernel[handle * _ndevices + _clid];
+    if (kernel == NULL || kernel != _kernel[_kerid]) {
+        if (!_cl_use_kernel(handle)) return 0;
+        kernel = _kernel[_kerid];
+    }
+
+    _cl_arg_cache *c = &_kh_args[handle * _ndevices + _clid];
+    if (c->nargs < nargs) {
+        c->len = (unsigned char *) realloc(c->len, nargs * sizeof(unsigned char));
+        c->val = (char *) realloc(c->val, nargs * ARG_KEPT);
+        memset(c->len + c->nargs, 0, (nargs - c->nargs) * sizeof(unsigned char));
+        c->nargs = nargs;
+    }
+
+    for (i = 0; i < nargs; i++) {
+        int index = desc[i].index;
+        size_t size = desc[i].size;
+        const void *val = vals[i];
+        cl_int status = CL_SUCCESS;
+
+        if (desc[i].kind == _CL_ARG_BUFFER) {
+            if (!_cl_resident(index)) return 0;
+            if (!_cl_arg_same(c, i, &_locs[index], sizeof(cl_mem)))
+                status = clSetKernelArg(kernel, i, sizeof(cl_mem), &_locs[index]);
+            if (_async) _cl_bind_buffer(index);
+            if (_split) _cl_record_arg(i, index, sizeof(cl_mem), NULL);
+        } else {
+            if (desc[i].kind == _CL_ARG_LOCAL) {
+                size *= *((int *) vals[i]);
+                val = NULL;
+                if (!_cl_arg_same(c, i, &size, sizeof(size_t)))
+                    status = clSetKernelArg(kernel, i, size, NULL);
+            } else if (!_cl_arg_same(c, i, val, size)) {
+                status = clSetKernelArg(kernel, i, size, val);
+            }
+            if (_split) _cl_record_arg(i, -1, size, val);
+        }
+
+        if (status != CL_SUCCESS) {
+            c->len[i] = 0;
+            _status = status;
+            fprintf(stderr, "<rtl> Error setting argument %d of the kernel.\n", i);
+            _clErrorCode(_status);
+            return 0;
+        }
+    }
+
+    if (ndrange[4] == 0)
+        return _cl_execute_kernel(ndrange[1], ndrange[2], ndrange[3], (int) ndrange[0]);
+    return _cl_execute_tiled_kernel((int) ndrange[1], (int) ndrange[2], (int) ndrange[3],
+                                    (int) ndrange[4], (int) ndrange[5], (int) ndrange[6],
+                                    (int) ndrange[0]);
+}
+
+///
+/// Auxiliary Function. The integer host argument of size bytes at val.
+///
+static int64_t _cl_host_int(const void *val, int size) {
+    if (size == 8) return *((const int64_t *) val);
+    return *((const int *) val);
+}
+
+///
+/// Auxiliary Function. Set the integer argument at position pos of kernel to
+/// v, as a value of size bytes.
+///
+static cl_int _cl_set_int_arg(cl_kernel kernel, int pos, int size, int64_t v) {
+    int v32 = (int) v;
+    _cl_arg_forget(pos);
+    return clSetKernelArg(kernel, pos, size, (size == 8) ? (void *) &v : (void *) &v32);
+}
+
+///
+/// Auxiliary Function. The elements [*e0, *e1) of the streamed array of d
+/// that the iterations with counter values first to last access at the
+/// offsets lo to hi.
+///
+static void _cl_stream_slice(const _cl_stream_desc *d, const _cl_stream_map *m,
+                             int64_t first, int64_t last, int lo, int hi,
+                             int64_t *e0, int64_t *e1) {
+    int64_t n = m->size / d->elem;
+    *e0 = first + lo;
+    *e1 = last + hi + 1;
+    if (*e0 < 0) *e0 = 0;
+    if (*e1 > n) *e1 = n;
+    if (*e1 < *e0) *e1 = *e0;
+}
+
+///
+/// Auxiliary Function. Allocate the depth slots of the ring of the streamed
+/// arrays (map[k] != NULL) for tiles of tile iterations. Slots have the
+/// exact size of a slice: they live for one launch and rounding them up to
+/// a pool class could exceed the device allocation limit. On failure
+/// nothing is left allocated and 0 is returned.
+///
+static int _cl_stream_ring(cl_mem *ring, int depth, int nstreams, const _cl_stream_desc *streams,
+                           _cl_stream_map **map, int64_t tile, int64_t step) {
+    int s, k;
+    cl_int status = CL_SUCCESS;
+    memset(ring, 0, depth * nstreams * sizeof(cl_mem));
+    for (s = 0; s < depth && status == CL_SUCCESS; s++) {
+        for (k = 0; k < nstreams && status == CL_SUCCESS; k++) {
+            if (map[k] == NULL) continue;
+            uint64_t n = (tile - 1) * step + streams[k].hi - streams[k].lo + 1;
+            if (n > map[k]->size / streams[k].elem) n = map[k]->size / streams[k].elem;
+            ring[s * nstreams + k] = clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE,
+                                                    n * streams[k].elem, NULL, &status);
+        }
+    }
+    if (status == CL_SUCCESS) return 1;
+    for (s = 0; s < depth * nstreams; s++)
+        if (ring[s] != NULL) clReleaseMemObject(ring[s]);
+    return 0;
+}
+
+///
+/// Launch the kernel given by handle as _cl_launch does, streaming the mapped
+/// arrays that do not fit on the device. The kernel runs a 1-D loop whose
+/// trip count, first value and step are the host arguments loop, loop + 1
+/// and loop + 2. streams describes the nstreams arrays whose subscripts are
+/// the counter plus a constant, the only ones that can be streamed: the
+/// iterations are cut in tiles, and for each tile the slice of every
+/// streamed array it touches is copied into a ring of _stream_depth device
+/// buffers, the kernel runs on the slices (with the first element of each
+/// slice in its offset argument) and the stored elements are copied back.
+/// The copies of the next tile overlap the kernel of the current one. The
+/// host arrays are up to date on return.
+/// Return 1 (=true), if success
+///
+int _cl_launch_stream(int handle, int nargs, const _cl_arg_desc *desc, void **vals,
+                      const int64_t *ndrange, int loop, int nstreams,
+                      const _cl_stream_desc *streams) {
+    int i, k, s;
+    int streamed = 0;
+    cl_int status = CL_SUCCESS;
+
+    _cl_stream_map **map = (_cl_stream_map **) calloc(nstreams, sizeof(_cl_stream_map *));
+    for (k = 0; k < nstreams; k++) {
+        int index = desc[streams[k].arg].index;
+        if (_locs_stream[index].size) {
+            map[k] = &_locs_stream[index];
+            streamed++;
+        }
+    }
+    if (!streamed) {
+        free(map);
+        if (!_split) return _cl_launch(handle, nargs, desc, vals, ndrange);
+        // A split launch copies the slices of the arrays to the helpers
+        _split_streams = streams;
+        _split_nstreams = nstreams;
+        _split_loop = loop;
+        int launched = _cl_launch(handle, nargs, desc, vals, ndrange);
+        _split_streams = NULL;
+        return launched;
+    }
+
+    int64_t trip = _cl_host_int(vals[loop], desc[loop].size);
+    int64_t first = _cl_host_int(vals[loop + 1], desc[loop + 1].size);
+    int64_t step = _cl_host_int(vals[loop + 2], desc[loop + 2].size);
+    if (trip <= 0 || step <= 0 || !_cl_use_kernel(handle)) {
+        if (step <= 0) fprintf(stderr, "<rtl> Cannot stream a loop of step %lld.\n", (long long) step);
+        free(map);
+        return trip <= 0 && step > 0;
+    }
+    cl_kernel kernel = _kernel[_kerid];
+
+    // The arguments that are the same for every tile; resident buffers must
+    // be ready, since the tiles do not wait for their events
+    char *tiled = (char *) calloc(nargs, 1);
+    tiled[loop] = tiled[loop + 1] = 1;
+    for (k = 0; k < nstreams; k++)
+        if (map[k] != NULL) tiled[streams[k].arg] = tiled[streams[k].offset] = 1;
+    for (i = 0; i < nargs && status == CL_SUCCESS; i++) {
+        size_t size = desc[i].size;
+        if (tiled[i]) continue;
+        if (desc[i].kind == _CL_ARG_BUFFER) {
+            if (!_cl_resident(desc[i].index)) {
+                status = CL_INVALID_MEM_OBJECT;
+                break;
+            }
+            if (_async) _cl_wait_buffer(desc[i].index);
+            status = clSetKernelArg(kernel, i, sizeof(cl_mem), &_locs[desc[i].index]);
+        } else if (desc[i].kind == _CL_ARG_LOCAL) {
+            size *= *((int *) vals[i]);
+            status = clSetKernelArg(kernel, i, size, NULL);
+        } else {
+            status = clSetKernelArg(kernel, i, size, vals[i]);
+        }
+        _cl_arg_forget(i);
+    }
+    free(tiled);
+
+    size_t local = 0, global;
+    size_t wg[3] = {0, 0, 0};
+    if (_autowg && _cl_work_group_size(1, wg)) local = wg[0];
+    if (local == 0) local = _dev_work_group[9 * _clid + ((_clid == 1) ? 3 : 0)];
+    // Tiles are not timed for the tuner
+    _tune_entry = -1;
+
+    // Tiles as long as the allocation limit allows for every slice, with
+    // all the slots of the ring in half the device memory
+    cl_ulong limit = 0, memsize = 0;
+    clGetDeviceInfo(_device[_clid], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &limit, NULL);
+    clGetDeviceInfo(_device[_clid], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &memsize, NULL);
+    int64_t tile = _stream_tile;
+    if (tile <= 0) {
+        uint64_t bytes = 0;
+        tile = trip;
+        for (k = 0; k < nstreams; k++) {
+            if (map[k] == NULL) continue;
+            int64_t fit = ((int64_t) (limit / streams[k].elem) - (streams[k].hi - streams[k].lo)) / step;
+            if (fit < tile) tile = fit;
+            bytes += step * streams[k].elem;
+        }
+        if (bytes > 0 && memsize / (2 * _stream_depth * bytes) < (uint64_t) tile)
+            tile = memsize / (2 * _stream_depth * bytes);
+        if (tile > (int64_t) local) tile -= tile % local;
+    }
+    if (tile > trip) tile = trip;
+    if (tile < 1) tile = 1;
+
+    // Smaller tiles when the resident buffers leave no room for the ring
+    int depth = _stream_depth;
+    cl_mem *ring = (cl_mem *) malloc(depth * nstreams * sizeof(cl_mem));
+    while (status == CL_SUCCESS && !_cl_stream_ring(ring, depth, nstreams, streams, map, tile, step)) {
+        if (tile == 1) status = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        tile = (tile + 1) / 2;
+    }
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "<rtl> Failed to set up the streamed launch of %s.\n", _cl_kernel_name());
+        _clErrorCode(status);
+        _status = status;
+        free(ring);
+        free(map);
+        return 0;
+    }
+
+    int64_t ntiles = (trip + tile - 1) / tile;
+    if (_verbose)
+        printf("<rtl> %s streams %d arrays in %lld tiles of %lld iterations on device %d\n",
+               _strprog[_kerid], streamed, (long long) ntiles, (long long) tile, _clid);
+
+    // in: the copies into each slot; done: the last command on each slot
+    cl_command_queue xq = _cl_transfer_queue();
+    cl_event *in = (cl_event *) calloc(depth * nstreams, sizeof(cl_event));
+    cl_event *done = (cl_event *) calloc(depth, sizeof(cl_event));
+    cl_event *wait = (cl_event *) malloc((nstreams + 1) * sizeof(cl_event));
+    int64_t t;
+
+    for (t = 0; t <= ntiles && status == CL_SUCCESS; t++) {
+        // Copy in tile t ahead of the kernel of tile t - 1
+        if (t < ntiles) {
+            int64_t a = first + step * t * tile;
+            int64_t b = first + step * (min(trip, (t + 1) * tile) - 1);
+            s = t % depth;
+            for (k = 0; k < nstreams && status == CL_SUCCESS; k++) {
+                int64_t e0, e1;
+                if (map[k] == NULL || !(map[k]->map & STREAM_TO)) continue;
+                _cl_stream_slice(&streams[k], map[k], a, b, streams[k].lo, streams[k].hi, &e0, &e1);
+                status = clEnqueueWriteBuffer(xq, ring[s * nstreams + k], CL_FALSE, 0,
+                                              (e1 - e0) * streams[k].elem,
+                                              (char *) map[k]->host + e0 * streams[k].elem,
+                                              (done[s] != NULL) ? 1 : 0, (done[s] != NULL) ? &done[s] : NULL,
+                                              &in[s * nstreams + k]);
+                if (_profile && status == CL_SUCCESS)
+                    _cl_trace("_cl_launch_stream", in[s * nstreams + k], TRACE_WRITE,
+                              desc[streams[k].arg].index, (e1 - e0) * streams[k].elem);
+            }
+            clFlush(xq);
+        }
+        if (t == 0 || status != CL_SUCCESS) continue;
+
+        // Run tile t - 1 on its slices, then copy back what it stored
+        int64_t t0 = (t - 1) * tile, count = min(trip, t * tile) - t0;
+        int64_t a = first + step * t0, b = first + step * (t0 + count - 1);
+        cl_uint nwait = 0;
+        cl_event kev = NULL, last = NULL;
+        s = (t - 1) % depth;
+        status = _cl_set_int_arg(kernel, loop, desc[loop].size, count);
+        status |= _cl_set_int_arg(kernel, loop + 1, desc[loop + 1].size, a);
+        for (k = 0; k < nstreams; k++) {
+            int64_t e0, e1;
+            if (map[k] == NULL) continue;
+            _cl_stream_slice(&streams[k], map[k], a, b, streams[k].lo, streams[k].hi, &e0, &e1);
+            status |= clSetKernelArg(kernel, streams[k].arg, sizeof(cl_mem), &ring[s * nstreams + k]);
+            status |= _cl_set_int_arg(kernel, streams[k].offset, desc[streams[k].offset].size, e0);
+            _cl_arg_forget(streams[k].arg);
+            if (in[s * nstreams + k] != NULL) wait[nwait++] = in[s * nstreams + k];
+        }
+        if (done[s] != NULL) wait[nwait++] = done[s];
+        global = (size_t) ((count + local - 1) / local) * local;
+        if (status == CL_SUCCESS)
+            status = clEnqueueNDRangeKernel(_cmd_queue[_clid], kernel, 1, NULL, &global, &local,
+                                            nwait, (nwait) ? wait : NULL, &kev);
+        if (status != CL_SUCCESS) break;
+        clFlush(_cmd_queue[_clid]);
+        if (_profile) _cl_trace(_cl_kernel_name(), kev, TRACE_KERNEL, -1, 0);
+        last = kev;
+
+        for (k = 0; k < nstreams && status == CL_SUCCESS; k++) {
+            int64_t e0, e1, w0, w1;
+            if (map[k] == NULL || !(map[k]->map & STREAM_FROM) || streams[k].wlo > streams[k].whi)
+                continue;
+            _cl_stream_slice(&streams[k], map[k], a, b, streams[k].lo, streams[k].hi, &e0, &e1);
+            _cl_stream_slice(&streams[k], map[k], a, b, streams[k].wlo, streams[k].whi, &w0, &w1);
+            cl_event rev = NULL;
+            status = clEnqueueReadBuffer(xq, ring[s * nstreams + k], CL_FALSE,
+                                         (w0 - e0) * streams[k].elem, (w1 - w0) * streams[k].elem,
+                                         (char *) map[k]->host + w0 * streams[k].elem,
+                                         1, &kev, &rev);
+            if (status != CL_SUCCESS) break;
+            if (_profile)
+                _cl_trace("_cl_launch_stream", rev, TRACE_READ, desc[streams[k].arg].index,
+                          (w1 - w0) * streams[k].elem);
+            if (last != kev) clReleaseEvent(last);
+            last = rev;
+        }
+        if (last != kev) clReleaseEvent(kev);
+        clFlush(xq);
+
+        // The slot is free again once its last command is done
+        for (k = 0; k < nstreams; k++) {
+            if (in[s * nstreams + k] != NULL) clReleaseEvent(in[s * nstreams + k]);
+            in[s * nstreams + k] = NULL;
+        }
+        if (done[s] != NULL) clReleaseEvent(done[s]);
+        done[s] = last;
+    }
+
+    clFinish(_cmd_queue[_clid]);
+    clFinish(xq);
+    for (s = 0; s < depth; s++) {
+        if (done[s] != NULL) clReleaseEvent(done[s]);
+        for (k = 0; k < nstreams; k++) {
+            if (in[s * nstreams + k] != NULL) clReleaseEvent(in[s * nstreams + k]);
+            if (ring[s * nstreams + k] != NULL) clReleaseMemObject(ring[s * nstreams + k]);
+        }
+    }
+    free(wait);
+    free(done);
+    free(in);
+    free(ring);
+    free(map);
+
+    if (status != CL_SUCCESS) {
+        _status = status;
+        fprintf(stderr, "<rtl> Error streaming %s on device %d.\n", _cl_kernel_name(), _clid);
+        _clErrorCode(_status);
+        return 0;
+    }
+    if (_verbose) printf("<rtl> %s has been streamed successfully.\n", _strprog[_kerid]);
+    return 1;
+}
+
+///
+/// Auxiliary Function. Record the argument set at position pos of the current
+/// kernel (index >= 0 for cl_mem buffers, -1 for host values) so that a split
+/// launch can replay it on the helper devices.
+///
+void _cl_record_arg(int pos, int index, size_t size, const void *loc) {
+    if (pos >= _maxargs) {
+        int n = (pos < 16) ? 16 : 2 * pos;
+        _arg_buf = (int *) realloc(_arg_buf, n * sizeof(int));
+        _arg_size = (size_t *) realloc(_arg_size, n * sizeof(size_t));
+        _arg_val = (char **) realloc(_arg_val, n * sizeof(char *));
+        memset(_arg_val + _maxargs, 0, (n - _maxargs) * sizeof(char *));
+        _maxargs = n;
+    }
+    _arg_buf[pos] = index;
+    _arg_size[pos] = size;
+    free(_arg_val[pos]);
+    _arg_val[pos] = NULL;
+    if (index < 0 && loc != NULL) {
+        _arg_val[pos] = (char *) malloc(size);
+        memcpy(_arg_val[pos], loc, size);
+    }
+    if (pos >= _nargs) _nargs = pos + 1;
+}
+
+///
+/// Auxiliary Function. Grow the per (kernel, device) split tables to hold
+/// nkernels kernels.
+///
+void _cl_split_resize(cl_uint old, cl_uint nkernels) {
+    cl_uint n = nkernels * _ndevices;
+    cl_uint o = old * _ndevices;
+    _split_rate = (double *) realloc(_split_rate, n * sizeof(double));
+    _split_program = (cl_program *) realloc(_split_program, n * sizeof(cl_program));
+    _split_kernel = (cl_kernel *) realloc(_split_kernel, n * sizeof(cl_kernel));
+    memset(_split_rate + o, 0, (n - o) * sizeof(double));
+    memset(_split_program + o, 0, (n - o) * sizeof(cl_program));
+    memset(_split_kernel + o, 0, (n - o) * sizeof(cl_kernel));
+}
+
+///
+/// Auxiliary Function. Return the kernel object of the current kernel built
+/// for helper device d, or NULL if the program cannot be built there.
+///
+cl_kernel _cl_split_helper_kernel(cl_uint d) {
+    cl_uint slot = _kerid * _ndevices + d;
+    char name[256];
+
+    if (_split_kernel[slot] != NULL) return _split_kernel[slot];
+
+    if (_split_program[slot] == NULL)
+        _split_program[slot] = _cl_image_program(_strprog[_kerid], d, 1);
+
+    if (_split_program[slot] == NULL) {
+        int fsize = strlen(_strprog[_kerid]);
+        char *cl_file = calloc(fsize + 4, sizeof(char));
+        char *bc_file = calloc(fsize + 4, sizeof(char));
+        strcpy(cl_file, _strprog[_kerid]);
+        strcat(cl_file, ".cl");
+        strcpy(bc_file, _strprog[_kerid]);
+        strcat(bc_file, ".bc");
+
+        // The source is portable; a .bc only is if it holds spir code
+        if (_does_file_exist(cl_file))
+            _split_program[slot] = _create_fromCache(_context[d], _device[d], cl_file, 1);
+        else if (_spir_support && _does_file_exist(bc_file))
+            _split_program[slot] = _create_fromCache(_context[d], _device[d], bc_file, 0);
+        free(cl_file);
+        free(bc_file);
+        if (_split_program[slot] == NULL) return NULL;
+    }
+
+    _status = clGetKernelInfo(_kernel[_kerid], CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL);
+    if (_status != CL_SUCCESS) return NULL;
+    _split_kernel[slot] = clCreateKernel(_split_program[slot], name, NULL);
+    return _split_kernel[slot];
+}
+
+///
+/// Auxiliary Function. Event callback that stamps the completion time of the
+/// slice executed by a device.
+///
+void CL_CALLBACK _cl_split_done(cl_event event, cl_int status, void *data) {
+    *((volatile double *) data) = _cl_rtclock();
+}
+
+///
+/// Split the x-dimension of the current kernel across the default device and
+/// every other device of the platform, proportionally to the throughput
+/// measured on previous launches of the same kernel. Only the 1-D loops
+/// launched with the table of their arrays are split (see _cl_launch_stream),
+/// and only if every buffer of the kernel is in the table and is stored to at
+/// a single offset from the counter, so that the slices store to disjoint
+/// elements. Each helper device gets a copy of the elements its iterations
+/// read, and the elements they store are copied back into the buffers of the
+/// default device. Slices are made of whole work-groups of local_size.
+/// Return -1 if the launch cannot be split, otherwise 1 on success and 0 on
+/// failure.
+///
+int _cl_execute_split_kernel(size_t *global_size, size_t *local_size, cl_uint wd) {
+    const _cl_stream_desc *streams = _split_streams;
+    int nstreams = _split_nstreams;
+    int loop = _split_loop;
+    cl_uint *devs = (cl_uint *) alloca(_ndevices * sizeof(cl_uint));
+    cl_uint ndevs = 0;
+    cl_uint d, i;
+    int a, b, k;
+
+    if (streams == NULL || wd != 1 || loop + 2 >= _nargs) return -1;
+    for (a = loop; a <= loop + 2; a++)
+        if (_arg_buf[a] >= 0 || _arg_val[a] == NULL) return -1;
+    for (a = 0; a < _nargs; a++) {
+        if (_arg_buf[a] < 0) continue;
+        for (k = 0; k < nstreams && streams[k].arg != a; k++);
+        if (k == nstreams || streams[k].wlo < streams[k].whi) return -1;
+        for (b = 0; b < a; b++)
+            if (_arg_buf[b] == _arg_buf[a]) return -1;
+    }
+    int64_t trip = _cl_host_int(_arg_val[loop], (int) _arg_size[loop]);
+    int64_t first = _cl_host_int(_arg_val[loop + 1], (int) _arg_size[loop + 1]);
+    int64_t step = _cl_host_int(_arg_val[loop + 2], (int) _arg_size[loop + 2]);
+    if (trip <= 0 || step <= 0) return -1;
+
+    // Device 0 is the default one (_clid), the others are the helpers, which
+    // must take work-groups of the size the default device uses
+    devs[ndevs++] = _clid;
+    for (d = 0; d < _ndevices; d++) {
+        cl_kernel kernel;
+        size_t wgsize = 0;
+        if (d == _clid || _device[d] == NULL || _cmd_queue[d] == NULL) continue;
+        if ((kernel = _cl_split_helper_kernel(d)) == NULL) continue;
+        clGetKernelWorkGroupInfo(kernel, _device[d], CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &wgsize, NULL);
+        if (local_size[0] > wgsize || local_size[0] > (size_t) _max_work_items[3 * d]) continue;
+        devs[ndevs++] = d;
+    }
+
+    size_t groups = global_size[0] / local_size[0];
+    if (ndevs < 2 || groups < 2 * ndevs) return -1;
+
+    // Compute the slices: the default device keeps the first work-groups,
+    // the helpers share the remaining ones
+    double *rate = &_split_rate[_kerid * _ndevices];
+    double total = 0;
+    int measured = 1;
+    for (i = 0; i < ndevs; i++) {
+        if (rate[devs[i]] <= 0) measured = 0;
+        total += rate[devs[i]];
+    }
+
+    size_t *offset = (size_t *) alloca(ndevs * sizeof(size_t));
+    size_t *length = (size_t *) alloca(ndevs * sizeof(size_t));
+    size_t pgroups = (measured) ? (size_t) (groups * rate[_clid] / total) : groups / ndevs;
+    pgroups = max(pgroups, (size_t) 1);
+    pgroups = min(pgroups, groups - (ndevs - 1));
+    offset[0] = 0;
+    length[0] = pgroups * local_size[0];
+
+    size_t rest = groups - pgroups;
+    size_t next = pgroups;
+    total -= rate[_clid];
+    for (i = 1; i < ndevs; i++) {
+        size_t g = (measured) ? (size_t) (rest * rate[devs[i]] / total) : rest / (ndevs - 1);
+        if (i == ndevs - 1 || g > groups - next) g = groups - next;
+        offset[i] = next * local_size[0];
+        length[i] = g * local_size[0];
+        next += g;
+    }
+
+    // The sizes of the arrays, once the commands that write them are done
+    _cl_stream_map *map = (_cl_stream_map *) calloc(nstreams, sizeof(_cl_stream_map));
+    for (k = 0; k < nstreams; k++) {
+        int id = _arg_buf[streams[k].arg];
+        size_t size = 0;
+        if (id < 0) continue;
+        if (_async) _cl_wait_buffer(id);
+        clGetMemObjectInfo(_locs[id], CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+        map[k].size = size;
+    }
+
+    cl_mem *mirror = (cl_mem *) calloc(ndevs * nstreams, sizeof(cl_mem));
+    int64_t *base = (int64_t *) calloc(ndevs * nstreams, sizeof(int64_t));
+    cl_event *events = (cl_event *) calloc(ndevs, sizeof(cl_event));
+    volatile double *done = (volatile double *) calloc(ndevs, sizeof(double));
+    char *stage = NULL;
+    size_t goffset[3] = {0, 0, 0};
+    size_t gsize[3];
+    double t0 = _cl_rtclock();
+    _status = CL_SUCCESS;
+
+    // Launch the helper slices first, so they overlap the default device.
+    // Their arrays start at the first element they read (the offset argument)
+    for (i = 1; i < ndevs && _status == CL_SUCCESS; i++) {
+        int64_t g1 = min((int64_t) (offset[i] + length[i]), trip);
+        if (g1 <= (int64_t) offset[i]) continue;
+        int64_t lo = first + step * (int64_t) offset[i], hi = first + step * (g1 - 1);
+        d = devs[i];
+        cl_kernel kernel = _split_kernel[_kerid * _ndevices + d];
+        for (a = 0; a < _nargs && _status == CL_SUCCESS; a++)
+            if (_arg_buf[a] < 0) _status = clSetKernelArg(kernel, a, _arg_size[a], _arg_val[a]);
+        for (k = 0; k < nstreams && _status == CL_SUCCESS; k++) {
+            int id = _arg_buf[streams[k].arg];
+            int64_t e0, e1;
+            if (id < 0) continue;
+            _cl_stream_slice(&streams[k], &map[k], lo, hi, streams[k].lo, streams[k].hi, &e0, &e1);
+            size_t bytes = (size_t) max(e1 - e0, (int64_t) 1) * streams[k].elem;
+            stage = (char *) realloc(stage, bytes);
+            if (e1 > e0)
+                _status = clEnqueueReadBuffer(_cmd_queue[_clid], _locs[id], CL_TRUE, e0 * streams[k].elem,
+                                              (e1 - e0) * streams[k].elem, stage, 0, NULL, NULL);
+            if (_status == CL_SUCCESS)
+                mirror[i * nstreams + k] = clCreateBuffer(_context[d], CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                                          bytes, stage, &_status);
+            base[i * nstreams + k] = e0;
+            if (_status == CL_SUCCESS)
+                _status = clSetKernelArg(kernel, streams[k].arg, sizeof(cl_mem), &mirror[i * nstreams + k]);
+            if (_status == CL_SUCCESS) {
+                int e32 = (int) e0;
+                _status = clSetKernelArg(kernel, streams[k].offset, _arg_size[streams[k].offset],
+                                         (_arg_size[streams[k].offset] == 8) ? (void *) &e0 : (void *) &e32);
+            }
+        }
+        goffset[0] = offset[i];
+        gsize[0] = length[i];
+        gsize[1] = global_size[1];
+        gsize[2] = global_size[2];
+        if (_status == CL_SUCCESS)
+            _status = clEnqueueNDRangeKernel(_cmd_queue[d], kernel, wd, goffset, gsize,
+                                             local_size, 0, NULL, &events[i]);
+        if (_status != CL_SUCCESS) {
+            fprintf(stderr, "<rtl> Error executing split slice on device %u\n", d);
+            _clErrorCode(_status);
+            break;
+        }
+        clSetEventCallback(events[i], CL_COMPLETE, _cl_split_done, (void *) &done[i]);
+        clFlush(_cmd_queue[d]);
+    }
 
-    if (_status != CL_SUCCESS) {
-        fprintf(stderr, "<rtl> Failed reading %llu bytes from buffer %d.\n", size, id);
-        _clErrorCode(_status);
-        return 0;
+    if (_status == CL_SUCCESS) {
+        gsize[0] = length[0];
+        gsize[1] = global_size[1];
+        gsize[2] = global_size[2];
+        _status = clEnqueueNDRangeKernel(_cmd_queue[_clid], _kernel[_kerid], wd, NULL, gsize,
+                                         local_size, 0, NULL, &events[0]);
+        if (_status == CL_SUCCESS)
+            clSetEventCallback(events[0], CL_COMPLETE, _cl_split_done, (void *) &done[0]);
     }
 
-    if (_profile) {
-        _read_time += _cl_profile("_cl_read_buffer", _global_event);
+    int ok = (_status == CL_SUCCESS);
+    for (i = 0; i < ndevs; i++)
+        if (events[i] != NULL) clWaitForEvents(1, &events[i]);
+
+    // Copy back the elements each helper slice stored
+    for (i = 1; i < ndevs && ok; i++) {
+        if (events[i] == NULL) continue;
+        int64_t g1 = min((int64_t) (offset[i] + length[i]), trip);
+        int64_t lo = first + step * (int64_t) offset[i], hi = first + step * (g1 - 1);
+        for (k = 0; k < nstreams && ok; k++) {
+            int id = _arg_buf[streams[k].arg];
+            int64_t w0, w1;
+            if (id < 0 || streams[k].wlo > streams[k].whi) continue;
+            _cl_stream_slice(&streams[k], &map[k], lo, hi, streams[k].wlo, streams[k].whi, &w0, &w1);
+            if (w1 <= w0) continue;
+            stage = (char *) realloc(stage, (w1 - w0) * streams[k].elem);
+            _status = clEnqueueReadBuffer(_cmd_queue[devs[i]], mirror[i * nstreams + k], CL_TRUE,
+                                          (w0 - base[i * nstreams + k]) * streams[k].elem,
+                                          (w1 - w0) * streams[k].elem, stage, 0, NULL, NULL);
+            if (_status == CL_SUCCESS)
+                _status = clEnqueueWriteBuffer(_cmd_queue[_clid], _locs[id], CL_TRUE, w0 * streams[k].elem,
+                                               (w1 - w0) * streams[k].elem, stage, 0, NULL, NULL);
+            ok = (_status == CL_SUCCESS);
+        }
     }
 
-    if (_verbose) {
-        printf("<rtl> Reading %llu bytes from buffer %d\n", size, id);
+    // Update the throughput (iterations per second) of each device
+    double t1 = _cl_rtclock();
+    for (i = 0; i < ndevs && ok; i++) {
+        if (events[i] == NULL) continue;
+        double elapsed = ((done[i] > t0) ? done[i] : t1) - t0;
+        double r = length[i] / max(elapsed, 1.0e-6);
+        rate[devs[i]] = (rate[devs[i]] > 0) ? 0.5 * rate[devs[i]] + 0.5 * r : r;
+        if (_verbose)
+            printf("<rtl> Split %s: device %u ran [%lu, %lu) at %.0f it/s\n", _strprog[_kerid],
+                   devs[i], offset[i], offset[i] + length[i], r);
     }
+    if (_profile) _kernel_time += (t1 - t0) * 1.0e9;
 
+    for (i = 0; i < ndevs; i++) {
+        if (events[i] != NULL) clReleaseEvent(events[i]);
+        for (k = 0; k < nstreams; k++)
+            if (mirror[i * nstreams + k] != NULL) clReleaseMemObject(mirror[i * nstreams + k]);
+    }
+    free(stage);
+    free(map);
+    free(mirror);
+    free(base);
+    free(events);
+    free((void *) done);
+    _nargbufs = 0;
+
+    if (!ok) {
+        fprintf(stderr, "<rtl> Error executing split kernel %s\n", _strprog[_kerid]);
+        _clErrorCode(_status);
+        return 0;
+    }
+    if (_verbose) printf("<rtl> %s has been running successfully.\n", _strprog[_kerid]);
     return 1;
 }
 
 ///
-/// Write (sync) the host variable to cl_memory given by index
+/// Auxiliary Function. Return the tuning database key of the current kernel
+/// on the selected device for a dim-dimensional launch.
 ///
-int _cl_write_buffer(uint64_t size, int id, void *loc) {
+uint64_t _cl_tune_key(cl_uint dim) {
+    char info[1024];
+    uint64_t key = _cl_hash(14695981039346656037ULL, _strprog[_kerid], strlen(_strprog[_kerid]) + 1);
+
+    key = _cl_hash(key, _kh_name[_kh_current], strlen(_kh_name[_kh_current]) + 1);
+    memset(info, '\0', sizeof(info));
+    clGetDeviceInfo(_device[_clid], CL_DEVICE_NAME, sizeof(info) - 1, info, NULL);
+    key = _cl_hash(key, info, strlen(info) + 1);
+    memset(info, '\0', sizeof(info));
+    clGetDeviceInfo(_device[_clid], CL_DRIVER_VERSION, sizeof(info) - 1, info, NULL);
+    key = _cl_hash(key, info, strlen(info) + 1);
+    return _cl_hash(key, &dim, sizeof(dim));
+}
 
-    _status = clEnqueueWriteBuffer(_cmd_queue[_clid],
-                                   _locs[id],
-                                   CL_TRUE,
-                                   0,
-                                   size,
-                                   loc,
-                                   0,
-                                   NULL,
-                                   (_profile) ? &_global_event : NULL);
+///
+/// Auxiliary Function. Return the tuning database record of key, or -1.
+///
+int _cl_tune_find(uint64_t key) {
+    int i;
+    for (i = 0; i < _ntdb; i++)
+        if (_tdb_key[i] == key) return i;
+    return -1;
+}
 
-    if (_status != CL_SUCCESS) {
-        fprintf(stderr, "<rtl> Failed writing %llu bytes into buffer %d.\n", size, id);
-        _clErrorCode(_status);
-        return 0;
+///
+/// Auxiliary Function. Set the local range of key in the tuning database.
+/// If save, the record is also appended to the database file; later lines
+/// override earlier ones when it is loaded.
+///
+void _cl_tune_set(uint64_t key, const size_t *local, int save, double time) {
+    int i = _cl_tune_find(key);
+
+    if (i < 0) {
+        if (_ntdb == _maxtdb) {
+            _maxtdb = (_maxtdb == 0) ? 16 : 2 * _maxtdb;
+            _tdb_key = (uint64_t *) realloc(_tdb_key, _maxtdb * sizeof(uint64_t));
+            _tdb_local = (size_t *) realloc(_tdb_local, 3 * _maxtdb * sizeof(size_t));
+        }
+        i = _ntdb++;
+        _tdb_key[i] = key;
     }
-
-    if (_profile) {
-        _write_time += _cl_profile("_cl_write_buffer", _global_event);
+    memcpy(&_tdb_local[3 * i], local, 3 * sizeof(size_t));
+
+    if (save && _cache_dir != NULL) {
+        char path[1100];
+        snprintf(path, sizeof(path), "%s/tuning.db", _cache_dir);
+        FILE *file = fopen(path, "a");
+        if (file == NULL) {
+            fprintf(stderr, "<rtl> Failed to open tuning database %s.\n", path);
+            return;
+        }
+        fprintf(file, "%016llx %lu %lu %lu %.0f %s:%s\n", (unsigned long long) key,
+                local[0], local[1], local[2], time, _strprog[_kerid], _kh_name[_kh_current]);
+        fclose(file);
     }
+}
 
-    if (_verbose) {
-        printf("<rtl> Writing %llu bytes into buffer %d\n", size, id);
+///
+/// Auxiliary Function. Load the tuning database from the program cache
+/// directory, if there is one.
+///
+void _cl_tune_load() {
+    char path[1100];
+    char line[2048];
+    unsigned long long key;
+    unsigned long l0, l1, l2;
+    size_t local[3];
+
+    if (_cache_dir == NULL) return;
+    snprintf(path, sizeof(path), "%s/tuning.db", _cache_dir);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%llx %lu %lu %lu", &key, &l0, &l1, &l2) != 4) continue;
+        local[0] = l0;
+        local[1] = l1;
+        local[2] = l2;
+        _cl_tune_set((uint64_t) key, local, 0, 0);
     }
-    return 1;
+    fclose(file);
+    if (_verbose) printf("<rtl> Loaded %d tuned work-groups from %s.\n", _ntdb, path);
 }
 
 ///
-/// Auxiliary Function.
-/// Return true if program object was created before.
+/// Auxiliary Function. Set local_size to the next candidate work-group of a
+/// dim-dimensional launch that fits the current kernel, skipping the ones
+/// it does not. Return 0 (=false) when all candidates have been tried.
 ///
-int _program_created(const char *str) {
+int _cl_tune_candidate(int entry, cl_uint dim, size_t *local_size) {
+    int c = _kh_trial[entry] / _tune;
+    int n = (dim == 2) ? sizeof(_tune_shapes2) / sizeof(_tune_shapes2[0])
+                       : sizeof(_tune_shapes1) / sizeof(_tune_shapes1[0]);
+    size_t wgsize = 0, x = 1, y = 1;
+
+    clGetKernelWorkGroupInfo(_kernel[_kerid], _device[_clid], CL_KERNEL_WORK_GROUP_SIZE,
+                             sizeof(size_t), &wgsize, NULL);
+    for (; c < n; c++) {
+        x = (dim == 2) ? _tune_shapes2[c][0] : _tune_shapes1[c];
+        y = (dim == 2) ? _tune_shapes2[c][1] : 1;
+        if (x * y <= wgsize && x <= _max_work_items[3 * _clid] && y <= _max_work_items[3 * _clid + 1]) break;
+    }
+    if (c >= n) return 0;
+    if (c != _kh_trial[entry] / _tune) _kh_trial[entry] = c * _tune;
 
-    cl_uint i;
+    local_size[0] = x;
+    local_size[1] = y;
+    local_size[2] = 1;
+    return 1;
+}
 
-    for (i = 0; i < _sentinel; i++)
-        if (strcmp(str, _strprog[i]) == 0) {
-            _kerid = i;
-            return 1;
-        }
+///
+/// Auxiliary Function. Account the time of the trial launch in event to the
+/// candidate it ran, keeping it if it is the fastest so far.
+///
+void _cl_tune_record(cl_event event) {
+    int entry = _tune_entry;
+    cl_ulong time_start, time_end;
+    cl_int status;
+
+    _tune_entry = -1;
+    status = clWaitForEvents(1, &event);
+    status |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &time_start, NULL);
+    status |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &time_end, NULL);
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "<rtl> Warning: Unable to time %s, autotuning stopped.\n", _kh_name[_kh_current]);
+        _kh_trial[entry] = -1;
+        return;
+    }
 
-    _kerid = _sentinel++;
-    if (_sentinel == _nkernels) {
-        _nkernels *= 2;
-        _program = (cl_program *) realloc(_program, _nkernels * sizeof(cl_program));
-        _kernel = (cl_kernel *) realloc(_kernel, _nkernels * sizeof(cl_kernel));
+    double time = (double) (time_end - time_start);
+    pthread_mutex_lock(&_rtl_lock);
+    if (_verbose)
+        printf("<rtl> Tuning %s: %lu x %lu took %.0f ns\n", _kh_name[_kh_current],
+               _tune_local[0], _tune_local[1], time);
+    if (_kh_best[entry] < 0 || time < _kh_best[entry]) {
+        _kh_best[entry] = time;
+        memcpy(&_kh_local[3 * entry], _tune_local, 3 * sizeof(size_t));
     }
-    _strprog[_kerid] = (char *) calloc(strlen(str), sizeof(char));
-    strcpy (_strprog[_kerid], str);
-    return 0;
+    _kh_trial[entry]++;
+    pthread_mutex_unlock(&_rtl_lock);
 }
 
-
 ///
-/// Auxiliary Function. Return true if file exist.
+/// Auxiliary Function. Return the calibration database key of device d: the
+/// host name, the device name and the driver version.
 ///
-int _does_file_exist(const char *filename) {
-    struct stat st;
-    int result = stat(filename, &st);
-    return result == 0;
+uint64_t _cl_calibration_key(cl_uint d) {
+    char info[1024];
+    uint64_t key;
+
+    memset(info, '\0', sizeof(info));
+    gethostname(info, sizeof(info) - 1);
+    key = _cl_hash(14695981039346656037ULL, info, strlen(info) + 1);
+    memset(info, '\0', sizeof(info));
+    clGetDeviceInfo(_device[d], CL_DEVICE_NAME, sizeof(info) - 1, info, NULL);
+    key = _cl_hash(key, info, strlen(info) + 1);
+    memset(info, '\0', sizeof(info));
+    clGetDeviceInfo(_device[d], CL_DRIVER_VERSION, sizeof(info) - 1, info, NULL);
+    return _cl_hash(key, info, strlen(info) + 1);
 }
 
 ///
-/// Create OpenCL program - first attempt to load cached binary.
-/// If that is not available, then create the program from source
-/// and store the binary for future use. Return 1, if success and
-/// 0, otherwise.
+/// Auxiliary Function. Load the calibration of device d from the program
+/// cache directory. Later lines override earlier ones. Return 1 (=true) if
+/// the device has a record.
 ///
-int _cl_create_program(char *str) {
-
-    // Sets the handle (_kerid) if program was created before
-    if (_program_created(str)) return 1;
-
-    // otherwise, create it
-    int fsize = strlen(str);
-
-    char *cl_file = calloc(fsize + 4, sizeof(char));
-    char *bc_file = calloc(fsize + 4, sizeof(char));
-    char *aocx_file = calloc(fsize + 6, sizeof(char));
-
-    strcpy(cl_file, str);
-    strcpy(bc_file, str);
-    strcpy(aocx_file, str);
-
-    strcat(bc_file, ".bc");
-    strcat(cl_file, ".cl");
-    strcat(aocx_file, ".aocx");
-
-    if (_does_file_exist(bc_file)) {
-        //Attempting to create program from binary
-        if (_verbose)
-            printf("<rtl> Creating the program object for %s.\n", str);
+int _cl_calibration_load(cl_uint d) {
+    char path[1100];
+    char line[2048];
+    unsigned long long key;
+    uint64_t want = _cl_calibration_key(d);
+    _cl_calibration c;
+    int found = 0;
+
+    if (_cache_dir == NULL) return 0;
+    snprintf(path, sizeof(path), "%s/calibration.db", _cache_dir);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%llx %lf %lf %lf %lf %lf", &key, &c.write_bw, &c.read_bw,
+                   &c.launch, &c.device_rate, &c.host_rate) != 6) continue;
+        if ((uint64_t) key != want || c.write_bw <= 0 || c.read_bw <= 0 ||
+            c.device_rate <= 0 || c.host_rate <= 0) continue;
+        _cal[d] = c;
+        found = 1;
+    }
+    fclose(file);
+    if (found && _verbose) printf("<rtl> Loaded the calibration of device %u from %s.\n", d, path);
+    return found;
+}
 
-        _program[_kerid] = _create_fromBinary(_context[_clid],
-                                              _device[_clid],
-                                              bc_file);
-        if (_program[_kerid] != NULL) return 1;
-    } else if (_does_file_exist(aocx_file)) {
-        //Attempting to create program from aocx
-        if (_verbose)
-            printf("<rtl> Creating the program object for %s.\n", str);
+///
+/// Auxiliary Function. Append the calibration of device d to the database.
+///
+void _cl_calibration_save(cl_uint d) {
+    char path[1100];
+    char name[1024];
 
-        _program[_kerid] = _create_fromBinary(_context[_clid],
-                                              _device[_clid],
-                                              aocx_file);
+    if (_cache_dir == NULL) return;
+    snprintf(path, sizeof(path), "%s/calibration.db", _cache_dir);
+    FILE *file = fopen(path, "a");
+    if (file == NULL) {
+        fprintf(stderr, "<rtl> Failed to open calibration database %s.\n", path);
+        return;
+    }
+    memset(name, '\0', sizeof(name));
+    clGetDeviceInfo(_device[d], CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+    fprintf(file, "%016llx %g %g %g %g %g %s\n", (unsigned long long) _cl_calibration_key(d),
+            _cal[d].write_bw, _cal[d].read_bw, _cal[d].launch, _cal[d].device_rate,
+            _cal[d].host_rate, name);
+    fclose(file);
+}
 
-        if (_program[_kerid] != NULL) return 1;
+///
+/// Auxiliary Function. Calibrate device d: time copies of CALIBRATE_BYTES
+/// each way, empty and full launches of _cl_cal_source, and the same loop
+/// on one host thread, into cal. It runs without _rtl_lock: the caller
+/// publishes the result in _cal. Return 1 (=true), if success
+///
+int _cl_calibrate(cl_uint d, _cl_calibration *cal) {
+    cl_command_queue queue = _cmd_queue[d];
+    cl_mem da = NULL, db = NULL;
+    cl_program program = NULL;
+    cl_kernel kernel = NULL;
+    cl_ulong maxalloc = 0;
+    size_t n = CALIBRATE_BYTES / sizeof(float), one = 1, i;
+    float s = 1.0f;
+    double t;
+    int r, ok = 0;
+
+    clGetDeviceInfo(_device[d], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxalloc, NULL);
+    while (n > 1024 && n * sizeof(float) > maxalloc / 2) n /= 2;
+    size_t bytes = n * sizeof(float);
+    float *a = (float *) malloc(bytes);
+    float *b = (float *) malloc(bytes);
+    if (a == NULL || b == NULL) goto done;
+    for (i = 0; i < n; i++) {
+        a[i] = 1.0f;
+        b[i] = 0.5f;
     }
 
-    //Binary not loaded, create from source
-    _program[_kerid] = _create_fromSource(_context[_clid],
-                                          _device[_clid],
-                                          cl_file);
-    if (_program[_kerid] == NULL) {
-        fprintf(stderr, "<rtl> Attempting to create program object failed.\n");
-        return 0;
+    da = clCreateBuffer(_context[d], CL_MEM_READ_WRITE, bytes, NULL, &_status);
+    if (_status != CL_SUCCESS) goto done;
+    db = clCreateBuffer(_context[d], CL_MEM_READ_ONLY, bytes, NULL, &_status);
+    if (_status != CL_SUCCESS) goto done;
+    program = clCreateProgramWithSource(_context[d], 1, &_cl_cal_source, NULL, &_status);
+    if (_status != CL_SUCCESS) goto done;
+    _status = clBuildProgram(program, 1, &_device[d], "", NULL, NULL);
+    if (_status != CL_SUCCESS) goto done;
+    kernel = clCreateKernel(program, "_cl_calibrate", &_status);
+    if (_status != CL_SUCCESS) goto done;
+    _status = clSetKernelArg(kernel, 0, sizeof(cl_mem), &da);
+    _status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &db);
+    _status |= clSetKernelArg(kernel, 2, sizeof(float), &s);
+    if (_status != CL_SUCCESS) goto done;
+
+    // The first command of each kind is a warm-up
+    _status = clEnqueueWriteBuffer(queue, db, CL_TRUE, 0, bytes, b, 0, NULL, NULL);
+    t = _cl_rtclock();
+    for (r = 0; r < CALIBRATE_REPS && _status == CL_SUCCESS; r++)
+        _status = clEnqueueWriteBuffer(queue, da, CL_TRUE, 0, bytes, a, 0, NULL, NULL);
+    if (_status != CL_SUCCESS) goto done;
+    cal->write_bw = CALIBRATE_REPS * (double) bytes / (_cl_rtclock() - t);
+
+    _status = clEnqueueReadBuffer(queue, db, CL_TRUE, 0, bytes, b, 0, NULL, NULL);
+    t = _cl_rtclock();
+    for (r = 0; r < CALIBRATE_REPS && _status == CL_SUCCESS; r++)
+        _status = clEnqueueReadBuffer(queue, da, CL_TRUE, 0, bytes, a, 0, NULL, NULL);
+    if (_status != CL_SUCCESS) goto done;
+    cal->read_bw = CALIBRATE_REPS * (double) bytes / (_cl_rtclock() - t);
+
+    _status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &one, NULL, 0, NULL, NULL);
+    _status |= clFinish(queue);
+    t = _cl_rtclock();
+    for (r = 0; r < CALIBRATE_LAUNCHES && _status == CL_SUCCESS; r++) {
+        _status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &one, NULL, 0, NULL, NULL);
+        _status |= clFinish(queue);
     }
-    if (_save_toBinary(_program[_kerid], _device[_clid], bc_file) == 0) {
-        fprintf(stderr, "<rtl> Failed to save program object in binary form.\n");
-        return 0;
+    if (_status != CL_SUCCESS) goto done;
+    cal->launch = (_cl_rtclock() - t) / CALIBRATE_LAUNCHES;
+
+    _status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &n, NULL, 0, NULL, NULL);
+    _status |= clFinish(queue);
+    t = _cl_rtclock();
+    for (r = 0; r < CALIBRATE_REPS && _status == CL_SUCCESS; r++) {
+        _status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &n, NULL, 0, NULL, NULL);
+        _status |= clFinish(queue);
     }
-    return 1;
+    if (_status != CL_SUCCESS) goto done;
+    t = (_cl_rtclock() - t) / CALIBRATE_REPS - cal->launch;
+    cal->device_rate = CALIBRATE_OPS * (double) n / max(t, 1e-9);
+
+    t = _cl_rtclock();
+    for (r = 0; r < CALIBRATE_REPS; r++)
+        for (i = 0; i < n; i++)
+            a[i] = a[i] * s + b[i];
+    _cal_sink = a[n - 1];
+    t = _cl_rtclock() - t;
+    cal->host_rate = CALIBRATE_OPS * (double) n * CALIBRATE_REPS / max(t, 1e-9);
+    ok = 1;
+
+done:
+    if (!ok) {
+        fprintf(stderr, "<rtl> Failed to calibrate device %u, target regions run on it.\n", d);
+        _clErrorCode(_status);
+        memset(cal, 0, sizeof(_cl_calibration));
+    }
+    if (kernel != NULL) clReleaseKernel(kernel);
+    if (program != NULL) clReleaseProgram(program);
+    if (da != NULL) clReleaseMemObject(da);
+    if (db != NULL) clReleaseMemObject(db);
+    free(a);
+    free(b);
+    if (ok && _verbose)
+        printf("<rtl> Calibrated device %u: write %.0f MB/s, read %.0f MB/s, launch %.1f us, "
+               "%.0f Mop/s (host thread %.0f Mop/s)\n", d, cal->write_bw / 1e6,
+               cal->read_bw / 1e6, cal->launch * 1e6, cal->device_rate / 1e6,
+               cal->host_rate / 1e6);
+    return ok;
 }
 
 ///
-/// Create OpenCL kernel. Return 1 (=true), if success
+/// Choose where a target region built with -offload-dispatch runs. ops is
+/// the work of its kernels (as counted by codegen, -1 if unknown), launches
+/// their number, and locs, sizes and types give the nmaps ranges it maps
+/// with their map types. The selected
+/// device is used if its launches, the copies of the ranges not present yet
+/// and the work cost less time than the work split among the host threads.
+/// Return 1 (=true) to offload the region, 0 to run it on the host.
 ///
-int _cl_create_kernel(char *str) {
+int _cl_offload_profitable(int64_t ops, int launches, int nmaps, void **locs,
+                           const int64_t *sizes, const int *types) {
+    double in = 0, out = 0;
+    int i;
 
-    if (_kernel[_kerid] != NULL) {
-        clReleaseKernel(_kernel[_kerid]);
+    if (_dispatch != 1) return _dispatch != 2;
+    if (ops < 0) return 1;
+
+    // Calibrating takes a while and runs outside the lock; meanwhile the
+    // device is marked, and the regions of other threads offload
+    pthread_mutex_lock(&_rtl_lock);
+    if (_cal == NULL) _cal = (_cl_calibration *) calloc(_ndevices, sizeof(_cl_calibration));
+    int calibrate = _cal[_clid].device_rate == 0 && !_cl_calibration_load(_clid);
+    if (calibrate) _cal[_clid].device_rate = CALIBRATE_PENDING;
+    pthread_mutex_unlock(&_rtl_lock);
+    if (calibrate) {
+        _cl_calibration cal;
+        int ok = _cl_calibrate(_clid, &cal);
+        pthread_mutex_lock(&_rtl_lock);
+        _cal[_clid] = cal;
+        if (!ok) {
+            _cal[_clid].device_rate = -1;
+        } else {
+            _cl_calibration_save(_clid);
+        }
+        pthread_mutex_unlock(&_rtl_lock);
     }
 
-    if (_verbose) printf("<rtl> Creating the kernel object for %s.\n", str);
-    _kernel[_kerid] = clCreateKernel(_program[_kerid], str, NULL);
-    if (_kernel[_kerid] == NULL) {
-        fprintf(stderr, "<rtl> Failed to create kernel object.\n");
-        return 0;
+    pthread_mutex_lock(&_rtl_lock);
+    _cl_calibration c = _cal[_clid];
+
+    for (i = 0; i < nmaps; i++) {
+        uintptr_t begin = (uintptr_t) locs[i];
+        if (sizes[i] <= 0 || _cl_wrap_host_ok(sizes[i], locs[i])) continue;
+        if (_present) {
+            int e = _cl_present_find(begin);
+            if (e >= 0 && begin + sizes[i] <= _pt_end[e] && _pt_dev[e] == _clid) continue;
+        }
+        if (types[i] & STREAM_TO) in += sizes[i];
+        if (types[i] & STREAM_FROM) out += sizes[i];
     }
-    return 1;
+    pthread_mutex_unlock(&_rtl_lock);
+    if (c.device_rate < 0) return 1;
+
+    int threads = _cl_getenv_int("OMP_NUM_THREADS", 0);
+    if (threads <= 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+
+    double device = launches * c.launch + in / c.write_bw + out / c.read_bw + ops / c.device_rate;
+    double host = ops / (c.host_rate * threads);
+    if (_verbose)
+        printf("<rtl> %lld operations, %.0f bytes in, %.0f bytes out: device %.1f us, "
+               "host %.1f us (%d threads), run on the %s\n", (long long) ops, in, out,
+               device * 1e6, host * 1e6, threads, device < host ? "device" : "host");
+    return device < host;
 }
 
 ///
-/// Set the kernel arguments for cl_mem buffers
+/// Vector width of the kernels for elements of the given kind (_CL_VEC_INT,
+/// _CL_VEC_LONG, _CL_VEC_FLOAT or _CL_VEC_DOUBLE) on the selected device:
+/// its CL_DEVICE_PREFERRED_VECTOR_WIDTH_* rounded down to 2, 4, 8 or 16
+/// and capped by CLDEVICE_VECTOR. Return 1 to run the scalar kernel.
 ///
-int _cl_set_kernel_args(int nargs) {
-    int i;
-    for (i = 0; i < nargs; i++) {
-        _status |= clSetKernelArg(_kernel[_kerid], i, sizeof(cl_mem), &_locs[i]);
+int _cl_vector_width(int kind) {
+    static const cl_device_info query[] = {
+        CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG,
+        CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE
+    };
+    static const char *names[] = { "int", "long", "float", "double" };
+    cl_uint pref = 0;
+    int width;
+
+    if (_vector <= 1 || kind < _CL_VEC_INT || kind > _CL_VEC_DOUBLE) return 1;
+
+    pthread_mutex_lock(&_rtl_lock);
+    if (_vec_width == NULL) _vec_width = (int *) calloc(4 * _ndevices, sizeof(int));
+    width = _vec_width[4 * _clid + kind];
+    if (width == 0) {
+        _status = clGetDeviceInfo(_device[_clid], query[kind], sizeof(cl_uint), &pref, NULL);
         if (_status != CL_SUCCESS) {
-            fprintf(stderr, "<rtl> Error setting buffer %d to kernel in pos %d.\n", i, i);
+            fprintf(stderr, "<rtl> Warning: Unable to query the preferred %s vector width.\n", names[kind]);
             _clErrorCode(_status);
-            return 0;
+            pref = 1;
         }
-        if (_verbose) printf("<rtl> Pass buffer %d to kernel in pos %d\n", i, i);
+        // A device without double support reports 0
+        for (width = 1; width < 16 && 2 * width <= (int) pref; width *= 2);
+        _vec_width[4 * _clid + kind] = width;
+        if (_verbose)
+            printf("<rtl> Preferred %s vector width of device %d: %u, using %d\n",
+                   names[kind], _clid, pref, width);
     }
-    return 1;
+    pthread_mutex_unlock(&_rtl_lock);
+
+    while (width > _vector) width /= 2;
+    return width;
 }
 
 ///
-/// Set the kernel argument for cl_mem buffer given by index
+/// Auxiliary Function. Choose the local range of the current kernel for a
+/// dim-dimensional launch on the selected device, from the kernel limits
+/// (CL_KERNEL_WORK_GROUP_SIZE, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE)
+/// and its local memory use. The choice is kept in the kernel registry, so
+/// the queries run once per kernel and device. Return 1 (=true), if success
 ///
-int _cl_set_kernel_arg(int pos, int index) {
-    _status |= clSetKernelArg(_kernel[_kerid], pos, sizeof(cl_mem), &_locs[index]);
-    if (_status != CL_SUCCESS) {
-        fprintf(stderr, "<rtl> Error setting buffer %d to kernel in pos %d.\n", index, pos);
-        _clErrorCode(_status);
-        return 0;
-    }
-    if (_verbose) printf("<rtl> Pass buffer %d to kernel in pos %d\n", index, pos);
-    return 1;
+int _cl_work_group_size(cl_uint dim, size_t *local_size) {
+    pthread_mutex_lock(&_rtl_lock);
+    int status = _cl_work_group_size_locked(dim, local_size);
+    pthread_mutex_unlock(&_rtl_lock);
+    return status;
 }
 
 ///
-/// Set the kernel arguments for host args
+/// Auxiliary Function. Body of _cl_work_group_size, run under _rtl_lock
+/// since the sizing and tuning state is shared by all threads.
 ///
-int _cl_set_kernel_hostArg(int pos, int size, void *loc) {
-    _status = clSetKernelArg(_kernel[_kerid], pos, size, loc);
-    if (_status != CL_SUCCESS) {
-        fprintf(stderr, "<rtl> Error setting host args on device.\n");
-        _clErrorCode(_status);
+int _cl_work_group_size_locked(cl_uint dim, size_t *local_size) {
+
+    cl_kernel kernel = _kernel[_kerid];
+    cl_device_id device = _device[_clid];
+    cl_device_type type;
+    size_t wgsize, mult, target, x;
+    cl_ulong klocal = 0, dlocal = 0;
+    cl_int status;
+    int entry;
+
+    if (_kh_current < 0 || _kh_kernel[_kh_current * _ndevices + _clid] != kernel) return 0;
+    entry = _kh_current * _ndevices + _clid;
+    if (_kh_ldim[entry] == dim) {
+        if (_kh_trial[entry] >= 0) {
+            if (_cl_tune_candidate(entry, dim, local_size)) {
+                _tune_entry = entry;
+                memcpy(_tune_local, local_size, 3 * sizeof(size_t));
+                return 1;
+            }
+            // All candidates tried: keep the winner
+            _kh_trial[entry] = -1;
+            _cl_tune_set(_cl_tune_key(dim), &_kh_local[3 * entry], 1, _kh_best[entry]);
+            if (_verbose)
+                printf("<rtl> Tuned work-group of %s on device %d: %lu x %lu\n", _kh_name[_kh_current],
+                       _clid, _kh_local[3 * entry], _kh_local[3 * entry + 1]);
+        }
+        memcpy(local_size, &_kh_local[3 * entry], 3 * sizeof(size_t));
+        return 1;
+    }
+
+    status = clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                                      sizeof(size_t), &wgsize, NULL);
+    status |= clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                                       sizeof(size_t), &mult, NULL);
+    status |= clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_LOCAL_MEM_SIZE,
+                                       sizeof(cl_ulong), &klocal, NULL);
+    status |= clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &dlocal, NULL);
+    status |= clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &type, NULL);
+    if (status != CL_SUCCESS || wgsize == 0) {
+        fprintf(stderr, "<rtl> Warning: Unable to query work-group limits of %s.\n", _kh_name[_kh_current]);
         return 0;
     }
+    if (mult == 0 || mult > wgsize) mult = 1;
+
+    // CPUs run a work-group per core and want few large groups; GPUs want
+    // enough groups per compute unit to hide latency. A kernel whose local
+    // memory leaves room for a single resident group gets the largest one.
+    target = (type & CL_DEVICE_TYPE_CPU) ? 128 : 256;
+    if (klocal > 0 && 2 * klocal > dlocal) target = wgsize;
+    if (target > wgsize) target = wgsize;
+    if (target > mult) target -= target % mult;
+
+    local_size[0] = target;
+    local_size[1] = 1;
+    local_size[2] = 1;
+    if (dim == 2) {
+        // Rows of a warp/wavefront, stacked up to the target
+        x = (mult < 16) ? 16 : mult;
+        if (x > target) x = target;
+        local_size[0] = x;
+        local_size[1] = target / x;
+    }
+    if (local_size[0] > _max_work_items[3 * _clid]) local_size[0] = _max_work_items[3 * _clid];
+    if (local_size[1] > _max_work_items[3 * _clid + 1]) local_size[1] = _max_work_items[3 * _clid + 1];
+    if (local_size[0] == 0) local_size[0] = 1;
+    if (local_size[1] == 0) local_size[1] = 1;
+
+    // A tuned range from the database wins over the heuristic one
+    int record = _cl_tune_find(_cl_tune_key(dim));
+    if (record >= 0 && _tdb_local[3 * record] * _tdb_local[3 * record + 1] <= wgsize) {
+        memcpy(local_size, &_tdb_local[3 * record], 3 * sizeof(size_t));
+        if (_verbose) printf("<rtl> Using tuned work-group for %s.\n", _kh_name[_kh_current]);
+    }
+
+    memcpy(&_kh_local[3 * entry], local_size, 3 * sizeof(size_t));
+    _kh_ldim[entry] = dim;
+    _kh_best[entry] = -1;
+    // A split launch times the slices of all devices together, which says
+    // nothing about the range of one of them: it is never tuned
+    _kh_trial[entry] = (_tune && !_split && record < 0) ? 0 : -1;
+    if (_verbose)
+        printf("<rtl> Work-group of %s on device %d: %lu x %lu (max %lu, multiple %lu, local mem %lu)\n",
+               _kh_name[_kh_current], _clid, local_size[0], local_size[1], wgsize, mult,
+               (unsigned long) klocal);
     return 1;
 }
 
@@ -1398,19 +4692,34 @@ int _cl_execute_kernel(uint64_t size1, uint64_t size2, uint64_t size3, int dim)
     //     cpu     {0:128, 1:1, 2:1}
     //     gpu 1-d {3:256, 4:1, 5:1}
     //     gpu 2-d {6:32, 7:16, 8:1};
+    // used only when the kernel cannot be sized (see _cl_work_group_size)
     int idx = 0;
     if (_clid == 1) idx = 3; // >=1 ??
     if (dim == 2) idx *= 2;
 
+    local_size = (size_t *) calloc(3, sizeof(size_t));
+    if (!_autowg || !_cl_work_group_size(wd, local_size)) {
+        local_size[0] = _dev_work_group[9 * _clid + idx];
+        local_size[1] = _dev_work_group[9 * _clid + idx + 1];
+        local_size[2] = _dev_work_group[9 * _clid + idx + 2];
+    }
+
     global_size = (size_t *) calloc(3, sizeof(size_t));
-    global_size[0] = (size_t) ceil(((float) size1) / ((float) _work_group[idx])) * _work_group[idx];
-    global_size[1] = (size_t) ceil(((float) size2) / ((float) _work_group[idx + 1])) * _work_group[idx + 1];
-    global_size[2] = (size_t) ceil(((float) size2) / ((float) _work_group[idx + 2])) * _work_group[idx + 2];
+    global_size[0] = (size_t) ceil(((float) size1) / ((float) local_size[0])) * local_size[0];
+    global_size[1] = (size_t) ceil(((float) size2) / ((float) local_size[1])) * local_size[1];
+    global_size[2] = (size_t) ceil(((float) size3) / ((float) local_size[2])) * local_size[2];
 
-    local_size = (size_t *) calloc(3, sizeof(size_t));
-    local_size[0] = _work_group[idx];
-    local_size[1] = _work_group[idx + 1];
-    local_size[2] = _work_group[idx + 2];
+    if (_split && _ndevices > 1) {
+        int split = _cl_execute_split_kernel(global_size, local_size, wd);
+        if (split >= 0) return split;
+    }
+
+    cl_event *wait = NULL;
+    cl_uint nwait = 0;
+    if (_async) {
+        wait = (cl_event *) malloc((_nargbufs + 1) * sizeof(cl_event));
+        nwait = _cl_kernel_waitlist(wait);
+    }
 
     if (_verbose) {
         printf("<rtl> %s will be executed on device: %d\n", _strprog[_kerid], _clid);
@@ -1430,22 +4739,37 @@ int _cl_execute_kernel(uint64_t size1, uint64_t size2, uint64_t size3, int dim)
                     NULL,                              // global_work_offset
                     global_size,                       // global_work_size
                     local_size,                        // local_work_size
-                    0,                                 // num_events_in_wait_list
-                    NULL,                              // event_wait_list
-                    (_profile) ? &_global_event : NULL // event
+                    nwait,                             // num_events_in_wait_list
+                    (nwait) ? wait : NULL,             // event_wait_list
+                    (_profile || _async || _tune_entry >= 0) ? &_global_event : NULL // event
             );
+    if (_async) _cl_kernel_launched(wait);
 
     if (_status == CL_SUCCESS) {
         if (_profile) {
-            _kernel_time += _cl_profile("_cl_execute_kernel", _global_event);
+            _cl_trace(_cl_kernel_name(), _global_event, TRACE_KERNEL, -1, 0);
+        }
+
+        if (_tune_entry >= 0) {
+            _cl_tune_record(_global_event);
+            if (!_async) clReleaseEvent(_global_event);
         }
 
+        if (_async) clReleaseEvent(_global_event);
+
         if (_verbose) {
             printf("<rtl> %s has been running successfully.\n", _strprog[_kerid]);
         }
 
         return 1;
     } else {
+        // A candidate the device rejects is not retried
+        if (_tune_entry >= 0) {
+            pthread_mutex_lock(&_rtl_lock);
+            _kh_trial[_tune_entry] = (_kh_trial[_tune_entry] / _tune + 1) * _tune;
+            pthread_mutex_unlock(&_rtl_lock);
+            _tune_entry = -1;
+        }
         if (_status == CL_INVALID_WORK_DIMENSION)
             fprintf(stderr, "<rtl> Error executing kernel. Number of dimmensions is not a valid value.\n");
         else if (_status == CL_INVALID_GLOBAL_WORK_SIZE)
@@ -1463,6 +4787,8 @@ int _cl_execute_kernel(uint64_t size1, uint64_t size2, uint64_t size3, int dim)
 
 ///
 /// Enqueues a command to execute a (possible optimized w/ tilling) kernel.
+/// The local range is the block of the tiling, which the kernel code is
+/// written for, so it is neither sized nor tuned (see _cl_work_group_size).
 ///
 int _cl_execute_tiled_kernel(int wsize0, int wsize1, int wsize2,
                              int block0, int block1, int block2,
@@ -1496,6 +4822,13 @@ int _cl_execute_tiled_kernel(int wsize0, int wsize1, int wsize2,
         local_size[2] = block2;
     }
 
+    cl_event *wait = NULL;
+    cl_uint nwait = 0;
+    if (_async) {
+        wait = (cl_event *) malloc((_nargbufs + 1) * sizeof(cl_event));
+        nwait = _cl_kernel_waitlist(wait);
+    }
+
     if (_verbose) {
         printf("<rtl> %s will be executed on device: %d\n", _strprog[_kerid], _clid);
         printf("<rtl> Work Group was configured to:\n");
@@ -1514,16 +4847,19 @@ int _cl_execute_tiled_kernel(int wsize0, int wsize1, int wsize2,
                     NULL,                              // global_work_offset
                     global_size,                       // global_work_size
                     local_size,                        // local_work_size
-                    0,                                 // num_events_in_wait_list
-                    NULL,                              // event_wait_list
-                    (_profile) ? &_global_event : NULL // event
+                    nwait,                             // num_events_in_wait_list
+                    (nwait) ? wait : NULL,             // event_wait_list
+                    (_profile || _async) ? &_global_event : NULL // event
             );
+    if (_async) _cl_kernel_launched(wait);
 
     if (_status == CL_SUCCESS) {
         if (_profile) {
-            _kernel_time += _cl_profile("_cl_execute_tiled_kernel", _global_event);
+            _cl_trace(_cl_kernel_name(), _global_event, TRACE_KERNEL, -1, 0);
         }
 
+        if (_async) clReleaseEvent(_global_event);
+
         if (_verbose) {
             printf("<rtl> %s has been running successfully.\n", _strprog[_kerid]);
         }
@@ -1550,9 +4886,14 @@ int _cl_execute_tiled_kernel(int wsize0, int wsize1, int wsize2,
 ///
 void _cl_release_buffers(int upper) {
     int i;
+    _cl_thread_init();
     for (i = 0; i < upper; i++) {
-        if (_locs[i]) {
-            _status = clReleaseMemObject(_locs[i]);
+        if (_locs_stream[i].size) {
+            _locs_stream[i].size = 0;
+            if (_verbose) printf("<rtl> Releasing streamed buffer %d\n", i);
+        } else if (_locs[i]) {
+            if (_async) _cl_wait_buffer(i);
+            _cl_present_release(i);
             if (_verbose) printf("<rtl> Releasing buffer %d\n", i);
             _locs[i] = NULL;
         }
@@ -1564,8 +4905,13 @@ void _cl_release_buffers(int upper) {
 /// Release an OpenCL allocated buffer inside the map region, given an index.
 ///
 void _cl_release_buffer(int index) {
-    if (_locs[index]) {
-        _status = clReleaseMemObject(_locs[index]);
+    if (_locs_stream[index].size) {
+        _locs_stream[index].size = 0;
+        if (_verbose) printf("<rtl> Releasing streamed buffer %d\n", index);
+        _curid--;
+    } else if (_locs[index]) {
+        if (_async) _cl_wait_buffer(index);
+        _cl_present_release(index);
         if (_verbose) printf("<rtl> Releasing buffer %d\n", index);
         _locs[index] = NULL;
         _curid--;
@@ -1584,9 +4930,10 @@ double _cl_profile(const char *str, cl_event event) {
         exit(1);
     }
 
-    _status = clFinish(_cmd_queue[_clid]);
+    // wait only for the profiled command, not for the whole queue
+    _status = clWaitForEvents(1, &event);
     if (_status != CL_SUCCESS) {
-        fprintf(stderr, "<rtl> unable to finish command queue.\n");
+        fprintf(stderr, "<rtl> unable to wait for profiled event.\n");
         _clErrorCode(_status);
         exit(1);
     }
@@ -1628,6 +4975,148 @@ double _cl_profile(const char *str, cl_event event) {
     return time_elapsed;
 }
 
+///
+/// Auxiliary Function. Return the name of the current kernel.
+///
+const char *_cl_kernel_name() {
+    if (_kh_current >= 0 && _kh_prog[_kh_current] == _kerid) return _kh_name[_kh_current];
+    return _strprog[_kerid];
+}
+
+///
+/// Auxiliary Function. Called when a profiled command completes: account its
+/// time and keep its record for the trace. It never blocks.
+///
+void CL_CALLBACK _cl_trace_done(cl_event event, cl_int status, void *data) {
+    _cl_trace_rec *rec = (_cl_trace_rec *) data;
+    cl_ulong elapsed = 0;
+
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &rec->queued, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &rec->submit, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &rec->start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &rec->end, NULL);
+    if (status == CL_COMPLETE && rec->end > rec->start) elapsed = rec->end - rec->start;
+
+    pthread_mutex_lock(&_trace_lock);
+    *_trace_total[rec->kind] += elapsed;
+    if (_trace_file != NULL && status == CL_COMPLETE) {
+        if (_ntrace == _maxtrace) {
+            _maxtrace = (_maxtrace == 0) ? 256 : 2 * _maxtrace;
+            _trace = (_cl_trace_rec *) realloc(_trace, _maxtrace * sizeof(_cl_trace_rec));
+        }
+        _trace[_ntrace++] = *rec;
+    }
+    if (--_trace_pending == 0) pthread_cond_broadcast(&_trace_idle);
+    pthread_mutex_unlock(&_trace_lock);
+
+    if (_trace_file == NULL) printf("<rtl><profile> %s = %llu ns\n", rec->name, elapsed);
+    clReleaseEvent(event);
+    free(rec);
+}
+
+///
+/// Profile the command of event without waiting for it: its time is added to
+/// the totals of kind when it completes. id and bytes name the buffer and
+/// the size of a transfer (-1 and 0 for kernels).
+///
+void _cl_trace(const char *name, cl_event event, int kind, int id, uint64_t bytes) {
+    _cl_trace_rec *rec = (_cl_trace_rec *) calloc(1, sizeof(_cl_trace_rec));
+
+    rec->name = name;
+    rec->kind = kind;
+    rec->id = id;
+    rec->bytes = bytes;
+    rec->device = _clid;
+
+    clRetainEvent(event);
+    pthread_mutex_lock(&_trace_lock);
+    _trace_pending++;
+    pthread_mutex_unlock(&_trace_lock);
+    _status = clSetEventCallback(event, CL_COMPLETE, _cl_trace_done, rec);
+    if (_status != CL_SUCCESS) {
+        fprintf(stderr, "<rtl> Failed to register the profiling callback of %s.\n", name);
+        _clErrorCode(_status);
+        pthread_mutex_lock(&_trace_lock);
+        _trace_pending--;
+        pthread_mutex_unlock(&_trace_lock);
+        clReleaseEvent(event);
+        free(rec);
+    }
+}
+
+///
+/// Auxiliary Function. Write s to file as the body of a JSON string.
+///
+void _cl_json_string(FILE *file, const char *s) {
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', file);
+        if ((unsigned char) *s >= 0x20) fputc(*s, file);
+    }
+}
+
+///
+/// Wait for the pending profiling callbacks (the queues are already
+/// finished, so only the callbacks themselves may still be running, on
+/// threads of the OpenCL implementation) and write the Chrome trace, if
+/// requested. Timestamps are in
+/// microseconds from the first queued command; each device is a process,
+/// with kernels and transfers on separate threads.
+///
+void _cl_trace_finish() {
+    int i, pending;
+    cl_ulong base = 0;
+    const char *sep = "";
+    char info[256];
+    struct timespec deadline;
+
+    // A callback the implementation never calls must not hang the exit
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 10;
+    pthread_mutex_lock(&_trace_lock);
+    while (_trace_pending > 0 && pthread_cond_timedwait(&_trace_idle, &_trace_lock, &deadline) == 0);
+    pending = _trace_pending;
+    pthread_mutex_unlock(&_trace_lock);
+    if (pending > 0) fprintf(stderr, "<rtl> Warning: %d profiled commands never completed.\n", pending);
+
+    if (_trace_file == NULL) return;
+    FILE *file = fopen(_trace_file, "w");
+    if (file == NULL) {
+        fprintf(stderr, "<rtl> Failed to open trace file %s.\n", _trace_file);
+    } else {
+        for (i = 0; i < _ntrace; i++)
+            if (base == 0 || _trace[i].queued < base) base = _trace[i].queued;
+
+        fprintf(file, "{\"traceEvents\":[\n");
+        for (i = 0; i < (int) _ndevices; i++) {
+            memset(info, '\0', sizeof(info));
+            if (_device[i] != NULL) clGetDeviceInfo(_device[i], CL_DEVICE_NAME, sizeof(info) - 1, info, NULL);
+            fprintf(file, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"", sep, i);
+            _cl_json_string(file, info);
+            fprintf(file, "\"}}");
+            sep = ",\n";
+        }
+        for (i = 0; i < _ntrace; i++) {
+            _cl_trace_rec *rec = &_trace[i];
+            fprintf(file, "%s{\"name\":\"", sep);
+            _cl_json_string(file, rec->name);
+            fprintf(file, "\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                          "\"args\":{\"buffer\":%d,\"bytes\":%llu,\"queued\":%.3f,\"submit\":%.3f}}",
+                    _trace_cat[rec->kind], rec->device, (rec->kind == TRACE_KERNEL) ? 0 : 1,
+                    (rec->start - base) / 1e3, (rec->end - rec->start) / 1e3, rec->id,
+                    (unsigned long long) rec->bytes, (rec->queued - base) / 1e3,
+                    (rec->submit - base) / 1e3);
+            sep = ",\n";
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        if (_verbose) printf("<rtl> Wrote %d profiled commands to %s.\n", _ntrace, _trace_file);
+    }
+
+    free(_trace);
+    _trace = NULL;
+    _ntrace = _maxtrace = 0;
+}
+
 ///
 /// Return the threads * size(type) in bytes.
 /// Adjust the threads & blocks to be power of 2
@@ -1645,8 +5134,8 @@ int _cl_get_threads_blocks(int *threads, int *blocks, int *sthreads, int *sblock
         }
     }
 
-    *threads = min(*threads, _max_work_items[0]);
-    *blocks = min(*blocks, _max_work_items[0]);
+    *threads = min(*threads, _max_work_items[3 * _clid]);
+    *blocks = min(*blocks, _max_work_items[3 * _clid]);
     bytesthreads = (*threads) * bytes;
     *sthreads = max(1, *threads / 2);
     *sblocks = max(1, *blocks / 2);
@@ -1662,6 +5151,169 @@ int _cl_get_threads_blocks(int *threads, int *blocks, int *sthreads, int *sblock
     return bytesthreads;
 }
 
+///
+/// Size the first stage of a reduction over size iterations for the current
+/// kernel: threads work-items per group, a power of two so that the tree in
+/// local memory halves evenly, and enough blocks to keep every compute unit
+/// busy. The work-items stride over the remaining iterations, so blocks does
+/// not grow with size. Return 1 (=true), if success
+///
+int _cl_get_reduction_groups(int *threads, int *blocks, uint64_t size) {
+    size_t wgsize = 0, target, t;
+    cl_uint units = 1;
+    cl_device_type type = CL_DEVICE_TYPE_GPU;
+    uint64_t groups, cap;
+
+    _status = clGetKernelWorkGroupInfo(_kernel[_kerid], _device[_clid], CL_KERNEL_WORK_GROUP_SIZE,
+                                       sizeof(size_t), &wgsize, NULL);
+    _status |= clGetDeviceInfo(_device[_clid], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &units, NULL);
+    _status |= clGetDeviceInfo(_device[_clid], CL_DEVICE_TYPE, sizeof(cl_device_type), &type, NULL);
+    if (_status != CL_SUCCESS || wgsize == 0) {
+        fprintf(stderr, "<rtl> Warning: Unable to query work-group limits for the reduction.\n");
+        _clErrorCode(_status);
+        wgsize = 1;
+        units = 1;
+    }
+
+    target = (type & CL_DEVICE_TYPE_CPU) ? 128 : 256;
+    if (target > wgsize) target = wgsize;
+    if (target > (size_t) _max_work_items[3 * _clid]) target = _max_work_items[3 * _clid];
+    for (t = 1; 2 * t <= target; t *= 2);
+
+    // CPUs run a group per core, GPUs want several per compute unit
+    cap = (type & CL_DEVICE_TYPE_CPU) ? units : 8 * (uint64_t) units;
+    groups = (size + t - 1) / t;
+    if (groups > cap) groups = cap;
+    if (groups == 0) groups = 1;
+
+    *threads = (int) t;
+    *blocks = (int) groups;
+    if (_verbose) {
+        printf("<rtl> reduction of %llu iterations: %d groups of %d work-items\n",
+               (unsigned long long) size, *blocks, *threads);
+    }
+    return 1;
+}
+
+// Elements each work-item of a scan block scans serially
+#define SCAN_ITEMS 8
+
+///
+/// Scan one level of the block-sum hierarchy: the block kernel scans tiles
+/// of SCAN_ITEMS elements per work-item, the group totals are scanned by
+/// recursion and the add kernel combines them back into the tiles. flags is
+/// the buffer of segment heads, or -1 for an unsegmented scan. Scratch
+/// buffers are taken above _curid and released in reverse order.
+/// Return 1 (=true), if success
+///
+static int _cl_scan_level(int block, int add, int in, int out, int flags,
+                          uint64_t n, int bytes, int fbytes, int exclusive) {
+    size_t wgsize = 0, t;
+    uint64_t tile, groups;
+    int threads, items = SCAN_ITEMS, sums = out, gflags = flags, gfirst = flags;
+    int pos, ok;
+    cl_long len = (cl_long) n;
+
+    if (n == 0) return 1;
+    if (!_cl_use_kernel(block)) return 0;
+
+    _status = clGetKernelWorkGroupInfo(_kernel[_kerid], _device[_clid], CL_KERNEL_WORK_GROUP_SIZE,
+                                       sizeof(size_t), &wgsize, NULL);
+    if (_status != CL_SUCCESS || wgsize == 0) {
+        // _cl_set_kernel_arg accumulates _status
+        _status = CL_SUCCESS;
+        wgsize = 1;
+    }
+    if (wgsize > 256) wgsize = 256;
+    if (wgsize > (size_t) _max_work_items[3 * _clid]) wgsize = _max_work_items[3 * _clid];
+    // no more work-items than the elements need
+    for (t = 1; 2 * t <= wgsize && t * items < n; t *= 2);
+    threads = (int) t;
+    tile = (uint64_t) threads * items;
+    groups = (n + tile - 1) / tile;
+
+    if (_verbose) {
+        printf("<rtl> scan of %llu elements: %llu groups of %d work-items\n",
+               (unsigned long long) n, (unsigned long long) groups, threads);
+    }
+
+    if (groups > 1) {
+        if (!_cl_create_read_write(groups * bytes)) return 0;
+        sums = _curid;
+        if (flags >= 0) {
+            if (!_cl_create_read_write(groups * fbytes)) {
+                _cl_release_buffer(sums);
+                return 0;
+            }
+            gflags = _curid;
+            if (!_cl_create_read_write(groups * sizeof(cl_int))) {
+                _cl_release_buffer(gflags);
+                _cl_release_buffer(sums);
+                return 0;
+            }
+            gfirst = _curid;
+        }
+    }
+
+    // With a single group the totals are never stored: any buffer will do
+    ok = _cl_set_kernel_arg(0, in) && _cl_set_kernel_arg(1, out) && _cl_set_kernel_arg(2, sums) &&
+         _cl_set_kernel_hostArg(3, sizeof(cl_long), &len) &&
+         _cl_set_kernel_hostArg(4, sizeof(int), &items) &&
+         _cl_set_kernel_hostArg(5, sizeof(int), &exclusive) &&
+         _cl_set_kernel_hostArg(6, threads * bytes, NULL);
+    if (ok && flags >= 0) {
+        ok = _cl_set_kernel_arg(7, flags) && _cl_set_kernel_arg(8, gflags) &&
+             _cl_set_kernel_arg(9, gfirst) &&
+             _cl_set_kernel_hostArg(10, threads * sizeof(cl_int), NULL);
+    }
+    ok = ok && _cl_execute_tiled_kernel((int) groups, 0, 0, threads, 0, 0, 1);
+
+    if (ok && groups > 1) {
+        // Group totals are always scanned inclusive: group g adds total g-1
+        ok = _cl_scan_level(block, add, sums, sums, gflags, groups, bytes, fbytes, 0);
+        ok = ok && _cl_use_kernel(add);
+        pos = 0;
+        ok = ok && _cl_set_kernel_arg(pos++, out) && _cl_set_kernel_arg(pos++, sums) &&
+             _cl_set_kernel_hostArg(pos++, sizeof(cl_long), &len) &&
+             _cl_set_kernel_hostArg(pos++, sizeof(int), &items);
+        if (ok && flags >= 0) ok = _cl_set_kernel_arg(pos++, gfirst);
+        ok = ok && _cl_execute_tiled_kernel((int) groups, 0, 0, threads, 0, 0, 1);
+    }
+
+    if (groups > 1) {
+        if (flags >= 0) {
+            _cl_release_buffer(gfirst);
+            _cl_release_buffer(gflags);
+        }
+        _cl_release_buffer(sums);
+    }
+    return ok;
+}
+
+///
+/// Scan n elements of bytes bytes each from buffer in into buffer out (they
+/// may be the same) with the kernels of the handles block and add, which
+/// codegen emits for each scan variable. flags is the buffer of segment
+/// heads, of fbytes bytes each, or -1; exclusive selects the exclusive scan.
+/// Any n works: the group totals are scanned by the same kernels until they
+/// fit in one work-group. Return 1 (=true), if success
+///
+int _cl_scan(int block, int add, int in, int out, int flags,
+             uint64_t n, int bytes, int fbytes, int exclusive) {
+    _cl_thread_init();
+    if (_verbose) {
+        printf("<rtl> %s scan of buffer %d into buffer %d%s\n",
+               exclusive ? "exclusive" : "inclusive", in, out,
+               (flags >= 0) ? " (segmented)" : "");
+    }
+    if (!_cl_scan_level(block, add, in, out, flags, n, bytes, fbytes, exclusive)) {
+        fprintf(stderr, "<rtl> Failed scanning buffer %d of %llu elements.\n", in,
+                (unsigned long long) n);
+        return 0;
+    }
+    return 1;
+}
+
 //
 // Init Shared Buffer Vector
 //
@@ -1680,14 +5332,39 @@ void _cl_init_shared_buffer (int DCAO_dbg) {
 }
 
 //
-// Checking if the Object buffer being created exceeds the size of the vector
+// Checking if the Object buffer being created exceeds the size of the vector.
+// The vector is shared by the host threads: it only changes under _rtl_lock,
+// and its entries are read through _cl_shared_buffer
 //
 void _inc_curid_shared_buffer () {
+  pthread_mutex_lock(&_rtl_lock);
   _curid_shared_buffer++;
   if (_curid_shared_buffer == _upperid_shared_buffer) {
+    _locs_shared_buffer = (cl_mem *) realloc(_locs_shared_buffer,
+                                             2 * _upperid_shared_buffer * sizeof(cl_mem));
+    memset(_locs_shared_buffer + _upperid_shared_buffer, 0, _upperid_shared_buffer * sizeof(cl_mem));
     _upperid_shared_buffer *= 2;
-    _locs = (cl_mem *) realloc(_locs, _upperid_shared_buffer * sizeof(cl_mem));
   }
+  pthread_mutex_unlock(&_rtl_lock);
+}
+
+//
+// Shared buffer index, read under the lock (see _inc_curid_shared_buffer)
+//
+cl_mem _cl_shared_buffer (int index) {
+  pthread_mutex_lock(&_rtl_lock);
+  cl_mem buf = _locs_shared_buffer[index];
+  pthread_mutex_unlock(&_rtl_lock);
+  return buf;
+}
+
+//
+// Store buf as shared buffer index
+//
+void _cl_set_shared_buffer (int index, cl_mem buf) {
+  pthread_mutex_lock(&_rtl_lock);
+  _locs_shared_buffer[index] = buf;
+  pthread_mutex_unlock(&_rtl_lock);
 }
 
 //
@@ -1695,6 +5372,7 @@ void _inc_curid_shared_buffer () {
 //
 void _cl_release_buffers_shared_buffer() {
   int i;
+  pthread_mutex_lock(&_rtl_lock);
   for (i=0; i<_upperid_shared_buffer; i++) {
     if (_locs_shared_buffer[i]) {
       _status = clReleaseMemObject(_locs_shared_buffer[i]);
@@ -1703,18 +5381,20 @@ void _cl_release_buffers_shared_buffer() {
     }
   }
   _curid_shared_buffer = -1;
+  pthread_mutex_unlock(&_rtl_lock);
 }
 
 //
 // Releasing a specific shared buffer objects 
 //
 void _cl_release_shared_buffer(int index) {
-  int i;
+  pthread_mutex_lock(&_rtl_lock);
   if (_locs_shared_buffer[index]) {
     _status = clReleaseMemObject(_locs_shared_buffer[index]);
     if (_verbose) printf("<rtl> Releasing buffer %d\n", index);
     _locs_shared_buffer[index] = NULL;
   }
+  pthread_mutex_unlock(&_rtl_lock);
 }
 
 //
@@ -1727,8 +5407,8 @@ void _cl_create_shared_buffer_write_only (long size, int position) {
 
   if(_profile) t_start = _cl_rtclock();
 
-  _locs_shared_buffer[position] = clCreateBuffer(_context[_clid], CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-				 size, NULL, &_status);
+  _cl_set_shared_buffer(position, clCreateBuffer(_context[_clid], CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+				 size, NULL, &_status));
   if(_profile){
     t_end= _cl_rtclock();
     _buffer_time += t_end - t_start;
@@ -1752,8 +5432,8 @@ void _cl_create_shared_buffer_read_only (long size, int position) {
 
   if(_profile) t_start = _cl_rtclock();
 
-  _locs_shared_buffer[position] = clCreateBuffer(_context[_clid], CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
-				 size, NULL, &_status);
+  _cl_set_shared_buffer(position, clCreateBuffer(_context[_clid], CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+				 size, NULL, &_status));
   if(_profile){
     t_end= _cl_rtclock();
     _buffer_time += t_end - t_start;
@@ -1778,8 +5458,8 @@ void _cl_create_shared_buffer_read_write (long size, int position) {
   if(_profile) 
     t_start = _cl_rtclock();
 
-  _locs_shared_buffer[position] = clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-				 size, NULL, &_status);
+  _cl_set_shared_buffer(position, clCreateBuffer(_context[_clid], CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+				 size, NULL, &_status));
   if(_profile){
     t_end= _cl_rtclock();
     _buffer_time += t_end - t_start;
@@ -1797,7 +5477,8 @@ void _cl_create_shared_buffer_read_write (long size, int position) {
 // Setting a shared buffer as argument
 //
 int _cl_set_kernel_arg_shared_buffer (int pos, int index) {
-  _status |= clSetKernelArg (_kernel[_kerid], pos, sizeof(cl_mem), &_locs_shared_buffer[index]);
+  cl_mem buf = _cl_shared_buffer(index);
+  _status |= clSetKernelArg (_kernel[_kerid], pos, sizeof(cl_mem), &buf);
 
   if (_status != CL_SUCCESS) {
     fprintf(stderr, "<rtl> Error setting buffer %d to kernel in pos %d.\n", index, pos);
@@ -1816,11 +5497,11 @@ void *_cl_map_buffer_write_invalidate_region(int index){
   cl_int errcode;
   
   clFinish(_cmd_queue[_clid]);
-  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _locs_shared_buffer[index], CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 
+  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _cl_shared_buffer(index), CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 
 				0, sharedSize[index], 0, NULL, (_profile) ? &_global_event : NULL, &errcode);
 
   if (_profile) {
-    _map_time += _cl_profile("_cl_map_buffer_write_invalidate_region", _global_event);
+    _cl_trace("_cl_map_buffer_write_invalidate_region", _global_event, TRACE_MAP, index, sharedSize[index]);
   }
 
   ptr_shared_buffers[index] = p; 
@@ -1838,11 +5519,11 @@ void *_cl_map_buffer_write(int index){
   cl_int errcode;
   
   clFinish(_cmd_queue[_clid]);
-  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _locs_shared_buffer[index], CL_TRUE, CL_MAP_WRITE, 
+  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _cl_shared_buffer(index), CL_TRUE, CL_MAP_WRITE, 
 				0, sharedSize[index], 0, NULL, (_profile) ? &_global_event : NULL, &errcode);
 
   if (_profile) {
-    _map_time += _cl_profile("_cl_map_buffer_write", _global_event);
+    _cl_trace("_cl_map_buffer_write", _global_event, TRACE_MAP, index, sharedSize[index]);
   }
 
   ptr_shared_buffers[index] = p; 
@@ -1858,13 +5539,13 @@ void *_cl_map_buffer_write(int index){
 void *_cl_map_buffer_read(int index){
   cl_int errcode;
 
-  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _locs_shared_buffer[index], CL_TRUE, CL_MAP_READ, 
+  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _cl_shared_buffer(index), CL_TRUE, CL_MAP_READ, 
 				0, sharedSize[index], 0, NULL, (_profile) ? &_global_event : NULL, &errcode);
 
   ptr_shared_buffers[index] = p; 
   
   if (_profile) {
-    _map_time += _cl_profile("_cl_map_buffer_read", _global_event);
+    _cl_trace("_cl_map_buffer_read", _global_event, TRACE_MAP, index, sharedSize[index]);
   }
 
   if (_verbose) printf("<rtl> Mapping buffer %d (%ld bytes) to read\n", index, sharedSize[index]);
@@ -1879,13 +5560,13 @@ void *_cl_map_buffer_read(int index){
 void *_cl_map_buffer_read_write(int index){
   cl_int errcode;
 
-  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _locs_shared_buffer[index], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 
+  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _cl_shared_buffer(index), CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 
 				0, sharedSize[index], 0, NULL, (_profile) ? &_global_event : NULL, &errcode);
  
   ptr_shared_buffers[index] = p; 
   
   if (_profile) {
-    _map_time += _cl_profile("_cl_map_buffer_read_write", _global_event);
+    _cl_trace("_cl_map_buffer_read_write", _global_event, TRACE_MAP, index, sharedSize[index]);
   }
 
   if (_verbose) printf("<rtl> Mapping buffer %d (%ld bytes) to read-writte\n", index, sharedSize[index]);
@@ -1901,13 +5582,13 @@ void *_cl_map_buffer_read_write(int index){
 void *_cl_map_buffer_read_write_nBlock(int index){
   cl_int errcode;
 
-  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _locs_shared_buffer[index], CL_FALSE, CL_MAP_READ | CL_MAP_WRITE, 
+  void *p = clEnqueueMapBuffer(_cmd_queue[_clid], _cl_shared_buffer(index), CL_FALSE, CL_MAP_READ | CL_MAP_WRITE, 
 				0, sharedSize[index], 0, NULL, (_profile) ? &_global_event : NULL, &errcode);
  
   ptr_shared_buffers[index] = p; 
   
   if (_profile) {
-    _map_time += _cl_profile("_cl_map_buffer_read_write", _global_event);
+    _cl_trace("_cl_map_buffer_read_write", _global_event, TRACE_MAP, index, sharedSize[index]);
   }
 
   if (_verbose) printf("<rtl> Mapping buffer %d (%ld bytes) to read-writte\n", index, sharedSize[index]);
@@ -1922,11 +5603,11 @@ void *_cl_map_buffer_read_write_nBlock(int index){
 void _cl_unmap_buffer(int index){
   
   cl_int errcode;
-  errcode = clEnqueueUnmapMemObject(_cmd_queue[_clid], _locs_shared_buffer[index], ptr_shared_buffers[index],
+  errcode = clEnqueueUnmapMemObject(_cmd_queue[_clid], _cl_shared_buffer(index), ptr_shared_buffers[index],
                                     0, NULL, (_profile) ? &_global_event : NULL);
 
   if (_profile) {
-    _unmap_time += _cl_profile("_cl_unmap_buffer", _global_event);
+    _cl_trace("_cl_unmap_buffer", _global_event, TRACE_UNMAP, index, sharedSize[index]);
   }
 
   if(errcode != CL_SUCCESS) printf("<rtl> Error[%d] in unmapping buffer %d\n", errcode, index);
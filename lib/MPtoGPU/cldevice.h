@@ -28,19 +28,70 @@
 
 #include <sys/time.h>
 
+// Kinds of the kernel images codegen embeds in the host executable
+#define _CL_IMAGE_SOURCE 0
+#define _CL_IMAGE_SPIR   1
+#define _CL_IMAGE_AOCX   2
+#define _CL_IMAGE_SPIRV  3
+
+// Kinds of the arguments of a batched launch (see _cl_launch)
+#define _CL_ARG_BUFFER 0
+#define _CL_ARG_HOST   1
+#define _CL_ARG_LOCAL  2
+
+// Element kinds of the vector kernels (see _cl_vector_width)
+#define _CL_VEC_INT    0
+#define _CL_VEC_LONG   1
+#define _CL_VEC_FLOAT  2
+#define _CL_VEC_DOUBLE 3
+
+// Entry of the argument table codegen emits for each launch site
+typedef struct {
+    int kind;
+    int index;
+    int size;
+} _cl_arg_desc;
+
+// Entry of the table of the arrays a streamed launch may move in slices (see
+// _cl_launch_stream): the kernel arguments of the buffer and of the first
+// element of its slice, the range of constants added to the loop counter in
+// its subscripts ([wlo, whi] for the stores, empty if wlo > whi) and the
+// size of an element
+typedef struct {
+    int arg;
+    int offset;
+    int lo;
+    int hi;
+    int wlo;
+    int whi;
+    int elem;
+} _cl_stream_desc;
+
+// Calibration of a device for the offload dispatch (see
+// _cl_offload_profitable): bytes per second of each copy direction, seconds
+// per launch, and operations per second of the device and of one host thread
+typedef struct {
+    double write_bw;
+    double read_bw;
+    double launch;
+    double device_rate;
+    double host_rate;
+} _cl_calibration;
+
+// Variables marked __thread are kept per host thread (see cldevice.c)
 extern cl_device_id     *_device;
 extern cl_context       *_context;
 extern cl_command_queue *_cmd_queue;
-extern cl_mem           *_locs;
+extern __thread cl_mem  *_locs;
 
 extern cl_platform_id    _platform;
-extern cl_program       *_program;
-extern cl_kernel        *_kernel;
+extern __thread cl_program *_program;
+extern __thread cl_kernel  *_kernel;
 extern cl_uint           _ndevices;
-extern cl_uint           _clid;
-extern cl_int            _status;
+extern __thread cl_uint  _clid;
+extern __thread cl_int   _status;
 
-extern cl_uint           _kerid;
+extern __thread cl_uint  _kerid;
 extern cl_uint           _nkernels;
 extern cl_uint           _sentinel;
 extern char            **_strprog;
@@ -48,20 +99,47 @@ extern char            **_strprog;
 extern int               _spir_support;
 extern int               _gpu_present;
 extern int               _cpu_present;
-extern int               _upperid;
-extern int               _curid;
+extern __thread int      _upperid;
+extern __thread int      _curid;
 extern int               _verbose;
 extern int               _profile;
+extern int               _async;
 
 extern int               _work_group[9];
+extern int*              _dev_work_group;
 extern int               _block_sizes[11];
     
-extern cl_event         _global_event;
+extern __thread cl_event _global_event;
+
+extern cl_command_queue *_xfer_queue;
+extern __thread cl_event *_locs_event;
+
+extern int               _split;
+extern int               _pool;
+extern int               _present;
+extern int               _pinned;
+extern int               _zerocopy;
+extern int               _prebuild;
+extern int               _embedded;
+extern int               _stream;
+extern int               _dispatch;
+extern int               _vector;
+extern int*              _vec_width;
 
 void _cldevice_details(cl_device_id   id,
                        cl_device_info param_name,
                        const char*    param_str);
 
+int _cl_getenv_int (const char* name, int defval);
+
+void _cl_thread_init ();
+
+void _cl_thread_reset ();
+
+void _cl_thread_grow ();
+
+void _cl_thread_sync ();
+
 void _cldevice_init (int rtlmode);
 
 void _cldevice_finish ();
@@ -70,6 +148,11 @@ cl_program _create_fromSource(cl_context   context,
                               cl_device_id device,
                               const char*  fileName);
 
+cl_program _create_fromBinaryWithOptions(cl_context   context,
+                                         cl_device_id device,
+                                         const char*  fileName,
+                                         const char*  flags);
+
 cl_program _create_fromBinary(cl_context   context,
                               cl_device_id device,
                               const char*  fileName);
@@ -78,6 +161,29 @@ int _save_toBinary(cl_program    program,
                    cl_device_id device,
                    const char*  fileName);
 
+int _does_file_exist (const char* filename);
+
+void _cl_cache_init ();
+
+cl_program _create_fromMemory(cl_context          context,
+                              cl_device_id        device,
+                              const char*         name,
+                              const unsigned char* image,
+                              size_t              size,
+                              int                 kind);
+
+cl_program _create_fromImage(cl_context          context,
+                             cl_device_id        device,
+                             const char*         name,
+                             const unsigned char* image,
+                             size_t              size,
+                             int                 kind);
+
+cl_program _create_fromCache(cl_context   context,
+                             cl_device_id device,
+                             const char*  fileName,
+                             int          is_source);
+
 cl_uint _get_num_cores (int A, int B, int C, int T);
 
 cl_uint _get_num_devices ();
@@ -86,6 +192,44 @@ cl_uint _get_default_device ();
 
 void _set_default_device (cl_uint id);
 
+void _cl_query_work_items (cl_uint d);
+
+cl_mem _cl_pool_alloc (cl_mem_flags flags, size_t size, cl_int* status);
+
+void _cl_pool_free (cl_mem mem);
+
+void _cl_pool_init ();
+
+void _cl_pool_finish ();
+
+void _cl_pool_stats ();
+
+int _cl_present_map (uint64_t size, void* loc);
+
+void _cl_present_insert (uint64_t size, void* loc);
+
+void _cl_present_release (int id);
+
+int _cl_staging (uint64_t size);
+
+cl_int _cl_staged_write (cl_command_queue queue, cl_mem dst, uint64_t size,
+                         const void* src, cl_event* event);
+
+cl_int _cl_staged_read (cl_command_queue queue, cl_mem src, uint64_t size, void* dst,
+                        cl_uint nwait, const cl_event* wait, cl_event* event);
+
+int _cl_host_unified (cl_uint d);
+
+int _cl_wrap_host_ok (uint64_t size, void* loc);
+
+int _cl_offload_wrapped (uint64_t size, void* loc);
+
+int _cl_stream_ok (uint64_t size);
+
+int _cl_offload_streamed (uint64_t size, void* loc, int map);
+
+int _cl_resident (int id);
+
 int _cl_create_read_only (uint64_t size);
 
 int _cl_create_write_only (uint64_t size);
@@ -102,16 +246,90 @@ int _cl_read_buffer (uint64_t size, int id, void* loc);
 
 int _cl_write_buffer (uint64_t size, int id, void* loc);
 
+int _cl_read_mapped (uint64_t size, int id, void* loc);
+
 int _cl_create_program (char* str);
 
+cl_program _cl_build_program (cl_uint prog, const char* str);
+
+int _cl_find_image (const char* str, int kind);
+
+int _cl_il_support (cl_uint d);
+
+cl_program _cl_image_program (const char* str, cl_uint d, int portable);
+
+cl_program _cl_load_program (const char* str);
+
+void _cl_register_program (char* str);
+
+void _cl_register_image (char* str, int kind, char* image, uint64_t size);
+
+void _cl_prebuild_start ();
+
+int _cl_prebuilt (const char* str, cl_program* program);
+
+void _cl_prebuild_finish ();
+
 int _cl_create_kernel (char* str);
 
+int _cl_kernel_lookup (cl_uint prog, const char* name);
+
+int _cl_select_kernel (int handle);
+
+int _cl_kernel_handle (char* prog, char* kernel);
+
+int _cl_use_kernel (int handle);
+
 int _cl_set_kernel_args (int nargs);
 
 int _cl_set_kernel_arg (int pos, int index);
 
 int _cl_set_kernel_hostArg (int pos, int size, void* loc);
 
+void _cl_record_arg (int pos, int index, size_t size, const void* loc);
+
+void _cl_arg_forget (int pos);
+
+void _cl_arg_drop (cl_mem mem);
+
+int _cl_launch (int handle, int nargs, const _cl_arg_desc* desc, void** vals, const int64_t* ndrange);
+
+int _cl_launch_stream (int handle, int nargs, const _cl_arg_desc* desc, void** vals, const int64_t* ndrange,
+                       int loop, int nstreams, const _cl_stream_desc* streams);
+
+void _cl_split_resize (cl_uint old, cl_uint nkernels);
+
+int _cl_execute_split_kernel (size_t* global_size, size_t* local_size, cl_uint wd);
+
+uint64_t _cl_calibration_key (cl_uint d);
+
+int _cl_calibration_load (cl_uint d);
+
+void _cl_calibration_save (cl_uint d);
+
+int _cl_calibrate (cl_uint d, _cl_calibration* cal);
+
+int _cl_offload_profitable (int64_t ops, int launches, int nmaps, void** locs,
+                            const int64_t* sizes, const int* types);
+
+int _cl_vector_width (int kind);
+
+uint64_t _cl_tune_key (cl_uint dim);
+
+int _cl_tune_find (uint64_t key);
+
+void _cl_tune_set (uint64_t key, const size_t* local, int save, double time);
+
+void _cl_tune_load ();
+
+int _cl_tune_candidate (int entry, cl_uint dim, size_t* local_size);
+
+void _cl_tune_record (cl_event event);
+
+int _cl_work_group_size (cl_uint dim, size_t* local_size);
+
+int _cl_work_group_size_locked (cl_uint dim, size_t* local_size);
+
 int _cl_execute_kernel (uint64_t size1, uint64_t size2, uint64_t size3, int dim);
 
 int _cl_execute_tiled_kernel (int wsize0, int wsize1, int wsize2, int block0, int block1, int block2, int dim);
@@ -120,12 +338,25 @@ void _cl_release_buffers (int upper);
 
 double _cl_profile(const char* str, cl_event event);
 
+const char* _cl_kernel_name ();
+
+void _cl_trace (const char* name, cl_event event, int kind, int id, uint64_t bytes);
+
+void _cl_trace_finish ();
+
 int _cl_get_threads_blocks(int *threads, int *blocks, int *sthreads, int *sblocks, uint64_t size, int bytes);
 
+int _cl_get_reduction_groups(int *threads, int *blocks, uint64_t size);
+
+int _cl_scan(int block, int add, int in, int out, int flags,
+             uint64_t n, int bytes, int fbytes, int exclusive);
+
 
 /* DCAO runtime */
 void _cl_init_shared_buffer (int DCAO_dbg);
 void _inc_curid_shared_buffer ();
+cl_mem _cl_shared_buffer (int index);
+void _cl_set_shared_buffer (int index, cl_mem buf);
 void _cl_release_buffers_shared_buffer();
 void _cl_release_shared_buffer(int index);
 void _cl_create_shared_buffer_write_only (long size, int position);
@@ -1930,7 +1930,10 @@ OMPClause *Parser::ParseOpenMPClause(OpenMPClauseKind Kind) {
 ///       'reduction' '(' reduction-identifier ':' list ')'
 ///
 ///    scan-clause:
-///       'scan' '(' scan-identifier ':' list ')'
+///       'scan' '(' [ scan-mode ',' ] scan-identifier ':' list [ ':' segment-flags ] ')'
+///
+///    scan-mode:
+///       'inclusive' | 'exclusive'
 ///
 ///    depend-clause:
 ///       'depend' '(' dependence-type ':' list ')'
@@ -1967,6 +1970,7 @@ OMPClause *Parser::ParseOpenMPVarListClause(OpenMPClauseKind Kind) {
     ConsumeAnyToken();
 
   unsigned Op = OMPC_REDUCTION_unknown;
+  bool ScanExclusive = false;
   // Parsing "reduction-identifier ':'" for reduction clause.
   if (Kind == OMPC_reduction) {
     Op = Tok.isAnnotation()
@@ -2012,6 +2016,14 @@ OMPClause *Parser::ParseOpenMPVarListClause(OpenMPClauseKind Kind) {
     else
       ConsumeAnyToken();
   } else if (Kind == OMPC_scan) {
+      // Parsing "scan-mode ','" for scan clause, inclusive by default.
+      if (Tok.is(tok::identifier) && NextToken().is(tok::comma) &&
+          (Tok.getIdentifierInfo()->isStr("inclusive") ||
+           Tok.getIdentifierInfo()->isStr("exclusive"))) {
+          ScanExclusive = Tok.getIdentifierInfo()->isStr("exclusive");
+          ConsumeAnyToken();
+          ConsumeAnyToken();
+      }
       // Parsing "scan-identifier ':'" for scan clause.
       Op = Tok.isAnnotation()
            ? (unsigned) OMPC_SCAN_unknown
@@ -2112,7 +2124,8 @@ OMPClause *Parser::ParseOpenMPVarListClause(OpenMPClauseKind Kind) {
                  (Kind != OMPC_scan || Op != OMPC_SCAN_unknown) &&
                  (Kind != OMPC_depend || Op != OMPC_DEPEND_unknown) &&
                  (Kind != OMPC_map || Op != OMPC_MAP_unknown);
-  bool MayHaveTail = (Kind == OMPC_linear) || (Kind == OMPC_aligned);
+  bool MayHaveTail = (Kind == OMPC_linear) || (Kind == OMPC_aligned) ||
+                     (Kind == OMPC_scan);
   while (IsComma ||
          (Tok.isNot(tok::r_paren) && Tok.isNot(tok::annot_pragma_openmp_end) &&
           Tok.isNot(tok::colon))) {
@@ -2143,7 +2156,7 @@ OMPClause *Parser::ParseOpenMPVarListClause(OpenMPClauseKind Kind) {
   Expr *TailExpr = 0;
   SourceLocation TailLoc;
   if (MayHaveTail) {
-    // Parse "':' linear-step" or "':' alignment"
+    // Parse "':' linear-step", "':' alignment" or "':' segment-flags"
     if (Tok.is(tok::colon)) {
       MustHaveTail = true;
       ConsumeAnyToken();
@@ -2184,7 +2197,7 @@ OMPClause *Parser::ParseOpenMPVarListClause(OpenMPClauseKind Kind) {
 
   return Actions.ActOnOpenMPVarListClause(
       Kind, Vars, Loc, Tok.getLocation(), Op, TailExpr, SS, OpName,
-      (TailExpr ? TailLoc : SourceLocation()));
+      (TailExpr ? TailLoc : SourceLocation()), ScanExclusive);
 }
 
 /// \brief Parsing of OpenMP clause 'linear', 'aligned' or 'uniform' for
@@ -5433,7 +5433,7 @@ OMPClause *Sema::ActOnOpenMPDistScheduleClause(
 OMPClause *Sema::ActOnOpenMPVarListClause(
     OpenMPClauseKind Kind, ArrayRef<Expr *> VarList, SourceLocation StartLoc,
     SourceLocation EndLoc, unsigned Op, Expr *TailExpr, CXXScopeSpec &SS,
-    const UnqualifiedId &OpName, SourceLocation OpLoc) {
+    const UnqualifiedId &OpName, SourceLocation OpLoc, bool ScanExclusive) {
   OMPClause *Res = 0;
   switch (Kind) {
   case OMPC_private:
@@ -5464,7 +5464,7 @@ OMPClause *Sema::ActOnOpenMPVarListClause(
           Res = ActOnOpenMPScanClause(
                   VarList, StartLoc, EndLoc,
                   static_cast<OpenMPScanClauseOperator>(Op), SS,
-                  GetNameFromUnqualifiedId(OpName));
+                  GetNameFromUnqualifiedId(OpName), ScanExclusive, TailExpr);
           break;
   case OMPC_flush:
     Res = ActOnOpenMPFlushClause(VarList, StartLoc, EndLoc);
@@ -7262,7 +7262,16 @@ OMPClause *Sema::ActOnOpenMPScanClause(ArrayRef<Expr *> VarList,
                                        SourceLocation EndLoc,
                                        OpenMPScanClauseOperator Op,
                                        CXXScopeSpec &SS,
-                                       DeclarationNameInfo OpName) {
+                                       DeclarationNameInfo OpName,
+                                       bool Exclusive, Expr *Segment) {
+    // The segment flags mark with a non-zero element the first element
+    // of each segment, so they must be indexable as the scanned data
+    if (Segment && !Segment->isTypeDependent() &&
+        !Segment->getType()->isArrayType() && !Segment->getType()->isPointerType()) {
+        Diag(Segment->getExprLoc(), diag::err_omp_scan_segment_not_array)
+                << Segment->getSourceRange();
+        return 0;
+    }
     BinaryOperatorKind NewOp = BO_Assign;
     switch (Op) {
         case OMPC_SCAN_add:
@@ -7610,7 +7619,8 @@ OMPClause *Sema::ActOnOpenMPScanClause(ArrayRef<Expr *> VarList,
 
     return OMPScanClause::Create(
             Context, StartLoc, EndLoc, Vars, OpExprs, HelperParams1, HelperParams2,
-            DefaultInits, Op, SS.getWithLocInContext(Context), OpName);
+            DefaultInits, Op, SS.getWithLocInContext(Context), OpName,
+            Exclusive, Segment);
 }
 
 namespace {
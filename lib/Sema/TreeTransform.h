@@ -1527,10 +1527,11 @@ public:
                                         SourceLocation EndLoc,
                                         OpenMPScanClauseOperator Op,
                                         CXXScopeSpec &SS,
-                                        DeclarationNameInfo OpName) {
+                                        DeclarationNameInfo OpName,
+                                        bool Exclusive, Expr *Segment) {
             return getSema().ActOnOpenMPScanClause(VarList,
                                                    StartLoc, EndLoc, Op,
-                                                   SS, OpName);
+                                                   SS, OpName, Exclusive, Segment);
         }
 
         /// \brief Build a new OpenMP 'depend' clause.
@@ -7483,8 +7484,16 @@ TreeTransform<Derived>::TransformOMPReductionClause(OMPReductionClause *C) {
         SS.Adopt(C->getSpec());
         DeclarationNameInfo DNI =
                 getDerived().TransformDeclarationNameInfo(C->getOpName());
+        Expr *Segment = 0;
+        if (C->getSegment()) {
+            ExprResult ESeg = getDerived().TransformExpr(C->getSegment());
+            if (ESeg.isInvalid())
+                return 0;
+            Segment = ESeg.get();
+        }
         return getDerived().RebuildOMPScanClause(
-                Vars, C->getLocStart(), C->getLocEnd(), C->getOperator(), SS, DNI);
+                Vars, C->getLocStart(), C->getLocEnd(), C->getOperator(), SS, DNI,
+                C->isExclusive(), Segment);
     }
 
 template <typename Derived>
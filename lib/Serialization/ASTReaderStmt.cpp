@@ -2043,6 +2043,7 @@ void OMPClauseReader::VisitOMPReductionClause(OMPReductionClause *C) {
 void OMPClauseReader::VisitOMPScanClause(OMPScanClause *C) {
     C->setOperator(
             static_cast<OpenMPScanClauseOperator>(Record[Idx++]));
+    C->setExclusive(Record[Idx++]);
     NestedNameSpecifierLoc NNSL =
             Reader.ReadNestedNameSpecifierLoc(this->MFile, Record, Idx);
     DeclarationNameInfo DNI;
@@ -2077,6 +2078,7 @@ void OMPClauseReader::VisitOMPScanClause(OMPScanClause *C) {
         Inits.push_back(Reader.ReadSubExpr());
     }
     C->setDefaultInits(Inits);
+    C->setSegment(Reader.ReadSubExpr());
 }
 
 void OMPClauseReader::VisitOMPOrderedClause(OMPOrderedClause *C) { }
@@ -1848,6 +1848,7 @@ void OMPClauseWriter::VisitOMPReductionClause(OMPReductionClause *C) {
 void OMPClauseWriter::VisitOMPScanClause(OMPScanClause *C) {
     Record.push_back(C->varlist_size());
     Record.push_back(C->getOperator());
+    Record.push_back(C->isExclusive());
     Writer.AddNestedNameSpecifierLoc(C->getSpec(), Record);
     Writer.AddDeclarationNameInfo(C->getOpName(), Record);
     for (OMPScanClause::varlist_iterator I = C->varlist_begin(),
@@ -1870,6 +1871,7 @@ void OMPClauseWriter::VisitOMPScanClause(OMPScanClause *C) {
                  E = C->getDefaultInits().end();
          I != E; ++I)
         Writer.AddStmt(*I);
+    Writer.AddStmt(C->getSegment());
 }
 
 void OMPClauseWriter::VisitOMPOrderedClause(OMPOrderedClause *C) { }
@@ -0,0 +1,19 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: printf '#!/bin/sh\nexit 0\n' > %t.dir/clang-pcg && chmod +x %t.dir/clang-pcg
+// RUN: env PATH=%t.dir %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -offload-dispatch -Rmptogpu-dispatch -emit-llvm -o %t.ll %s
+
+void foo(int n, int *a) {
+  int i;
+
+#pragma omp target map(tofrom: a[0:n]) // expected-remark {{the target region runs on the device or on the host, as the runtime cost model chooses}}
+#pragma omp parallel for
+  for (i = 0; i < n; i++)
+    a[i] = a[i] * 2;
+
+  // The trip count of the inner loop is only known while it runs
+#pragma omp target map(tofrom: a[0:n]) // expected-remark {{the work of the target region is not known when it starts; it always runs on the device}}
+#pragma omp parallel for
+  for (i = 0; i < n; i++)
+    while (a[i] > 1)
+      a[i] /= 2;
+}
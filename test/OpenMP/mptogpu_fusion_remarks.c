@@ -0,0 +1,75 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: printf '#!/bin/sh\nexit 0\n' > %t.dir/clang-pcg && chmod +x %t.dir/clang-pcg
+// RUN: env PATH=%t.dir %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -kernel-fusion -Rmptogpu-fusion -emit-llvm -o %t.ll %s
+
+double a[32];
+double b[32];
+double c[32];
+
+void foo(void) {
+  int i;
+
+#pragma omp target map(to: a) map(from: b, c)
+  {
+#pragma omp parallel for // expected-remark {{2 adjacent target loops fused into one kernel}}
+    for (i = 0; i < 32; i++)
+      b[i] = a[i] + 1;
+#pragma omp parallel for
+    for (i = 0; i < 32; i++)
+      c[i] = a[i] * b[i];
+  }
+
+  // The second loop reads an element of 'b' that another iteration of the
+  // first one writes
+#pragma omp target map(to: a) map(from: b, c)
+  {
+#pragma omp parallel for
+    for (i = 0; i < 31; i++)
+      b[i] = a[i] + 1;
+#pragma omp parallel for
+    for (i = 0; i < 31; i++)
+      c[i] = b[i + 1];
+  }
+
+  // The iteration spaces differ
+#pragma omp target map(to: a) map(from: b, c)
+  {
+#pragma omp parallel for
+    for (i = 0; i < 32; i++)
+      b[i] = a[i];
+#pragma omp parallel for
+    for (i = 0; i < 16; i++)
+      c[i] = a[i];
+  }
+}
+
+// 'p' and 'q' may point into the same array: the second loop could read an
+// element of 'p' that another iteration of the first one writes
+void bar(int n, double *p, double *q) {
+  int i;
+
+#pragma omp target map(tofrom: p[0:n], q[0:n])
+  {
+#pragma omp parallel for
+    for (i = 0; i < n; i++)
+      p[i] = p[i] + 1;
+#pragma omp parallel for
+    for (i = 0; i < n; i++)
+      q[i] = q[i] * 2;
+  }
+}
+
+// Restrict pointers never do
+void baz(int n, double *restrict p, double *restrict q) {
+  int i;
+
+#pragma omp target map(tofrom: p[0:n], q[0:n])
+  {
+#pragma omp parallel for // expected-remark {{2 adjacent target loops fused into one kernel}}
+    for (i = 0; i < n; i++)
+      p[i] = p[i] + 1;
+#pragma omp parallel for
+    for (i = 0; i < n; i++)
+      q[i] = q[i] * 2;
+  }
+}
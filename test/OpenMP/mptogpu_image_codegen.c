@@ -0,0 +1,23 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -emit-llvm -o - %s | FileCheck %s
+// expected-no-diagnostics
+
+// The kernel file of the region is embedded in the host object
+// CHECK: @.cl_image.[[PROG:kernel_[A-Za-z0-9]+]].cl = private unnamed_addr constant {{\[}}[[SIZE:[0-9]+]] x i8] c"{{.*}}__kernel void kernel_{{[0-9a-f]+}} (\0A__global int *a,
+
+void foo(int n, int *a) {
+  int sum = 0;
+  int i;
+
+#pragma omp target map(to: a[0:n])
+#pragma omp parallel for reduction(+ : sum)
+  for (i = 0; i < n; i++)
+    sum += a[i];
+}
+
+// and handed to the runtime as the OpenCL C image (kind 0) of its program,
+// with its size
+// CHECK-LABEL: define internal void @.cl_register_programs()
+// CHECK: call void @_cl_register_program(i8* getelementptr inbounds ([14 x i8]* [[NAME:@[^,]+]], i32 0, i32 0))
+// CHECK-NEXT: call void @_cl_register_image(i8* getelementptr inbounds ([14 x i8]* [[NAME]], i32 0, i32 0), i32 0, i8* getelementptr inbounds ({{\[}}[[SIZE]] x i8]* @.cl_image.[[PROG]].cl, i32 0, i32 0), i64 [[SIZE]])
+// CHECK-NEXT: ret void
@@ -0,0 +1,36 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -emit-llvm -o - %s | FileCheck %s
+// expected-no-diagnostics
+
+// Each kernel of the region keeps its registry handle in a private global,
+// unresolved (-1) until the region first runs
+// CHECK-DAG: @.cl_handle = private global i32 -1
+// CHECK-DAG: @.cl_handle1 = private global i32 -1
+
+// CHECK-LABEL: define void @foo
+void foo(int n, int *a) {
+  int sum = 0;
+  int i;
+
+// The handle is looked up by program and kernel name only while the global
+// holds no handle yet, then kept there
+// CHECK: [[CACHED:%[0-9a-z.]+]] = load i32* @.cl_handle{{(, align 4)?$}}
+// CHECK-NEXT: icmp slt i32 [[CACHED]], 0
+// CHECK: [[RESOLVED:%[0-9a-z.]+]] = call i32 @_cl_kernel_handle(i8* getelementptr inbounds ([14 x i8]* @{{[^,]+}}, i32 0, i32 0), i8* getelementptr inbounds
+// CHECK-NEXT: store i32 [[RESOLVED]], i32* @.cl_handle{{(, align 4)?$}}
+// CHECK: [[HANDLE:%[0-9a-z.]+]] = phi i32 [ [[CACHED]], %{{[^ ]+}} ], [ [[RESOLVED]], %{{[^ ]+}} ]
+// CHECK-NEXT: call i32 @_cl_use_kernel(i32 [[HANDLE]])
+// CHECK: call i32 @_cl_launch(i32 [[HANDLE]],
+
+// The final stage has a handle of its own
+// CHECK: [[CACHED1:%[0-9a-z.]+]] = load i32* @.cl_handle1{{(, align 4)?$}}
+// CHECK-NEXT: icmp slt i32 [[CACHED1]], 0
+// CHECK: [[RESOLVED1:%[0-9a-z.]+]] = call i32 @_cl_kernel_handle(i8* getelementptr inbounds ([14 x i8]* @{{[^,]+}}, i32 0, i32 0), i8* getelementptr inbounds
+// CHECK-NEXT: store i32 [[RESOLVED1]], i32* @.cl_handle1{{(, align 4)?$}}
+// CHECK: [[HANDLE1:%[0-9a-z.]+]] = phi i32 [ [[CACHED1]], %{{[^ ]+}} ], [ [[RESOLVED1]], %{{[^ ]+}} ]
+// CHECK: call i32 @_cl_launch(i32 [[HANDLE1]],
+#pragma omp target map(to: a[0:n])
+#pragma omp parallel for reduction(+ : sum)
+  for (i = 0; i < n; i++)
+    sum += a[i];
+}
@@ -0,0 +1,33 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: printf '#!/bin/sh\nexit 0\n' > %t.dir/clang-pcg && chmod +x %t.dir/clang-pcg
+// RUN: printf '#!/bin/sh\ncp "$1" "$2"\n' > %t.dir/spir-encoder && chmod +x %t.dir/spir-encoder
+// RUN: env -u LLVM_INCLUDE_PATH PATH=%t.dir %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=spir64-unknown-unknown -emit-llvm -o - %s | FileCheck %s
+// expected-no-diagnostics
+
+// clang-pcg is stubbed out and spir-encoder only copies its input. The
+// kernels of both regions are lowered on the kernel generation pool while
+// host codegen goes on; the module waits for them before it embeds the
+// images, so each program has its SPIR image (kind 1) next to its source
+
+void foo(int n, int *a, float *b) {
+  int i;
+
+#pragma omp target map(tofrom: a[0:n])
+#pragma omp parallel for
+  for (i = 0; i < n; i++)
+    a[i] = a[i] * 2;
+
+#pragma omp target map(tofrom: b[0:n])
+#pragma omp parallel for
+  for (i = 0; i < n; i++)
+    b[i] = b[i] + 1;
+}
+
+// CHECK-LABEL: define internal void @.cl_register_programs()
+// CHECK: call void @_cl_register_program(i8* getelementptr inbounds ([14 x i8]* [[NAME1:@[^,]+]], i32 0, i32 0))
+// CHECK-NEXT: call void @_cl_register_image(i8* getelementptr inbounds ([14 x i8]* [[NAME1]], i32 0, i32 0), i32 0, i8* getelementptr inbounds ({{.*}} @.cl_image.[[PROG1:kernel_[A-Za-z0-9]+]].cl, i32 0, i32 0), i64 {{[0-9]+}})
+// CHECK-NEXT: call void @_cl_register_image(i8* getelementptr inbounds ([14 x i8]* [[NAME1]], i32 0, i32 0), i32 1, i8* getelementptr inbounds ({{.*}} @.cl_image.[[PROG1]].bc, i32 0, i32 0), i64 {{[0-9]+}})
+// CHECK-NEXT: call void @_cl_register_program(i8* getelementptr inbounds ([14 x i8]* [[NAME2:@[^,]+]], i32 0, i32 0))
+// CHECK-NEXT: call void @_cl_register_image(i8* getelementptr inbounds ([14 x i8]* [[NAME2]], i32 0, i32 0), i32 0, i8* getelementptr inbounds ({{.*}} @.cl_image.[[PROG2:kernel_[A-Za-z0-9]+]].cl, i32 0, i32 0), i64 {{[0-9]+}})
+// CHECK-NEXT: call void @_cl_register_image(i8* getelementptr inbounds ([14 x i8]* [[NAME2]], i32 0, i32 0), i32 1, i8* getelementptr inbounds ({{.*}} @.cl_image.[[PROG2]].bc, i32 0, i32 0), i64 {{[0-9]+}})
+// CHECK-NEXT: ret void
@@ -0,0 +1,14 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: printf '#!/bin/sh\nexit 0\n' > %t.dir/clang-pcg && chmod +x %t.dir/clang-pcg
+// RUN: printf '#!/bin/sh\nexit 1\n' > %t.dir/spir-encoder && chmod +x %t.dir/spir-encoder
+// RUN: env -u LLVM_INCLUDE_PATH PATH=%t.dir %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=spir64-unknown-unknown -emit-llvm -o %t.ll %s
+
+// Without the SpirTools prelude the kernels compile against the built-in
+// one; the failure of a later step is reported at its target region
+void foo(int n, int *a) {
+  int i;
+#pragma omp target map(tofrom: a[0:n])
+#pragma omp parallel for // expected-error {{'spir-encoder' failed while generating the kernels of the target region: exit status 1}}
+  for (i = 0; i < n; i++)
+    a[i] = a[i] * 2;
+}
@@ -0,0 +1,24 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: printf '#!/bin/sh\nfor a in "$@"; do echo "$a"; done > "$0.args"\n' > %t.dir/clang-pcg && chmod +x %t.dir/clang-pcg
+// RUN: env PATH=%t.dir %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -emit-llvm -o %t.ll %s
+// RUN: FileCheck %s < %t.dir/clang-pcg.args
+// expected-no-diagnostics
+
+// clang-pcg is found in the PATH and started without a shell: the stub
+// writes one line per argument it gets. The naive mode asks for one
+// iteration per work-item and no shared or private memory
+// CHECK: --no-reschedule
+// CHECK-NEXT: --tile-size=1
+// CHECK-NEXT: --no-shared-memory
+// CHECK-NEXT: --no-private-memory
+// CHECK-NEXT: {{.+}}.c
+// CHECK-NOT: {{.}}
+
+void foo(int n, int *a) {
+  int i;
+
+#pragma omp target map(tofrom: a[0:n])
+#pragma omp parallel for
+  for (i = 0; i < n; i++)
+    a[i] = a[i] * 2;
+}
@@ -0,0 +1,19 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: printf '#!/bin/sh\nexit 0\n' > %t.dir/clang-pcg && chmod +x %t.dir/clang-pcg
+// RUN: env -u LLVM_INCLUDE_PATH PATH=%t.dir %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=spir64-unknown-unknown -emit-llvm -o %t.ll %s
+
+// clang-pcg is stubbed out (it generates nothing, so the loops get the
+// kernels clang writes itself); spir-encoder is not in the PATH
+void foo(int n, int *a) {
+  int i;
+#pragma omp target map(tofrom: a[0:n])
+#pragma omp parallel for // expected-error {{'spir-encoder' is needed to generate the kernels of target regions but was not found in the PATH}}
+  for (i = 0; i < n; i++)
+    a[i] = a[i] * 2;
+
+  // A missing tool is reported once
+#pragma omp target map(tofrom: a[0:n])
+#pragma omp parallel for
+  for (i = 0; i < n; i++)
+    a[i] = a[i] + 1;
+}
@@ -0,0 +1,32 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -emit-llvm -o - %s | FileCheck %s
+// expected-no-diagnostics
+
+// Every launch describes its arguments with a constant table of
+// {kind, buffer, bytes} triples (the _cl_arg_desc of cldevice.h): the mapped
+// array, the trip count, first value and step of the loop, then the buffer
+// and local array of the partial results
+// CHECK-DAG: @.cl_args = private unnamed_addr constant [18 x i32] [i32 0, i32 0, i32 0, i32 1, i32 0, i32 4, i32 1, i32 0, i32 4, i32 1, i32 0, i32 4, i32 0, i32 1, i32 0, i32 2, i32 0, i32 4]
+// The final stage gets the partial results, the original value and the
+// number of groups
+// CHECK-DAG: @.cl_args1 = private unnamed_addr constant [12 x i32] [i32 0, i32 1, i32 0, i32 2, i32 0, i32 4, i32 1, i32 0, i32 4, i32 1, i32 0, i32 4]
+
+// CHECK-LABEL: define void @foo
+void foo(int n, int *a) {
+  int sum = 0;
+  int i;
+
+// The partial results live in a buffer of the region, released after they
+// are read back
+// CHECK: call i32 @_cl_create_read_write(
+// CHECK-NOT: call i32 @_cl_set_kernel_arg
+// CHECK: call i32 @_cl_launch(i32 {{%[0-9a-z.]+}}, i32 6, i32* getelementptr inbounds ([18 x i32]* @.cl_args, i32 0, i32 0), i8** {{%[0-9a-z.]+}}, i64* {{%[0-9a-z.]+}})
+// CHECK-NOT: call i32 @_cl_set_kernel_arg
+// CHECK: call i32 @_cl_launch(i32 {{%[0-9a-z.]+}}, i32 4, i32* getelementptr inbounds ([12 x i32]* @.cl_args1, i32 0, i32 0), i8** {{%[0-9a-z.]+}}, i64* {{%[0-9a-z.]+}})
+// CHECK: call i32 @_cl_read_buffer(i64 4, i32 1,
+// CHECK: call void @_cl_release_buffer(i32 1)
+#pragma omp target map(to: a[0:n])
+#pragma omp parallel for reduction(+ : sum)
+  for (i = 0; i < n; i++)
+    sum += a[i];
+}
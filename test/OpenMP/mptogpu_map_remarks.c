@@ -0,0 +1,32 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: printf '#!/bin/sh\nexit 0\n' > %t.dir/clang-pcg && chmod +x %t.dir/clang-pcg
+// RUN: env PATH=%t.dir %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -Rmptogpu-map -emit-llvm -o %t.ll %s
+
+double a[32];
+double b[32];
+double c[32];
+
+void touch(void);
+
+void foo(int n, double *p, double *q) {
+  int i;
+
+#pragma omp target map(tofrom: a, b, c) // expected-remark {{'a' is only read in the target region; map(tofrom) reduced to map(to), saving 256 bytes of transfer}} expected-remark {{'c' is only written in the target region; map(tofrom) reduced to map(from), saving 256 bytes of transfer}}
+#pragma omp parallel for
+  for (i = 0; i < 32; i++) {
+    b[i] += a[i];
+    c[i] = a[i] * 2;
+  }
+
+#pragma omp target map(tofrom: p[0:n]) map(tofrom: q[0:n]) // expected-remark {{'p' is only read in the target region; map(tofrom) reduced to map(to)}}
+#pragma omp parallel for
+  for (i = 0; i < n - 1; i++)
+    q[i] = p[i];
+
+#pragma omp target map(tofrom: a, b)
+#pragma omp parallel for
+  for (i = 0; i < 32; i++) {
+    b[i] = a[i];
+    touch();
+  }
+}
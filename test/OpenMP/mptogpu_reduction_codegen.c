@@ -0,0 +1,37 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -emit-llvm -o - %s | FileCheck %s
+// expected-no-diagnostics
+
+// A declare reduction for several types gets OpenCL macros for each of them
+#pragma omp declare reduction (plus : int : omp_out += omp_in)
+#pragma omp declare reduction (plus : float : omp_out = omp_out + omp_in)
+
+// The kernels are embedded with the macros, and the final stage combines
+// the partial results of the groups with the original value
+// CHECK-DAG: c"kernel_{{[0-9a-f]+}}_final\00"
+// CHECK-DAG: @.cl_image.kernel_{{[A-Za-z0-9]+}}.cl = private unnamed_addr constant {{.*}}#define plus_int_combiner(omp_out, omp_in) omp_out += omp_in{{.*}}#define plus_float_combiner(omp_out, omp_in) omp_out = omp_out + omp_in{{.*}}__kernel void kernel_{{[0-9a-f]+}}_final (\0A__global int *_red_sum, __local int *_loc_sum, int _orig_sum,\0A__global float *_red_f, __local float *_loc_f, float _orig_f,\0Aint _NG) {{.*}}plus_int_combiner(omp_out, omp_in);{{.*}}plus_float_combiner(omp_out, omp_in);
+
+// CHECK-LABEL: define void @foo
+void foo(int n, int *a, float *b) {
+  int sum = 0;
+  float f = 0;
+  int i;
+
+// CHECK: call i32 @_cl_get_reduction_groups(
+// CHECK: call i32 @_cl_create_read_write(
+// CHECK: call i32 @_cl_create_read_write(
+// CHECK: call i32 @_cl_launch(
+// CHECK: call i32 @_cl_kernel_handle(
+// CHECK: call i32 @_cl_launch(
+// CHECK: call i32 @_cl_read_buffer(
+// CHECK: call i32 @_cl_read_buffer(
+// CHECK: call void @_cl_release_buffer(
+// CHECK: call void @_cl_release_buffer(
+// CHECK-NOT: @__kmpc_fork_call
+#pragma omp target map(to: a[0:n], b[0:n])
+#pragma omp parallel for reduction(plus : sum, f)
+  for (i = 0; i < n; i++) {
+    sum += a[i];
+    f += b[i];
+  }
+}
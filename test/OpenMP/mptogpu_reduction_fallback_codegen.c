@@ -0,0 +1,31 @@
+// RUN: %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=spir64-unknown-unknown -emit-llvm -o - %s | FileCheck %s
+
+struct S {
+  int a;
+};
+
+void init_s(struct S *priv);
+void init_i(int *priv);
+
+#pragma omp declare reduction (merge : struct S : omp_out.a += omp_in.a) initializer (init_s(&omp_priv))
+#pragma omp declare reduction (plus : int : omp_out += omp_in) initializer (init_i(&omp_priv))
+
+// CHECK-LABEL: define void @foo
+void foo(int n, int *v) {
+  struct S s;
+  int sum = 0;
+  int i;
+
+  s.a = 0;
+#pragma omp target map(to: v[0:n])
+#pragma omp parallel for reduction(merge : s) // expected-warning {{reduction of 's' is not supported on the device: only scalar variables can be reduced; the loop runs on the host}}
+  for (i = 0; i < n; i++)
+    s.a += v[i];
+// CHECK: call void {{.*}}@__kmpc_fork_call
+
+#pragma omp target map(to: v[0:n])
+#pragma omp parallel for reduction(plus : sum) // expected-warning {{reduction of 'sum' is not supported on the device: its declare reduction can not be compiled to OpenCL; the loop runs on the host}}
+  for (i = 0; i < n; i++)
+    sum += v[i];
+// CHECK: call void {{.*}}@__kmpc_fork_call
+}
@@ -0,0 +1,30 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -emit-llvm -o - %s | FileCheck %s
+// expected-no-diagnostics
+
+// A global ctor registers the programs of the module with the runtime, so
+// that it can build them before their first launch
+// CHECK: @llvm.global_ctors = appending global {{.*}} @.cl_register_programs
+
+void foo(int n, int *a, int *b) {
+  int s = 0, t = 0;
+  int i;
+
+#pragma omp target map(to: a[0:n])
+#pragma omp parallel for reduction(+ : s)
+  for (i = 0; i < n; i++)
+    s += a[i];
+
+#pragma omp target map(to: b[0:n])
+#pragma omp parallel for reduction(+ : t)
+  for (i = 0; i < n; i++)
+    t += b[i];
+}
+
+// One call per program, however many kernels of it the module launches
+// CHECK-LABEL: define internal void @.cl_register_programs()
+// CHECK: call void @_cl_register_program(i8* getelementptr inbounds ([14 x i8]* @{{[^,]+}}, i32 0, i32 0))
+// CHECK-NOT: @_cl_register_program(
+// CHECK: call void @_cl_register_program(i8* getelementptr inbounds ([14 x i8]* @{{[^,]+}}, i32 0, i32 0))
+// CHECK-NOT: @_cl_register_program(
+// CHECK: ret void
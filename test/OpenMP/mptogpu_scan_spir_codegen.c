@@ -0,0 +1,13 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: env -u LLVM_INCLUDE_PATH PATH=%t.dir %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=spir-unknown-unknown -emit-llvm -o %t.ll %s
+
+// Scan kernels are lowered like parallel-for kernels: a SPIR target needs
+// the encoder for them too
+
+void foo(int n, int *a) {
+  int i;
+#pragma omp target map(tofrom: a[0:n])
+#pragma omp parallel for scan(+ : a) // expected-error {{'spir-encoder' is needed to generate the kernels of target regions but was not found in the PATH}}
+  for (i = 0; i < n; i++)
+    a[i] = a[i] + 1;
+}
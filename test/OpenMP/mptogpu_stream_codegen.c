@@ -0,0 +1,32 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: printf '#!/bin/sh\nexit 0\n' > %t.dir/clang-pcg && chmod +x %t.dir/clang-pcg
+// RUN: env PATH=%t.dir %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -emit-llvm -o - %s | FileCheck %s
+// expected-no-diagnostics
+
+// clang-pcg is stubbed out, so the loop gets the kernel clang writes
+// itself. Both arrays are only subscripted with the counter plus a
+// constant: the kernel takes the index of the first element of each slice
+// and rebases the arrays on it
+// CHECK-DAG: @.cl_image.kernel_{{[A-Za-z0-9]+}}.cl = private unnamed_addr constant {{.*}}__kernel void kernel_{{[0-9a-f]+}} (\0A__global int *a,\0A__global int *b,\0Aint _UB_0, int _MIN_0, int _INC_0,\0Along _OFF_0,\0Along _OFF_1) {{.*}}a -= _OFF_0;\0A   b -= _OFF_1;
+
+// The offsets are host arguments of 8 bytes after the loop ones
+// CHECK-DAG: @.cl_args = private unnamed_addr constant [21 x i32] [i32 0, i32 0, i32 0, i32 0, i32 1, i32 0, i32 1, i32 0, i32 4, i32 1, i32 0, i32 4, i32 1, i32 0, i32 4, i32 1, i32 0, i32 8, i32 1, i32 0, i32 8]
+
+// One {buffer arg, offset arg, lo, hi, store lo, store hi, element size}
+// entry per array (the _cl_stream_desc of cldevice.h): 'a' is read at
+// i and i + 1 and never written, 'b' is written at i
+// CHECK-DAG: @.cl_streams = private unnamed_addr constant [14 x i32] [i32 0, i32 5, i32 0, i32 1, i32 1, i32 0, i32 4, i32 1, i32 6, i32 0, i32 0, i32 0, i32 0, i32 4]
+
+// The loop is described by the arguments 2 to 4 (trip count, first value,
+// step), so that the runtime can run it in slices
+// CHECK-LABEL: define void @foo
+// CHECK: call i32 @_cl_launch_stream(i32 {{%[0-9a-z.]+}}, i32 7, i32* getelementptr inbounds ([21 x i32]* @.cl_args, i32 0, i32 0), i8** {{%[0-9a-z.]+}}, i64* {{%[0-9a-z.]+}}, i32 2, i32 2, i32* getelementptr inbounds ([14 x i32]* @.cl_streams, i32 0, i32 0))
+// CHECK-NOT: call i32 @_cl_launch(
+void foo(int n, int *a, int *b) {
+  int i;
+
+#pragma omp target map(to: a[0:n + 1]) map(from: b[0:n])
+#pragma omp parallel for
+  for (i = 0; i < n; i++)
+    b[i] = a[i] + a[i + 1];
+}
@@ -0,0 +1,35 @@
+// RUN: rm -rf %t.dir && mkdir -p %t.dir && cd %t.dir
+// RUN: %clang_cc1 -triple x86_64-unknown-linux-gnu -verify -fopenmp -omptargets=opencl-unknown-unknown -opt-poly=vectorize -emit-llvm -o - %s | FileCheck %s
+// expected-no-diagnostics
+
+// The kernel file holds the scalar kernel and a version of it for each
+// vector width; a work-item of kernel_<n>_v<W> runs W iterations with
+// vloadW/vstoreW, or the scalar body for the last ones
+// CHECK-DAG: @.cl_image.kernel_{{[A-Za-z0-9]+}}.cl = private unnamed_addr constant {{.*}}__kernel void [[KERNEL:kernel_[0-9a-f]+]] (\0A{{.*}}\0A__kernel void [[KERNEL]]_v2 ({{.*}}int _ID_0 = get_global_id(0) * 2;\0A   int i = _INC_0 * _ID_0 + _MIN_0;\0A   if ( _ID_0 + 2 <= _UB_0 ) {\0A      vstore2((vload2(0, &a[i]) * ((float2)((float)(s)))), 0, &b[i]);\0A   }\0A   else for (; _ID_0 < _UB_0; _ID_0++, i++) {{.*}}\0A__kernel void [[KERNEL]]_v4 ({{.*}}vstore4((vload4(0, &a[i]) * ((float4)((float)(s)))), 0, &b[i]);{{.*}}\0A__kernel void [[KERNEL]]_v8 ({{.*}}vstore8((vload8(0, &a[i]) * ((float8)((float)(s)))), 0, &b[i]);{{.*}}\0A__kernel void [[KERNEL]]_v16 ({{.*}}vstore16((vload16(0, &a[i]) * ((float16)((float)(s)))), 0, &b[i]);
+
+// The launch runs the version of the width the device prefers for float
+// elements (_CL_VEC_FLOAT), with one work-item per that many iterations
+// CHECK-LABEL: define void @foo
+// CHECK: [[WIDTH:%[0-9a-z.]+]] = call i32 @_cl_vector_width(i32 2)
+// CHECK: store i32 {{%[0-9a-z.]+}}, i32* @.cl_handle1
+// CHECK: icmp eq i32 [[WIDTH]], 2
+// CHECK-NEXT: select i1
+// CHECK: store i32 {{%[0-9a-z.]+}}, i32* @.cl_handle2
+// CHECK: icmp eq i32 [[WIDTH]], 4
+// CHECK-NEXT: select i1
+// CHECK: store i32 {{%[0-9a-z.]+}}, i32* @.cl_handle3
+// CHECK: icmp eq i32 [[WIDTH]], 8
+// CHECK-NEXT: select i1
+// CHECK: store i32 {{%[0-9a-z.]+}}, i32* @.cl_handle4
+// CHECK: icmp eq i32 [[WIDTH]], 16
+// CHECK-NEXT: [[HANDLE:%[0-9a-z.]+]] = select i1
+// CHECK: udiv i32 {{%[0-9a-z.]+}}, [[WIDTH]]
+// CHECK: call i32 @_cl_launch(i32 [[HANDLE]],
+void foo(int n, float s, float *a, float *b) {
+  int i;
+
+#pragma omp target map(to: a[0:n]) map(from: b[0:n])
+#pragma omp parallel for
+  for (i = 0; i < n; i++)
+    b[i] = a[i] * s;
+}
@@ -0,0 +1,35 @@
+// RUN: %clang_cc1 -verify -fopenmp -ast-print %s | FileCheck %s
+// RUN: %clang_cc1 -fopenmp -emit-pch -o %t %s
+// RUN: %clang_cc1 -fopenmp -include-pch %t -fsyntax-only -verify %s -ast-print | FileCheck %s
+// expected-no-diagnostics
+
+#ifndef HEADER
+#define HEADER
+
+#pragma omp declare scan (merge : int : omp_out += omp_in)
+// CHECK: #pragma omp declare scan (merge : int : omp_out += omp_in)
+
+#pragma omp declare scan (fun : float : omp_out *= omp_in) initializer (omp_priv = 1)
+// CHECK: #pragma omp declare scan (fun : float : omp_out *= omp_in) initializer(omp_priv = 1)
+
+void foo(int n, int *a, int *b, float *c, char *f) {
+  int i;
+#pragma omp parallel for scan(+ : a)
+// CHECK: #pragma omp parallel for scan(+: a)
+  for (i = 0; i < n; i++)
+    a[i] = i;
+#pragma omp parallel for scan(exclusive, max : a, b)
+// CHECK: #pragma omp parallel for scan(exclusive, max: a,b)
+  for (i = 0; i < n; i++)
+    a[i] = b[i];
+#pragma omp parallel for scan(inclusive, + : a : f)
+// CHECK: #pragma omp parallel for scan(+: a : f)
+  for (i = 0; i < n; i++)
+    a[i] = i;
+#pragma omp parallel for simd scan(fun : c)
+// CHECK: #pragma omp parallel for simd scan(fun: c)
+  for (i = 0; i < n; i++)
+    c[i] = 1;
+}
+
+#endif
@@ -0,0 +1,31 @@
+// RUN: %clang_cc1 -verify -fopenmp -ferror-limit 100 %s
+
+struct S {
+  int head;
+};
+
+void foo(int n, int *a, char *f, char g[10]) {
+  int i, h = 0;
+  struct S s;
+#pragma omp parallel for scan(+ : a : f)
+  for (i = 0; i < n; i++)
+    a[i] = i;
+#pragma omp parallel for scan(+ : a : g)
+  for (i = 0; i < n; i++)
+    a[i] = i;
+#pragma omp parallel for scan(+ : a : h) // expected-error {{segment flags of a scan clause should be an array or a pointer}}
+  for (i = 0; i < n; i++)
+    a[i] = i;
+#pragma omp parallel for scan(exclusive, + : a : s) // expected-error {{segment flags of a scan clause should be an array or a pointer}}
+  for (i = 0; i < n; i++)
+    a[i] = i;
+#pragma omp parallel for scan(+ : a : h + 1) // expected-error {{segment flags of a scan clause should be an array or a pointer}}
+  for (i = 0; i < n; i++)
+    a[i] = i;
+#pragma omp parallel for scan(+ a) // expected-error {{expected ':' in 'scan' clause}}
+  for (i = 0; i < n; i++)
+    a[i] = i;
+#pragma omp parallel for scan(+ : a : ) // expected-error {{expected expression}}
+  for (i = 0; i < n; i++)
+    a[i] = i;
+}